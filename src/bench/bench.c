@@ -0,0 +1,671 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#if defined(_MSC_VER)
+#pragma comment(lib, "psapi.lib")
+#endif
+#else
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "libdither.h"
+
+/* Benchmarks every ditherer (and every color comparison mode / quantization method combination for the color
+ * ditherers) on synthetic images and prints throughput, per-stage timings, peak memory use and palette cache hit
+ * rates as CSV or JSON. Every case runs in a process of its own, so peak_rss_kb is the peak resident memory of the
+ * process that ran just this case (including its input image), not a high-water mark left by an earlier case.
+ * usage: bench [--size WIDTHxHEIGHT] [--repeat N] [--threads N] [--colors N] [--filter TEXT] [--json] */
+
+struct BenchOptions {
+    int width;
+    int height;
+    int repeat;        // every case is run this many times; the fastest run is reported
+    int threads;       // threads for the parallel ditherers, 0 = one per CPU core
+    int colors;        // palette size for color dithering
+    const char* filter;  // only run cases whose name contains this text
+    bool json;
+    long run_case;       // internal (--case N): this process only runs the N-th selected case; -1 = all cases
+};
+typedef struct BenchOptions BenchOptions;
+
+struct BenchResult {
+    char name[64];
+    const char* mode;          // color comparison mode, "" for mono ditherers
+    const char* quantization;  // quantization method, "" for mono ditherers
+    double setup_ms;           // creating matrices, curves, palette lookup structures
+    double quantize_ms;        // palette quantization
+    double dither_ms;          // the dithering itself
+    size_t cache_lookups;
+    size_t cache_misses;
+};
+typedef struct BenchResult BenchResult;
+
+typedef void (*MonoBench)(const DitherImage* img, const BenchOptions* opt, uint8_t* out, BenchResult* r);
+typedef void (*ColorBench)(const ColorImage* img, CachedPalette* pal, const BenchOptions* opt, int* out, BenchResult* r);
+
+static const char* MODE_NAMES[] = {"LUMINANCE", "SRGB", "LINEAR", "HSV", "LAB76", "LAB94", "LAB2000", "SRGB_CCIR",
+                                   "LINEAR_CCIR", "TETRAPAL"};
+static const char* QUANTIZATION_NAMES[] = {"MEDIAN_CUT", "WU", "KDTREE"};
+
+double now_ms(void) {
+    /* wall clock time in milliseconds */
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1.0e6;
+}
+
+long peak_rss_kb(void) {
+    /* high-water mark of the process' resident memory in KB. Only meaningful per case because each case runs in a
+     * process of its own (see run_here) */
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+        return (long)(pmc.PeakWorkingSetSize / 1024);
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#if defined(__APPLE__)
+    return (long)(usage.ru_maxrss / 1024);  // bytes on macOS
+#else
+    return (long)usage.ru_maxrss;  // KB on Linux
+#endif
+#endif
+}
+
+void synthetic_rgba(int x, int y, int width, int height, uint8_t* rgba) {
+    /* deterministic test pattern: horizontal hue ramp, vertical brightness ramp and some pseudo random texture */
+    uint32_t h = (uint32_t)x * 374761393u + (uint32_t)y * 668265263u;
+    h = (h ^ (h >> 13)) * 1274126177u;
+    int noise = (int)((h >> 24) & 31) - 16;
+    int fx = x * 255 / (width > 1 ? width - 1 : 1);
+    int fy = y * 255 / (height > 1 ? height - 1 : 1);
+    int c[3] = {fx + noise, (fx + fy) / 2 + noise, 255 - fy + noise};
+    for (int i = 0; i < 3; i++)
+        rgba[i] = (uint8_t)(c[i] < 0 ? 0 : (c[i] > 255 ? 255 : c[i]));
+    rgba[3] = 255;
+}
+
+DitherImage* synthetic_monoimage(int width, int height) {
+    DitherImage* image = DitherImage_new(width, height);
+    uint8_t rgba[4];
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            synthetic_rgba(x, y, width, height, rgba);
+            DitherImage_set_pixel_rgba(image, x, y, rgba[0], rgba[1], rgba[2], rgba[3], true);
+        }
+    }
+    DitherImage_compact(image);
+    return image;
+}
+
+ColorImage* synthetic_colorimage(int width, int height) {
+    ColorImage* image = ColorImage_new(width, height);
+    uint8_t rgba[4];
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            synthetic_rgba(x, y, width, height, rgba);
+            ColorImage_set_rgb(image, (size_t)y * (size_t)width + (size_t)x, rgba[0], rgba[1], rgba[2], rgba[3]);
+        }
+    }
+    return image;
+}
+
+/* **** MONO DITHERERS **** */
+
+void bench_error_diffusion(const DitherImage* img, const BenchOptions* opt, uint8_t* out, BenchResult* r) {
+    (void)opt;
+    double t = now_ms();
+    ErrorDiffusionMatrix* m = get_floyd_steinberg_matrix();
+    r->setup_ms = now_ms() - t;
+    t = now_ms();
+    error_diffusion_dither(img, m, true, 0.0, out);
+    r->dither_ms = now_ms() - t;
+    ErrorDiffusionMatrix_free(m);
+}
+
+void bench_error_diffusion_jjn(const DitherImage* img, const BenchOptions* opt, uint8_t* out, BenchResult* r) {
+    (void)opt;
+    double t = now_ms();
+    ErrorDiffusionMatrix* m = get_jarvis_judice_ninke_matrix();
+    r->setup_ms = now_ms() - t;
+    t = now_ms();
+    error_diffusion_dither(img, m, true, 0.0, out);
+    r->dither_ms = now_ms() - t;
+    ErrorDiffusionMatrix_free(m);
+}
+
+void bench_error_diffusion_parallel(const DitherImage* img, const BenchOptions* opt, uint8_t* out, BenchResult* r) {
+    double t = now_ms();
+    ErrorDiffusionMatrix* m = get_floyd_steinberg_matrix();
+    r->setup_ms = now_ms() - t;
+    t = now_ms();
+    error_diffusion_dither_parallel(img, m, true, 0.0, NULL, opt->threads, out);
+    r->dither_ms = now_ms() - t;
+    ErrorDiffusionMatrix_free(m);
+}
+
+void bench_error_diffusion_stream(const DitherImage* img, const BenchOptions* opt, uint8_t* out, BenchResult* r) {
+    (void)opt;
+    double t = now_ms();
+    ErrorDiffusionMatrix* m = get_floyd_steinberg_matrix();
+    ErrorDiffusionStream* stream = ErrorDiffusionStream_new(img->width, m, true, 0.0, NULL);
+    double* row = (double*)calloc((size_t)img->width, sizeof(double));
+    r->setup_ms = now_ms() - t;
+    t = now_ms();
+    int popped = 0;
+    for (int y = 0; y < img->height; y++) {
+        for (int x = 0; x < img->width; x++)
+            row[x] = DitherImage_get_pixel((DitherImage*)img, x, y);
+        while (!ErrorDiffusionStream_push_row(stream, row, NULL)) {
+            ErrorDiffusionStream_pop_row(stream, &out[(size_t)popped * (size_t)img->width]);
+            popped++;
+        }
+    }
+    ErrorDiffusionStream_finish(stream);
+    while (popped < img->height && ErrorDiffusionStream_pop_row(stream, &out[(size_t)popped * (size_t)img->width]))
+        popped++;
+    r->dither_ms = now_ms() - t;
+    free(row);
+    ErrorDiffusionStream_free(stream);
+    ErrorDiffusionMatrix_free(m);
+}
+
+void bench_ordered(const DitherImage* img, const BenchOptions* opt, uint8_t* out, BenchResult* r) {
+    (void)opt;
+    double t = now_ms();
+    OrderedDitherMatrix* m = get_bayer8x8_matrix();
+    r->setup_ms = now_ms() - t;
+    t = now_ms();
+    ordered_dither(img, m, 0.0, out);
+    r->dither_ms = now_ms() - t;
+    OrderedDitherMatrix_free(m);
+}
+
+void bench_ordered_blue_noise(const DitherImage* img, const BenchOptions* opt, uint8_t* out, BenchResult* r) {
+    (void)opt;
+    double t = now_ms();
+    OrderedDitherMatrix* m = get_blue_noise_128x128();
+    r->setup_ms = now_ms() - t;
+    t = now_ms();
+    ordered_dither(img, m, 0.0, out);
+    r->dither_ms = now_ms() - t;
+    OrderedDitherMatrix_free(m);
+}
+
+void bench_ordered_parallel(const DitherImage* img, const BenchOptions* opt, uint8_t* out, BenchResult* r) {
+    double t = now_ms();
+    OrderedDitherMatrix* m = get_bayer8x8_matrix();
+    r->setup_ms = now_ms() - t;
+    t = now_ms();
+    ordered_dither_parallel(img, m, 0.0, NULL, opt->threads, out);
+    r->dither_ms = now_ms() - t;
+    OrderedDitherMatrix_free(m);
+}
+
+void bench_grid(const DitherImage* img, const BenchOptions* opt, uint8_t* out, BenchResult* r) {
+    (void)opt;
+    double t = now_ms();
+    grid_dither(img, 4, 4, 0, false, out);
+    r->dither_ms = now_ms() - t;
+}
+
+void bench_dot_diffusion(const DitherImage* img, const BenchOptions* opt, uint8_t* out, BenchResult* r) {
+    (void)opt;
+    double t = now_ms();
+    DotDiffusionMatrix* ddm = get_default_diffusion_matrix();
+    DotClassMatrix* dcm = get_knuth_class_matrix();
+    r->setup_ms = now_ms() - t;
+    t = now_ms();
+    dot_diffusion_dither(img, ddm, dcm, out);
+    r->dither_ms = now_ms() - t;
+    DotClassMatrix_free(dcm);
+    DotDiffusionMatrix_free(ddm);
+}
+
+void bench_varerrdiff_ostromoukhov(const DitherImage* img, const BenchOptions* opt, uint8_t* out, BenchResult* r) {
+    (void)opt;
+    double t = now_ms();
+    variable_error_diffusion_dither(img, Ostromoukhov, true, out);
+    r->dither_ms = now_ms() - t;
+}
+
+void bench_varerrdiff_zhoufang(const DitherImage* img, const BenchOptions* opt, uint8_t* out, BenchResult* r) {
+    (void)opt;
+    double t = now_ms();
+    variable_error_diffusion_dither(img, Zhoufang, true, out);
+    r->dither_ms = now_ms() - t;
+}
+
+void bench_varerrdiff_parallel(const DitherImage* img, const BenchOptions* opt, uint8_t* out, BenchResult* r) {
+    double t = now_ms();
+    variable_error_diffusion_dither_parallel(img, Ostromoukhov, true, NULL, opt->threads, out);
+    r->dither_ms = now_ms() - t;
+}
+
+void bench_threshold(const DitherImage* img, const BenchOptions* opt, uint8_t* out, BenchResult* r) {
+    (void)opt;
+    double t = now_ms();
+    double threshold = auto_threshold(img);
+    r->setup_ms = now_ms() - t;
+    t = now_ms();
+    threshold_dither(img, threshold, 0.55, out);
+    r->dither_ms = now_ms() - t;
+}
+
+void bench_dbs(const DitherImage* img, const BenchOptions* opt, uint8_t* out, BenchResult* r) {
+    (void)opt;
+    double t = now_ms();
+    dbs_dither(img, 0, out);
+    r->dither_ms = now_ms() - t;
+}
+
+void bench_dbs_parallel(const DitherImage* img, const BenchOptions* opt, uint8_t* out, BenchResult* r) {
+    double t = now_ms();
+    dbs_dither_parallel(img, 0, opt->threads, 0, 0.0, out);
+    r->dither_ms = now_ms() - t;
+}
+
+void bench_kallebach(const DitherImage* img, const BenchOptions* opt, uint8_t* out, BenchResult* r) {
+    (void)opt;
+    double t = now_ms();
+    kallebach_dither(img, true, out);
+    r->dither_ms = now_ms() - t;
+}
+
+void bench_kallebach_parallel(const DitherImage* img, const BenchOptions* opt, uint8_t* out, BenchResult* r) {
+    double t = now_ms();
+    kallebach_dither_parallel(img, true, NULL, opt->threads, out);
+    r->dither_ms = now_ms() - t;
+}
+
+void bench_riemersma(const DitherImage* img, const BenchOptions* opt, uint8_t* out, BenchResult* r) {
+    (void)opt;
+    double t = now_ms();
+    RiemersmaCurve* rc = get_hilbert_curve();
+    r->setup_ms = now_ms() - t;
+    t = now_ms();
+    riemersma_dither(img, rc, false, out);
+    r->dither_ms = now_ms() - t;
+    RiemersmaCurve_free(rc);
+}
+
+void bench_pattern(const DitherImage* img, const BenchOptions* opt, uint8_t* out, BenchResult* r) {
+    (void)opt;
+    double t = now_ms();
+    TilePattern* tp = get_4x4_pattern();
+    r->setup_ms = now_ms() - t;
+    t = now_ms();
+    pattern_dither(img, tp, out);
+    r->dither_ms = now_ms() - t;
+    TilePattern_free(tp);
+}
+
+void bench_dotlippens(const DitherImage* img, const BenchOptions* opt, uint8_t* out, BenchResult* r) {
+    (void)opt;
+    double t = now_ms();
+    DotClassMatrix* cm = get_dotlippens_class_matrix();
+    DotLippensCoefficients* coe = get_dotlippens_coefficients1();
+    r->setup_ms = now_ms() - t;
+    t = now_ms();
+    dotlippens_dither(img, cm, coe, out);
+    r->dither_ms = now_ms() - t;
+    DotLippensCoefficients_free(coe);
+    DotClassMatrix_free(cm);
+}
+
+struct MonoCase {
+    const char* name;
+    MonoBench func;
+};
+
+static const struct MonoCase MONO_CASES[] = {
+    {"error_diffusion", bench_error_diffusion},
+    {"error_diffusion_jjn", bench_error_diffusion_jjn},
+    {"error_diffusion_parallel", bench_error_diffusion_parallel},
+    {"error_diffusion_stream", bench_error_diffusion_stream},
+    {"ordered", bench_ordered},
+    {"ordered_blue_noise", bench_ordered_blue_noise},
+    {"ordered_parallel", bench_ordered_parallel},
+    {"grid", bench_grid},
+    {"dot_diffusion", bench_dot_diffusion},
+    {"variable_error_diffusion_ostromoukhov", bench_varerrdiff_ostromoukhov},
+    {"variable_error_diffusion_zhoufang", bench_varerrdiff_zhoufang},
+    {"variable_error_diffusion_parallel", bench_varerrdiff_parallel},
+    {"threshold", bench_threshold},
+    {"dbs", bench_dbs},
+    {"dbs_parallel", bench_dbs_parallel},
+    {"kallebach", bench_kallebach},
+    {"kallebach_parallel", bench_kallebach_parallel},
+    {"riemersma", bench_riemersma},
+    {"pattern", bench_pattern},
+    {"dotlippens", bench_dotlippens},
+};
+
+/* **** COLOR DITHERERS **** */
+
+void bench_error_diffusion_color(const ColorImage* img, CachedPalette* pal, const BenchOptions* opt, int* out,
+                                 BenchResult* r) {
+    (void)opt;
+    double t = now_ms();
+    ErrorDiffusionMatrix* m = get_floyd_steinberg_matrix();
+    r->setup_ms += now_ms() - t;
+    t = now_ms();
+    error_diffusion_dither_color(img, m, pal, true, out);
+    r->dither_ms = now_ms() - t;
+    ErrorDiffusionMatrix_free(m);
+}
+
+void bench_error_diffusion_stream_color(const ColorImage* img, CachedPalette* pal, const BenchOptions* opt, int* out,
+                                        BenchResult* r) {
+    (void)opt;
+    double t = now_ms();
+    ErrorDiffusionMatrix* m = get_floyd_steinberg_matrix();
+    ErrorDiffusionStream* stream = ErrorDiffusionStream_new_color(img->width, m, pal, true);
+    r->setup_ms += now_ms() - t;
+    t = now_ms();
+    int popped = 0;
+    for (int y = 0; y < img->height; y++) {
+        const ByteColor* row = &img->b_srgb[(size_t)y * (size_t)img->width];
+        while (!ErrorDiffusionStream_push_row_color(stream, row)) {
+            ErrorDiffusionStream_pop_row_color(stream, &out[(size_t)popped * (size_t)img->width]);
+            popped++;
+        }
+    }
+    ErrorDiffusionStream_finish(stream);
+    while (popped < img->height &&
+           ErrorDiffusionStream_pop_row_color(stream, &out[(size_t)popped * (size_t)img->width]))
+        popped++;
+    r->dither_ms = now_ms() - t;
+    ErrorDiffusionStream_free(stream);
+    ErrorDiffusionMatrix_free(m);
+}
+
+void bench_ordered_color(const ColorImage* img, CachedPalette* pal, const BenchOptions* opt, int* out,
+                         BenchResult* r) {
+    (void)opt;
+    double t = now_ms();
+    OrderedDitherMatrix* m = get_bayer8x8_matrix();
+    r->setup_ms += now_ms() - t;
+    t = now_ms();
+    ordered_dither_color(img, pal, m, out);
+    r->dither_ms = now_ms() - t;
+    OrderedDitherMatrix_free(m);
+}
+
+void bench_ordered_color_parallel(const ColorImage* img, CachedPalette* pal, const BenchOptions* opt, int* out,
+                                  BenchResult* r) {
+    double t = now_ms();
+    OrderedDitherMatrix* m = get_bayer8x8_matrix();
+    r->setup_ms += now_ms() - t;
+    t = now_ms();
+    ordered_dither_color_parallel(img, pal, m, opt->threads, out);
+    r->dither_ms = now_ms() - t;
+    OrderedDitherMatrix_free(m);
+}
+
+struct ColorCase {
+    const char* name;
+    ColorBench func;
+};
+
+static const struct ColorCase COLOR_CASES[] = {
+    {"error_diffusion_color", bench_error_diffusion_color},
+    {"error_diffusion_stream_color", bench_error_diffusion_stream_color},
+    {"ordered_color", bench_ordered_color},
+    {"ordered_color_parallel", bench_ordered_color_parallel},
+};
+
+/* **** REPORTING **** */
+
+void keep_fastest(BenchResult* best, const BenchResult* r, int run) {
+    /* keeps the fastest time of every stage over all runs */
+    if (run == 0 || r->setup_ms < best->setup_ms)
+        best->setup_ms = r->setup_ms;
+    if (run == 0 || r->quantize_ms < best->quantize_ms)
+        best->quantize_ms = r->quantize_ms;
+    if (run == 0 || r->dither_ms < best->dither_ms) {
+        best->dither_ms = r->dither_ms;
+        best->cache_lookups = r->cache_lookups;
+        best->cache_misses = r->cache_misses;
+    }
+}
+
+void print_header(const BenchOptions* opt) {
+    if (opt->json)
+        printf("{\"version\": \"%s\", \"width\": %d, \"height\": %d, \"repeat\": %d, \"results\": [\n",
+               libdither_version(), opt->width, opt->height, opt->repeat);
+    else
+        printf("ditherer,mode,quantization,width,height,setup_ms,quantize_ms,dither_ms,mpix_per_s,peak_rss_kb,"
+               "cache_lookups,cache_hit_rate\n");
+}
+
+void print_result(const BenchOptions* opt, const BenchResult* r, bool first) {
+    double mpix = (double)opt->width * (double)opt->height / 1.0e6;
+    double mpix_per_s = r->dither_ms > 0.0 ? mpix / (r->dither_ms / 1000.0) : 0.0;
+    double hit_rate = r->cache_lookups > 0 ? 1.0 - (double)r->cache_misses / (double)r->cache_lookups : 0.0;
+    if (opt->json)
+        printf("%s  {\"ditherer\": \"%s\", \"mode\": \"%s\", \"quantization\": \"%s\", \"setup_ms\": %.3f, "
+               "\"quantize_ms\": %.3f, \"dither_ms\": %.3f, \"mpix_per_s\": %.3f, \"peak_rss_kb\": %ld, "
+               "\"cache_lookups\": %zu, \"cache_hit_rate\": %.4f}",
+               first ? "" : ",\n", r->name, r->mode, r->quantization, r->setup_ms, r->quantize_ms, r->dither_ms,
+               mpix_per_s, peak_rss_kb(), r->cache_lookups, hit_rate);
+    else
+        printf("%s,%s,%s,%d,%d,%.3f,%.3f,%.3f,%.3f,%ld,%zu,%.4f\n", r->name, r->mode, r->quantization, opt->width,
+               opt->height, r->setup_ms, r->quantize_ms, r->dither_ms, mpix_per_s, peak_rss_kb(), r->cache_lookups,
+               hit_rate);
+    fflush(stdout);
+}
+
+bool matches(const BenchOptions* opt, const char* name, const char* mode, const char* quantization) {
+    /* true if the case should run: the filter matches the ditherer, mode or quantization name */
+    if (opt->filter == NULL)
+        return true;
+    return strstr(name, opt->filter) != NULL || strstr(mode, opt->filter) != NULL ||
+           strstr(quantization, opt->filter) != NULL;
+}
+
+void run_cases(const BenchOptions* opt);
+
+int run_case_process(const BenchOptions* opt, long index) {
+    /* runs the index-th selected case in a child process, which prints its result. Returns 0 on success, 1 if the
+     * child process failed and -1 if it couldn't be started */
+    fflush(stdout);
+#if defined(_WIN32)
+    char command[4096];
+    snprintf(command, sizeof(command), "%s --case %ld", GetCommandLineA(), index);
+    STARTUPINFOA si;
+    PROCESS_INFORMATION pi;
+    memset(&si, 0, sizeof(si));
+    si.cb = sizeof(si);
+    if (!CreateProcessA(NULL, command, NULL, NULL, TRUE, 0, NULL, NULL, &si, &pi))
+        return -1;
+    WaitForSingleObject(pi.hProcess, INFINITE);
+    DWORD exit_code = 1;
+    GetExitCodeProcess(pi.hProcess, &exit_code);
+    CloseHandle(pi.hThread);
+    CloseHandle(pi.hProcess);
+    return exit_code == 0 ? 0 : 1;
+#else
+    pid_t pid = fork();
+    if (pid < 0)
+        return -1;
+    if (pid == 0) {
+        BenchOptions child = *opt;
+        child.run_case = index;
+        run_cases(&child);
+        fflush(stdout);
+        _exit(0);
+    }
+    int status;
+    return waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : 1;
+#endif
+}
+
+bool run_here(const BenchOptions* opt, long index, bool* first) {
+    /* called for every selected case, numbered by index. The main process starts a child process per case, so the
+     * peak memory of one case doesn't show up in the results of the cases after it. Returns true if the case has to
+     * run in this process: in its child process, or in the main process if no child process could be started */
+    if (opt->run_case >= 0)
+        return opt->run_case == index;
+    if (opt->json && !*first)  // the child process prints its result as if it were the first one
+        printf(",\n");
+    int result = run_case_process(opt, index);
+    if (result >= 0) {
+        if (result != 0)
+            fprintf(stderr, "bench: case %ld failed\n", index);
+        *first = false;
+        return false;
+    }
+    fprintf(stderr, "bench: case %ld couldn't run in a separate process, its peak_rss_kb includes earlier cases\n",
+            index);
+    *first = true;  // the separator is already printed
+    return true;
+}
+
+void run_mono(const BenchOptions* opt, long* index, bool* first) {
+    DitherImage* image = NULL;
+    uint8_t* out = NULL;
+    for (size_t c = 0; c < sizeof(MONO_CASES) / sizeof(MONO_CASES[0]); c++) {
+        if (!matches(opt, MONO_CASES[c].name, "", "") || !run_here(opt, (*index)++, first))
+            continue;
+        if (image == NULL) {
+            image = synthetic_monoimage(opt->width, opt->height);
+            out = (uint8_t*)calloc((size_t)opt->width * (size_t)opt->height, sizeof(uint8_t));
+        }
+        BenchResult best;
+        memset(&best, 0, sizeof(best));
+        for (int run = 0; run < opt->repeat; run++) {
+            BenchResult r;
+            memset(&r, 0, sizeof(r));
+            MONO_CASES[c].func(image, opt, out, &r);
+            keep_fastest(&best, &r, run);
+        }
+        snprintf(best.name, sizeof(best.name), "%s", MONO_CASES[c].name);
+        best.mode = "";
+        best.quantization = "";
+        print_result(opt, &best, *first);
+        *first = false;
+    }
+    free(out);
+    if (image != NULL)
+        DitherImage_free(image);
+}
+
+void run_color(const BenchOptions* opt, long* index, bool* first) {
+    ColorImage* image = NULL;
+    int* out = NULL;
+    for (size_t c = 0; c < sizeof(COLOR_CASES) / sizeof(COLOR_CASES[0]); c++) {
+        for (int q = MEDIAN_CUT; q <= KDTREE; q++) {
+            for (int mode = LUMINANCE; mode <= TETRAPAL; mode++) {
+                if (!matches(opt, COLOR_CASES[c].name, MODE_NAMES[mode], QUANTIZATION_NAMES[q]) ||
+                    !run_here(opt, (*index)++, first))
+                    continue;
+                if (image == NULL) {
+                    image = synthetic_colorimage(opt->width, opt->height);
+                    out = (int*)calloc((size_t)opt->width * (size_t)opt->height, sizeof(int));
+                }
+                BenchResult best;
+                memset(&best, 0, sizeof(best));
+                for (int run = 0; run < opt->repeat; run++) {
+                    BenchResult r;
+                    memset(&r, 0, sizeof(r));
+                    double t = now_ms();
+                    CachedPalette* palette = CachedPalette_new();
+                    CachedPalette_from_image(palette, image, (size_t)opt->colors, (enum QuantizationMethod)q, true,
+                                             false, false, false);
+                    r.quantize_ms = now_ms() - t;
+                    t = now_ms();
+                    CachedPalette_update_cache(palette, (enum ColorComparisonMode)mode, NULL);
+                    CachedPalette_set_shift(palette, 1, 1, 1);
+                    r.setup_ms = now_ms() - t;
+                    COLOR_CASES[c].func(image, palette, opt, out, &r);
+                    CachedPalette_get_stats(palette, &r.cache_lookups, &r.cache_misses);
+                    CachedPalette_free(palette);
+                    keep_fastest(&best, &r, run);
+                }
+                snprintf(best.name, sizeof(best.name), "%s", COLOR_CASES[c].name);
+                best.mode = MODE_NAMES[mode];
+                best.quantization = QUANTIZATION_NAMES[q];
+                print_result(opt, &best, *first);
+                *first = false;
+            }
+        }
+    }
+    free(out);
+    if (image != NULL)
+        ColorImage_free(image);
+}
+
+void run_cases(const BenchOptions* opt) {
+    /* runs all selected cases, or just opt->run_case */
+    bool first = true;
+    long index = 0;
+    run_mono(opt, &index, &first);
+    run_color(opt, &index, &first);
+}
+
+void usage(void) {
+    fprintf(stderr, "usage: bench [--size WIDTHxHEIGHT] [--repeat N] [--threads N] [--colors N] [--filter TEXT] "
+                    "[--json]\n");
+}
+
+int main(int argc, char* argv[]) {
+    BenchOptions opt;
+    opt.width = 256;
+    opt.height = 256;
+    opt.repeat = 1;
+    opt.threads = 0;
+    opt.colors = 16;
+    opt.filter = NULL;
+    opt.json = false;
+    opt.run_case = -1;
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--json") == 0) {
+            opt.json = true;
+        } else if (strcmp(argv[i], "--size") == 0 && has_value) {
+            if (sscanf(argv[++i], "%dx%d", &opt.width, &opt.height) != 2) {
+                usage();
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--repeat") == 0 && has_value) {
+            opt.repeat = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && has_value) {
+            opt.threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--colors") == 0 && has_value) {
+            opt.colors = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--filter") == 0 && has_value) {
+            opt.filter = argv[++i];
+        } else if (strcmp(argv[i], "--case") == 0 && has_value) {  // internal: see run_case_process
+            opt.run_case = atol(argv[++i]);
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (opt.width <= 0 || opt.height <= 0 || opt.repeat <= 0 || opt.threads < 0 || opt.colors < 2) {
+        usage();
+        return 1;
+    }
+    if (opt.run_case >= 0) {
+        run_cases(&opt);
+        return 0;
+    }
+    print_header(&opt);
+    run_cases(&opt);
+    if (opt.json)
+        printf("\n]}\n");
+    return 0;
+}
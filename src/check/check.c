@@ -0,0 +1,1109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "libdither.h"
+
+/* Regression check. Every mono case dithers two synthetic images (one fully opaque, one with transparent pixels) and
+ * compares a hash of the output with the value recorded below. Cases with a multithreaded variant also run it with
+ * several thread counts and require the same output as the single-threaded ditherer. The color and palette cases
+ * don't use recorded hashes: they compare palette lookups with a plain linear search, and the batch, streaming, 8 bit
+ * and packed (1 bit per pixel) APIs with the ditherers whose output they must match.
+ * The recorded hashes assume IEEE 754 doubles without contracted multiply-adds (the Makefile builds with
+ * -ffp-contract=off); run 'check --print' to list the hashes of the current build.
+ * usage: check [--print] */
+
+#define CHECK_WIDTH 173
+#define CHECK_HEIGHT 101
+#define CHECK_SEED 1234
+
+typedef void (*CheckFunc)(const DitherImage* img, int threads, uint8_t* out);
+
+struct CheckCase {
+    const char* name;
+    CheckFunc serial;
+    CheckFunc parallel;     // NULL if the ditherer has no multithreaded variant
+    int reference_threads;  // thread count whose output the other multithreaded runs (more than 1 thread) must match
+    uint64_t hash_opaque;
+    uint64_t hash_alpha;
+};
+typedef struct CheckCase CheckCase;
+
+static const int THREAD_COUNTS[] = {1, 2, 3, 5};
+
+uint64_t hash_output(const uint8_t* out, size_t size) {
+    /* 64 bit FNV-1a */
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; i++) {
+        h ^= out[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+uint32_t texture_hash(int x, int y) {
+    /* pseudo random texture of the synthetic images */
+    uint32_t h = (uint32_t)x * 374761393u + (uint32_t)y * 668265263u;
+    return (h ^ (h >> 13)) * 1274126177u;
+}
+
+DitherImage* synthetic_image(int width, int height, bool alpha) {
+    /* deterministic test pattern: diagonal ramp with pseudo random texture; with alpha, about every 16th pixel is
+     * fully transparent and some are translucent. Gamma correction is off, so the input doesn't depend on pow() */
+    DitherImage* image = DitherImage_new(width, height);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            uint32_t h = texture_hash(x, y);
+            int noise = (int)((h >> 24) & 31) - 16;
+            int v = (x * 255 / (width - 1) + y * 255 / (height - 1)) / 2 + noise;
+            v = v < 0 ? 0 : (v > 255 ? 255 : v);
+            int a = 255;
+            if (alpha && (h & 15) == 0)
+                a = (h >> 4) & 1 ? 0 : 128;
+            DitherImage_set_pixel_rgba(image, x, y, v, (v + x) & 255, 255 - v, a, false);
+        }
+    }
+    DitherImage_compact(image);
+    return image;
+}
+
+ColorImage* synthetic_color_image(int width, int height, bool alpha) {
+    /* deterministic color test pattern: red and green ramps with pseudo random blue, with transparent pixels like
+     * synthetic_image. Pixels come in horizontal pairs, so the batch lookups see runs of equal colors */
+    ColorImage* image = ColorImage_new(width, height);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            uint32_t h = texture_hash(x / 2, y);
+            uint8_t a = 255;
+            if (alpha && (h & 15) == 0)
+                a = (h >> 4) & 1 ? 0 : 128;
+            ColorImage_set_rgb(image, (size_t)y * (size_t)width + (size_t)x, (uint8_t)(x * 255 / (width - 1)),
+                               (uint8_t)(y * 255 / (height - 1)), (uint8_t)(h >> 24), a);
+        }
+    }
+    return image;
+}
+
+BytePalette* synthetic_palette(size_t size) {
+    /* black, white and size - 2 pseudo random colors */
+    BytePalette* pal = BytePalette_new(size);
+    for (size_t i = 0; i < size; i++) {
+        uint32_t h = texture_hash((int)i, 7);
+        ByteColor bc = {(uint8_t)h, (uint8_t)(h >> 8), (uint8_t)(h >> 16), 255};
+        if (i < 2)
+            bc.r = bc.g = bc.b = i == 0 ? 0 : 255;
+        BytePalette_set(pal, i, &bc);
+    }
+    return pal;
+}
+
+/* **** CASES **** */
+
+void check_error_diffusion(const DitherImage* img, int threads, uint8_t* out) {
+    (void)threads;
+    ErrorDiffusionMatrix* m = get_floyd_steinberg_matrix();
+    DitherRandom* rng = DitherRandom_new(CHECK_SEED);
+    error_diffusion_dither_rng(img, m, true, 0.0, rng, out);
+    DitherRandom_free(rng);
+    ErrorDiffusionMatrix_free(m);
+}
+
+void check_error_diffusion_parallel(const DitherImage* img, int threads, uint8_t* out) {
+    ErrorDiffusionMatrix* m = get_floyd_steinberg_matrix();
+    DitherRandom* rng = DitherRandom_new(CHECK_SEED);
+    error_diffusion_dither_parallel(img, m, true, 0.0, rng, threads, out);
+    DitherRandom_free(rng);
+    ErrorDiffusionMatrix_free(m);
+}
+
+void check_error_diffusion_jjn(const DitherImage* img, int threads, uint8_t* out) {
+    (void)threads;
+    ErrorDiffusionMatrix* m = get_jarvis_judice_ninke_matrix();
+    DitherRandom* rng = DitherRandom_new(CHECK_SEED);
+    error_diffusion_dither_rng(img, m, false, 0.0, rng, out);
+    DitherRandom_free(rng);
+    ErrorDiffusionMatrix_free(m);
+}
+
+void check_error_diffusion_jjn_parallel(const DitherImage* img, int threads, uint8_t* out) {
+    ErrorDiffusionMatrix* m = get_jarvis_judice_ninke_matrix();
+    DitherRandom* rng = DitherRandom_new(CHECK_SEED);
+    error_diffusion_dither_parallel(img, m, false, 0.0, rng, threads, out);
+    DitherRandom_free(rng);
+    ErrorDiffusionMatrix_free(m);
+}
+
+void check_error_diffusion_stucki_noise(const DitherImage* img, int threads, uint8_t* out) {
+    (void)threads;
+    ErrorDiffusionMatrix* m = get_stucki_matrix();
+    DitherRandom* rng = DitherRandom_new(CHECK_SEED);
+    error_diffusion_dither_rng(img, m, true, 0.3, rng, out);
+    DitherRandom_free(rng);
+    ErrorDiffusionMatrix_free(m);
+}
+
+void check_error_diffusion_stucki_noise_parallel(const DitherImage* img, int threads, uint8_t* out) {
+    ErrorDiffusionMatrix* m = get_stucki_matrix();
+    DitherRandom* rng = DitherRandom_new(CHECK_SEED);
+    error_diffusion_dither_parallel(img, m, true, 0.3, rng, threads, out);
+    DitherRandom_free(rng);
+    ErrorDiffusionMatrix_free(m);
+}
+
+void check_ordered(const DitherImage* img, int threads, uint8_t* out) {
+    (void)threads;
+    OrderedDitherMatrix* m = get_bayer8x8_matrix();
+    DitherRandom* rng = DitherRandom_new(CHECK_SEED);
+    ordered_dither_rng(img, m, 0.2, rng, out);
+    DitherRandom_free(rng);
+    OrderedDitherMatrix_free(m);
+}
+
+void check_ordered_parallel(const DitherImage* img, int threads, uint8_t* out) {
+    OrderedDitherMatrix* m = get_bayer8x8_matrix();
+    DitherRandom* rng = DitherRandom_new(CHECK_SEED);
+    ordered_dither_parallel(img, m, 0.2, rng, threads, out);
+    DitherRandom_free(rng);
+    OrderedDitherMatrix_free(m);
+}
+
+void check_threshold(const DitherImage* img, int threads, uint8_t* out) {
+    (void)threads;
+    DitherRandom* rng = DitherRandom_new(CHECK_SEED);
+    threshold_dither_rng(img, 0.5, 0.3, rng, out);
+    DitherRandom_free(rng);
+}
+
+void check_ostromoukhov(const DitherImage* img, int threads, uint8_t* out) {
+    (void)threads;
+    variable_error_diffusion_dither(img, Ostromoukhov, true, out);
+}
+
+void check_ostromoukhov_parallel(const DitherImage* img, int threads, uint8_t* out) {
+    variable_error_diffusion_dither_parallel(img, Ostromoukhov, true, NULL, threads, out);
+}
+
+void check_zhoufang(const DitherImage* img, int threads, uint8_t* out) {
+    (void)threads;
+    DitherRandom* rng = DitherRandom_new(CHECK_SEED);
+    variable_error_diffusion_dither_rng(img, Zhoufang, true, rng, out);
+    DitherRandom_free(rng);
+}
+
+void check_zhoufang_parallel(const DitherImage* img, int threads, uint8_t* out) {
+    DitherRandom* rng = DitherRandom_new(CHECK_SEED);
+    variable_error_diffusion_dither_parallel(img, Zhoufang, true, rng, threads, out);
+    DitherRandom_free(rng);
+}
+
+void check_dot_diffusion(const DitherImage* img, int threads, uint8_t* out) {
+    (void)threads;
+    DotDiffusionMatrix* dm = get_default_diffusion_matrix();
+    DotClassMatrix* cm = get_knuth_class_matrix();
+    dot_diffusion_dither(img, dm, cm, out);
+    DotClassMatrix_free(cm);
+    DotDiffusionMatrix_free(dm);
+}
+
+void check_dot_diffusion_parallel(const DitherImage* img, int threads, uint8_t* out) {
+    DotDiffusionMatrix* dm = get_default_diffusion_matrix();
+    DotClassMatrix* cm = get_knuth_class_matrix();
+    dot_diffusion_dither_parallel(img, dm, cm, threads, out);
+    DotClassMatrix_free(cm);
+    DotDiffusionMatrix_free(dm);
+}
+
+void check_dotlippens(const DitherImage* img, int threads, uint8_t* out) {
+    (void)threads;
+    DotClassMatrix* cm = get_dotlippens_class_matrix();
+    DotLippensCoefficients* coe = get_dotlippens_coefficients1();
+    dotlippens_dither(img, cm, coe, out);
+    DotLippensCoefficients_free(coe);
+    DotClassMatrix_free(cm);
+}
+
+void check_dotlippens_parallel(const DitherImage* img, int threads, uint8_t* out) {
+    DotClassMatrix* cm = get_dotlippens_class_matrix();
+    DotLippensCoefficients* coe = get_dotlippens_coefficients1();
+    dotlippens_dither_parallel(img, cm, coe, threads, out);
+    DotLippensCoefficients_free(coe);
+    DotClassMatrix_free(cm);
+}
+
+void check_dbs1(const DitherImage* img, int threads, uint8_t* out) {
+    (void)threads;
+    dbs_dither(img, 1, out);
+}
+
+void check_dbs1_parallel(const DitherImage* img, int threads, uint8_t* out) {
+    dbs_dither_parallel(img, 1, threads, 0, 0.0, out);
+}
+
+void check_dbs3(const DitherImage* img, int threads, uint8_t* out) {
+    (void)threads;
+    dbs_dither(img, 3, out);
+}
+
+void check_kallebach(const DitherImage* img, int threads, uint8_t* out) {
+    (void)threads;
+    DitherRandom* rng = DitherRandom_new(CHECK_SEED);
+    kallebach_dither_rng(img, true, rng, out);
+    DitherRandom_free(rng);
+}
+
+void check_kallebach_parallel(const DitherImage* img, int threads, uint8_t* out) {
+    DitherRandom* rng = DitherRandom_new(CHECK_SEED);
+    kallebach_dither_parallel(img, true, rng, threads, out);
+    DitherRandom_free(rng);
+}
+
+void check_riemersma_curve(const DitherImage* img, RiemersmaCurve* rc, uint8_t* out) {
+    riemersma_dither(img, rc, false, out);
+    RiemersmaCurve_free(rc);
+}
+
+void check_riemersma_hilbert(const DitherImage* img, int threads, uint8_t* out) {
+    (void)threads;
+    check_riemersma_curve(img, get_hilbert_curve(), out);
+}
+
+void check_riemersma_peano(const DitherImage* img, int threads, uint8_t* out) {
+    (void)threads;
+    check_riemersma_curve(img, get_peano_curve(), out);
+}
+
+void check_riemersma_gosper(const DitherImage* img, int threads, uint8_t* out) {
+    (void)threads;
+    check_riemersma_curve(img, get_gosper_curve(), out);
+}
+
+void check_pattern(const DitherImage* img, int threads, uint8_t* out) {
+    (void)threads;
+    TilePattern* tp = get_4x4_pattern();
+    pattern_dither(img, tp, out);
+    TilePattern_free(tp);
+}
+
+void check_grid(const DitherImage* img, int threads, uint8_t* out) {
+    (void)threads;
+    DitherRandom* rng = DitherRandom_new(CHECK_SEED);
+    grid_dither_rng(img, 4, 4, 0, false, rng, out);
+    DitherRandom_free(rng);
+}
+
+void image_luma(const DitherImage* img, uint8_t* luma) {
+    /* the image's linear values as 8 bit luminance, the input of the 8 bit ditherers */
+    for (size_t i = 0; i < (size_t)img->width * (size_t)img->height; i++)
+        luma[i] = (uint8_t)(DitherImage_value(img, i) * 255.0 + 0.5);
+}
+
+void check_error_diffusion_8bit_fixed(const DitherImage* img, int threads, uint8_t* out) {
+    /* integer arithmetic only, so the hash doesn't depend on the platform's floating point */
+    (void)threads;
+    uint8_t* luma = (uint8_t*)calloc((size_t)img->width * (size_t)img->height, sizeof(uint8_t));
+    image_luma(img, luma);
+    ErrorDiffusionMatrix* m = get_stucki_matrix();
+    error_diffusion_dither_8bit(luma, DitherImage_alpha(img, 0), img->width, img->height, m, true, ED_FIXED_POINT, out);
+    ErrorDiffusionMatrix_free(m);
+    free(luma);
+}
+
+static const CheckCase CHECK_CASES[] = {
+    {"error_diffusion", check_error_diffusion, check_error_diffusion_parallel, 1, 0xa87921f899d90444ULL, 0x58f085255c3a0578ULL},
+    {"error_diffusion_jjn", check_error_diffusion_jjn, check_error_diffusion_jjn_parallel, 1, 0x551c732ad53350b9ULL, 0x0cfda792d4d88b35ULL},
+    {"error_diffusion_stucki_noise", check_error_diffusion_stucki_noise, check_error_diffusion_stucki_noise_parallel, 1, 0xee67e51414b0d524ULL, 0xc4a9639ddbd84acaULL},
+    {"ordered", check_ordered, check_ordered_parallel, 1, 0xfdb64772fc60a687ULL, 0x2c820b3ba5504b87ULL},
+    {"threshold", check_threshold, NULL, 1, 0x57997732523ffe4aULL, 0xe80b0126282d65d6ULL},
+    {"variable_error_diffusion_ostromoukhov", check_ostromoukhov, check_ostromoukhov_parallel, 1, 0xf3a116d6013effb6ULL, 0x5baba6f39e25f24dULL},
+    {"variable_error_diffusion_zhoufang", check_zhoufang, check_zhoufang_parallel, 1, 0x711cfde74de00fe6ULL, 0xb1606c2b865ff2a7ULL},
+    {"dot_diffusion", check_dot_diffusion, check_dot_diffusion_parallel, 1, 0x20e8b6e5de129360ULL, 0x16d8dbdf19b56d14ULL},
+    {"dotlippens", check_dotlippens, check_dotlippens_parallel, 1, 0x26c2a43404468792ULL, 0x9272306b7ccd9606ULL},
+    // multithreaded DBS optimizes distant tiles concurrently: only its single thread run matches dbs_dither
+    {"dbs1", check_dbs1, check_dbs1_parallel, 2, 0x02ecdc50beb16c5eULL, 0xa920d64dd1ec2bd9ULL},
+    {"dbs3", check_dbs3, NULL, 1, 0x774b0a1a7f1bf476ULL, 0xb697a6e07bab29a4ULL},
+    {"kallebach", check_kallebach, check_kallebach_parallel, 1, 0x8aa5012cea4061baULL, 0x8d96421e6324dd52ULL},
+    {"riemersma_hilbert", check_riemersma_hilbert, NULL, 1, 0x9001155afe4fb718ULL, 0x33ccaca6aa37bf50ULL},
+    {"riemersma_peano", check_riemersma_peano, NULL, 1, 0x7f13d0ddb5545720ULL, 0x5f7141ae7cfa8d1eULL},
+    {"riemersma_gosper", check_riemersma_gosper, NULL, 1, 0x3203235b3660ae18ULL, 0x929da2abd0cb4d96ULL},
+    {"pattern", check_pattern, NULL, 1, 0x84d3cfbb64bce9f3ULL, 0x96efe50d3323a27dULL},
+    {"grid", check_grid, NULL, 1, 0xfd82bcd2df9ac8b5ULL, 0x70cc37b4775c017fULL},
+    {"error_diffusion_8bit_fixed", check_error_diffusion_8bit_fixed, NULL, 1, 0xcf8f5edd656c19b8ULL, 0x93257e66b69edf23ULL},
+};
+
+/* **** COLOR AND PALETTE CASES **** */
+
+#define PALETTE_SMALL 16   // searched linearly, with SIMD where available
+#define PALETTE_LARGE 100  // searched with the palette's k-d tree (64 colors or more)
+
+typedef int (*PropertyFunc)(void);
+
+struct PropertyCase {
+    const char* name;
+    PropertyFunc run;  // returns the number of failures
+};
+typedef struct PropertyCase PropertyCase;
+
+struct LookupConfig {
+    const char* name;
+    uint8_t lut_bits;  // 0: hash cache
+    bool eager;
+};
+typedef struct LookupConfig LookupConfig;
+
+static const LookupConfig LOOKUP_CONFIGS[] = {{"hash cache", 0, false}, {"lazy 6 bit LUT", 6, false},
+                                              {"eager 4 bit LUT", 4, true}};
+
+void color_from_byte(const ByteColor* bc, FloatColor* out) {
+    out->r = (double)bc->r / 255.0;
+    out->g = (double)bc->g / 255.0;
+    out->b = (double)bc->b / 255.0;
+}
+
+void reference_color(enum ColorComparisonMode mode, const FloatColor* c, FloatColor* out) {
+    /* converts an sRGB color into the comparison color space; only SRGB and LINEAR are used by the checks */
+    if (mode == LINEAR)
+        rgb_to_linear(c, out);
+    else
+        FloatColor_from_FloatColor(out, c);
+}
+
+int reference_closest(const FloatColor* pal, size_t size, const FloatColor* c) {
+    /* plain linear search by Euclidean distance, the lowest index wins a tie. pal and c are already converted by
+     * reference_color */
+    double lowest = 0.0;
+    int index = -1;
+    for (size_t i = 0; i < size; i++) {
+        double dr = pal[i].r - c->r;
+        double dg = pal[i].g - c->g;
+        double db = pal[i].b - c->b;
+        double d = sqrt(dr * dr + dg * dg + db * db);
+        if (index < 0 || d < lowest) {
+            lowest = d;
+            index = (int)i;
+        }
+    }
+    return index;
+}
+
+void lut_cell_center(const ByteColor* bc, uint8_t bits, FloatColor* out) {
+    /* a lookup table entry holds the closest color to the center of its cell */
+    int shift = 8 - bits;
+    int half = shift > 0 ? 1 << (shift - 1) : 0;
+    out->r = (double)(((bc->r >> shift) << shift) | half) / 255.0;
+    out->g = (double)(((bc->g >> shift) << shift) | half) / 255.0;
+    out->b = (double)(((bc->b >> shift) << shift) | half) / 255.0;
+}
+
+CachedPalette* synthetic_cached_palette(size_t size, enum ColorComparisonMode mode, uint8_t lut_bits, bool eager) {
+    BytePalette* bp = synthetic_palette(size);
+    CachedPalette* pal = CachedPalette_new();
+    CachedPalette_from_BytePalette(pal, bp);
+    CachedPalette_set_lut(pal, lut_bits, eager);
+    CachedPalette_update_cache(pal, mode, NULL);
+    BytePalette_free(bp);
+    return pal;
+}
+
+void reference_lookups(size_t palette_size, enum ColorComparisonMode mode, uint8_t lut_bits, const ByteColor* colors,
+                       size_t count, int* out) {
+    /* the palette index each color must map to */
+    BytePalette* bp = synthetic_palette(palette_size);
+    FloatColor* pal = (FloatColor*)calloc(palette_size, sizeof(FloatColor));
+    for (size_t i = 0; i < palette_size; i++) {
+        FloatColor fc;
+        color_from_byte(BytePalette_get(bp, i), &fc);
+        reference_color(mode, &fc, &pal[i]);
+    }
+    for (size_t i = 0; i < count; i++) {
+        FloatColor fc, converted;
+        if (lut_bits != 0)
+            lut_cell_center(&colors[i], lut_bits, &fc);
+        else
+            color_from_byte(&colors[i], &fc);
+        reference_color(mode, &fc, &converted);
+        out[i] = reference_closest(pal, palette_size, &converted);
+    }
+    free(pal);
+    BytePalette_free(bp);
+}
+
+int compare_indices(const char* name, const char* what, const int* out, const int* expected, size_t count) {
+    /* reports the first mismatch; returns the number of failures */
+    for (size_t i = 0; i < count; i++) {
+        if (out[i] != expected[i]) {
+            printf("FAIL %s (%s): entry %zu is %d, expected %d\n", name, what, i, out[i], expected[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int compare_output(const char* name, const char* what, const uint8_t* out, const uint8_t* expected, size_t count) {
+    if (memcmp(out, expected, count) != 0) {
+        printf("FAIL %s (%s): output differs\n", name, what);
+        return 1;
+    }
+    return 0;
+}
+
+int property_palette_lookup(void) {
+    /* CachedPalette_find_closest_colors and CachedPalette_map_image against a linear search: SRGB and LINEAR
+     * palettes searched with SIMD or the k-d tree, with the hash cache or a lookup table */
+    ColorImage* image = synthetic_color_image(CHECK_WIDTH, CHECK_HEIGHT, true);
+    size_t size = (size_t)image->width * (size_t)image->height;
+    FloatColor* colors = (FloatColor*)calloc(size, sizeof(FloatColor));
+    int* out = (int*)calloc(size, sizeof(int));
+    int* expected = (int*)calloc(size, sizeof(int));
+    for (size_t i = 0; i < size; i++)
+        color_from_byte(&image->b_srgb[i], &colors[i]);
+    const size_t palette_sizes[] = {PALETTE_SMALL, PALETTE_LARGE};
+    const enum ColorComparisonMode modes[] = {SRGB, LINEAR};
+    int failures = 0;
+    for (size_t p = 0; p < 2; p++) {
+        for (size_t m = 0; m < 2; m++) {
+            for (size_t l = 0; l < sizeof(LOOKUP_CONFIGS) / sizeof(LOOKUP_CONFIGS[0]); l++) {
+                const LookupConfig* lc = &LOOKUP_CONFIGS[l];
+                char what[96];
+                snprintf(what, sizeof(what), "%s, %zu colors, %s", modes[m] == SRGB ? "SRGB" : "LINEAR",
+                         palette_sizes[p], lc->name);
+                reference_lookups(palette_sizes[p], modes[m], lc->lut_bits, image->b_srgb, size, expected);
+                CachedPalette* pal = synthetic_cached_palette(palette_sizes[p], modes[m], lc->lut_bits, lc->eager);
+                if (pal->palette_index != NULL && pal->simd_palette != NULL) {
+                    printf("FAIL palette_lookup (%s): SIMD copy built next to the k-d tree\n", what);
+                    failures++;
+                }
+                for (int pass = 0; pass < 2; pass++) {  // the second pass is answered from the cache
+                    CachedPalette_find_closest_colors(pal, colors, size, out);
+                    failures += compare_indices("palette_lookup", what, out, expected, size);
+                }
+                CachedPalette_map_image(pal, image, out);
+                for (size_t i = 0; i < size; i++)
+                    if (image->b_srgb[i].a == 0)
+                        expected[i] = -1;
+                failures += compare_indices("palette_lookup map_image", what, out, expected, size);
+                CachedPalette_free(pal);
+            }
+        }
+    }
+    free(expected);
+    free(out);
+    free(colors);
+    ColorImage_free(image);
+    return failures;
+}
+
+void stream_dither(const double* values, const uint8_t* alpha, int width, int height, const ErrorDiffusionMatrix* m,
+                   double sigma, DitherRandom* rng, uint8_t* out) {
+    /* mono error diffusion through ErrorDiffusionStream, row by row. alpha may be NULL */
+    ErrorDiffusionStream* stream = ErrorDiffusionStream_new(width, m, true, sigma, rng);
+    int popped = 0;
+    for (int y = 0; y < height; y++) {
+        size_t addr = (size_t)y * (size_t)width;
+        while (!ErrorDiffusionStream_push_row(stream, &values[addr], alpha != NULL ? &alpha[addr] : NULL)) {
+            ErrorDiffusionStream_pop_row(stream, &out[(size_t)popped * (size_t)width]);
+            popped++;
+        }
+    }
+    ErrorDiffusionStream_finish(stream);
+    while (popped < height && ErrorDiffusionStream_pop_row(stream, &out[(size_t)popped * (size_t)width]))
+        popped++;
+    ErrorDiffusionStream_free(stream);
+}
+
+void stream_dither_color(const ColorImage* image, const ErrorDiffusionMatrix* m, CachedPalette* pal, int* out) {
+    /* color error diffusion through ErrorDiffusionStream, row by row */
+    ErrorDiffusionStream* stream = ErrorDiffusionStream_new_color(image->width, m, pal, true);
+    int popped = 0;
+    for (int y = 0; y < image->height; y++) {
+        const ByteColor* row = &image->b_srgb[(size_t)y * (size_t)image->width];
+        while (!ErrorDiffusionStream_push_row_color(stream, row)) {
+            ErrorDiffusionStream_pop_row_color(stream, &out[(size_t)popped * (size_t)image->width]);
+            popped++;
+        }
+    }
+    ErrorDiffusionStream_finish(stream);
+    while (popped < image->height &&
+           ErrorDiffusionStream_pop_row_color(stream, &out[(size_t)popped * (size_t)image->width]))
+        popped++;
+    ErrorDiffusionStream_free(stream);
+}
+
+int property_error_diffusion_stream(void) {
+    /* ErrorDiffusionStream against error_diffusion_dither_rng and error_diffusion_dither_color */
+    size_t size = (size_t)CHECK_WIDTH * (size_t)CHECK_HEIGHT;
+    double* values = (double*)calloc(size, sizeof(double));
+    uint8_t* out = (uint8_t*)calloc(size, sizeof(uint8_t));
+    uint8_t* expected = (uint8_t*)calloc(size, sizeof(uint8_t));
+    ErrorDiffusionMatrix* m = get_stucki_matrix();
+    int failures = 0;
+    for (int alpha = 0; alpha < 2; alpha++) {
+        DitherImage* img = synthetic_image(CHECK_WIDTH, CHECK_HEIGHT, alpha != 0);
+        for (size_t i = 0; i < size; i++)
+            values[i] = DitherImage_value(img, i);
+        DitherRandom* rng = DitherRandom_new(CHECK_SEED);
+        memset(expected, 0, size);
+        error_diffusion_dither_rng(img, m, true, 0.3, rng, expected);
+        DitherRandom_free(rng);
+        rng = DitherRandom_new(CHECK_SEED);
+        memset(out, 0, size);
+        stream_dither(values, DitherImage_alpha(img, 0), CHECK_WIDTH, CHECK_HEIGHT, m, 0.3, rng, out);
+        DitherRandom_free(rng);
+        failures += compare_output("error_diffusion_stream", alpha ? "mono, alpha" : "mono, opaque", out, expected,
+                                   size);
+        DitherImage_free(img);
+    }
+    ColorImage* image = synthetic_color_image(CHECK_WIDTH, CHECK_HEIGHT, true);
+    CachedPalette* pal = synthetic_cached_palette(PALETTE_SMALL, LINEAR, 0, false);
+    int* color_out = (int*)calloc(size, sizeof(int));
+    int* color_expected = (int*)calloc(size, sizeof(int));
+    error_diffusion_dither_color(image, m, pal, true, color_expected);
+    stream_dither_color(image, m, pal, color_out);
+    failures += compare_indices("error_diffusion_stream", "color", color_out, color_expected, size);
+    free(color_expected);
+    free(color_out);
+    CachedPalette_free(pal);
+    ColorImage_free(image);
+    ErrorDiffusionMatrix_free(m);
+    free(expected);
+    free(out);
+    free(values);
+    return failures;
+}
+
+int property_error_diffusion_8bit(void) {
+    /* the 8 bit ditherers with ED_DOUBLE against the double precision ditherers, and ED_FIXED_POINT against
+     * ED_DOUBLE: the fixed point errors stay within a fraction of an 8 bit step, so the number of white dots or
+     * of each palette color may only differ by a fraction of a percent */
+    size_t size = (size_t)CHECK_WIDTH * (size_t)CHECK_HEIGHT;
+    uint8_t* luma = (uint8_t*)calloc(size, sizeof(uint8_t));
+    double* values = (double*)calloc(size, sizeof(double));
+    uint8_t* out = (uint8_t*)calloc(size, sizeof(uint8_t));
+    uint8_t* expected = (uint8_t*)calloc(size, sizeof(uint8_t));
+    ErrorDiffusionMatrix* m = get_stucki_matrix();
+    int failures = 0;
+    for (int alpha = 0; alpha < 2; alpha++) {
+        const char* what = alpha ? "mono, alpha" : "mono, opaque";
+        DitherImage* img = synthetic_image(CHECK_WIDTH, CHECK_HEIGHT, alpha != 0);
+        const uint8_t* transparency = DitherImage_alpha(img, 0);
+        image_luma(img, luma);
+        for (size_t i = 0; i < size; i++)
+            values[i] = (double)luma[i] / 255.0;
+        memset(expected, 0, size);
+        stream_dither(values, transparency, CHECK_WIDTH, CHECK_HEIGHT, m, 0.0, NULL, expected);
+        memset(out, 0, size);
+        error_diffusion_dither_8bit(luma, transparency, CHECK_WIDTH, CHECK_HEIGHT, m, true, ED_DOUBLE, out);
+        failures += compare_output("error_diffusion_8bit double", what, out, expected, size);
+        memset(out, 0, size);
+        error_diffusion_dither_8bit(luma, transparency, CHECK_WIDTH, CHECK_HEIGHT, m, true, ED_FIXED_POINT, out);
+        long dots = 0;
+        for (size_t i = 0; i < size; i++)
+            dots += (out[i] == 0xff) - (expected[i] == 0xff);
+        if (labs(dots) * 200 > (long)size) {
+            printf("FAIL error_diffusion_8bit fixed point (%s): %ld more white dots than ED_DOUBLE\n", what, dots);
+            failures++;
+        }
+        DitherImage_free(img);
+    }
+    ColorImage* image = synthetic_color_image(CHECK_WIDTH, CHECK_HEIGHT, true);
+    CachedPalette* pal = synthetic_cached_palette(PALETTE_SMALL, LINEAR, 0, false);
+    int* color_out = (int*)calloc(size, sizeof(int));
+    int* color_expected = (int*)calloc(size, sizeof(int));
+    error_diffusion_dither_color(image, m, pal, true, color_expected);
+    error_diffusion_dither_color_8bit(image->b_srgb, CHECK_WIDTH, CHECK_HEIGHT, m, pal, true, ED_DOUBLE, color_out);
+    failures += compare_indices("error_diffusion_8bit double", "color", color_out, color_expected, size);
+    error_diffusion_dither_color_8bit(image->b_srgb, CHECK_WIDTH, CHECK_HEIGHT, m, pal, true, ED_FIXED_POINT,
+                                      color_out);
+    long counts[PALETTE_SMALL + 1] = {0};  // per palette color, and transparent pixels last
+    for (size_t i = 0; i < size; i++) {
+        counts[color_out[i] >= 0 ? color_out[i] : PALETTE_SMALL]++;
+        counts[color_expected[i] >= 0 ? color_expected[i] : PALETTE_SMALL]--;
+    }
+    for (int c = 0; c <= PALETTE_SMALL; c++) {
+        if (labs(counts[c]) * 200 > (long)size) {
+            printf("FAIL error_diffusion_8bit fixed point (color): %ld more pixels of color %d than ED_DOUBLE\n",
+                   counts[c], c);
+            failures++;
+        }
+    }
+    free(color_expected);
+    free(color_out);
+    CachedPalette_free(pal);
+    ColorImage_free(image);
+    ErrorDiffusionMatrix_free(m);
+    free(expected);
+    free(out);
+    free(values);
+    free(luma);
+    return failures;
+}
+
+typedef void (*PackedFunc)(const DitherImage* img, const PackedOutput* out);
+
+struct PackedCase {
+    const char* name;
+    CheckFunc serial;  // byte output the packed variant must match
+    PackedFunc packed;
+};
+typedef struct PackedCase PackedCase;
+
+void packed_threshold(const DitherImage* img, const PackedOutput* out) {
+    DitherRandom* rng = DitherRandom_new(CHECK_SEED);
+    threshold_dither_packed(img, 0.5, 0.3, rng, out);
+    DitherRandom_free(rng);
+}
+
+void packed_ordered(const DitherImage* img, const PackedOutput* out) {
+    OrderedDitherMatrix* m = get_bayer8x8_matrix();
+    DitherRandom* rng = DitherRandom_new(CHECK_SEED);
+    ordered_dither_packed(img, m, 0.2, rng, out);
+    DitherRandom_free(rng);
+    OrderedDitherMatrix_free(m);
+}
+
+void packed_error_diffusion(const DitherImage* img, const PackedOutput* out) {
+    ErrorDiffusionMatrix* m = get_stucki_matrix();
+    DitherRandom* rng = DitherRandom_new(CHECK_SEED);
+    error_diffusion_dither_packed(img, m, true, 0.3, rng, out);
+    DitherRandom_free(rng);
+    ErrorDiffusionMatrix_free(m);
+}
+
+void packed_kallebach(const DitherImage* img, const PackedOutput* out) {
+    DitherRandom* rng = DitherRandom_new(CHECK_SEED);
+    kallebach_dither_packed(img, true, rng, out);
+    DitherRandom_free(rng);
+}
+
+static const PackedCase PACKED_CASES[] = {
+    {"threshold", check_threshold, packed_threshold},
+    {"ordered", check_ordered, packed_ordered},
+    {"error_diffusion", check_error_diffusion_stucki_noise, packed_error_diffusion},
+    {"kallebach", check_kallebach, packed_kallebach},
+};
+
+#define PACKED_PADDING 3     // extra bytes per packed row, which must stay untouched
+#define PACKED_SENTINEL 0xa5
+
+int property_packed_output(void) {
+    /* the '_packed' ditherers against their byte output packed with PackedOutput_pack, in both bit orders, with a
+     * padded row stride and the transparency mask, and with the mask left out */
+    size_t size = (size_t)CHECK_WIDTH * (size_t)CHECK_HEIGHT;
+    size_t stride = (CHECK_WIDTH + 7) / 8 + PACKED_PADDING;
+    size_t packed_size = stride * CHECK_HEIGHT;
+    uint8_t* out = (uint8_t*)calloc(size, sizeof(uint8_t));
+    uint8_t* buffers[4];  // expected bits and mask, bits and mask of the packed ditherer
+    for (int i = 0; i < 4; i++)
+        buffers[i] = (uint8_t*)calloc(packed_size, sizeof(uint8_t));
+    int failures = 0;
+    for (int alpha = 0; alpha < 2; alpha++) {
+        DitherImage* img = synthetic_image(CHECK_WIDTH, CHECK_HEIGHT, alpha != 0);
+        for (size_t c = 0; c < sizeof(PACKED_CASES) / sizeof(PACKED_CASES[0]); c++) {
+            const PackedCase* pc = &PACKED_CASES[c];
+            memset(out, 0, size);
+            pc->serial(img, 1, out);
+            for (int order = MSB_FIRST; order <= LSB_FIRST; order++) {
+                for (int with_mask = 0; with_mask < 2; with_mask++) {
+                    char what[64];
+                    snprintf(what, sizeof(what), "%s, %s first%s", alpha ? "alpha" : "opaque",
+                             order == MSB_FIRST ? "MSB" : "LSB", with_mask ? ", mask" : "");
+                    for (int i = 0; i < 4; i++)
+                        memset(buffers[i], PACKED_SENTINEL, packed_size);
+                    PackedOutput expected = {buffers[0], stride, with_mask ? buffers[1] : NULL, stride,
+                                             (enum BitOrder)order};
+                    PackedOutput packed = {buffers[2], stride, with_mask ? buffers[3] : NULL, stride,
+                                           (enum BitOrder)order};
+                    PackedOutput_pack(&expected, out, CHECK_WIDTH, CHECK_HEIGHT);
+                    pc->packed(img, &packed);
+                    if (memcmp(buffers[0], buffers[2], packed_size) != 0 ||
+                        memcmp(buffers[1], buffers[3], packed_size) != 0) {
+                        printf("FAIL packed_output %s (%s): differs from the packed byte output\n", pc->name, what);
+                        failures++;
+                    }
+                    for (size_t y = 0; y < CHECK_HEIGHT; y++) {
+                        if (buffers[2][y * stride + stride - 1] != PACKED_SENTINEL) {
+                            printf("FAIL packed_output %s (%s): row %zu writes past its end\n", pc->name, what, y);
+                            failures++;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+        DitherImage_free(img);
+    }
+    for (int i = 0; i < 4; i++)
+        free(buffers[i]);
+    free(out);
+    return failures;
+}
+
+#define LOOKUP_THREADS 4
+#define CONCURRENT_BITS 10  // the smallest concurrent table (1024 slots): the synthetic image has far more colors
+
+struct LookupThread {
+    /* looks up all colors, starting at 'first' and wrapping around, so the threads race for the same entries */
+    CachedPalette* pal;
+    const FloatColor* colors;
+    size_t count;
+    size_t first;
+    int* out;
+};
+typedef struct LookupThread LookupThread;
+
+void lookup_thread(LookupThread* t) {
+    CachedPalette_find_closest_colors(t->pal, &t->colors[t->first], t->count - t->first, &t->out[t->first]);
+    CachedPalette_find_closest_colors(t->pal, t->colors, t->first, t->out);
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI lookup_thread_entry(LPVOID param) {
+    lookup_thread((LookupThread*)param);
+    return 0;
+}
+#else
+static void* lookup_thread_entry(void* param) {
+    lookup_thread((LookupThread*)param);
+    return NULL;
+}
+#endif
+
+void run_lookup_threads(LookupThread* threads, int count) {
+    /* runs every lookup thread at the same time; a thread that can't be started runs on the calling thread */
+#if defined(_WIN32)
+    HANDLE handles[LOOKUP_THREADS];
+#else
+    pthread_t handles[LOOKUP_THREADS];
+#endif
+    bool started[LOOKUP_THREADS];
+    for (int i = 0; i < count; i++) {
+#if defined(_WIN32)
+        handles[i] = CreateThread(NULL, 0, lookup_thread_entry, &threads[i], 0, NULL);
+        started[i] = handles[i] != NULL;
+#else
+        started[i] = pthread_create(&handles[i], NULL, lookup_thread_entry, &threads[i]) == 0;
+#endif
+        if (!started[i])
+            lookup_thread(&threads[i]);
+    }
+    for (int i = 0; i < count; i++) {
+        if (!started[i])
+            continue;
+#if defined(_WIN32)
+        WaitForSingleObject(handles[i], INFINITE);
+        CloseHandle(handles[i]);
+#else
+        pthread_join(handles[i], NULL);
+#endif
+    }
+}
+
+int property_concurrent_palette(void) {
+    /* LOOKUP_THREADS threads share one CachedPalette_set_concurrent palette: with the lock-free table, which fills up
+     * to its 3/4 limit, and with a lazily filled lookup table. Every result must match a plain linear search */
+    ColorImage* image = synthetic_color_image(CHECK_WIDTH, CHECK_HEIGHT, false);
+    size_t size = (size_t)image->width * (size_t)image->height;
+    FloatColor* colors = (FloatColor*)calloc(size, sizeof(FloatColor));
+    int* expected = (int*)calloc(size, sizeof(int));
+    int* out[LOOKUP_THREADS];
+    for (size_t i = 0; i < size; i++)
+        color_from_byte(&image->b_srgb[i], &colors[i]);
+    for (int t = 0; t < LOOKUP_THREADS; t++)
+        out[t] = (int*)calloc(size, sizeof(int));
+    const uint8_t lut_bits[] = {0, 6};
+    int failures = 0;
+    for (size_t l = 0; l < 2; l++) {
+        const char* what = lut_bits[l] != 0 ? "lazy 6 bit LUT" : "lock-free table";
+        reference_lookups(PALETTE_LARGE, LINEAR, lut_bits[l], image->b_srgb, size, expected);
+        CachedPalette* pal = synthetic_cached_palette(PALETTE_LARGE, LINEAR, lut_bits[l], false);
+        CachedPalette_set_concurrent(pal, CONCURRENT_BITS);
+        for (int pass = 0; pass < 2; pass++) {  // the second pass is answered from the shared cache
+            LookupThread threads[LOOKUP_THREADS];
+            for (int t = 0; t < LOOKUP_THREADS; t++) {
+                threads[t].pal = pal;
+                threads[t].colors = colors;
+                threads[t].count = size;
+                threads[t].first = size * (size_t)t / LOOKUP_THREADS;
+                threads[t].out = out[t];
+            }
+            run_lookup_threads(threads, LOOKUP_THREADS);
+            for (int t = 0; t < LOOKUP_THREADS; t++)
+                failures += compare_indices("concurrent_palette", what, out[t], expected, size);
+        }
+        // the slot counter stops at the 3/4 limit, plus at most one reservation per thread
+        int limit = (1 << CONCURRENT_BITS) / 4 * 3 + LOOKUP_THREADS;
+        if (lut_bits[l] == 0 && pal->concurrent_count > limit) {
+            printf("FAIL concurrent_palette (%s): %d slots counted, limit %d\n", what, pal->concurrent_count, limit);
+            failures++;
+        }
+        CachedPalette_free(pal);
+    }
+    for (int t = 0; t < LOOKUP_THREADS; t++)
+        free(out[t]);
+    free(expected);
+    free(colors);
+    ColorImage_free(image);
+    return failures;
+}
+
+#define PALETTE_FILE "check_palette.tmp"
+
+struct PaletteSetup {
+    /* everything a saved palette file has to match */
+    const char* name;
+    enum ColorComparisonMode mode;
+    const FloatColor* illuminant;
+    uint8_t shift;
+    uint8_t lut_bits;
+    uint8_t concurrent_bits;
+    bool other_palette;  // one color differs from synthetic_palette
+};
+typedef struct PaletteSetup PaletteSetup;
+
+CachedPalette* setup_palette(const PaletteSetup* ps) {
+    BytePalette* bp = synthetic_palette(PALETTE_LARGE);
+    if (ps->other_palette) {
+        ByteColor bc = {1, 2, 3, 255};
+        BytePalette_set(bp, 5, &bc);
+    }
+    CachedPalette* pal = CachedPalette_new();
+    CachedPalette_from_BytePalette(pal, bp);
+    if (ps->shift != 0)
+        CachedPalette_set_shift(pal, ps->shift, ps->shift, ps->shift);
+    CachedPalette_set_lut(pal, ps->lut_bits, false);
+    CachedPalette_update_cache(pal, ps->mode, ps->illuminant);
+    CachedPalette_set_concurrent(pal, ps->concurrent_bits);
+    BytePalette_free(bp);
+    return pal;
+}
+
+uint8_t* read_file(const char* filename, size_t* size) {
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL)
+        return NULL;
+    fseek(file, 0, SEEK_END);
+    *size = (size_t)ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t* data = (uint8_t*)malloc(*size > 0 ? *size : 1);
+    if (fread(data, 1, *size, file) != *size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    return data;
+}
+
+bool write_file(const char* filename, const uint8_t* data, size_t size) {
+    FILE* file = fopen(filename, "wb");
+    if (file == NULL)
+        return false;
+    bool ok = fwrite(data, 1, size, file) == size;
+    return fclose(file) == 0 && ok;
+}
+
+int expect_rejected(const PaletteSetup* ps, const char* what) {
+    /* loading PALETTE_FILE into a palette set up like ps must fail */
+    CachedPalette* pal = setup_palette(ps);
+    bool loaded = CachedPalette_load(pal, PALETTE_FILE);
+    CachedPalette_free(pal);
+    if (loaded) {
+        printf("FAIL palette_file (%s): a file with %s was loaded\n", ps->name, what);
+        return 1;
+    }
+    return 0;
+}
+
+int check_palette_file(const PaletteSetup* saved, const FloatColor* colors, const int* expected, size_t count) {
+    /* saves a palette after looking up count colors, loads the file into a palette set up the same way and looks
+     * them up again: the results must match and come from the file. Then damages the file in ways the loader
+     * has to reject. Returns the number of failures */
+    int* out = (int*)calloc(count, sizeof(int));
+    int failures = 0;
+    CachedPalette* pal = setup_palette(saved);
+    CachedPalette_find_closest_colors(pal, colors, count, out);
+    failures += compare_indices("palette_file", saved->name, out, expected, count);
+    int saved_count = pal->concurrent_count;
+    if (!CachedPalette_save(pal, PALETTE_FILE)) {
+        printf("FAIL palette_file (%s): can't save\n", saved->name);
+        CachedPalette_free(pal);
+        free(out);
+        return failures + 1;
+    }
+    CachedPalette_free(pal);
+    pal = setup_palette(saved);
+    if (!CachedPalette_load(pal, PALETTE_FILE)) {
+        printf("FAIL palette_file (%s): can't load\n", saved->name);
+        failures++;
+    }
+    CachedPalette_find_closest_colors(pal, colors, count, out);
+    failures += compare_indices("palette_file loaded", saved->name, out, expected, count);
+    size_t misses = 0;
+    CachedPalette_get_stats(pal, NULL, &misses);  // not counted for concurrent palettes
+    if (misses != 0 || pal->concurrent_count != saved_count) {
+        printf("FAIL palette_file (%s): the lookups weren't loaded\n", saved->name);
+        failures++;
+    }
+    CachedPalette_free(pal);
+    // settings that differ from the saved ones
+    PaletteSetup ps = *saved;
+    ps.mode = saved->mode == LINEAR ? SRGB : LINEAR;
+    failures += expect_rejected(&ps, "another mode");
+    ps = *saved;
+    ps.illuminant = &D50_XYZ;
+    failures += expect_rejected(&ps, "another illuminant");
+    ps = *saved;
+    ps.shift = 1;
+    failures += expect_rejected(&ps, "another shift");
+    ps = *saved;
+    ps.lut_bits = saved->lut_bits != 0 ? (uint8_t)(saved->lut_bits - 1) : 6;
+    failures += expect_rejected(&ps, "another lookup table size");
+    ps = *saved;
+    ps.other_palette = true;
+    failures += expect_rejected(&ps, "another palette");
+    // damaged files
+    size_t size = 0;
+    uint8_t* data = read_file(PALETTE_FILE, &size);
+    if (data == NULL || size < 16) {
+        printf("FAIL palette_file (%s): can't read the saved file\n", saved->name);
+        failures++;
+    } else {
+        const size_t cuts[] = {16, size / 2, size - 1};  // within the header, the middle and the last byte
+        for (size_t i = 0; i < 3; i++) {
+            write_file(PALETTE_FILE, data, cuts[i]);
+            failures += expect_rejected(saved, "a truncated end");
+        }
+        // the file ends with the last lookup table entry (int32) or cache entry (uint64, index in the low bits)
+        uint8_t* damaged = (uint8_t*)malloc(size);
+        memcpy(damaged, data, size);
+        if (saved->lut_bits != 0) {
+            int32_t entry = PALETTE_LARGE;
+            memcpy(&damaged[size - sizeof(int32_t)], &entry, sizeof(int32_t));
+        } else {
+            uint64_t entry;
+            memcpy(&entry, &damaged[size - sizeof(uint64_t)], sizeof(uint64_t));
+            entry = (entry & ~(uint64_t)0xffffffff) | PALETTE_LARGE;
+            memcpy(&damaged[size - sizeof(uint64_t)], &entry, sizeof(uint64_t));
+        }
+        write_file(PALETTE_FILE, damaged, size);
+        failures += expect_rejected(saved, "a palette index out of range");
+        free(damaged);
+    }
+    free(data);
+    remove(PALETTE_FILE);
+    free(out);
+    return failures;
+}
+
+int property_palette_file(void) {
+    /* CachedPalette_save / CachedPalette_load round trips with the hash cache, a lookup table and the concurrent
+     * cache, and files the loader has to reject */
+    ColorImage* image = synthetic_color_image(CHECK_WIDTH, CHECK_HEIGHT, false);
+    size_t size = (size_t)image->width * (size_t)image->height;
+    FloatColor* colors = (FloatColor*)calloc(size, sizeof(FloatColor));
+    int* expected = (int*)calloc(size, sizeof(int));
+    for (size_t i = 0; i < size; i++)
+        color_from_byte(&image->b_srgb[i], &colors[i]);
+    const PaletteSetup setups[] = {
+        {"hash cache", LINEAR, NULL, 0, 0, 0, false},
+        {"lazy 6 bit LUT", LINEAR, NULL, 0, 6, 0, false},
+        {"concurrent cache", SRGB, NULL, 0, 0, 16, false},
+    };
+    int failures = 0;
+    for (size_t i = 0; i < sizeof(setups) / sizeof(setups[0]); i++) {
+        reference_lookups(PALETTE_LARGE, setups[i].mode, setups[i].lut_bits, image->b_srgb, size, expected);
+        failures += check_palette_file(&setups[i], colors, expected, size);
+    }
+    free(expected);
+    free(colors);
+    ColorImage_free(image);
+    return failures;
+}
+
+static const PropertyCase PROPERTY_CASES[] = {
+    {"palette_lookup", property_palette_lookup},
+    {"error_diffusion_stream", property_error_diffusion_stream},
+    {"error_diffusion_8bit", property_error_diffusion_8bit},
+    {"packed_output", property_packed_output},
+    {"concurrent_palette", property_concurrent_palette},
+    {"palette_file", property_palette_file},
+};
+
+int check_case(const CheckCase* c, const DitherImage* img, uint64_t expected, const char* image_name, bool print,
+               uint64_t* hash) {
+    /* runs one case on one image; returns the number of failures */
+    size_t size = (size_t)img->width * (size_t)img->height;
+    uint8_t* serial = (uint8_t*)calloc(size, sizeof(uint8_t));
+    uint8_t* reference = (uint8_t*)calloc(size, sizeof(uint8_t));
+    uint8_t* out = (uint8_t*)calloc(size, sizeof(uint8_t));
+    int failures = 0;
+    c->serial(img, 1, serial);
+    *hash = hash_output(serial, size);
+    if (!print && *hash != expected) {
+        printf("FAIL %s (%s): hash 0x%016llx, expected 0x%016llx\n", c->name, image_name, (unsigned long long)*hash,
+               (unsigned long long)expected);
+        failures++;
+    }
+    if (c->parallel != NULL) {
+        bool has_reference = false;
+        for (size_t i = 0; i < sizeof(THREAD_COUNTS) / sizeof(THREAD_COUNTS[0]); i++) {
+            int threads = THREAD_COUNTS[i];
+            memset(out, 0, size);
+            c->parallel(img, threads, out);
+            const uint8_t* expected_out = serial;
+            if (threads > 1 && c->reference_threads > 1) {
+                if (!has_reference) {  // the first multithreaded run is the reference for the others
+                    memcpy(reference, out, size);
+                    has_reference = true;
+                }
+                expected_out = reference;
+            }
+            if (memcmp(out, expected_out, size) != 0) {
+                printf("FAIL %s (%s): %d threads differ from the %s output\n", c->name, image_name, threads,
+                       expected_out == serial ? "single-threaded" : "multithreaded");
+                failures++;
+            }
+        }
+    }
+    free(out);
+    free(reference);
+    free(serial);
+    return failures;
+}
+
+int main(int argc, char* argv[]) {
+    bool print = argc > 1 && strcmp(argv[1], "--print") == 0;
+    if (argc > 1 && !print) {
+        printf("usage: check [--print]\n");
+        return 1;
+    }
+    DitherImage* opaque = synthetic_image(CHECK_WIDTH, CHECK_HEIGHT, false);
+    DitherImage* alpha = synthetic_image(CHECK_WIDTH, CHECK_HEIGHT, true);
+    size_t case_count = sizeof(CHECK_CASES) / sizeof(CHECK_CASES[0]);
+    int failures = 0;
+    for (size_t i = 0; i < case_count; i++) {
+        const CheckCase* c = &CHECK_CASES[i];
+        uint64_t hash_opaque, hash_alpha;
+        failures += check_case(c, opaque, c->hash_opaque, "opaque", print, &hash_opaque);
+        failures += check_case(c, alpha, c->hash_alpha, "alpha", print, &hash_alpha);
+        if (print)
+            printf("%s 0x%016llx 0x%016llx\n", c->name, (unsigned long long)hash_opaque,
+                   (unsigned long long)hash_alpha);
+    }
+    DitherImage_free(alpha);
+    DitherImage_free(opaque);
+    size_t property_count = sizeof(PROPERTY_CASES) / sizeof(PROPERTY_CASES[0]);
+    if (!print) {
+        for (size_t i = 0; i < property_count; i++)
+            failures += PROPERTY_CASES[i].run();
+    }
+    printf("%zu cases, %d failures\n", case_count + property_count, failures);
+    return failures == 0 ? 0 : 1;
+}
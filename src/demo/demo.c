@@ -56,6 +56,7 @@ DitherImage* bmp_to_monoimage(char *filename) {
             a += PNG_WIDTH;
         }
     }
+    DitherImage_compact(image);
     free(png);
     return image;
 }
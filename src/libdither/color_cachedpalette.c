@@ -1,5 +1,6 @@
 #define MODULE_API_EXPORTS
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include "libdither.h"
 #include "color_cachedpalette.h"
@@ -7,10 +8,33 @@
 #include "color_quant_mediancut.h"
 #include "color_quant_wu.h"
 #include "color_quant_kdtree.h"
+#include "color_simd.h"
+#include "threading.h"
 #include "tetrapal/tetrapal.h"
 
+#if defined(_MSC_VER)
+#pragma warning( disable : 4996 ) // VS does not like fopen, but fopen_s is not standard C
+#endif
+
 #define DBL_MAX 1.7976931348623158e+308
 
+#define LUT_MIN_BITS 4  // smallest supported lookup table: 16x16x16 entries
+#define LUT_MAX_BITS 8  // largest supported lookup table: 256x256x256 entries
+#define LUT_EMPTY -1    // marks a lookup table entry that has not been resolved yet
+
+#define CONCURRENT_MIN_BITS 10  // smallest concurrent cache: 1024 slots
+#define CONCURRENT_MAX_BITS 25  // largest concurrent cache: 32M slots (twice the number of possible keys)
+#define CONCURRENT_EMPTY 0      // marks an unused concurrent cache slot
+
+#define PALETTE_INDEX_MIN_SIZE 64  // smaller palettes are searched linearly (or with SIMD)
+
+#define PALETTE_FILE_MAGIC "LDCP"       // CachedPalette_save / CachedPalette_load file signature
+#define PALETTE_FILE_VERSION 1
+#define PALETTE_FILE_BYTE_ORDER 0x01020304u  // files are written in the native byte order
+
+#define BATCH_SIZE 256     // colors resolved per chunk by CachedPalette_find_closest_colors
+#define BATCH_SLOT_BITS 9  // the per-chunk table of pending cache misses has 2^9 slots (at most half full)
+
 #define IDXD 0  // darkest color
 #define IDXL 1  // lightest color
 #define IDXR 2  // reddest color
@@ -21,13 +45,8 @@
 #define IDXY 7  // yellowest color
 
 static void create_lookup_palette(CachedPalette* self);
-
-struct ByteColorHashEntry {
-    /* helper for uthash */
-    long key;                   /* key */
-    ByteColor color;            /* sRGB color */
-    UT_hash_handle hh2;         /* makes this structure hashable */
-};
+static size_t find_closest_color(const CachedPalette* palette, const FloatColor* x);
+static void create_lut(CachedPalette* self);
 
 struct ColorExtremes {
     /* helper to find color extremes within a palette */
@@ -54,6 +73,49 @@ inline static long key_from_srgb(const ByteColor* bc) {
     return rr | gg | bb;
 }
 
+inline static size_t lut_channel(double c, uint8_t bits) {
+    /* quantizes a float color channel (0.0 - 1.0) to the lookup table's resolution */
+    c = (c > 1.0 ? 1.0 : (c < 0.0 ? 0.0 : c));
+    return (size_t)((int)(c * 255.0) >> (8 - bits));
+}
+
+inline static size_t lut_index(const CachedPalette* self, const FloatColor* c) {
+    /* returns the lookup table index for a float sRGB color */
+    uint8_t bits = self->lut_bits;
+    return (lut_channel(c->r, bits) << (bits * 2)) | (lut_channel(c->g, bits) << bits) | lut_channel(c->b, bits);
+}
+
+static void lut_color(const CachedPalette* self, size_t index, FloatColor* out) {
+    /* returns the color in the center of the lookup table cell 'index'; used to resolve the cell's closest color */
+    uint8_t bits = self->lut_bits;
+    int shift = 8 - bits;
+    int half = shift > 0 ? 1 << (shift - 1) : 0;
+    size_t mask = ((size_t)1 << bits) - 1;
+    int r = (int)((index >> (bits * 2)) & mask);
+    int g = (int)((index >> bits) & mask);
+    int b = (int)(index & mask);
+    out->r = (double)((r << shift) | half) / 255.0;
+    out->g = (double)((g << shift) | half) / 255.0;
+    out->b = (double)((b << shift) | half) / 255.0;
+}
+
+static void create_lut(CachedPalette* self) {
+    /* allocates the lookup table. In eager mode every entry is resolved right away, otherwise entries are resolved
+     * on first use */
+    size_t lut_size = (size_t)1 << (self->lut_bits * 3);
+    self->lut = (int32_t*)malloc(lut_size * sizeof(int32_t));
+    if (self->lut_eager) {
+        FloatColor fc;
+        for (size_t i = 0; i < lut_size; i++) {
+            lut_color(self, i, &fc);
+            self->lut[i] = (int32_t)find_closest_color(self, &fc);
+        }
+    } else {
+        for (size_t i = 0; i < lut_size; i++)
+            self->lut[i] = LUT_EMPTY;
+    }
+}
+
 MODULE_API CachedPalette* CachedPalette_new(void) {
     /* Constructor */
     CachedPalette* self = (CachedPalette*)calloc(1, sizeof(CachedPalette));
@@ -66,6 +128,22 @@ MODULE_API CachedPalette* CachedPalette_new(void) {
     self->g_shift = 0;
     self->b_shift = 0;
     self->reduce = false;
+    self->lut = NULL;
+    self->lut_bits = 0;
+    self->lut_eager = false;
+    self->simd_palette = NULL;
+    self->simd_stride = 0;
+    self->simd_level = SIMD_NONE;
+    self->concurrent_cache = NULL;
+    self->concurrent_bits = 0;
+    self->concurrent_count = 0;
+    self->frozen = false;
+    self->palette_index = NULL;
+    self->lab_prefilter = 0;
+    KMeansOptions_init(&self->kmeans);
+    WuOptions_init(&self->wu);
+    self->stat_lookups = 0;
+    self->stat_misses = 0;
     self->lab_weights.h = LAB_W_HUE;
     self->lab_weights.c = LAB_W_CHROMA;
     self->lab_weights.v = LAB_W_VALUE;
@@ -76,6 +154,20 @@ MODULE_API void CachedPalette_set_lab_weights(CachedPalette* self, FloatColor* w
     /* sets weights for LAB color comparison; will be used during color lookup - no need to call
      * CachedPalette_update_cache() after calling this function */
     FloatColor_from_FloatColor(&self->lab_weights, weights);
+    if (self->lut != NULL) {  // resolved lookup table entries depend on the weights
+        free(self->lut);
+        self->lut = NULL;
+        if (self->lookup_palette != NULL)
+            create_lut(self);
+    }
+}
+
+MODULE_API void CachedPalette_set_lab_prefilter(CachedPalette* self, int candidates) {
+    /* speeds up LAB94 and LAB2000 lookups in large palettes: a k-d tree finds the 'candidates' closest palette colors
+     * by LAB76 (Euclidean) distance, and only those are compared with the selected distance formula. The result
+     * may differ from a full search when the best match isn't among the candidates. candidates is clamped to 0 - 64,
+     * 0 = compare all palette colors. Takes effect with the next call of CachedPalette_update_cache() */
+    self->lab_prefilter = candidates < 0 ? 0 : (candidates > PALETTE_INDEX_MAX_K ? PALETTE_INDEX_MAX_K : candidates);
 }
 
 MODULE_API void CachedPalette_set_shift(CachedPalette* self, uint8_t r_shift, uint8_t g_shift, uint8_t b_shift) {
@@ -87,11 +179,30 @@ MODULE_API void CachedPalette_set_shift(CachedPalette* self, uint8_t r_shift, ui
     self->reduce = r_shift !=0 || g_shift !=0 || b_shift !=0;
 }
 
+MODULE_API void CachedPalette_set_lut(CachedPalette* self, uint8_t bits, bool eager) {
+    /* replaces the hash cache with a dense lookup table of 2^bits x 2^bits x 2^bits entries. Each lookup becomes a
+     * single array read without any memory allocation. The table needs 4 * 2^(3 * bits) bytes, e.g. 128 KB for 5
+     * bits or 1 MB for 6 bits. bits is clamped to 4 - 8; 0 disables the lookup table again.
+     * eager: when true all entries are resolved up front (during this call or CachedPalette_update_cache), otherwise
+     *        each entry is resolved when it is first looked up. The table itself is allocated right away either way,
+     *        so that concurrent lookups never have to allocate it */
+    if (bits != 0)
+        bits = bits < LUT_MIN_BITS ? LUT_MIN_BITS : (bits > LUT_MAX_BITS ? LUT_MAX_BITS : bits);
+    free(self->lut);
+    self->lut = NULL;
+    self->lut_bits = bits;
+    self->lut_eager = eager;
+    if (bits != 0 && self->lookup_palette != NULL)
+        create_lut(self);
+}
+
 MODULE_API void CachedPalette_update_cache(CachedPalette* self, enum ColorComparisonMode mode,
                                            const FloatColor* lab_illuminant) {
     /* updates the lookup cache when the color comparison mode changes */
     FloatPalette_free(self->lookup_palette);
     CachedPalette_free_cache(self);
+    free(self->lut);
+    self->lut = NULL;
     if (self->tetrapal != NULL) {
         tetrapal_free(self->tetrapal);
         self->tetrapal = NULL;
@@ -103,6 +214,25 @@ MODULE_API void CachedPalette_update_cache(CachedPalette* self, enum ColorCompar
     }
     self->mode = mode;
     create_lookup_palette(self);
+    PaletteIndex_free(self->palette_index);
+    self->palette_index = NULL;
+    if (self->lookup_palette->size >= PALETTE_INDEX_MIN_SIZE) {
+        if (mode == LINEAR || mode == SRGB || mode == LAB76)
+            self->palette_index = PaletteIndex_new(self->lookup_palette, 3);
+        else if (mode == LUMINANCE)
+            self->palette_index = PaletteIndex_new(self->lookup_palette, 1);
+        else if ((mode == LAB94 || mode == LAB2000) && self->lab_prefilter > 0 &&
+                 (size_t)self->lab_prefilter < self->lookup_palette->size)
+            self->palette_index = PaletteIndex_new(self->lookup_palette, 3);
+    }
+    free(self->simd_palette);
+    self->simd_palette = NULL;
+    // plain Euclidean distance: use SIMD search if available, unless the k-d tree answers all searches
+    if ((mode == LINEAR || mode == SRGB || mode == LAB76) && self->palette_index == NULL) {
+        self->simd_level = (int)simd_detect();
+        if (self->simd_level != SIMD_NONE)
+            self->simd_palette = simd_palette_new(self->lookup_palette, &self->simd_stride);
+    }
     if (mode == TETRAPAL) {
         float* floatpal = (float*)calloc(self->lookup_palette->size * 3, sizeof(float));
         for (size_t i = 0; i < self->lookup_palette->size; i++) {
@@ -117,6 +247,8 @@ MODULE_API void CachedPalette_update_cache(CachedPalette* self, enum ColorCompar
     } else {
         self->tetrapal = NULL;
     }
+    if (self->lut_bits != 0)
+        create_lut(self);
 }
 
 static size_t get_tetrapal_index(Tetrapal* tetrapal, FloatColor* fc) {
@@ -175,58 +307,93 @@ static void create_lookup_palette(CachedPalette* self) {
     }
 }
 
-static size_t find_closest_color(const CachedPalette* palette, const FloatColor* x) {
-    /* returns the index of the color in the reduced palette with the smallest distance.
-     * converts the input FloatColor into the color space in which the distance is calculated */
+static void convert_colors(const CachedPalette* palette, const FloatColor* in, size_t count, FloatColor* out) {
+    /* converts count input colors into the color space in which the distance is calculated. The mode is dispatched
+     * once for the whole span */
+    size_t i;
+    switch(palette->mode) {
+        case HSV:
+            for (i = 0; i < count; i++)
+                rgb_to_hsv(&in[i], &out[i]);
+            break;
+        case SRGB_CCIR:
+        case SRGB:
+            for (i = 0; i < count; i++)
+                FloatColor_from_FloatColor(&out[i], &in[i]);
+            break;
+        case LINEAR_CCIR:
+        case LINEAR:
+        case TETRAPAL:
+            for (i = 0; i < count; i++)
+                rgb_to_linear(&in[i], &out[i]);
+            break;
+        case LUMINANCE:
+            for (i = 0; i < count; i++)
+                rgb_to_luminance(&in[i], &out[i]);
+            break;
+        case LAB76:
+        case LAB94:
+        case LAB2000:
+            for (i = 0; i < count; i++)
+                rgb_to_lab(&in[i], &out[i], &palette->lab_illuminant);
+            break;
+    }
+}
+
+static size_t search_converted(const CachedPalette* palette, FloatColor* fc) {
+    /* returns the index of the color in the reduced palette with the smallest distance to fc, which has already been
+     * converted by convert_colors() */
     double (*functionPtr)(const FloatColor*, const FloatColor*);
     double (*functionPtrLab)(const FloatColor*, const FloatColor*, const FloatColor*);
     functionPtr = &distance_linear;
     functionPtrLab = &distance_lab94;
-    FloatColor fc;
-    switch(palette->mode) {    // convert input color
+    switch(palette->mode) {
         case HSV:
-            rgb_to_hsv(x, &fc);
             functionPtr = &distance_hsv;
             break;
         case SRGB_CCIR:
-            FloatColor_from_FloatColor(&fc, x);
-            functionPtr = &distance_ccir;
-            break;
-        case SRGB:
-            FloatColor_from_FloatColor(&fc, x);
-            break;
         case LINEAR_CCIR:
-            rgb_to_linear(x, &fc);
             functionPtr = &distance_ccir;
             break;
-        case LINEAR:
-            rgb_to_linear(x, &fc);
-            break;
         case LUMINANCE:
-            rgb_to_luminance(x, &fc);
             functionPtr = &distance_luminance;
             break;
-        case LAB76:
-            rgb_to_lab(x, &fc, &palette->lab_illuminant);
-            break;
-        case LAB94:
-            rgb_to_lab(x, &fc, &palette->lab_illuminant);
-            break;
         case LAB2000:
-            rgb_to_lab(x, &fc, &palette->lab_illuminant);
             functionPtrLab = &distance_lab2000;
             break;
         case TETRAPAL:
-            rgb_to_linear(x, &fc);
-            return get_tetrapal_index(palette->tetrapal, &fc);
+            return get_tetrapal_index(palette->tetrapal, fc);
+        default:
+            break;
+    }
+    if (palette->palette_index != NULL && (palette->mode == LAB94 || palette->mode == LAB2000)) {
+        // prefilter: only the colors closest by (much cheaper) LAB76 distance are compared
+        size_t candidates[PALETTE_INDEX_MAX_K];
+        size_t count = PaletteIndex_nearest_k(palette->palette_index, fc, (size_t)palette->lab_prefilter, candidates);
+        double lowest = DBL_MAX;
+        size_t index = 0;
+        for (size_t i = 0; i < count; i++) {
+            double delta = fabs((*functionPtrLab)(FloatPalette_get(palette->lookup_palette, candidates[i]),
+                                                                   fc, &palette->lab_weights));
+            if (delta < lowest) {
+                lowest = delta;
+                index = candidates[i];
+            }
+        }
+        return index;
     }
+    if (palette->palette_index != NULL)
+        return PaletteIndex_nearest(palette->palette_index, fc);
+    if (palette->simd_palette != NULL)
+        return simd_find_closest_color(palette->simd_palette, palette->simd_stride, fc,
+                                       (enum SimdLevel)palette->simd_level);
     double lowest = DBL_MAX;
     size_t index = 0;
     size_t i;
     if (palette->mode == LAB94 || palette->mode == LAB2000) {
         for (i = 0; i < palette->lookup_palette->size; i++) {
             double delta = fabs((*functionPtrLab)(FloatPalette_get(palette->lookup_palette, i),
-                                                                   &fc, &palette->lab_weights));
+                                                                   fc, &palette->lab_weights));
             if (delta < lowest) {
                 lowest = delta;
                 index = i;
@@ -234,7 +401,7 @@ static size_t find_closest_color(const CachedPalette* palette, const FloatColor*
         }
     } else {
         for (i = 0; i < palette->lookup_palette->size; i++) {
-            double delta = fabs((*functionPtr)(FloatPalette_get(palette->lookup_palette, i), &fc));
+            double delta = fabs((*functionPtr)(FloatPalette_get(palette->lookup_palette, i), fc));
             if (delta < lowest) {
                 lowest = delta;
                 index = i;
@@ -244,39 +411,517 @@ static size_t find_closest_color(const CachedPalette* palette, const FloatColor*
     return index;
 }
 
-size_t CachedPalette_find_closest_color(CachedPalette* self, const FloatColor *c) {
-    /* color lookup with caching */
-    /* c is a linear float color with an error */
-    /* self->palette is a palette in lab color */
-    long key;
+static size_t find_closest_color(const CachedPalette* palette, const FloatColor* x) {
+    /* returns the index of the color in the reduced palette with the smallest distance.
+     * converts the input FloatColor into the color space in which the distance is calculated */
+    FloatColor fc;
+    convert_colors(palette, x, 1, &fc);
+    return search_converted(palette, &fc);
+}
+
+static long cache_key(const CachedPalette* self, const FloatColor* c) {
+    /* returns the hash cache key of a color */
     if (self->reduce) { // reduce source color's depth for less caching (sacrifice accuracy for speed)
         ByteColor bc;
         bc.r = ((uint8_t)(c->r * 255.0) >> self->r_shift);
         bc.g = ((uint8_t)(c->g * 255.0) >> self->g_shift);
         bc.b = ((uint8_t)(c->b * 255.0) >> self->b_shift);
-        key = key_from_srgb(&bc);
-    } else {
-        key = key_from_rgb(c->r, c->g, c->b);
+        return key_from_srgb(&bc);
     }
+    return key_from_rgb(c->r, c->g, c->b);
+}
+
+static size_t cache_lookup(const CachedPalette* self, PaletteHashEntry** cache, long key, const FloatColor* c,
+                           bool insert, size_t* misses) {
+    /* looks up key in cache; on a miss the closest color to c is searched and, if insert is set, added to the cache.
+     * misses (optional) is incremented on a miss */
     PaletteHashEntry* hash_item;
-    HASH_FIND(hh1, self->hash, &key, sizeof(long), hash_item);
+    HASH_FIND(hh1, *cache, &key, sizeof(long), hash_item);
     if (hash_item == NULL) { // not in cache
         size_t index = find_closest_color(self, c);
-        hash_item = malloc(sizeof *hash_item);
-        hash_item->key = key;
-        hash_item->index = index;
-        HASH_ADD(hh1, self->hash, key, sizeof(long), hash_item);
+        if (misses != NULL)
+            (*misses)++;
+        if (insert) {
+            hash_item = malloc(sizeof *hash_item);
+            hash_item->key = key;
+            hash_item->index = index;
+            HASH_ADD(hh1, *cache, key, sizeof(long), hash_item);
+        }
         return index;
     }
     return hash_item->index;
 }
 
+static size_t concurrent_lookup(CachedPalette* self, long key, const FloatColor* c) {
+    /* lock-free open addressing (linear probing) cache. Each slot holds (key + 1) << 32 | index, so a slot is
+     * written by a single compare-and-swap and entries are never removed while threads use the cache */
+    size_t mask = ((size_t)1 << self->concurrent_bits) - 1;
+    size_t slot = (size_t)(((uint64_t)key * 0x9E3779B97F4A7C15ULL) >> (64 - self->concurrent_bits));
+    int64_t tag = (int64_t)(key + 1) << 32;
+    size_t probes = 0;
+    int64_t entry;
+    while ((entry = atomic_load_int64(&self->concurrent_cache[slot])) != CONCURRENT_EMPTY) {
+        if ((entry & ~(int64_t)0xffffffff) == tag)
+            return (size_t)(uint32_t)entry;
+        slot = (slot + 1) & mask;
+        if (++probes > mask)
+            break;
+    }
+    size_t index = find_closest_color(self, c);
+    // only add new entries while the table is less than 3/4 full, so probe sequences stay short. The count is
+    // checked before it is incremented, so it stops growing at the limit (plus at most one per thread) and can't
+    // overflow on a long-lived shared palette
+    int limit = (int)(mask / 4 * 3);
+    if (self->frozen || atomic_load_int(&self->concurrent_count) >= limit ||
+        atomic_add_int(&self->concurrent_count, 1) >= limit)
+        return index;
+    int64_t new_entry = tag | (int64_t)(uint32_t)index;
+    probes = 0;
+    while (!atomic_cas_int64(&self->concurrent_cache[slot], CONCURRENT_EMPTY, new_entry)) {
+        entry = atomic_load_int64(&self->concurrent_cache[slot]);
+        if ((entry & ~(int64_t)0xffffffff) == tag)  // another thread added the same key
+            break;
+        slot = (slot + 1) & mask;
+        if (++probes > mask)  // no empty slot left
+            break;
+    }
+    return index;
+}
+
+size_t CachedPalette_find_closest_color(CachedPalette* self, const FloatColor *c) {
+    /* color lookup with caching */
+    /* c is a linear float color with an error */
+    /* self->palette is a palette in lab color */
+    bool count = !CachedPalette_is_thread_safe(self);  // statistics are only kept while the palette isn't shared
+    if (count)
+        self->stat_lookups++;
+    if (self->lut_bits != 0) {  // dense lookup table instead of the hash
+        if (self->lut == NULL)
+            create_lut(self);
+        size_t lut_addr = lut_index(self, c);
+        volatile int* shared_entry = (volatile int*)&self->lut[lut_addr];
+        int32_t lut_entry = self->concurrent_cache != NULL ? (int32_t)atomic_load_int(shared_entry) : self->lut[lut_addr];
+        if (lut_entry == LUT_EMPTY) {
+            FloatColor fc;
+            lut_color(self, lut_addr, &fc);
+            lut_entry = (int32_t)find_closest_color(self, &fc);
+            if (count)
+                self->stat_misses++;
+            if (self->concurrent_cache != NULL && !self->frozen)  // racing threads store the same value
+                atomic_store_int(shared_entry, (int)lut_entry);
+            else if (!self->frozen)
+                self->lut[lut_addr] = lut_entry;
+        }
+        return (size_t)lut_entry;
+    }
+    if (self->concurrent_cache != NULL)
+        return concurrent_lookup(self, cache_key(self, c), c);
+    return cache_lookup(self, &self->hash, cache_key(self, c), c, !self->frozen, count ? &self->stat_misses : NULL);
+}
+
+size_t CachedPalette_find_closest_color_local(const CachedPalette* self, PaletteHashEntry** local_cache,
+                                              const FloatColor* c) {
+    /* thread-safe color lookup: the palette is only read, new lookups are cached in the caller's local_cache
+     * (which must start out as NULL and be freed with CachedPalette_free_local_cache). Any number of threads can
+     * share one palette as long as each one uses its own local_cache */
+    if (self->lut_bits != 0) {
+        size_t lut_addr = lut_index(self, c);
+        if (self->lut != NULL && self->lut_eager)  // fully resolved lookup table
+            return (size_t)self->lut[lut_addr];
+        FloatColor fc;
+        lut_color(self, lut_addr, &fc);  // resolve the cell the same way the lookup table would
+        return cache_lookup(self, local_cache, (long)lut_addr, &fc, true, NULL);
+    }
+    return cache_lookup(self, local_cache, cache_key(self, c), c, true, NULL);
+}
+
+void CachedPalette_free_local_cache(PaletteHashEntry** local_cache) {
+    /* frees a cache filled by CachedPalette_find_closest_color_local */
+    PaletteHashEntry *hash_item, *tmp;
+    HASH_ITER(hh1, *local_cache, hash_item, tmp) {
+        HASH_DELETE(hh1, *local_cache, hash_item);
+        free(hash_item);
+    }
+    *local_cache = NULL;
+}
+
+static size_t batch_pending(long* pending_keys, int16_t* slots, size_t* pending_count, long key) {
+    /* returns the pending miss for key in the current chunk, adding a new one if key isn't pending yet */
+    size_t mask = ((size_t)1 << BATCH_SLOT_BITS) - 1;
+    size_t slot = (size_t)(((uint64_t)key * 0x9E3779B97F4A7C15ULL) >> (64 - BATCH_SLOT_BITS));
+    while (slots[slot] >= 0) {
+        if (pending_keys[slots[slot]] == key)
+            return (size_t)slots[slot];
+        slot = (slot + 1) & mask;
+    }
+    size_t p = (*pending_count)++;
+    slots[slot] = (int16_t)p;
+    pending_keys[p] = key;
+    return p;
+}
+
+MODULE_API void CachedPalette_find_closest_colors(CachedPalette* self, const FloatColor* colors, size_t count,
+                                                  int* out) {
+    /* batch version of CachedPalette_find_closest_color with identical results: maps count colors to palette
+     * indices. Colors are resolved in chunks: first all cache probes (runs of colors with the same cache key are
+     * probed once), then the misses of the chunk - each distinct key only once - are converted into the comparison
+     * color space in one go, searched and added to the cache */
+    if (CachedPalette_is_thread_safe(self)) {  // shared palettes keep using the thread-safe single lookups
+        for (size_t i = 0; i < count; i++)
+            out[i] = (int)CachedPalette_find_closest_color(self, &colors[i]);
+        return;
+    }
+    if (self->lut_bits != 0 && self->lut == NULL)
+        create_lut(self);
+    long pending_keys[BATCH_SIZE];
+    FloatColor pending_colors[BATCH_SIZE];
+    FloatColor converted[BATCH_SIZE];
+    int results[BATCH_SIZE];           // palette index of each pending miss
+    size_t pending_of[BATCH_SIZE];     // pending miss of each color of the chunk, if it missed the cache
+    bool missed[BATCH_SIZE];
+    int16_t slots[(size_t)1 << BATCH_SLOT_BITS];
+    for (size_t start = 0; start < count; start += BATCH_SIZE) {
+        size_t n = count - start < BATCH_SIZE ? count - start : BATCH_SIZE;
+        size_t pending_count = 0;
+        memset(slots, 0xff, sizeof(slots));
+        long prev_key = -1;
+        for (size_t i = 0; i < n; i++) {
+            const FloatColor* c = &colors[start + i];
+            long key;
+            if (self->lut_bits != 0)
+                key = (long)lut_index(self, c);
+            else
+                key = cache_key(self, c);
+            if (key == prev_key) {  // same cache entry as the previous color
+                missed[i] = missed[i - 1];
+                pending_of[i] = pending_of[i - 1];
+                out[start + i] = out[start + i - 1];
+                continue;
+            }
+            prev_key = key;
+            missed[i] = false;
+            if (self->lut_bits != 0) {
+                int32_t lut_entry = self->lut[key];
+                if (lut_entry != LUT_EMPTY) {
+                    out[start + i] = (int)lut_entry;
+                    continue;
+                }
+            } else {
+                PaletteHashEntry* hash_item;
+                HASH_FIND(hh1, self->hash, &key, sizeof(long), hash_item);
+                if (hash_item != NULL) {
+                    out[start + i] = (int)hash_item->index;
+                    continue;
+                }
+            }
+            missed[i] = true;
+            size_t before = pending_count;
+            pending_of[i] = batch_pending(pending_keys, slots, &pending_count, key);
+            if (pending_count != before) {  // first miss of this key: search for the color a single lookup would use
+                if (self->lut_bits != 0)
+                    lut_color(self, (size_t)key, &pending_colors[pending_of[i]]);
+                else
+                    FloatColor_from_FloatColor(&pending_colors[pending_of[i]], c);
+            }
+        }
+        convert_colors(self, pending_colors, pending_count, converted);
+        for (size_t p = 0; p < pending_count; p++) {
+            size_t index = search_converted(self, &converted[p]);
+            results[p] = (int)index;
+            if (self->lut_bits != 0) {
+                self->lut[pending_keys[p]] = (int32_t)index;
+            } else {
+                PaletteHashEntry* hash_item = malloc(sizeof *hash_item);
+                hash_item->key = pending_keys[p];
+                hash_item->index = index;
+                HASH_ADD(hh1, self->hash, key, sizeof(long), hash_item);
+            }
+        }
+        for (size_t i = 0; i < n; i++)
+            if (missed[i])
+                out[start + i] = results[pending_of[i]];
+        self->stat_lookups += n;
+        self->stat_misses += pending_count;
+    }
+}
+
+MODULE_API void CachedPalette_map_image(CachedPalette* self, const ColorImage* image, int* out) {
+    /* maps every pixel of image to its closest palette color without dithering. out receives the palette indices
+     * (-1 for fully transparent pixels) */
+    FloatColor* row = (FloatColor*)calloc((size_t)image->width, sizeof(FloatColor));
+    int* indices = (int*)calloc((size_t)image->width, sizeof(int));
+    bool all_opaque = ColorImage_is_opaque(image);
+    for (int y = 0; y < image->height; y++) {
+        size_t addr = (size_t)y * (size_t)image->width;
+        if (all_opaque) {  // no transparent pixels to skip: map the row straight into out
+            for (int x = 0; x < image->width; x++)
+                FloatColor_from_ByteColor(&row[x], &image->b_srgb[addr + (size_t)x]);
+            CachedPalette_find_closest_colors(self, row, (size_t)image->width, &out[addr]);
+            continue;
+        }
+        size_t opaque = 0;
+        for (int x = 0; x < image->width; x++) {
+            if (image->b_srgb[addr + (size_t)x].a != 0)
+                FloatColor_from_ByteColor(&row[opaque++], &image->b_srgb[addr + (size_t)x]);
+        }
+        CachedPalette_find_closest_colors(self, row, opaque, indices);
+        opaque = 0;
+        for (int x = 0; x < image->width; x++)
+            out[addr + (size_t)x] = image->b_srgb[addr + (size_t)x].a != 0 ? indices[opaque++] : -1;
+    }
+    free(indices);
+    free(row);
+}
+
+bool CachedPalette_is_thread_safe(const CachedPalette* self) {
+    /* returns true if CachedPalette_find_closest_color may be called by several threads at the same time */
+    return self->concurrent_cache != NULL || self->frozen;
+}
+
+MODULE_API void CachedPalette_get_stats(const CachedPalette* self, size_t* lookups, size_t* misses) {
+    /* returns the number of color lookups since the cache was last cleared, and how many of them weren't cached and
+     * needed a palette search. Lookups are only counted while the palette isn't thread-safe (i.e. neither concurrent
+     * nor frozen) */
+    if (lookups != NULL)
+        *lookups = self->stat_lookups;
+    if (misses != NULL)
+        *misses = self->stat_misses;
+}
+
+MODULE_API void CachedPalette_set_concurrent(CachedPalette* self, uint8_t capacity_bits) {
+    /* replaces the hash cache with a lock-free table of 2^capacity_bits slots (8 bytes each), which any number of
+     * threads can use at the same time, e.g. 20 bits = 1M slots = 8 MB. Once the table is 3/4 full, new lookups are
+     * no longer cached. capacity_bits is clamped to 10 - 25; 0 switches back to the hash cache.
+     * Must not be called while other threads use the palette */
+    free((void*)self->concurrent_cache);
+    self->concurrent_cache = NULL;
+    self->concurrent_count = 0;
+    self->concurrent_bits = 0;
+    if (capacity_bits != 0) {
+        if (capacity_bits < CONCURRENT_MIN_BITS)
+            capacity_bits = CONCURRENT_MIN_BITS;
+        else if (capacity_bits > CONCURRENT_MAX_BITS)
+            capacity_bits = CONCURRENT_MAX_BITS;
+        self->concurrent_bits = capacity_bits;
+        self->concurrent_cache = (volatile int64_t*)calloc((size_t)1 << capacity_bits, sizeof(int64_t));
+    }
+}
+
+MODULE_API void CachedPalette_freeze(CachedPalette* self, bool frozen) {
+    /* turns the warmed up cache into a read-only snapshot: lookups still hit cached entries, but misses are no longer
+     * added. A frozen palette never modifies itself during lookups, so it can be shared by any number of threads.
+     * Must not be called while other threads use the palette */
+    self->frozen = frozen;
+}
+
+struct PaletteFileHeader {
+    /* CachedPalette_save file header. It is followed by the target palette (4 bytes per color), the lookup table
+     * (int32 per entry) and the cached lookups (uint64: key << 32 | palette index); every section starts at a
+     * multiple of 8 bytes, so the file can also be memory-mapped */
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;
+    int32_t mode;
+    double illuminant[3];
+    double weights[3];
+    uint8_t shift[3];
+    uint8_t lut_bits;
+    int32_t lab_prefilter;
+    uint64_t palette_size;
+    uint64_t lut_size;
+    uint64_t cache_size;
+};
+typedef struct PaletteFileHeader PaletteFileHeader;
+
+static size_t padded(size_t bytes) {
+    /* rounds up to the next section boundary */
+    return (bytes + 7) / 8 * 8;
+}
+
+static void palette_file_header(const CachedPalette* self, PaletteFileHeader* header) {
+    /* fills in everything the cached lookups depend on */
+    memset(header, 0, sizeof(PaletteFileHeader));
+    memcpy(header->magic, PALETTE_FILE_MAGIC, 4);
+    header->version = PALETTE_FILE_VERSION;
+    header->byte_order = PALETTE_FILE_BYTE_ORDER;
+    header->mode = (int32_t)self->mode;
+    header->illuminant[0] = self->lab_illuminant.r;
+    header->illuminant[1] = self->lab_illuminant.g;
+    header->illuminant[2] = self->lab_illuminant.b;
+    header->weights[0] = self->lab_weights.r;
+    header->weights[1] = self->lab_weights.g;
+    header->weights[2] = self->lab_weights.b;
+    header->shift[0] = self->r_shift;
+    header->shift[1] = self->g_shift;
+    header->shift[2] = self->b_shift;
+    header->lut_bits = self->lut_bits;
+    header->lab_prefilter = (int32_t)self->lab_prefilter;
+    header->palette_size = self->target_palette->size;
+    header->lut_size = self->lut != NULL ? (uint64_t)1 << (self->lut_bits * 3) : 0;
+}
+
+static bool write_section(FILE* file, const void* data, size_t bytes) {
+    /* writes data and pads it to the next section boundary */
+    static const uint8_t zeros[8] = {0};
+    size_t padding = padded(bytes) - bytes;
+    return fwrite(data, 1, bytes, file) == bytes && fwrite(zeros, 1, padding, file) == padding;
+}
+
+static bool read_section(FILE* file, void* data, size_t bytes) {
+    /* reads data and skips the padding up to the next section boundary */
+    uint8_t padding[8];
+    size_t pad = padded(bytes) - bytes;
+    return fread(data, 1, bytes, file) == bytes && fread(padding, 1, pad, file) == pad;
+}
+
+MODULE_API bool CachedPalette_save(const CachedPalette* self, const char* filename) {
+    /* writes the palette's resolved lookups (the lookup table if there is one, otherwise the hash or concurrent
+     * cache) to a file, together with the target palette and all settings the lookups depend on: comparison mode,
+     * illuminant, LAB weights, shift, lookup table size and LAB prefilter. Returns false if the palette has no
+     * lookup palette yet (see CachedPalette_update_cache) or the file can't be written */
+    if (self->target_palette == NULL || self->lookup_palette == NULL)
+        return false;
+    PaletteFileHeader header;
+    palette_file_header(self, &header);
+    uint64_t* cache = NULL;
+    if (self->lut == NULL) {  // the lookup table replaces the other caches, so they are only saved without one
+        size_t capacity = self->concurrent_cache != NULL ? (size_t)1 << self->concurrent_bits : HASH_CNT(hh1, self->hash);
+        cache = (uint64_t*)malloc((capacity > 0 ? capacity : 1) * sizeof(uint64_t));
+        if (self->concurrent_cache != NULL) {
+            for (size_t i = 0; i < capacity; i++) {
+                int64_t entry = atomic_load_int64(&self->concurrent_cache[i]);
+                if (entry != CONCURRENT_EMPTY)  // stored as (key + 1) << 32 | index
+                    cache[header.cache_size++] = (uint64_t)(entry - ((int64_t)1 << 32));
+            }
+        } else {
+            PaletteHashEntry *hash_item, *tmp;
+            HASH_ITER(hh1, self->hash, hash_item, tmp) {
+                cache[header.cache_size++] = ((uint64_t)hash_item->key << 32) | (uint32_t)hash_item->index;
+            }
+        }
+    }
+    FILE* file = fopen(filename, "wb");
+    bool ok = file != NULL;
+    if (ok) {
+        ok = write_section(file, &header, sizeof(PaletteFileHeader))
+             && write_section(file, self->target_palette->buffer, self->target_palette->size * BYTE_COLOR_RGB_CHANNELS)
+             && write_section(file, self->lut, (size_t)header.lut_size * sizeof(int32_t))
+             && write_section(file, cache, (size_t)header.cache_size * sizeof(uint64_t));
+        ok = fclose(file) == 0 && ok;
+    }
+    free(cache);
+    return ok;
+}
+
+static void concurrent_insert(CachedPalette* self, long key, size_t index) {
+    /* adds an entry to the concurrent cache; only used while no other thread uses the palette */
+    size_t mask = ((size_t)1 << self->concurrent_bits) - 1;
+    if (self->concurrent_count >= (int)(mask / 4 * 3))
+        return;
+    size_t slot = (size_t)(((uint64_t)key * 0x9E3779B97F4A7C15ULL) >> (64 - self->concurrent_bits));
+    int64_t tag = (int64_t)(key + 1) << 32;
+    while (self->concurrent_cache[slot] != CONCURRENT_EMPTY) {
+        if ((self->concurrent_cache[slot] & ~(int64_t)0xffffffff) == tag)
+            return;
+        slot = (slot + 1) & mask;
+    }
+    self->concurrent_cache[slot] = tag | (int64_t)(uint32_t)index;
+    self->concurrent_count++;
+}
+
+MODULE_API bool CachedPalette_load(CachedPalette* self, const char* filename) {
+    /* fills the cache with the lookups saved by CachedPalette_save. The palette has to be set up exactly like the
+     * saved one (target palette, CachedPalette_update_cache mode and illuminant, LAB weights, shift, lookup table
+     * size and LAB prefilter); otherwise, or if the file is invalid, nothing is loaded and false is returned.
+     * A saved lookup table replaces the palette's table; tables without unresolved entries count as eager from then
+     * on. To skip resolving an eager table twice, set it up lazily (CachedPalette_set_lut) before loading it.
+     * Must not be called while other threads use the palette */
+    if (self->target_palette == NULL || self->lookup_palette == NULL)
+        return false;
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL)
+        return false;
+    PaletteFileHeader expected, header;
+    palette_file_header(self, &expected);
+    bool ok = read_section(file, &header, sizeof(PaletteFileHeader))
+              && memcmp(header.magic, expected.magic, 4) == 0
+              && header.version == expected.version
+              && header.byte_order == expected.byte_order
+              && header.mode == expected.mode
+              && memcmp(header.illuminant, expected.illuminant, sizeof(header.illuminant)) == 0
+              && memcmp(header.weights, expected.weights, sizeof(header.weights)) == 0
+              && memcmp(header.shift, expected.shift, sizeof(header.shift)) == 0
+              && header.lut_bits == expected.lut_bits
+              && header.lab_prefilter == expected.lab_prefilter
+              && header.palette_size == expected.palette_size
+              && (header.lut_size == 0 || header.lut_size == (uint64_t)1 << (header.lut_bits * 3))
+              && header.cache_size <= ((uint64_t)1 << 24);  // keys are 24 bit sRGB colors or lookup table cells
+    uint8_t* palette = NULL;
+    int32_t* lut = NULL;
+    uint64_t* cache = NULL;
+    if (ok) {
+        size_t palette_bytes = (size_t)header.palette_size * BYTE_COLOR_RGB_CHANNELS;
+        palette = (uint8_t*)malloc(palette_bytes > 0 ? palette_bytes : 1);
+        ok = read_section(file, palette, palette_bytes)
+             && memcmp(palette, self->target_palette->buffer, palette_bytes) == 0;
+    }
+    if (ok && header.lut_size > 0) {
+        lut = (int32_t*)malloc((size_t)header.lut_size * sizeof(int32_t));
+        ok = read_section(file, lut, (size_t)header.lut_size * sizeof(int32_t));
+        for (size_t i = 0; ok && i < (size_t)header.lut_size; i++)
+            ok = lut[i] == LUT_EMPTY || (lut[i] >= 0 && (uint64_t)lut[i] < header.palette_size);
+    }
+    if (ok && header.cache_size > 0) {
+        cache = (uint64_t*)malloc((size_t)header.cache_size * sizeof(uint64_t));
+        ok = read_section(file, cache, (size_t)header.cache_size * sizeof(uint64_t));
+        for (size_t i = 0; ok && i < (size_t)header.cache_size; i++)
+            ok = (cache[i] & 0xffffffff) < header.palette_size;
+    }
+    fclose(file);
+    if (ok && lut != NULL && self->lut_bits != 0) {
+        free(self->lut);
+        self->lut = lut;
+        lut = NULL;
+        bool complete = true;
+        for (size_t i = 0; complete && i < (size_t)header.lut_size; i++)
+            complete = self->lut[i] != LUT_EMPTY;
+        if (complete)
+            self->lut_eager = true;
+    }
+    if (ok && cache != NULL) {
+        for (size_t i = 0; i < (size_t)header.cache_size; i++) {
+            long key = (long)(cache[i] >> 32);
+            size_t index = (size_t)(cache[i] & 0xffffffff);
+            if (self->concurrent_cache != NULL) {
+                concurrent_insert(self, key, index);
+            } else {
+                PaletteHashEntry* hash_item;
+                HASH_FIND(hh1, self->hash, &key, sizeof(long), hash_item);
+                if (hash_item == NULL) {
+                    hash_item = malloc(sizeof *hash_item);
+                    hash_item->key = key;
+                    hash_item->index = index;
+                    HASH_ADD(hh1, self->hash, key, sizeof(long), hash_item);
+                }
+            }
+        }
+    }
+    free(palette);
+    free(lut);
+    free(cache);
+    return ok;
+}
+
 MODULE_API void CachedPalette_free(CachedPalette* self) {
     /* frees the cached palette (i.e. destructor) */
     if (self) {
         FloatPalette_free(self->lookup_palette);
         BytePalette_free(self->target_palette);
+        free(self->simd_palette);
+        PaletteIndex_free(self->palette_index);
         CachedPalette_free_cache(self);
+        free((void*)self->concurrent_cache);
+        free(self->lut);
         if (self->tetrapal != NULL)
             tetrapal_free(self->tetrapal);
         free(self);
@@ -294,6 +939,17 @@ MODULE_API void CachedPalette_free_cache(CachedPalette* self) {
         }
     }
     self->hash = NULL;
+    self->stat_lookups = 0;
+    self->stat_misses = 0;
+    if (self->lut != NULL && !self->lut_eager) {  // lazily resolved entries; the table itself stays allocated
+        size_t lut_size = (size_t)1 << (self->lut_bits * 3);
+        for (size_t i = 0; i < lut_size; i++)
+            self->lut[i] = LUT_EMPTY;
+    }
+    if (self->concurrent_cache != NULL) {
+        memset((void*)self->concurrent_cache, 0, ((size_t)1 << self->concurrent_bits) * sizeof(int64_t));
+        self->concurrent_count = 0;
+    }
 }
 
 MODULE_API void CachedPalette_from_BytePalette(CachedPalette* self, const BytePalette* pal) {
@@ -368,78 +1024,56 @@ static size_t add_extreme_colors(ColorExtremes* ce, BytePalette* outPal, size_t
     return offset;
 }
 
-static BytePalette* get_image_palette(const ColorImage* image, ColorExtremes* ce, bool unique) {
-    /* returns the palette of an image */
-    // TODO future improvement: we don't have to iterate over the entire image to find the extremes, we
-    //                          only have to iterate over its palette (which could be smaller than width*height)
-    ByteColor bc;
-    BytePalette* image_palette;
-    size_t image_size = (size_t)(image->width * image->height);
-    if (unique) { // creates a palette comprised entirely of unique colors in the image
-        struct ByteColorHashEntry *hash_entries = NULL;
-        struct ByteColorHashEntry *hash_item = NULL;
-        struct ByteColorHashEntry* tmp;
-        hash_entries = NULL;
-        size_t hash_color_count = 0;
-        // find unique colors
-        for (size_t i = 0; i < image_size; i++) {
-            ColorImage_get_srgb(image, i, &bc);
-            if (bc.a != 0) {                        // only count not fully transparent pixels
-                long key = key_from_srgb(&bc);
-                HASH_FIND(hh2, hash_entries, &key, sizeof(long), hash_item);
-                if (hash_item == NULL) {
-                    hash_item = malloc(sizeof *hash_item);
-                    hash_item->key = key;
-                    ByteColor_copy(&hash_item->color, &bc);
-                    HASH_ADD(hh2, hash_entries, key, sizeof(long), hash_item);
-                    hash_color_count++;
-                }
-                include_extremes(ce, &bc);
-            }
-        }
-        // gather hash items and convert to palette
-        image_palette = BytePalette_new(hash_color_count);
-        size_t i = 0;
-        HASH_ITER(hh2, hash_entries, hash_item, tmp) {
-            ByteColor_copy(BytePalette_get(image_palette, i++), &hash_item->color);
-        }
-        // free hash
-        HASH_ITER(hh2, hash_entries, hash_item, tmp) {
-            HASH_DELETE(hh2, hash_entries, hash_item);  /* delete; advances to next */
-            free(hash_item);
-        }
-    } else { // creates a histogram of the image; i.e. a palette comprising of every pixel's color of the image
-        image_palette = BytePalette_new(image_size);
-        for (size_t i = 0; i < image_size; i++) {
-            ColorImage_get_srgb(image, i, &bc);
-            if (bc.a != 0) {       // only count not fully transparency pixels
-                BytePalette_set(image_palette, i, &bc);
-                include_extremes(ce, &bc);
-            }
-        }
-    }
-    return image_palette;
+static ColorHistogram* get_image_histogram(const ColorImage* image, ColorExtremes* ce, bool unique) {
+    /* returns the color histogram of an image and finds its extreme colors */
+    ColorHistogram* histogram = ColorHistogram_from_image(image, unique);
+    // the histogram lists the colors in order of their first appearance, so this finds the same extremes as a
+    // scan over all pixels
+    for (size_t i = 0; i < histogram->size; i++)
+        include_extremes(ce, &histogram->entries[i].color);
+    return histogram;
 }
 
-static BytePalette* quantify_colors(const BytePalette* unique_pal,
+static BytePalette* quantify_colors(const CachedPalette* self, const ColorHistogram* histogram,
                                     enum QuantizationMethod quantization_method, size_t target_colors) {
     /* quantifies (i.e. reduces) the (source) palette with the given method to the specified number of colors */
     BytePalette* pal;
     switch (quantization_method) {
         case WU:
-            pal = wu_quantization(unique_pal, target_colors);
+            pal = wu_quantization(histogram, target_colors, &self->wu);
+            if (pal == NULL)  // not enough memory for the moment tables
+                pal = median_cut(histogram, target_colors);
             break;
         case KDTREE:
-            pal = kdtree_quantization(unique_pal, target_colors);
+            pal = kdtree_quantization(histogram, target_colors, &self->kmeans);
             break;
         case MEDIAN_CUT:
         default:
-            pal = median_cut(unique_pal, target_colors);
+            pal = median_cut(histogram, target_colors);
             break;
     }
     return pal;
 }
 
+MODULE_API void CachedPalette_set_kdtree_options(CachedPalette* self, int threads, bool plus_plus, uint64_t seed) {
+    /* options for the KDTREE (k-means) quantization of CachedPalette_from_image.
+     * threads: threads for assigning colors to their nearest center (0 = one per CPU core, default: 1)
+     * plus_plus: pick the initial centers with k-means++ (seeded with seed) instead of spreading them evenly over
+     *            the image's colors (default: false) */
+    self->kmeans.threads = threads;
+    self->kmeans.plus_plus = plus_plus;
+    self->kmeans.seed = seed;
+}
+
+MODULE_API void CachedPalette_set_wu_options(CachedPalette* self, int bits, int threads) {
+    /* options for the WU quantization of CachedPalette_from_image.
+     * bits: histogram precision per color channel, 5 - 7 (default: 5). More bits separate similar colors better
+     *       but need more memory (1.4 MB, 11 MB, 86 MB)
+     * threads: threads for building the moment tables (0 = one per CPU core, default: 1) */
+    self->wu.bits = bits < WU_MIN_BITS ? WU_MIN_BITS : (bits > WU_MAX_BITS ? WU_MAX_BITS : bits);
+    self->wu.threads = threads;
+}
+
 MODULE_API void CachedPalette_from_image(CachedPalette* self, const ColorImage* image, size_t target_colors,
                                          enum QuantizationMethod quantization_method,
                                          bool unique, bool include_bw, bool include_rgb, bool include_cmy) {
@@ -448,19 +1082,20 @@ MODULE_API void CachedPalette_from_image(CachedPalette* self, const ColorImage*
      * unique-colors: true - counts unique colors once
      *                false - also counts the number of appearances (# of pixels) of each color
      * */
-    // get all unique colors in image: using a hash we ensure we don't get duplicates
+    // get all unique colors in image (and their number of pixels)
     ColorExtremes ce;
     init_color_extremes_struct(&ce, include_bw, include_rgb, include_cmy);
     BytePalette_free(self->target_palette); // we're going to replace the existing target_palette...
-    BytePalette* unique_pal = get_image_palette(image, &ce, unique);
+    ColorHistogram* histogram = get_image_histogram(image, &ce, unique);
     // do the quantization
     BytePalette *pal = NULL;
-    if (unique_pal->size <= target_colors) {  // original palette has fewer colors than quantization target
-        self->target_palette = unique_pal;    // we just return the original palette of unique colors...
+    if (histogram->size <= target_colors) {  // original palette has fewer colors than quantization target
+        self->target_palette = ColorHistogram_to_palette(histogram);  // we just return the original palette of unique colors...
+        ColorHistogram_free(histogram);
         return;
     } else if (!include_bw && !include_rgb && !include_cmy) {  // user doesn't want 'extreme' colors included
-        pal = quantify_colors(unique_pal, quantization_method, target_colors);
-        BytePalette_free(unique_pal);
+        pal = quantify_colors(self, histogram, quantization_method, target_colors);
+        ColorHistogram_free(histogram);
         self->target_palette = pal;
         return;
     } else { // include extreme colors in palette
@@ -469,17 +1104,20 @@ MODULE_API void CachedPalette_from_image(CachedPalette* self, const ColorImage*
         size_t offset = add_extreme_colors(&ce, outPal, target_colors);
         // reduce palette and merge palette
         if (target_colors - offset > 0) {
-            pal = quantify_colors(unique_pal, quantization_method, target_colors - offset);
-            BytePalette_free(unique_pal);
-            for (size_t i = offset; i < target_colors; i++) { // merge
+            pal = quantify_colors(self, histogram, quantization_method, target_colors - offset);
+            ColorHistogram_free(histogram);
+            for (size_t i = offset; i < target_colors && i - offset < pal->size; i++) { // merge
                 ByteColor *c = BytePalette_get(pal, i - offset);
                 BytePalette_set(outPal, i, c);
             }
+            if (offset + pal->size < target_colors)  // Wu can return fewer colors than asked for
+                outPal->size = offset + pal->size;
             BytePalette_free(pal);
             self->target_palette = outPal;
             return;
         }
         // no space for reduced palette because 'extreme' colors take up all the space
+        ColorHistogram_free(histogram);
         self->target_palette = outPal;
         return;
     }
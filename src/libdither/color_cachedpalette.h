@@ -7,6 +7,9 @@
 #include "color_bytepalette.h"
 #include "uthash/uthash.h"
 #include "tetrapal/tetrapal.h"
+#include "color_paletteindex.h"
+#include "color_quant_kdtree.h"
+#include "color_quant_wu.h"
 
 enum ColorComparisonMode {
     LUMINANCE = 0,
@@ -44,10 +47,30 @@ struct CachedPalette {
     enum ColorComparisonMode mode;
     uint8_t r_shift, g_shift, b_shift; // for faster cache lookups at reduced precision
     bool reduce;
-
+    int32_t* lut;      // optional dense lookup table, indexed by quantized sRGB; replaces the hash cache
+    uint8_t lut_bits;  // bits per color channel of the lookup table; 0 = lookup table disabled
+    bool lut_eager;    // when true the whole lookup table is filled in advance instead of during lookups
+    double* simd_palette;  // structure-of-arrays copy of lookup_palette for SIMD searches (Euclidean modes without
+                           // palette_index only)
+    size_t simd_stride;    // padded number of entries per component in simd_palette
+    int simd_level;        // SIMD instruction set used for searching simd_palette
+    volatile int64_t* concurrent_cache;  // lock-free lookup cache, replaces hash when set (CachedPalette_set_concurrent)
+    uint8_t concurrent_bits;             // concurrent_cache has 2^concurrent_bits slots
+    volatile int concurrent_count;       // number of occupied (or reserved) slots in concurrent_cache
+    bool frozen;           // the cache is a read-only snapshot: lookups no longer add entries
+    PaletteIndex* palette_index;  // k-d tree over lookup_palette for large palettes (Euclidean and LAB modes)
+    int lab_prefilter;     // LAB94 / LAB2000: only compare this many nearest colors (by LAB76 distance), 0 = all
+    KMeansOptions kmeans;  // options for KDTREE quantization
+    WuOptions wu;          // options for WU quantization
+    size_t stat_lookups;   // number of lookups since the cache was last cleared (see CachedPalette_get_stats)
+    size_t stat_misses;    // number of those lookups that had to search the palette
 };
 typedef struct CachedPalette CachedPalette;
 
 size_t CachedPalette_find_closest_color(CachedPalette* self, const FloatColor *c);
+size_t CachedPalette_find_closest_color_local(const CachedPalette* self, PaletteHashEntry** local_cache,
+                                              const FloatColor* c);
+void CachedPalette_free_local_cache(PaletteHashEntry** local_cache);
+bool CachedPalette_is_thread_safe(const CachedPalette* self);
 
 #endif // COLOR_CACHEDPALETTE_H
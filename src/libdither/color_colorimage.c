@@ -1,4 +1,5 @@
 #define MODULE_API_EXPORTS
+#include <string.h>
 #include "color_colorimage.h"
 #include "libdither.h"
 
@@ -8,7 +9,21 @@ MODULE_API ColorImage* ColorImage_new(int width, int height) {
     //      put linear colors in it.
     ColorImage* self = (ColorImage*)malloc(sizeof(ColorImage));
     self->b_linear = (FloatColor*)calloc((size_t)(width * height), sizeof(FloatColor));
+    self->b_linear_f32 = NULL;
     self->b_srgb = (ByteColor*)calloc((size_t)(width * height), sizeof(ByteColor));
+    self->not_opaque = (size_t)(width * height);  // new pixels are transparent until they are set
+    self->width = width;
+    self->height = height;
+    return self;
+}
+
+MODULE_API ColorImage* ColorImage_new_f32(int width, int height) {
+    /* Creates a new ColorImage whose float buffer uses single precision, halving its size */
+    ColorImage* self = (ColorImage*)malloc(sizeof(ColorImage));
+    self->b_linear = NULL;
+    self->b_linear_f32 = (float*)calloc((size_t)(width * height) * FLOAT_COLOR_RGB_CHANNELS, sizeof(float));
+    self->b_srgb = (ByteColor*)calloc((size_t)(width * height), sizeof(ByteColor));
+    self->not_opaque = (size_t)(width * height);  // new pixels are transparent until they are set
     self->width = width;
     self->height = height;
     return self;
@@ -18,6 +33,7 @@ MODULE_API void ColorImage_free(ColorImage* self) {
     /* Frees the ColorImage (i.e. destructor) */
     if(self) {
         free(self->b_linear);
+        free(self->b_linear_f32);
         free(self->b_srgb);
         free(self);
         self = NULL;
@@ -30,12 +46,28 @@ MODULE_API void ColorImage_set_rgb(ColorImage* self, size_t addr, uint8_t r, uin
     self->b_srgb[addr].r = bc.r = r;
     self->b_srgb[addr].g = bc.g = g;
     self->b_srgb[addr].b = bc.b = b;
+    if (self->b_srgb[addr].a == 255 && a != 255)
+        self->not_opaque++;
+    else if (self->b_srgb[addr].a != 255 && a == 255)
+        self->not_opaque--;
     self->b_srgb[addr].a = a;
     FloatColor fc;
     FloatColor_from_ByteColor(&fc, &bc);
-    self->b_linear[addr].r = fc.r;
-    self->b_linear[addr].g = fc.g;
-    self->b_linear[addr].b = fc.b;
+    if (self->b_linear_f32 != NULL) {
+        float* f = &self->b_linear_f32[addr * FLOAT_COLOR_RGB_CHANNELS];
+        f[0] = (float)fc.r;
+        f[1] = (float)fc.g;
+        f[2] = (float)fc.b;
+    } else {
+        self->b_linear[addr].r = fc.r;
+        self->b_linear[addr].g = fc.g;
+        self->b_linear[addr].b = fc.b;
+    }
+}
+
+MODULE_API bool ColorImage_is_opaque(const ColorImage* self) {
+    /* true if every pixel is fully opaque */
+    return self->not_opaque == 0;
 }
 
 void ColorImage_get_srgb(const ColorImage* self, size_t addr, ByteColor* color) {
@@ -45,3 +77,16 @@ void ColorImage_get_srgb(const ColorImage* self, size_t addr, ByteColor* color)
     color->b = self->b_srgb[addr].b;
     color->a = self->b_srgb[addr].a;
 }
+
+void ColorImage_copy_linear(const ColorImage* self, FloatColor* out) {
+    /* copies the float buffer into a double precision working buffer */
+    size_t size = (size_t)(self->width * self->height);
+    if (self->b_linear_f32 != NULL) {
+        for (size_t i = 0; i < size; i++) {
+            const float* f = &self->b_linear_f32[i * FLOAT_COLOR_RGB_CHANNELS];
+            FloatColor_set(&out[i], (double)f[0], (double)f[1], (double)f[2]);
+        }
+    } else {
+        memcpy(out, self->b_linear, size * sizeof(FloatColor));
+    }
+}
@@ -7,14 +7,17 @@
 #include "color_bytecolor.h"
 
 struct ColorImage {
-    FloatColor* b_linear;
+    FloatColor* b_linear;   // NULL if the image uses b_linear_f32
+    float* b_linear_f32;    // single precision r, g, b triplets (images created with ColorImage_new_f32)
     ByteColor* b_srgb;
+    size_t not_opaque;      // number of pixels whose alpha isn't 255
     int width;
     int height;
 };
 typedef struct ColorImage ColorImage;
 
 void ColorImage_get_srgb(const ColorImage* self, size_t addr, ByteColor* color);
+void ColorImage_copy_linear(const ColorImage* self, FloatColor* out);
 
 #endif // COLOR_COLORIMAGE_H
 
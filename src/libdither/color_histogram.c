@@ -0,0 +1,99 @@
+#include <stdlib.h>
+#include <string.h>
+#include "color_histogram.h"
+#include "libdither.h"
+
+#define HISTOGRAM_MIN_BITS 10  // smallest hash table: 1024 slots
+#define HISTOGRAM_EMPTY 0      // marks an unused hash table slot; slots hold entry index + 1
+
+inline static uint32_t histogram_key(const ByteColor* bc) {
+    return ((uint32_t)bc->r << 16) | ((uint32_t)bc->g << 8) | (uint32_t)bc->b;
+}
+
+inline static size_t histogram_slot(uint32_t key, int bits) {
+    /* multiplicative (Fibonacci) hashing of the 24 bit color key */
+    return (size_t)((key * 2654435769u) >> (32 - bits));
+}
+
+static void histogram_rehash(const ColorHistogram* self, uint32_t* slots, int bits) {
+    /* re-inserts all entries into an empty table of 2^bits slots */
+    size_t mask = ((size_t)1 << bits) - 1;
+    for (size_t i = 0; i < self->size; i++) {
+        size_t slot = histogram_slot(histogram_key(&self->entries[i].color), bits);
+        while (slots[slot] != HISTOGRAM_EMPTY)
+            slot = (slot + 1) & mask;
+        slots[slot] = (uint32_t)(i + 1);
+    }
+}
+
+ColorHistogram* ColorHistogram_from_image(const ColorImage* image, bool unique) {
+    /* collects the distinct colors of an image with an open addressing hash table in a single pass over the pixels.
+     * Fully transparent pixels are ignored.
+     * unique: true - every color is counted once (count = 1)
+     *         false - every color is counted with its number of pixels */
+    ColorHistogram* self = (ColorHistogram*)calloc(1, sizeof(ColorHistogram));
+    size_t image_size = (size_t)(image->width * image->height);
+    size_t capacity = 256;
+    self->entries = (ColorHistogramEntry*)malloc(capacity * sizeof(ColorHistogramEntry));
+    int bits = HISTOGRAM_MIN_BITS;
+    uint32_t* slots = (uint32_t*)calloc((size_t)1 << bits, sizeof(uint32_t));
+    ColorHistogramEntry* last = NULL;  // runs of the same color only need one lookup
+    uint32_t last_key = 0;
+    for (size_t i = 0; i < image_size; i++) {
+        ByteColor bc;
+        ColorImage_get_srgb(image, i, &bc);
+        if (bc.a == 0)  // only count not fully transparent pixels
+            continue;
+        uint32_t key = histogram_key(&bc);
+        if (last == NULL || key != last_key) {
+            size_t mask = ((size_t)1 << bits) - 1;
+            size_t slot = histogram_slot(key, bits);
+            while (slots[slot] != HISTOGRAM_EMPTY && histogram_key(&self->entries[slots[slot] - 1].color) != key)
+                slot = (slot + 1) & mask;
+            if (slots[slot] == HISTOGRAM_EMPTY) {  // new color
+                if (self->size == capacity) {
+                    capacity *= 2;
+                    self->entries = (ColorHistogramEntry*)realloc(self->entries, capacity * sizeof(ColorHistogramEntry));
+                }
+                ColorHistogramEntry* entry = &self->entries[self->size++];
+                entry->color.r = bc.r;
+                entry->color.g = bc.g;
+                entry->color.b = bc.b;
+                entry->color.a = 255;
+                entry->count = 0;
+                slots[slot] = (uint32_t)self->size;
+                if (self->size * 2 > ((size_t)1 << bits)) {  // keep the table at most half full
+                    free(slots);
+                    bits++;
+                    slots = (uint32_t*)calloc((size_t)1 << bits, sizeof(uint32_t));
+                    histogram_rehash(self, slots, bits);
+                }
+                last = entry;
+            } else {
+                last = &self->entries[slots[slot] - 1];
+            }
+            last_key = key;
+        }
+        if (!unique || last->count == 0) {
+            last->count++;
+            self->total++;
+        }
+    }
+    free(slots);
+    return self;
+}
+
+BytePalette* ColorHistogram_to_palette(const ColorHistogram* self) {
+    /* returns the histogram's colors as a palette */
+    BytePalette* pal = BytePalette_new(self->size);
+    for (size_t i = 0; i < self->size; i++)
+        BytePalette_set(pal, i, &self->entries[i].color);
+    return pal;
+}
+
+void ColorHistogram_free(ColorHistogram* self) {
+    if (self) {
+        free(self->entries);
+        free(self);
+    }
+}
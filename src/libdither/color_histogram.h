@@ -0,0 +1,32 @@
+#pragma once
+#ifndef COLOR_HISTOGRAM_H
+#define COLOR_HISTOGRAM_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "color_bytecolor.h"
+#include "color_bytepalette.h"
+#include "color_colorimage.h"
+
+/* weighted color histogram: every distinct (opaque) color of an image once, with its number of pixels.
+ * This is the input of the quantizers; its size is O(unique colors) rather than O(pixels). */
+
+struct ColorHistogramEntry {
+    ByteColor color;    // sRGB color (alpha is always 255)
+    uint32_t count;     // number of pixels with this color
+};
+typedef struct ColorHistogramEntry ColorHistogramEntry;
+
+struct ColorHistogram {
+    ColorHistogramEntry* entries;   // distinct colors, in order of their first appearance in the image
+    size_t size;                    // number of distinct colors
+    uint64_t total;                 // sum of all counts
+};
+typedef struct ColorHistogram ColorHistogram;
+
+ColorHistogram* ColorHistogram_from_image(const ColorImage* image, bool unique);
+BytePalette* ColorHistogram_to_palette(const ColorHistogram* self);
+void ColorHistogram_free(ColorHistogram* self);
+
+#endif  // COLOR_HISTOGRAM_H
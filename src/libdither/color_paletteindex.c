@@ -0,0 +1,263 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "color_paletteindex.h"
+
+#define LEAF_SIZE 8               // ranges of up to 8 nodes are scanned linearly
+#define PRUNE_SLACK (1.0 + 1e-9)  // keeps subtrees at (rounding-level) equal distance, so ties resolve like a linear scan
+
+struct Neighbors {
+    /* bounded max-heap of the k closest nodes found so far */
+    double dist[PALETTE_INDEX_MAX_K];
+    size_t index[PALETTE_INDEX_MAX_K];
+    size_t count;
+    size_t k;
+};
+typedef struct Neighbors Neighbors;
+
+static bool node_less(const double* coords, const size_t* order, size_t a, size_t b, int dim) {
+    /* orders nodes by their coordinate in dim, then by palette index to make the tree deterministic */
+    double ca = coords[order[a] * 3 + (size_t)dim];
+    double cb = coords[order[b] * 3 + (size_t)dim];
+    return ca < cb || (ca == cb && order[a] < order[b]);
+}
+
+static void swap_nodes(size_t* order, size_t a, size_t b) {
+    size_t tmp = order[a];
+    order[a] = order[b];
+    order[b] = tmp;
+}
+
+static void select_nth(const double* coords, size_t* order, size_t lo, size_t hi, size_t nth, int dim) {
+    /* partially sorts order[lo, hi) so that order[nth] holds the node that would be there if the range was sorted */
+    while (hi - lo > 1) {
+        size_t pivot = lo + (hi - lo) / 2;
+        swap_nodes(order, pivot, hi - 1);
+        size_t store = lo;
+        for (size_t i = lo; i < hi - 1; i++) {
+            if (node_less(coords, order, i, hi - 1, dim))
+                swap_nodes(order, i, store++);
+        }
+        swap_nodes(order, store, hi - 1);
+        if (store == nth)
+            return;
+        if (nth < store)
+            hi = store;
+        else
+            lo = store + 1;
+    }
+}
+
+static void build(const double* coords, size_t* order, uint8_t* split, size_t lo, size_t hi, int dimensions) {
+    /* splits the range at its median along the component with the largest spread */
+    if (hi - lo <= LEAF_SIZE)
+        return;
+    int dim = 0;
+    double widest = -1.0;
+    for (int d = 0; d < dimensions; d++) {
+        double low = coords[order[lo] * 3 + (size_t)d];
+        double high = low;
+        for (size_t i = lo + 1; i < hi; i++) {
+            double v = coords[order[i] * 3 + (size_t)d];
+            low = v < low ? v : low;
+            high = v > high ? v : high;
+        }
+        if (high - low > widest) {
+            widest = high - low;
+            dim = d;
+        }
+    }
+    size_t mid = lo + (hi - lo) / 2;
+    select_nth(coords, order, lo, hi, mid, dim);
+    split[mid] = (uint8_t)dim;
+    build(coords, order, split, lo, mid, dimensions);
+    build(coords, order, split, mid + 1, hi, dimensions);
+}
+
+PaletteIndex* PaletteIndex_new_empty(size_t capacity, int dimensions) {
+    /* creates an index for up to capacity colors, which is filled (and can be refilled any number of times without
+     * allocating memory) by PaletteIndex_build */
+    PaletteIndex* self = (PaletteIndex*)calloc(1, sizeof(PaletteIndex));
+    self->size = 0;
+    self->capacity = capacity;
+    self->dimensions = dimensions;
+    self->coords = (double*)calloc(capacity * 3, sizeof(double));
+    self->index = (size_t*)calloc(capacity, sizeof(size_t));
+    self->split = (uint8_t*)calloc(capacity, sizeof(uint8_t));
+    return self;
+}
+
+void PaletteIndex_build(PaletteIndex* self, const double* points, size_t size) {
+    /* (re)builds the k-d tree over size points (points[i * 3 + component]); size must not exceed the capacity.
+     * The tree is stored flat: the root of the node range [lo, hi) is the node in the middle of the range */
+    self->size = size;
+    for (size_t i = 0; i < size; i++)
+        self->index[i] = i;
+    build(points, self->index, self->split, 0, size, self->dimensions);
+    for (size_t i = 0; i < size; i++)
+        memcpy(&self->coords[i * 3], &points[self->index[i] * 3], 3 * sizeof(double));
+}
+
+PaletteIndex* PaletteIndex_new(const FloatPalette* pal, int dimensions) {
+    /* builds a k-d tree over all palette colors. dimensions: 3 for Euclidean distance over all three components,
+     * 1 to only compare the first component (luminance) */
+    PaletteIndex* self = PaletteIndex_new_empty(pal->size, dimensions);
+    double* points = (double*)calloc(pal->size * 3, sizeof(double));
+    for (size_t i = 0; i < pal->size; i++) {
+        const FloatColor* fc = FloatPalette_get((FloatPalette*)pal, i);
+        points[i * 3] = fc->r;
+        points[i * 3 + 1] = fc->g;
+        points[i * 3 + 2] = fc->b;
+    }
+    PaletteIndex_build(self, points, pal->size);
+    free(points);
+    return self;
+}
+
+void PaletteIndex_free(PaletteIndex* self) {
+    if (self) {
+        free(self->coords);
+        free(self->index);
+        free(self->split);
+        free(self);
+    }
+}
+
+static double node_distance(const PaletteIndex* self, size_t node, const double* q) {
+    /* same arithmetic as distance_linear() / distance_luminance() */
+    const double* p = &self->coords[node * 3];
+    if (self->dimensions == 1)
+        return fabs(p[0] - q[0]);
+    double dist_r = p[0] - q[0];
+    double dist_g = p[1] - q[1];
+    double dist_b = p[2] - q[2];
+    return sqrt(dist_r * dist_r + dist_g * dist_g + dist_b * dist_b);
+}
+
+static void nearest(const PaletteIndex* self, size_t lo, size_t hi, const double* q, double* best, size_t* best_index) {
+    if (hi - lo <= LEAF_SIZE) {
+        for (size_t n = lo; n < hi; n++) {
+            double d = node_distance(self, n, q);
+            if (d < *best || (d == *best && self->index[n] < *best_index)) {
+                *best = d;
+                *best_index = self->index[n];
+            }
+        }
+        return;
+    }
+    size_t mid = lo + (hi - lo) / 2;
+    double d = node_distance(self, mid, q);
+    if (d < *best || (d == *best && self->index[mid] < *best_index)) {
+        *best = d;
+        *best_index = self->index[mid];
+    }
+    double diff = q[self->split[mid]] - self->coords[mid * 3 + self->split[mid]];
+    if (diff < 0.0) {
+        nearest(self, lo, mid, q, best, best_index);
+        if (-diff <= *best * PRUNE_SLACK)
+            nearest(self, mid + 1, hi, q, best, best_index);
+    } else {
+        nearest(self, mid + 1, hi, q, best, best_index);
+        if (diff <= *best * PRUNE_SLACK)
+            nearest(self, lo, mid, q, best, best_index);
+    }
+}
+
+size_t PaletteIndex_nearest(const PaletteIndex* self, const FloatColor* c) {
+    /* returns the palette index of the closest color. The result is identical to a linear scan with
+     * distance_linear() (3 dimensions) or distance_luminance() (1 dimension), including ties */
+    double q[3] = {c->r, c->g, c->b};
+    double best = HUGE_VAL;
+    size_t best_index = 0;
+    nearest(self, 0, self->size, q, &best, &best_index);
+    return best_index;
+}
+
+static bool neighbor_farther(const Neighbors* nb, size_t a, size_t b) {
+    return nb->dist[a] > nb->dist[b] || (nb->dist[a] == nb->dist[b] && nb->index[a] > nb->index[b]);
+}
+
+static void neighbor_sift_down(Neighbors* nb, size_t i) {
+    for (;;) {
+        size_t largest = i;
+        size_t left = i * 2 + 1;
+        size_t right = left + 1;
+        if (left < nb->count && neighbor_farther(nb, left, largest))
+            largest = left;
+        if (right < nb->count && neighbor_farther(nb, right, largest))
+            largest = right;
+        if (largest == i)
+            return;
+        double d = nb->dist[i];
+        size_t idx = nb->index[i];
+        nb->dist[i] = nb->dist[largest];
+        nb->index[i] = nb->index[largest];
+        nb->dist[largest] = d;
+        nb->index[largest] = idx;
+        i = largest;
+    }
+}
+
+static void neighbor_add(Neighbors* nb, double d, size_t index) {
+    /* keeps the k closest nodes; the farthest of them is at the top of the heap */
+    if (nb->count < nb->k) {
+        size_t i = nb->count++;
+        nb->dist[i] = d;
+        nb->index[i] = index;
+        while (i > 0 && neighbor_farther(nb, i, (i - 1) / 2)) {
+            size_t parent = (i - 1) / 2;
+            double pd = nb->dist[parent];
+            size_t pidx = nb->index[parent];
+            nb->dist[parent] = nb->dist[i];
+            nb->index[parent] = nb->index[i];
+            nb->dist[i] = pd;
+            nb->index[i] = pidx;
+            i = parent;
+        }
+    } else if (d < nb->dist[0] || (d == nb->dist[0] && index < nb->index[0])) {
+        nb->dist[0] = d;
+        nb->index[0] = index;
+        neighbor_sift_down(nb, 0);
+    }
+}
+
+static void nearest_k(const PaletteIndex* self, size_t lo, size_t hi, const double* q, Neighbors* nb) {
+    if (hi - lo <= LEAF_SIZE) {
+        for (size_t n = lo; n < hi; n++)
+            neighbor_add(nb, node_distance(self, n, q), self->index[n]);
+        return;
+    }
+    size_t mid = lo + (hi - lo) / 2;
+    neighbor_add(nb, node_distance(self, mid, q), self->index[mid]);
+    double diff = q[self->split[mid]] - self->coords[mid * 3 + self->split[mid]];
+    size_t near_lo = diff < 0.0 ? lo : mid + 1;
+    size_t near_hi = diff < 0.0 ? mid : hi;
+    nearest_k(self, near_lo, near_hi, q, nb);
+    if (nb->count < nb->k || fabs(diff) <= nb->dist[0] * PRUNE_SLACK) {
+        if (diff < 0.0)
+            nearest_k(self, mid + 1, hi, q, nb);
+        else
+            nearest_k(self, lo, mid, q, nb);
+    }
+}
+
+static int compare_size(const void* a, const void* b) {
+    size_t x = *(const size_t*)a;
+    size_t y = *(const size_t*)b;
+    return (x > y) - (x < y);
+}
+
+size_t PaletteIndex_nearest_k(const PaletteIndex* self, const FloatColor* c, size_t k, size_t* out) {
+    /* writes the palette indices of the k closest colors (k is limited to PALETTE_INDEX_MAX_K) to out, sorted by palette index.
+     * Returns the number of indices written (less than k for small palettes) */
+    Neighbors nb;
+    nb.count = 0;
+    nb.k = k < PALETTE_INDEX_MAX_K ? k : PALETTE_INDEX_MAX_K;
+    double q[3] = {c->r, c->g, c->b};
+    nearest_k(self, 0, self->size, q, &nb);
+    memcpy(out, nb.index, nb.count * sizeof(size_t));
+    qsort(out, nb.count, sizeof(size_t), compare_size);
+    return nb.count;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#ifndef COLOR_PALETTEINDEX_H
+#define COLOR_PALETTEINDEX_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "color_floatcolor.h"
+#include "color_floatpalette.h"
+
+/* static k-d tree over a palette for sub-linear nearest color searches (Euclidean distance) */
+
+#define PALETTE_INDEX_MAX_K 64  // largest number of neighbors PaletteIndex_nearest_k can return
+
+struct PaletteIndex {
+    double* coords;     // node coordinates: coords[node * 3 + component]
+    size_t* index;      // palette index of each node
+    uint8_t* split;     // split component of each inner node
+    size_t size;
+    size_t capacity;
+    int dimensions;     // 3, or 1 to only use the first component (luminance)
+};
+typedef struct PaletteIndex PaletteIndex;
+
+PaletteIndex* PaletteIndex_new(const FloatPalette* pal, int dimensions);
+PaletteIndex* PaletteIndex_new_empty(size_t capacity, int dimensions);
+void PaletteIndex_build(PaletteIndex* self, const double* points, size_t size);
+void PaletteIndex_free(PaletteIndex* self);
+size_t PaletteIndex_nearest(const PaletteIndex* self, const FloatColor* c);
+size_t PaletteIndex_nearest_k(const PaletteIndex* self, const FloatColor* c, size_t k, size_t* out);
+
+#endif  // COLOR_PALETTEINDEX_H
@@ -1,27 +1,63 @@
 #define MODULE_API_EXPORTS
 #include <stdlib.h>
-#include <time.h>
-#include "kdtree/kdtree.h"
+#include <string.h>
 #include "color_bytepalette.h"
 #include "color_bytecolor.h"
+#include "color_quant_kdtree.h"
+#include "color_paletteindex.h"
+#include "random.h"
+#include "threading.h"
 #include "libdither.h"
 
-#define MAX_ITER 10    // max of k-means iterations if convergence cannot be reached
+#define MAX_ITER 10             // max of k-means iterations if convergence cannot be reached
+#define MIN_COLORS_PER_THREAD 4096  // don't split the assignment into smaller chunks than this
+#define ARENA_ALIGN 16
 
-static void color_to_point(const ByteColor* color, double* pt) {
-    /* convert color to kdtree point */
-    pt[0] = color->r;
-    pt[1] = color->g;
-    pt[2] = color->b;
+struct KMeansWorker {
+    /* per-thread state: assigns the colors start to end - 1 to their nearest center and sums them up per center */
+    const ColorHistogram* colors;
+    const PaletteIndex* tree;
+    uint32_t* assignments;
+    uint64_t* sums;     // r, g, b and count per center
+    size_t start;
+    size_t end;
+    size_t k;
+    size_t changed;     // number of colors assigned to a different center than in the previous iteration
+    bool first;         // first iteration: there are no previous assignments
+};
+typedef struct KMeansWorker KMeansWorker;
+
+void KMeansOptions_init(KMeansOptions* self) {
+    /* default options: single threaded, evenly spread initial centers */
+    self->threads = 1;
+    self->plus_plus = false;
+    self->seed = 0;
+}
+
+static void* arena_take(uint8_t** cursor, size_t bytes) {
+    /* hands out the next aligned chunk of the arena */
+    void* p = *cursor;
+    *cursor += (bytes + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    return p;
 }
 
 static void pick_k_unique(size_t* out, size_t k, size_t n) {
-    /* pick k random unique indices between 0 an n */
+    /* pick k unique indices between 0 an n, spread out over the whole range */
     size_t chosen = 0;
     size_t i = 1;
     while (chosen < k) {
-        //size_t idx = rand() % n;
         size_t idx = n / i; i++;
+        if (idx == n)  // n itself is out of range
+            idx = n - 1;
+        if (i > n + 1) {  // n / i ran out of new values: take the lowest unused index
+            for (idx = 0; idx < n; idx++) {
+                bool used = false;
+                for (size_t j = 0; j < chosen && !used; j++)
+                    used = out[j] == idx;
+                if (!used)
+                    break;
+            }
+        }
         bool exists = false;
         for (size_t j = 0; j < chosen; j++) {
             if (out[j] == idx) {
@@ -35,75 +71,166 @@ static void pick_k_unique(size_t* out, size_t k, size_t n) {
     }
 }
 
-BytePalette* kdtree_quantization(const BytePalette* unique_pal, size_t target_colors) {
-    /* kdtree quantization */
-    //srand((unsigned int)time(NULL));
-    ByteColor* pixels = (ByteColor*)calloc(unique_pal->size, sizeof(ByteColor));
-    for (size_t i = 0; i < unique_pal->size; i++) {
-        ByteColor_copy(&pixels[i], BytePalette_get(unique_pal, i));
+static double distance_sq(const ByteColor* a, const ByteColor* b) {
+    double dr = (double)a->r - (double)b->r;
+    double dg = (double)a->g - (double)b->g;
+    double db = (double)a->b - (double)b->b;
+    return dr * dr + dg * dg + db * db;
+}
+
+static void seed_plus_plus(const ColorHistogram* colors, size_t k, uint64_t seed, double* d2, ByteColor* centers) {
+    /* k-means++ seeding: each further center is picked with a probability proportional to its squared distance to
+     * the closest center picked so far, times its number of pixels */
+    DitherRandom rng;
+    random_init(&rng, seed);
+    size_t n = colors->size;
+    size_t pick = (size_t)(random_float(&rng) * (double)n);
+    ByteColor_copy(&centers[0], &colors->entries[pick < n ? pick : n - 1].color);
+    for (size_t i = 0; i < n; i++)
+        d2[i] = distance_sq(&colors->entries[i].color, &centers[0]) * (double)colors->entries[i].count;
+    for (size_t c = 1; c < k; c++) {
+        double total = 0.0;
+        for (size_t i = 0; i < n; i++)
+            total += d2[i];
+        pick = c % n;  // all colors coincide with a center already: any color will do
+        if (total > 0.0) {
+            double r = random_float(&rng) * total;
+            double acc = 0.0;
+            for (size_t i = 0; i < n; i++) {
+                if (d2[i] <= 0.0)
+                    continue;
+                pick = i;
+                acc += d2[i];
+                if (acc > r)
+                    break;
+            }
+        }
+        ByteColor_copy(&centers[c], &colors->entries[pick].color);
+        for (size_t i = 0; i < n; i++) {
+            double d = distance_sq(&colors->entries[i].color, &centers[c]) * (double)colors->entries[i].count;
+            if (d < d2[i])
+                d2[i] = d;
+        }
     }
+}
 
+static void assign_worker(void* arg) {
+    KMeansWorker* w = (KMeansWorker*)arg;
+    memset(w->sums, 0, w->k * 4 * sizeof(uint64_t));
+    w->changed = 0;
+    for (size_t i = w->start; i < w->end; i++) {
+        const ByteColor* bc = &w->colors->entries[i].color;
+        uint64_t count = w->colors->entries[i].count;
+        FloatColor fc;
+        fc.r = bc->r;
+        fc.g = bc->g;
+        fc.b = bc->b;
+        uint32_t center = (uint32_t)PaletteIndex_nearest(w->tree, &fc);
+        if (w->first || w->assignments[i] != center)
+            w->changed++;
+        w->assignments[i] = center;
+        uint64_t* sum = &w->sums[center * 4];
+        sum[0] += bc->r * count;
+        sum[1] += bc->g * count;
+        sum[2] += bc->b * count;
+        sum[3] += count;
+    }
+}
+
+BytePalette* kdtree_quantization(const ColorHistogram* histogram, size_t target_colors, const KMeansOptions* options) {
+    /* k-means quantization, with every color weighted by its number of pixels. Colors are assigned to their nearest
+     * center with a flat k-d tree over the centers that is rebuilt in place every iteration; all working memory comes
+     * from a single arena allocated up front.
+     * The assignment is split across threads, and the iteration stops as soon as no color changes its center.
+     * options: NULL for the defaults (see KMeansOptions_init) */
+    KMeansOptions defaults;
+    if (options == NULL) {
+        KMeansOptions_init(&defaults);
+        options = &defaults;
+    }
+    size_t n = histogram->size;
+    size_t k = target_colors;
+    int threads = thread_count_resolve(options->threads);
+    if ((size_t)threads > n / MIN_COLORS_PER_THREAD)
+        threads = n / MIN_COLORS_PER_THREAD > 1 ? (int)(n / MIN_COLORS_PER_THREAD) : 1;
 
-    // initialize centers randomly
-    ByteColor* centers = (ByteColor*)calloc(target_colors, sizeof(ByteColor));
-    size_t* initial_indices = (size_t*)calloc(target_colors, sizeof(size_t));
+    size_t arena_size = 0;
+    size_t sizes[7] = {
+        n * sizeof(uint32_t),                               // assignments
+        k * sizeof(ByteColor),                              // centers
+        k * 3 * sizeof(double),                             // center coordinates for the tree
+        (size_t)threads * k * 4 * sizeof(uint64_t),         // per-thread sums
+        (size_t)threads * sizeof(KMeansWorker),             // workers
+        k * sizeof(size_t),                                 // initial indices
+        options->plus_plus ? n * sizeof(double) : 0,        // k-means++ distances
+    };
+    for (int i = 0; i < 7; i++)
+        arena_size += (sizes[i] + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    uint8_t* arena = (uint8_t*)calloc(arena_size, 1);
+    uint8_t* cursor = arena;
+    uint32_t* assignments = (uint32_t*)arena_take(&cursor, sizes[0]);
+    ByteColor* centers = (ByteColor*)arena_take(&cursor, sizes[1]);
+    double* center_points = (double*)arena_take(&cursor, sizes[2]);
+    uint64_t* sums = (uint64_t*)arena_take(&cursor, sizes[3]);
+    KMeansWorker* workers = (KMeansWorker*)arena_take(&cursor, sizes[4]);
+    size_t* initial_indices = (size_t*)arena_take(&cursor, sizes[5]);
+    double* d2 = (double*)arena_take(&cursor, sizes[6]);
 
-    pick_k_unique(initial_indices, target_colors, unique_pal->size);
-    for (size_t i = 0; i < target_colors; i++) {
-        centers[i] = pixels[initial_indices[i]];
+    // initialize centers
+    if (options->plus_plus) {
+        seed_plus_plus(histogram, k, options->seed, d2, centers);
+    } else {
+        pick_k_unique(initial_indices, k, n);
+        for (size_t i = 0; i < k; i++)
+            ByteColor_copy(&centers[i], &histogram->entries[initial_indices[i]].color);
+    }
+    PaletteIndex* tree = PaletteIndex_new_empty(k, 3);
+    for (int t = 0; t < threads; t++) {
+        workers[t].colors = histogram;
+        workers[t].tree = tree;
+        workers[t].assignments = assignments;
+        workers[t].sums = &sums[(size_t)t * k * 4];
+        workers[t].start = n * (size_t)t / (size_t)threads;
+        workers[t].end = n * (size_t)(t + 1) / (size_t)threads;
+        workers[t].k = k;
     }
-    size_t* assignments = (size_t*)calloc(unique_pal->size, sizeof(size_t));
     for (size_t iter = 0; iter < MAX_ITER; iter++) {
-        // build tree with current centers
-        struct kdtree *center_tree = kd_create(3);
-        for (size_t i = 0; i < target_colors; i++) {
-            double pt[3];
-            color_to_point(&centers[i], pt);
-            kd_insert(center_tree, pt, (void*)i);
+        // rebuild tree with current centers
+        for (size_t i = 0; i < k; i++) {
+            center_points[i * 3] = centers[i].r;
+            center_points[i * 3 + 1] = centers[i].g;
+            center_points[i * 3 + 2] = centers[i].b;
         }
+        PaletteIndex_build(tree, center_points, k);
         // assign each pixel to nearest center
-        for (size_t i = 0; i < unique_pal->size; i++) {
-            double pt[3];
-            color_to_point(&pixels[i], pt);
-            struct kdres *res = kd_nearest(center_tree, pt);
-            if (res) {
-                size_t idx = (size_t)kd_res_item_data(res);
-                assignments[i] = idx;
-                kd_res_free(res);
-            } else {
-                assignments[i] = 0; // fallback
-            }
-        }
-        kd_free(center_tree);
-
+        for (int t = 0; t < threads; t++)
+            workers[t].first = iter == 0;
+        threads_run_independent(threads, assign_worker, workers, sizeof(KMeansWorker));
+        size_t changed = 0;
+        for (int t = 0; t < threads; t++)
+            changed += workers[t].changed;
+        if (changed == 0)  // converged: the centers wouldn't move anymore
+            break;
         // update centers by computing mean of assigned pixels
-        size_t* count=(size_t*)calloc(target_colors, sizeof(size_t));
-        size_t* sum_r=(size_t*)calloc(target_colors, sizeof(size_t));
-        size_t* sum_g=(size_t*)calloc(target_colors, sizeof(size_t));
-        size_t* sum_b=(size_t*)calloc(target_colors, sizeof(size_t));
-
-        for (size_t i = 0; i < target_colors; i++) {
-            count[i] = sum_r[i] = sum_g[i] = sum_b[i] = 0;
-        }
-        for (size_t i = 0; i < unique_pal->size; i++) {
-            size_t c = assignments[i];
-            sum_r[c] += pixels[i].r;
-            sum_g[c] += pixels[i].g;
-            sum_b[c] += pixels[i].b;
-            count[c]++;
-        }
-        for (size_t i = 0; i < target_colors; i++) {
-            if (count[i] > 0) {
-                centers[i].r = (unsigned char)(sum_r[i] / count[i]);
-                centers[i].g = (unsigned char)(sum_g[i] / count[i]);
-                centers[i].b = (unsigned char)(sum_b[i] / count[i]);
+        for (size_t i = 0; i < k; i++) {
+            uint64_t sum_r = 0, sum_g = 0, sum_b = 0, count = 0;
+            for (int t = 0; t < threads; t++) {
+                const uint64_t* sum = &workers[t].sums[i * 4];
+                sum_r += sum[0];
+                sum_g += sum[1];
+                sum_b += sum[2];
+                count += sum[3];
+            }
+            if (count > 0) {
+                centers[i].r = (uint8_t)(sum_r / count);
+                centers[i].g = (uint8_t)(sum_g / count);
+                centers[i].b = (uint8_t)(sum_b / count);
             }
         }
-        free(count); free(sum_r); free(sum_g); free(sum_b);
     }
 
-    BytePalette* outpal = BytePalette_new(target_colors);
-    for (size_t i = 0; i < target_colors; ++i) {
+    BytePalette* outpal = BytePalette_new(k);
+    for (size_t i = 0; i < k; ++i) {
         ByteColor bc;
         bc.r = centers[i].r;
         bc.g = centers[i].g;
@@ -111,9 +238,7 @@ BytePalette* kdtree_quantization(const BytePalette* unique_pal, size_t target_co
         bc.a = 255;
         BytePalette_set(outpal, i, &bc);
     }
-    free(pixels);
-    free(assignments);
-    free(centers);
-    free(initial_indices);
+    PaletteIndex_free(tree);
+    free(arena);
     return outpal;
 }
@@ -3,8 +3,19 @@
 #define COLOR_QUANT_KDTREE
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include "color_bytepalette.h"
+#include "color_histogram.h"
 
-BytePalette* kdtree_quantization(const BytePalette* unique_pal, size_t target_colors);
+struct KMeansOptions {
+    int threads;        // threads for assigning colors to centers; 0 = one per CPU core
+    bool plus_plus;     // k-means++ seeding instead of evenly spread initial centers
+    uint64_t seed;      // random seed for k-means++
+};
+typedef struct KMeansOptions KMeansOptions;
+
+void KMeansOptions_init(KMeansOptions* self);
+BytePalette* kdtree_quantization(const ColorHistogram* histogram, size_t target_colors, const KMeansOptions* options);
 
 #endif // COLOR_QUANT_KDTREE
@@ -11,26 +11,36 @@ static inline int MAXi(int a, int b) { return((a) > (b) ? a : b); }
 /* return smaller of two integers */
 static inline int MINi(int a, int b) { return((a) < (b) ? a : b); }
 
-/* color bucket used for sorting */
+/* color bucket: the range [lo, hi) of the shared color array */
 struct Bucket {
-    uint8_t* buffer;
-    size_t size; // number of colors
+    size_t lo;
+    size_t hi;
+    uint64_t weight; // number of pixels
     int range;
     int channel;
-    ByteColor average;
 };
 typedef struct Bucket Bucket;
 
-/* current color channel used for sorting */
-static int sort_color_channel = 0;
+struct BucketHeap {
+    /* max-heap of the indices of all buckets that can still be split, ordered by range (ties: lower index first) */
+    const Bucket* buckets;
+    size_t* items;
+    size_t size;
+};
+typedef struct BucketHeap BucketHeap;
+
+static inline uint8_t channel_of(const ColorHistogramEntry* e, int channel) {
+    return channel == 0 ? e->color.r : (channel == 1 ? e->color.g : e->color.b);
+}
 
-static void Bucket_update_range(Bucket* self) {
+static void Bucket_update_range(Bucket* self, const ColorHistogramEntry* colors) {
     /* calculates range for RGB channels in the bucket and determines channel with the biggest range */
-    ByteColor *ptr = (ByteColor*)self->buffer;
     int lower_red = 255, lower_green = 255, lower_blue = 255;
     int upper_red = 0, upper_green = 0, upper_blue = 0;
-    for (size_t i = 0; i < self->size; i++) {
-        ByteColor* c = &ptr[i];
+    self->weight = 0;
+    for (size_t i = self->lo; i < self->hi; i++) {
+        const ByteColor* c = &colors[i].color;
+        self->weight += colors[i].count;
         lower_red = MINi(lower_red, c->r);
         lower_green = MINi(lower_green, c->g);
         lower_blue = MINi(lower_blue, c->b);
@@ -45,115 +55,156 @@ static void Bucket_update_range(Bucket* self) {
     // find channel with max range
     if (self->range == red) self->channel = 0;
     else if (self->range == green) self->channel = 1;
-    else if (self->range == blue) self->channel = 2;
+    else self->channel = 2;
 }
 
-static Bucket* Bucket_new(uint8_t* pal, size_t num_colors) {
-    /* creates a new bucket (i.e. constructor) */
-    Bucket* self = (Bucket*)calloc(1, sizeof(Bucket));
-    self->size = num_colors;
-    self->buffer = (uint8_t*)calloc(num_colors * 4, sizeof(uint8_t));
-    memcpy(self->buffer, pal, num_colors * 4 * sizeof(uint8_t));
-    Bucket_update_range(self);
-    return self;
+static void swap_entries(ColorHistogramEntry* colors, size_t a, size_t b) {
+    ColorHistogramEntry tmp = colors[a];
+    colors[a] = colors[b];
+    colors[b] = tmp;
 }
 
-static int compare(const void* a,const void* b) {
-    /* comparison function */
-    uint8_t* c1 = (uint8_t*)a;
-    uint8_t* c2 = (uint8_t*)b;
-    return c1[sort_color_channel] - c2[sort_color_channel];
+static size_t Bucket_partition(const Bucket* self, ColorHistogramEntry* colors) {
+    /* reorders the bucket's colors in place so that its lower part holds the colors up to (and including) the one
+     * where half of the bucket's pixels are reached along the split channel (the weighted median), and returns where
+     * the upper part begins. At least one color is left on either side.
+     * The median value is found with a counting pass over the 8 bit channel values; the colors are then partitioned
+     * three-way (below / equal to / above the median value) instead of being sorted. */
+    uint64_t weights[256] = {0};
+    for (size_t i = self->lo; i < self->hi; i++)
+        weights[channel_of(&colors[i], self->channel)] += colors[i].count;
+    uint64_t half = self->weight - self->weight / 2;
+    uint64_t below = 0;
+    int median = 0;
+    while (below + weights[median] < half)
+        below += weights[median++];
+    // three-way partition: [lo, lt) < median, [lt, gt) == median, [gt, hi) > median
+    size_t lt = self->lo, i = self->lo, gt = self->hi;
+    while (i < gt) {
+        int v = channel_of(&colors[i], self->channel);
+        if (v < median)
+            swap_entries(colors, i++, lt++);
+        else if (v > median)
+            swap_entries(colors, i, --gt);
+        else
+            i++;
+    }
+    // the colors equal to the median value are added to the lower part until half of the pixels are reached
+    size_t split = lt;
+    uint64_t sum = below;
+    while (split < gt && sum < half)
+        sum += colors[split++].count;
+    if (split <= self->lo)
+        split = self->lo + 1;
+    if (split >= self->hi)
+        split = self->hi - 1;
+    return split;
 }
 
-static void Bucket_sort(Bucket* self) {
-    /* sorts colors in a bucket by one of the RGB color channels */
-    sort_color_channel = self->channel;
-    qsort(self->buffer, self->size, sizeof(ByteColor), compare);
+static bool BucketHeap_before(const BucketHeap* self, size_t a, size_t b) {
+    /* true if the bucket at heap position a should be split before the one at position b */
+    const Bucket* x = &self->buckets[self->items[a]];
+    const Bucket* y = &self->buckets[self->items[b]];
+    return x->range > y->range || (x->range == y->range && self->items[a] < self->items[b]);
 }
 
-static void Bucket_free(Bucket* self) {
-    /* frees a bucket (i.e. destructor) */
-    if(self) {
-        free(self->buffer);
-        free(self);
-        self = NULL;
-    }
+static void BucketHeap_swap(BucketHeap* self, size_t a, size_t b) {
+    size_t tmp = self->items[a];
+    self->items[a] = self->items[b];
+    self->items[b] = tmp;
 }
 
-static Bucket* Bucket_split(Bucket* self, bool upper) {
-    /* splits a bucket in two */
-    if (self->size == 1) {
-        return self;
+static void BucketHeap_push(BucketHeap* self, size_t bucket) {
+    size_t i = self->size++;
+    self->items[i] = bucket;
+    while (i > 0 && BucketHeap_before(self, i, (i - 1) / 2)) {
+        BucketHeap_swap(self, i, (i - 1) / 2);
+        i = (i - 1) / 2;
     }
-    Bucket_sort(self);
-    size_t upper_size = self->size / 2;
-    size_t lower_size = self->size - upper_size;
-    if (upper) {
-        return Bucket_new(self->buffer + lower_size * 4, upper_size);
-    } else {
-        return Bucket_new(self->buffer, lower_size);
+}
+
+static size_t BucketHeap_pop(BucketHeap* self) {
+    size_t top = self->items[0];
+    self->items[0] = self->items[--self->size];
+    size_t i = 0;
+    for (;;) {
+        size_t first = i;
+        size_t left = i * 2 + 1;
+        size_t right = left + 1;
+        if (left < self->size && BucketHeap_before(self, left, first))
+            first = left;
+        if (right < self->size && BucketHeap_before(self, right, first))
+            first = right;
+        if (first == i)
+            break;
+        BucketHeap_swap(self, i, first);
+        i = first;
     }
+    return top;
 }
 
-static void Bucket_average(Bucket* self) {
-    /* finds the bucket's RGB color channel averages */
-    size_t red = 0;
-    size_t green = 0;
-    size_t blue = 0;
-    ByteColor *ptr = (ByteColor*)self->buffer;
-    if (self->size == 1) {
-        ByteColor*c = &ptr[0];
-        self->average.r = c->r;
-        self->average.g = c->g;
-        self->average.b = c->b;
-    } else {
-        for (size_t i = 0; i < self->size; i++) {
-            ByteColor*c = &ptr[i];
-            red += c->r;
-            green += c->g;
-            blue += c->b;
-        }
-        self->average.r = (uint8_t)round((double)red / (double)self->size);
-        self->average.g = (uint8_t)round((double)green / (double)self->size);
-        self->average.b = (uint8_t)round((double)blue / (double)self->size);
+static void Bucket_average(const Bucket* self, const ColorHistogramEntry* colors, ByteColor* average) {
+    /* finds the bucket's RGB color channel averages, weighted by the number of pixels of each color */
+    uint64_t red = 0;
+    uint64_t green = 0;
+    uint64_t blue = 0;
+    for (size_t i = self->lo; i < self->hi; i++) {
+        const ByteColor* c = &colors[i].color;
+        red += (uint64_t)c->r * colors[i].count;
+        green += (uint64_t)c->g * colors[i].count;
+        blue += (uint64_t)c->b * colors[i].count;
     }
-    self->average.a = 255;
+    average->r = (uint8_t)round((double)red / (double)self->weight);
+    average->g = (uint8_t)round((double)green / (double)self->weight);
+    average->b = (uint8_t)round((double)blue / (double)self->weight);
+    average->a = 255;
 }
 
-BytePalette* median_cut(const BytePalette* palette, size_t out_cols) {
-    /* performs the median cut color quantization algorithm */
-    if (out_cols >= palette->size) {
+BytePalette* median_cut(const ColorHistogram* histogram, size_t out_cols) {
+    /* performs the median cut color quantization algorithm: repeatedly splits the bucket with the largest range at
+     * its weighted median until there are out_cols buckets. Works in place on a single copy of the histogram, with
+     * all memory allocated up front; there is no shared state, so concurrent calls are safe. */
+    if (out_cols >= histogram->size || out_cols == 0) {
         return NULL;
     }
-    Bucket** bucket_list;
-    bucket_list = (Bucket**)calloc(out_cols + 1, sizeof(Bucket*));
-    bucket_list[0] = Bucket_new(palette->buffer, palette->size);
-    size_t num_buckets = 0;
-    for (size_t i = 0; i < out_cols; i++) {
-        int max_range = 0;
-        size_t max_bucket = 0;
-        for (size_t j = 0; j < num_buckets; j++) {
-            if (bucket_list[j]->range > max_range && bucket_list[j]->size > 1) {
-                max_range = bucket_list[j]->range;
-                max_bucket = j;
-            }
-        }
-        Bucket* upper_bucket = Bucket_split(bucket_list[max_bucket], true);
-        Bucket* lower_bucket = Bucket_split(bucket_list[max_bucket], false);
-        Bucket_free(bucket_list[max_bucket]);
-        bucket_list[max_bucket] = lower_bucket;
-        bucket_list[++num_buckets] = upper_bucket;
-    }
-    BytePalette* out = BytePalette_new(out_cols);
-    for (size_t i = 0; i < num_buckets; i++) {
-        Bucket_average(bucket_list[i]);
-        BytePalette_set(out, i, &bucket_list[i]->average);
+    ColorHistogramEntry* colors = (ColorHistogramEntry*)malloc(histogram->size * sizeof(ColorHistogramEntry));
+    memcpy(colors, histogram->entries, histogram->size * sizeof(ColorHistogramEntry));
+    Bucket* buckets = (Bucket*)calloc(out_cols, sizeof(Bucket));
+    BucketHeap heap;
+    heap.buckets = buckets;
+    heap.items = (size_t*)calloc(out_cols, sizeof(size_t));
+    heap.size = 0;
+
+    buckets[0].lo = 0;
+    buckets[0].hi = histogram->size;
+    Bucket_update_range(&buckets[0], colors);
+    BucketHeap_push(&heap, 0);
+    size_t num_buckets = 1;
+    while (num_buckets < out_cols && heap.size > 0) {
+        size_t index = BucketHeap_pop(&heap);
+        Bucket* lower = &buckets[index];
+        Bucket* upper = &buckets[num_buckets];
+        size_t split = Bucket_partition(lower, colors);
+        upper->lo = split;
+        upper->hi = lower->hi;
+        lower->hi = split;
+        Bucket_update_range(lower, colors);
+        Bucket_update_range(upper, colors);
+        // buckets with a single color can't be split any further
+        if (lower->hi - lower->lo > 1)
+            BucketHeap_push(&heap, index);
+        if (upper->hi - upper->lo > 1)
+            BucketHeap_push(&heap, num_buckets);
+        num_buckets++;
     }
+    BytePalette* out = BytePalette_new(num_buckets);
     for (size_t i = 0; i < num_buckets; i++) {
-        if (bucket_list[i] != NULL) {
-            Bucket_free(bucket_list[i]);
-        }
+        ByteColor average;
+        Bucket_average(&buckets[i], colors, &average);
+        BytePalette_set(out, i, &average);
     }
-    free(bucket_list);
+    free(heap.items);
+    free(buckets);
+    free(colors);
     return out;
 }
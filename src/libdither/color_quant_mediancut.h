@@ -4,7 +4,8 @@
 
 #include <stdlib.h>
 #include "color_bytepalette.h"
+#include "color_histogram.h"
 
-BytePalette* median_cut(const BytePalette* palette, size_t out_cols);
+BytePalette* median_cut(const ColorHistogram* histogram, size_t out_cols);
 
 #endif // COLOR_QUANT_MEDIANCUT_H
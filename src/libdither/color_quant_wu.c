@@ -19,11 +19,12 @@ Free to distribute, comments and suggestions are appreciated.
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "color_quant_wu.h"
 #include "color_bytepalette.h"
+#include "threading.h"
 #include "libdither.h"
 
-#define MAXCOLOR 256
 #define	RED	2
 #define	GREEN 1
 #define BLUE 0
@@ -39,51 +40,44 @@ struct Box {
 };
 typedef struct Box Box;
 
-/* Histogram is in elements 1..HISTSIZE along each axis,
+struct MomentWorker {
+    /* per-thread state for building the moment tables: red slab r0 to r1 - 1, green slab g0 to g1 - 1 */
+    WuContext* ctx;
+    int r0, r1;
+    int g0, g1;
+};
+typedef struct MomentWorker MomentWorker;
+
+/* Histogram is in elements 1..2^bits along each axis,
  * element 0 is for base or marginal value
  * NB: these must start out 0!
  */
 
-struct Shared {
-    double m2[33][33][33];
-    long wt[33][33][33], mr[33][33][33], mg[33][33][33], mb[33][33][33];
-    BytePalette *Ipal;  /* input palette */
-    size_t size;        /*image size*/
-    size_t K;           /*color look-up table size*/
-    unsigned short *Qadd;
-};
-typedef struct Shared Shared;
-
-Shared* shared = NULL;
-
+static inline size_t Cell(const WuContext* ctx, int r, int g, int b) {
+    /* index of [r][g][b] in the flat moment tables */
+    return ((size_t)r * (size_t)ctx->side + (size_t)g) * (size_t)ctx->side + (size_t)b;
+}
 
-static void Hist3d(long* vwt, long* vmr, long* vmg, long* vmb, double* m2_) {
-    /* build 3-D color histogram of counts, r/g/b, c^2 */
-    int ind, r, g, b;
-    int inr, ing, inb, table[256];
-    for(size_t i = 0; i < 256; ++i)
-        table[i] = (int)(i * i);
-    shared->Qadd = (unsigned short*)malloc(sizeof(short)*shared->size);
-    if (shared->Qadd == NULL) {
-        printf("WARNING: Wu quantification - Not enough space\n");
-        exit(1);
-    }
-    for(size_t i = 0; i < shared->size; ++i) {
-        ByteColor* bc = BytePalette_get(shared->Ipal, i);
-        r = bc->r;
-        g = bc->g;
-        b = bc->b;
-        inr = (r >> 3) + 1;
-        ing = (g >> 3) + 1;
-        inb = (b >> 3) + 1;
-        ind = (inr << 10) + (inr << 6) + inr + (ing << 5) + ing + inb;
-        shared->Qadd[i] = (unsigned short)ind;
-        /* [inr][ing][inb] */
-        ++vwt[ind];
-        vmr[ind] += r;
-        vmg[ind] += g;
-        vmb[ind] += b;
-        m2_[ind] += (double)(table[r] + table[g] + table[b]);
+static void Hist3d(void* arg) {
+    /* build 3-D color histogram of counts, r/g/b, c^2 for the cells with red index r0 to r1 - 1 */
+    MomentWorker* w = (MomentWorker*)arg;
+    WuContext* ctx = w->ctx;
+    int shift = 8 - ctx->bits;
+    for(size_t i = 0; i < ctx->hist->size; ++i) {
+        const ColorHistogramEntry* entry = &ctx->hist->entries[i];
+        int r = entry->color.r;
+        int inr = (r >> shift) + 1;
+        if (inr < w->r0 || inr >= w->r1)
+            continue;
+        int g = entry->color.g;
+        int b = entry->color.b;
+        int64_t count = (int64_t)entry->count;
+        size_t ind = Cell(ctx, inr, (g >> shift) + 1, (b >> shift) + 1); /* [inr][ing][inb] */
+        ctx->wt[ind] += count;
+        ctx->mr[ind] += r * count;
+        ctx->mg[ind] += g * count;
+        ctx->mb[ind] += b * count;
+        ctx->m2[ind] += (int64_t)(r * r + g * g + b * b) * count;
     }
 }
 
@@ -97,55 +91,75 @@ static void Hist3d(long* vwt, long* vmr, long* vmg, long* vmb, double* m2_) {
 
 /* We now convert histogram into moments so that we can rapidly calculate
  * the sums of the above quantities over any desired box.
+ * The moments are integer prefix sums over all three axes, so they can be summed up in any order: first within each
+ * red plane (over green and blue), then along red.
  */
 
-static void M3d(long* vwt, long* vmr, long* vmg, long* vmb, double* m2_) {
-    /* compute cumulative moments. */
-    unsigned short ind1, ind2;
-    uint8_t i, r, g, b;
-    long line, line_r, line_g, line_b, area[33], area_r[33], area_g[33], area_b[33];
-    double line2, area2[33];
-    for(r = 1; r <= 32; ++r) {
-        for(i = 0; i <= 32; ++i) {
-            area[i] = area_r[i] = area_g[i] = area_b[i] = 0;
-            area2[i] = 0.0;
-        }
-        for(g = 1; g <= 32; ++g) {
-            line = line_r = line_g = line_b = 0;
-            line2 = 0.0;
-            for(b = 1; b <= 32; ++b) {
-                ind1 = (unsigned short)((r << 10) + (r << 6) + r + (g << 5) + g + b); /* [r][g][b] */
-                line += vwt[ind1];
-                line_r += vmr[ind1];
-                line_g += vmg[ind1];
-                line_b += vmb[ind1];
-                line2 += m2_[ind1];
-                area[b] += line;
-                area_r[b] += line_r;
-                area_g[b] += line_g;
-                area_b[b] += line_b;
-                area2[b] += line2;
-                ind2 = ind1 - 1089; /* [r-1][g][b] */
-                vwt[ind1] = vwt[ind2] + area[b];
-                vmr[ind1] = vmr[ind2] + area_r[b];
-                vmg[ind1] = vmg[ind2] + area_g[b];
-                vmb[ind1] = vmb[ind2] + area_b[b];
-                m2_[ind1] = m2_[ind2] + area2[b];
+static void M3d_planes(void* arg) {
+    /* compute cumulative moments over green and blue for the red planes r0 to r1 - 1 */
+    MomentWorker* w = (MomentWorker*)arg;
+    WuContext* ctx = w->ctx;
+    int64_t* tables[5] = {ctx->wt, ctx->mr, ctx->mg, ctx->mb, ctx->m2};
+    int top = ctx->side - 1;
+    for(int r = w->r0; r < w->r1; ++r) {
+        for(int t = 0; t < 5; ++t) {
+            int64_t* mmt = tables[t];
+            for(int g = 1; g <= top; ++g) {
+                int64_t line = 0;
+                for(int b = 1; b <= top; ++b) {
+                    size_t ind = Cell(ctx, r, g, b);
+                    line += mmt[ind];
+                    mmt[ind] = mmt[ind - (size_t)ctx->side] + line;  /* [r][g-1][b] */
+                }
             }
         }
     }
 }
 
-static long Vol(Box* cube, long mmt[33][33][33]) {
+static void M3d_red(void* arg) {
+    /* compute cumulative moments along red for the green rows g0 to g1 - 1 */
+    MomentWorker* w = (MomentWorker*)arg;
+    WuContext* ctx = w->ctx;
+    int64_t* tables[5] = {ctx->wt, ctx->mr, ctx->mg, ctx->mb, ctx->m2};
+    int top = ctx->side - 1;
+    size_t plane = (size_t)ctx->side * (size_t)ctx->side;
+    for(int t = 0; t < 5; ++t) {
+        int64_t* mmt = tables[t];
+        for(int r = 2; r <= top; ++r)
+            for(int g = w->g0; g < w->g1; ++g)
+                for(int b = 1; b <= top; ++b) {
+                    size_t ind = Cell(ctx, r, g, b);
+                    mmt[ind] += mmt[ind - plane];  /* [r-1][g][b] */
+                }
+    }
+}
+
+static void Moments(WuContext* ctx) {
+    /* builds the cumulative moment tables, split into slabs across the context's threads */
+    int cells = ctx->side - 1;
+    int threads = ctx->threads < cells ? ctx->threads : cells;
+    MomentWorker* workers = (MomentWorker*)calloc((size_t)threads, sizeof(MomentWorker));
+    for (int t = 0; t < threads; t++) {
+        workers[t].ctx = ctx;
+        workers[t].r0 = workers[t].g0 = 1 + cells * t / threads;
+        workers[t].r1 = workers[t].g1 = 1 + cells * (t + 1) / threads;
+    }
+    threads_run_independent(threads, Hist3d, workers, sizeof(MomentWorker));
+    threads_run_independent(threads, M3d_planes, workers, sizeof(MomentWorker));
+    threads_run_independent(threads, M3d_red, workers, sizeof(MomentWorker));
+    free(workers);
+}
+
+static int64_t Vol(const WuContext* ctx, const Box* cube, const int64_t* mmt) {
     /* Compute sum over a box of any given statistic */
-    return(mmt[cube->r1][cube->g1][cube->b1]
-           -mmt[cube->r1][cube->g1][cube->b0]
-           -mmt[cube->r1][cube->g0][cube->b1]
-           +mmt[cube->r1][cube->g0][cube->b0]
-           -mmt[cube->r0][cube->g1][cube->b1]
-           +mmt[cube->r0][cube->g1][cube->b0]
-           +mmt[cube->r0][cube->g0][cube->b1]
-           -mmt[cube->r0][cube->g0][cube->b0]);
+    return(mmt[Cell(ctx, cube->r1, cube->g1, cube->b1)]
+           -mmt[Cell(ctx, cube->r1, cube->g1, cube->b0)]
+           -mmt[Cell(ctx, cube->r1, cube->g0, cube->b1)]
+           +mmt[Cell(ctx, cube->r1, cube->g0, cube->b0)]
+           -mmt[Cell(ctx, cube->r0, cube->g1, cube->b1)]
+           +mmt[Cell(ctx, cube->r0, cube->g1, cube->b0)]
+           +mmt[Cell(ctx, cube->r0, cube->g0, cube->b1)]
+           -mmt[Cell(ctx, cube->r0, cube->g0, cube->b0)]);
 }
 
 /* The next two routines allow a slightly more efficient calculation
@@ -154,74 +168,61 @@ static long Vol(Box* cube, long mmt[33][33][33]) {
  * and with the specified new upper bound.
  */
 
-static long Bottom(Box* cube, uint8_t dir, long mmt[33][33][33]) {
+static int64_t Bottom(const WuContext* ctx, const Box* cube, uint8_t dir, const int64_t* mmt) {
     /* Compute part of Vol(cube, mmt) that doesn't depend on r1, g1, or b1 */
     /* (depending on dir) */
     switch(dir){
         case RED:
-            return(-mmt[cube->r0][cube->g1][cube->b1]
-                   +mmt[cube->r0][cube->g1][cube->b0]
-                   +mmt[cube->r0][cube->g0][cube->b1]
-                   -mmt[cube->r0][cube->g0][cube->b0]);
-            break;
+            return(-mmt[Cell(ctx, cube->r0, cube->g1, cube->b1)]
+                   +mmt[Cell(ctx, cube->r0, cube->g1, cube->b0)]
+                   +mmt[Cell(ctx, cube->r0, cube->g0, cube->b1)]
+                   -mmt[Cell(ctx, cube->r0, cube->g0, cube->b0)]);
         case GREEN:
-            return(-mmt[cube->r1][cube->g0][cube->b1]
-                   +mmt[cube->r1][cube->g0][cube->b0]
-                   +mmt[cube->r0][cube->g0][cube->b1]
-                   -mmt[cube->r0][cube->g0][cube->b0]);
-            break;
+            return(-mmt[Cell(ctx, cube->r1, cube->g0, cube->b1)]
+                   +mmt[Cell(ctx, cube->r1, cube->g0, cube->b0)]
+                   +mmt[Cell(ctx, cube->r0, cube->g0, cube->b1)]
+                   -mmt[Cell(ctx, cube->r0, cube->g0, cube->b0)]);
         case BLUE:
-            return(-mmt[cube->r1][cube->g1][cube->b0]
-                   +mmt[cube->r1][cube->g0][cube->b0]
-                   +mmt[cube->r0][cube->g1][cube->b0]
-                   -mmt[cube->r0][cube->g0][cube->b0]);
-            break;
+            return(-mmt[Cell(ctx, cube->r1, cube->g1, cube->b0)]
+                   +mmt[Cell(ctx, cube->r1, cube->g0, cube->b0)]
+                   +mmt[Cell(ctx, cube->r0, cube->g1, cube->b0)]
+                   -mmt[Cell(ctx, cube->r0, cube->g0, cube->b0)]);
     }
     return 0;
 }
 
-static long Top(Box* cube, uint8_t dir, int pos, long mmt[33][33][33]) {
+static int64_t Top(const WuContext* ctx, const Box* cube, uint8_t dir, int pos, const int64_t* mmt) {
     /* Compute remainder of Vol(cube, mmt), substituting pos for */
     /* r1, g1, or b1 (depending on dir) */
     switch(dir){
         case RED:
-            return (mmt[pos][cube->g1][cube->b1]
-                    -mmt[pos][cube->g1][cube->b0]
-                    -mmt[pos][cube->g0][cube->b1]
-                    +mmt[pos][cube->g0][cube->b0]);
-            break;
+            return (mmt[Cell(ctx, pos, cube->g1, cube->b1)]
+                    -mmt[Cell(ctx, pos, cube->g1, cube->b0)]
+                    -mmt[Cell(ctx, pos, cube->g0, cube->b1)]
+                    +mmt[Cell(ctx, pos, cube->g0, cube->b0)]);
         case GREEN:
-            return (mmt[cube->r1][pos][cube->b1]
-                    -mmt[cube->r1][pos][cube->b0]
-                    -mmt[cube->r0][pos][cube->b1]
-                    +mmt[cube->r0][pos][cube->b0]);
-            break;
+            return (mmt[Cell(ctx, cube->r1, pos, cube->b1)]
+                    -mmt[Cell(ctx, cube->r1, pos, cube->b0)]
+                    -mmt[Cell(ctx, cube->r0, pos, cube->b1)]
+                    +mmt[Cell(ctx, cube->r0, pos, cube->b0)]);
         case BLUE:
-            return (mmt[cube->r1][cube->g1][pos]
-                    -mmt[cube->r1][cube->g0][pos]
-                    -mmt[cube->r0][cube->g1][pos]
-                    +mmt[cube->r0][cube->g0][pos]);
-            break;
+            return (mmt[Cell(ctx, cube->r1, cube->g1, pos)]
+                    -mmt[Cell(ctx, cube->r1, cube->g0, pos)]
+                    -mmt[Cell(ctx, cube->r0, cube->g1, pos)]
+                    +mmt[Cell(ctx, cube->r0, cube->g0, pos)]);
     }
     return 0;
 }
 
-static double Var(Box* cube) {
+static double Var(const WuContext* ctx, const Box* cube) {
     /* Compute the weighted variance of a box */
     /* NB: as with the raw statistics, this is really the variance * size */
     double dr, dg, db, xx;
-    dr = (double)Vol(cube, shared->mr);
-    dg = (double)Vol(cube, shared->mg);
-    db = (double)Vol(cube, shared->mb);
-    xx =   shared->m2[cube->r1][cube->g1][cube->b1]
-          -shared->m2[cube->r1][cube->g1][cube->b0]
-          -shared->m2[cube->r1][cube->g0][cube->b1]
-          +shared->m2[cube->r1][cube->g0][cube->b0]
-          -shared->m2[cube->r0][cube->g1][cube->b1]
-          +shared->m2[cube->r0][cube->g1][cube->b0]
-          +shared->m2[cube->r0][cube->g0][cube->b1]
-          -shared->m2[cube->r0][cube->g0][cube->b0];
-    return (xx - (dr * dr + dg * dg + db * db) / (double)Vol(cube, shared->wt) );
+    dr = (double)Vol(ctx, cube, ctx->mr);
+    dg = (double)Vol(ctx, cube, ctx->mg);
+    db = (double)Vol(ctx, cube, ctx->mb);
+    xx = (double)Vol(ctx, cube, ctx->m2);
+    return (xx - (dr * dr + dg * dg + db * db) / (double)Vol(ctx, cube, ctx->wt) );
 }
 
 /* We want to minimize the sum of the variances of two subboxes.
@@ -231,28 +232,29 @@ static double Var(Box* cube) {
  * so we drop the minus sign and MAXIMIZE the sum of the two terms.
  */
 
-static double Maximize(Box* cube, uint8_t dir, int first, int last, int* cut,
-               long whole_r, long whole_g, long whole_b, long whole_w) {
-    long half_r, half_g, half_b, half_w;
-    long base_r, base_g, base_b, base_w;
+static double Maximize(const WuContext* ctx, const Box* cube, uint8_t dir, int first, int last, int* cut,
+                       int64_t whole_r, int64_t whole_g, int64_t whole_b, int64_t whole_w) {
+    int64_t half_r, half_g, half_b, half_w;
+    int64_t base_r, base_g, base_b, base_w;
     int i;
     double temp, max;
-    base_r = Bottom(cube, dir, shared->mr);
-    base_g = Bottom(cube, dir, shared->mg);
-    base_b = Bottom(cube, dir, shared->mb);
-    base_w = Bottom(cube, dir, shared->wt);
+    base_r = Bottom(ctx, cube, dir, ctx->mr);
+    base_g = Bottom(ctx, cube, dir, ctx->mg);
+    base_b = Bottom(ctx, cube, dir, ctx->mb);
+    base_w = Bottom(ctx, cube, dir, ctx->wt);
     max = 0.0;
     *cut = -1;
     for(i=first; i<last; ++i){
-        half_r = base_r + Top(cube, dir, i, shared->mr);
-        half_g = base_g + Top(cube, dir, i, shared->mg);
-        half_b = base_b + Top(cube, dir, i, shared->mb);
-        half_w = base_w + Top(cube, dir, i, shared->wt);
+        half_r = base_r + Top(ctx, cube, dir, i, ctx->mr);
+        half_g = base_g + Top(ctx, cube, dir, i, ctx->mg);
+        half_b = base_b + Top(ctx, cube, dir, i, ctx->mb);
+        half_w = base_w + Top(ctx, cube, dir, i, ctx->wt);
         /* now half_x is sum over lower half of box, if split at i */
         if (half_w == 0) {      /* subbox could be empty of pixels! */
             continue;           /* never split into an empty box */
         } else
-            temp = (double)(half_r * half_r + half_g * half_g + half_b * half_b) / (double)half_w;
+            temp = ((double)half_r * (double)half_r + (double)half_g * (double)half_g
+                    + (double)half_b * (double)half_b) / (double)half_w;
         half_r = whole_r - half_r;
         half_g = whole_g - half_g;
         half_b = whole_b - half_b;
@@ -260,7 +262,8 @@ static double Maximize(Box* cube, uint8_t dir, int first, int last, int* cut,
         if (half_w == 0) {      /* subbox could be empty of pixels! */
             continue;           /* never split into an empty box */
         } else
-            temp += (double)(half_r * half_r + half_g * half_g + half_b * half_b) / (double)half_w;
+            temp += ((double)half_r * (double)half_r + (double)half_g * (double)half_g
+                     + (double)half_b * (double)half_b) / (double)half_w;
         if (temp > max) {
             max = temp;
             *cut = i;
@@ -269,18 +272,18 @@ static double Maximize(Box* cube, uint8_t dir, int first, int last, int* cut,
     return(max);
 }
 
-static int Cut(Box* set1, Box* set2) {
+static int Cut(const WuContext* ctx, Box* set1, Box* set2) {
     uint8_t dir;
     int cutr, cutg, cutb;
     double maxr, maxg, maxb;
-    long whole_r, whole_g, whole_b, whole_w;
-    whole_r = Vol(set1, shared->mr);
-    whole_g = Vol(set1, shared->mg);
-    whole_b = Vol(set1, shared->mb);
-    whole_w = Vol(set1, shared->wt);
-    maxr = Maximize(set1, RED, set1->r0+1, set1->r1, &cutr, whole_r, whole_g, whole_b, whole_w);
-    maxg = Maximize(set1, GREEN, set1->g0+1, set1->g1, &cutg, whole_r, whole_g, whole_b, whole_w);
-    maxb = Maximize(set1, BLUE, set1->b0+1, set1->b1, &cutb, whole_r, whole_g, whole_b, whole_w);
+    int64_t whole_r, whole_g, whole_b, whole_w;
+    whole_r = Vol(ctx, set1, ctx->mr);
+    whole_g = Vol(ctx, set1, ctx->mg);
+    whole_b = Vol(ctx, set1, ctx->mb);
+    whole_w = Vol(ctx, set1, ctx->wt);
+    maxr = Maximize(ctx, set1, RED, set1->r0+1, set1->r1, &cutr, whole_r, whole_g, whole_b, whole_w);
+    maxg = Maximize(ctx, set1, GREEN, set1->g0+1, set1->g1, &cutg, whole_r, whole_g, whole_b, whole_w);
+    maxb = Maximize(ctx, set1, BLUE, set1->b0+1, set1->b1, &cutb, whole_r, whole_g, whole_b, whole_w);
     if((maxr >= maxg) && (maxr >= maxb)) {
         dir = RED;
         if (cutr < 0)
@@ -316,45 +319,82 @@ static int Cut(Box* set1, Box* set2) {
     return 1;
 }
 
-static void Mark(Box* cube, size_t label, uint8_t* tag) {
-    int r, g, b;
-    for(r = cube->r0 + 1; r <= cube->r1; ++r)
-        for(g = cube->g0 + 1; g <= cube->g1; ++g)
-            for(b = cube->b0 + 1; b <= cube->b1; ++b)
-                tag[(r << 10) + (r << 6) + r + (g << 5) + g + b] = (uint8_t)label;
+void WuOptions_init(WuOptions* self) {
+    /* default options: 5 bits per channel (as in Wu's original implementation), single threaded */
+    self->bits = WU_MIN_BITS;
+    self->threads = 1;
 }
 
-BytePalette* wu_quantization(const BytePalette* pal, size_t target_k) {
-    /* performs the Wu color quantization */
-    // TODO add a check that target_k <= MAXCOLOR
-    Box cube[MAXCOLOR];
-    uint8_t *tag;
-    uint8_t lut_r[MAXCOLOR], lut_g[MAXCOLOR], lut_b[MAXCOLOR]; /* output */
-    size_t next;
-    size_t k;
-    long weight;
-    double vv[MAXCOLOR], temp;
+WuContext* WuContext_new(const WuOptions* options) {
+    /* allocates the moment tables for the given precision (options: NULL for the defaults, see WuOptions_init).
+     * A 5 bit context needs about 1.4 MB, 6 bits 11 MB and 7 bits 86 MB. Returns NULL if out of memory */
+    WuOptions defaults;
+    if (options == NULL) {
+        WuOptions_init(&defaults);
+        options = &defaults;
+    }
+    WuContext* self = (WuContext*)calloc(1, sizeof(WuContext));
+    if (self == NULL)
+        return NULL;
+    self->bits = options->bits < WU_MIN_BITS ? WU_MIN_BITS : (options->bits > WU_MAX_BITS ? WU_MAX_BITS : options->bits);
+    self->side = (1 << self->bits) + 1;
+    self->cells = (size_t)self->side * (size_t)self->side * (size_t)self->side;
+    self->threads = thread_count_resolve(options->threads);
+    self->wt = (int64_t*)calloc(self->cells, sizeof(int64_t));
+    self->mr = (int64_t*)calloc(self->cells, sizeof(int64_t));
+    self->mg = (int64_t*)calloc(self->cells, sizeof(int64_t));
+    self->mb = (int64_t*)calloc(self->cells, sizeof(int64_t));
+    self->m2 = (int64_t*)calloc(self->cells, sizeof(int64_t));
+    if (self->wt == NULL || self->mr == NULL || self->mg == NULL || self->mb == NULL || self->m2 == NULL) {
+        WuContext_free(self);
+        return NULL;
+    }
+    return self;
+}
 
-    /* reset global variables */
-    shared = (Shared*)calloc(1, sizeof(Shared));
+void WuContext_free(WuContext* self) {
+    if (self) {
+        free(self->wt);
+        free(self->mr);
+        free(self->mg);
+        free(self->mb);
+        free(self->m2);
+        free(self);
+    }
+}
 
-    /* input R,G,B components into Ir, Ig, Ib; set size to width*height */
-    shared->Ipal = BytePalette_copy(pal);
-    shared->size = pal->size;
-    shared->K = target_k;
+BytePalette* WuContext_quantize(WuContext* self, const ColorHistogram* hist, size_t target_k) {
+    /* performs the Wu color quantization of the histogram's colors (weighted by their pixel counts) into up to
+     * target_k colors. Returns NULL if out of memory */
+    Box* cube = (Box*)calloc(target_k > 0 ? target_k : 1, sizeof(Box));
+    double* vv = (double*)calloc(target_k > 0 ? target_k : 1, sizeof(double));
+    if (cube == NULL || vv == NULL) {
+        free(cube);
+        free(vv);
+        return NULL;
+    }
+    size_t next;
+    size_t K = target_k;    /* color look-up table size */
+    double temp;
 
-    Hist3d((long*)shared->wt, (long*)shared->mr, (long*)shared->mg, (long*)shared->mb, (double*)shared->m2);
-    M3d((long*)shared->wt, (long*)shared->mr, (long*)shared->mg, (long*)shared->mb, (double*)shared->m2);
+    /* the moment tables must start out 0 (the context may have been used before) */
+    memset(self->wt, 0, self->cells * sizeof(int64_t));
+    memset(self->mr, 0, self->cells * sizeof(int64_t));
+    memset(self->mg, 0, self->cells * sizeof(int64_t));
+    memset(self->mb, 0, self->cells * sizeof(int64_t));
+    memset(self->m2, 0, self->cells * sizeof(int64_t));
+    self->hist = hist;
+    Moments(self);
 
     cube[0].r0 = cube[0].g0 = cube[0].b0 = 0;
-    cube[0].r1 = cube[0].g1 = cube[0].b1 = 32;
+    cube[0].r1 = cube[0].g1 = cube[0].b1 = self->side - 1;
     next = 0;
 
-    for(size_t i = 1; i < shared->K; ++i){
-        if (Cut(&cube[next], &cube[i])) {
+    for(size_t i = 1; i < K; ++i){
+        if (Cut(self, &cube[next], &cube[i])) {
             /* volume test ensures we won't try to cut one-cell box */
-            vv[next] = (cube[next].vol > 1) ? Var(&cube[next]) : 0.0;
-            vv[i] = (cube[i].vol > 1) ? Var(&cube[i]) : 0.0;
+            vv[next] = (cube[next].vol > 1) ? Var(self, &cube[next]) : 0.0;
+            vv[i] = (cube[i].vol > 1) ? Var(self, &cube[i]) : 0.0;
         } else {
             vv[next] = 0.0;   /* don't try to split this box again */
             i--;              /* didn't create box i */
@@ -367,40 +407,39 @@ BytePalette* wu_quantization(const BytePalette* pal, size_t target_k) {
                 next = kk;
             }
         if (temp <= 0.0) {
-            shared->K = i + 1;
-            fprintf(stderr, "WARNING: Wu quantification - Only got %zu boxes\n", shared->K);
+            K = i + 1;
+            fprintf(stderr, "WARNING: Wu quantification - Only got %zu boxes\n", K);
             break;
         }
     }
-    /* the space for array m2 can be freed now */
-    BytePalette* wuPalette = BytePalette_new(shared->K);
-    tag = (uint8_t *)malloc(33 * 33 * 33);
-    if (tag == NULL) {
-        printf("WARNING: Wu quantification - Not enough space\n");
-        exit(1);
-    }
-    for(k = 0; k < shared->K; ++k){
-        Mark(&cube[k], k, tag);
-        weight = Vol(&cube[k], shared->wt);
+    BytePalette* wuPalette = BytePalette_new(K);
+    for(size_t k = 0; k < K; ++k){
+        int64_t weight = Vol(self, &cube[k], self->wt);
+        ByteColor bc;
         if (weight) {
-            lut_r[k] = (uint8_t)(Vol(&cube[k], shared->mr) / weight);
-            lut_g[k] = (uint8_t)(Vol(&cube[k], shared->mg) / weight);
-            lut_b[k] = (uint8_t)(Vol(&cube[k], shared->mb) / weight);
+            bc.r = (uint8_t)(Vol(self, &cube[k], self->mr) / weight);
+            bc.g = (uint8_t)(Vol(self, &cube[k], self->mg) / weight);
+            bc.b = (uint8_t)(Vol(self, &cube[k], self->mb) / weight);
         }
         else{
             fprintf(stderr, "WARNING: Wu quantification - bogus box %zu\n", k);
-            lut_r[k] = lut_g[k] = lut_b[k] = 0;
+            bc.r = bc.g = bc.b = 0;
         }
-        ByteColor bc;
-        bc.r = lut_r[k];
-        bc.g = lut_g[k];
-        bc.b = lut_b[k];
         bc.a = 255;
         BytePalette_set(wuPalette, k, &bc);
     }
-
-    for(size_t i=0; i<shared->size; ++i) shared->Qadd[i] = tag[shared->Qadd[i]];
-    /* output lut_r, lut_g, lut_b as color look-up table contents, Qadd as the quantized image (array of table addresses). */
-    free(shared);
+    self->hist = NULL;
+    free(cube);
+    free(vv);
     return wuPalette;
 }
+
+BytePalette* wu_quantization(const ColorHistogram* hist, size_t target_k, const WuOptions* options) {
+    /* performs the Wu color quantization with a temporary context. Returns NULL if out of memory */
+    WuContext* ctx = WuContext_new(options);
+    if (ctx == NULL)
+        return NULL;
+    BytePalette* pal = WuContext_quantize(ctx, hist, target_k);
+    WuContext_free(ctx);
+    return pal;
+}
@@ -2,8 +2,39 @@
 #ifndef COLOR_QUANT_WU
 #define COLOR_QUANT_WU
 
+#include <stdlib.h>
+#include <stdint.h>
 #include "color_bytepalette.h"
+#include "color_histogram.h"
 
-BytePalette* wu_quantization(const BytePalette* pal, size_t target_k);
+#define WU_MIN_BITS 5  // histogram precision: 32 cells per channel
+#define WU_MAX_BITS 7  // histogram precision: 128 cells per channel
+
+struct WuOptions {
+    int bits;       // histogram precision per color channel (WU_MIN_BITS - WU_MAX_BITS)
+    int threads;    // threads for accumulating the moment tables; 0 = one per CPU core
+};
+typedef struct WuOptions WuOptions;
+
+struct WuContext {
+    /* all state of one Wu quantization: contexts can be reused, and separate contexts can be used concurrently */
+    int bits;
+    int side;           // cells per axis of the moment tables: 2^bits + 1 (cell 0 is the zero base)
+    size_t cells;       // side^3
+    int threads;
+    int64_t* wt;        // cumulative moments: pixel count,
+    int64_t* mr;        // sum of red,
+    int64_t* mg;        // sum of green,
+    int64_t* mb;        // sum of blue
+    int64_t* m2;        // and sum of squared color components
+    const ColorHistogram* hist;
+};
+typedef struct WuContext WuContext;
+
+void WuOptions_init(WuOptions* self);
+WuContext* WuContext_new(const WuOptions* options);
+void WuContext_free(WuContext* self);
+BytePalette* WuContext_quantize(WuContext* self, const ColorHistogram* hist, size_t target_k);
+BytePalette* wu_quantization(const ColorHistogram* hist, size_t target_k, const WuOptions* options);
 
 #endif // COLOR_QUANT_WU
@@ -0,0 +1,164 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
+#include "color_simd.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#  if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#    define HAVE_SSE2
+#    define HAVE_AVX
+#    include <immintrin.h>
+#    if defined(_MSC_VER) && !defined(__clang__)
+#      include <intrin.h>
+#      define TARGET_AVX
+#    else
+#      define TARGET_AVX __attribute__((target("avx")))
+#    endif
+#  endif
+#endif
+
+#define SIMD_WIDTH 4           // palettes are padded to a multiple of the widest vector (4 doubles)
+#define SIMD_PADDING 1.0e300   // padding entries are so far away that they are never the closest color
+#define SIMD_DBL_MAX 1.7976931348623158e+308
+
+enum SimdLevel simd_detect(void) {
+    /* returns the best SIMD instruction set supported by the CPU we're running on */
+#if defined(HAVE_AVX) && defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 1);
+    bool os_saves_ymm = (info[2] & (1 << 27)) && ((_xgetbv(0) & 6) == 6);
+    if ((info[2] & (1 << 28)) && os_saves_ymm)
+        return SIMD_AVX;
+    return SIMD_SSE2;
+#elif defined(HAVE_AVX)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx"))
+        return SIMD_AVX;
+    return SIMD_SSE2;
+#else
+    return SIMD_NONE;
+#endif
+}
+
+double* simd_palette_new(FloatPalette* pal, size_t* stride) {
+    /* creates a structure-of-arrays copy of the palette: all first components, then all second components, then
+     * all third components. Each array is padded to a multiple of SIMD_WIDTH with entries that never match */
+    size_t n = (pal->size + SIMD_WIDTH - 1) / SIMD_WIDTH * SIMD_WIDTH;
+    double* soa = (double*)malloc(n * 3 * sizeof(double));
+    for (size_t i = 0; i < n; i++) {
+        if (i < pal->size) {
+            FloatColor* fc = FloatPalette_get(pal, i);
+            soa[i] = fc->r;
+            soa[n + i] = fc->g;
+            soa[n * 2 + i] = fc->b;
+        } else {
+            soa[i] = soa[n + i] = soa[n * 2 + i] = SIMD_PADDING;
+        }
+    }
+    *stride = n;
+    return soa;
+}
+
+static size_t closest_of_lanes(const double* best, const double* best_index, int lanes) {
+    /* horizontal argmin: the smallest distance wins, on a tie the lower palette index wins (like the scalar loop) */
+    double lowest = best[0];
+    double index = best_index[0];
+    for (int i = 1; i < lanes; i++) {
+        if (best[i] < lowest || (best[i] == lowest && best_index[i] < index)) {
+            lowest = best[i];
+            index = best_index[i];
+        }
+    }
+    return (size_t)index;
+}
+
+static size_t closest_scalar(const double* soa, size_t stride, const FloatColor* c) {
+    /* scalar reference: same arithmetic (and therefore same result) as distance_linear() */
+    double lowest = SIMD_DBL_MAX;
+    size_t index = 0;
+    for (size_t i = 0; i < stride; i++) {
+        double dr = soa[i] - c->r;
+        double dg = soa[stride + i] - c->g;
+        double db = soa[stride * 2 + i] - c->b;
+        double delta = sqrt(dr * dr + dg * dg + db * db);
+        if (delta < lowest) {
+            lowest = delta;
+            index = i;
+        }
+    }
+    return index;
+}
+
+#if defined(HAVE_SSE2)
+static size_t closest_sse2(const double* soa, size_t stride, const FloatColor* c) {
+    /* scores 2 palette entries per instruction */
+    __m128d cr = _mm_set1_pd(c->r);
+    __m128d cg = _mm_set1_pd(c->g);
+    __m128d cb = _mm_set1_pd(c->b);
+    __m128d best = _mm_set1_pd(SIMD_DBL_MAX);
+    __m128d best_index = _mm_setzero_pd();
+    __m128d index = _mm_set_pd(1.0, 0.0);
+    __m128d step = _mm_set1_pd(2.0);
+    for (size_t i = 0; i < stride; i += 2) {
+        __m128d dr = _mm_sub_pd(_mm_loadu_pd(&soa[i]), cr);
+        __m128d dg = _mm_sub_pd(_mm_loadu_pd(&soa[stride + i]), cg);
+        __m128d db = _mm_sub_pd(_mm_loadu_pd(&soa[stride * 2 + i]), cb);
+        __m128d sum = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dr, dr), _mm_mul_pd(dg, dg)), _mm_mul_pd(db, db));
+        __m128d delta = _mm_sqrt_pd(sum);
+        __m128d closer = _mm_cmplt_pd(delta, best);
+        best = _mm_or_pd(_mm_and_pd(closer, delta), _mm_andnot_pd(closer, best));
+        best_index = _mm_or_pd(_mm_and_pd(closer, index), _mm_andnot_pd(closer, best_index));
+        index = _mm_add_pd(index, step);
+    }
+    double lanes[2], lane_index[2];
+    _mm_storeu_pd(lanes, best);
+    _mm_storeu_pd(lane_index, best_index);
+    return closest_of_lanes(lanes, lane_index, 2);
+}
+#endif
+
+#if defined(HAVE_AVX)
+TARGET_AVX static size_t closest_avx(const double* soa, size_t stride, const FloatColor* c) {
+    /* scores 4 palette entries per instruction */
+    __m256d cr = _mm256_set1_pd(c->r);
+    __m256d cg = _mm256_set1_pd(c->g);
+    __m256d cb = _mm256_set1_pd(c->b);
+    __m256d best = _mm256_set1_pd(SIMD_DBL_MAX);
+    __m256d best_index = _mm256_setzero_pd();
+    __m256d index = _mm256_set_pd(3.0, 2.0, 1.0, 0.0);
+    __m256d step = _mm256_set1_pd(4.0);
+    for (size_t i = 0; i < stride; i += 4) {
+        __m256d dr = _mm256_sub_pd(_mm256_loadu_pd(&soa[i]), cr);
+        __m256d dg = _mm256_sub_pd(_mm256_loadu_pd(&soa[stride + i]), cg);
+        __m256d db = _mm256_sub_pd(_mm256_loadu_pd(&soa[stride * 2 + i]), cb);
+        __m256d sum = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dr, dr), _mm256_mul_pd(dg, dg)),
+                                    _mm256_mul_pd(db, db));
+        __m256d delta = _mm256_sqrt_pd(sum);
+        __m256d closer = _mm256_cmp_pd(delta, best, _CMP_LT_OQ);
+        best = _mm256_blendv_pd(best, delta, closer);
+        best_index = _mm256_blendv_pd(best_index, index, closer);
+        index = _mm256_add_pd(index, step);
+    }
+    double lanes[4], lane_index[4];
+    _mm256_storeu_pd(lanes, best);
+    _mm256_storeu_pd(lane_index, best_index);
+    return closest_of_lanes(lanes, lane_index, 4);
+}
+#endif
+
+size_t simd_find_closest_color(const double* simd_palette, size_t stride, const FloatColor* c, enum SimdLevel level) {
+    /* returns the index of the palette entry with the smallest Euclidean distance to c. The result is identical to
+     * the scalar loop over distance_linear() in the cached palette */
+    switch (level) {
+#if defined(HAVE_AVX)
+        case SIMD_AVX:
+            return closest_avx(simd_palette, stride, c);
+#endif
+#if defined(HAVE_SSE2)
+        case SIMD_SSE2:
+            return closest_sse2(simd_palette, stride, c);
+#endif
+        default:
+            return closest_scalar(simd_palette, stride, c);
+    }
+}
@@ -0,0 +1,21 @@
+#pragma once
+#ifndef COLOR_SIMD_H
+#define COLOR_SIMD_H
+
+#include <stdlib.h>
+#include "color_floatcolor.h"
+#include "color_floatpalette.h"
+
+/* SIMD accelerated nearest color search (Euclidean distance) over a structure-of-arrays palette copy */
+
+enum SimdLevel {
+    SIMD_NONE = 0,
+    SIMD_SSE2 = 1,
+    SIMD_AVX = 2,
+};
+
+enum SimdLevel simd_detect(void);
+double* simd_palette_new(FloatPalette* pal, size_t* stride);
+size_t simd_find_closest_color(const double* simd_palette, size_t stride, const FloatColor* c, enum SimdLevel level);
+
+#endif  // COLOR_SIMD_H
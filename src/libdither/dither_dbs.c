@@ -2,7 +2,10 @@
 #include <stdlib.h>
 #include <math.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
 #include "libdither.h"
+#include "threading.h"
 
 #ifndef M_PI
 #define M_PI (3.14159265358979323846)
@@ -49,6 +52,56 @@ void conv2d(const Matrix* matrix, const Matrix* kernel, Matrix** out) {
     }
 }
 
+static void conv2d_separable(const Matrix* matrix, const Matrix* kernel, Matrix** out) {
+    /* same result as conv2d for a separable (rank 1) kernel, i.e. kernel(y, x) = col(y) * row(x), using a
+     * horizontal and a vertical pass: kw + kh instead of kw * kh multiplications per output value */
+    int kw = kernel->width;
+    int kh = kernel->height;
+    int mw = matrix->width;
+    int mh = matrix->height;
+    int ow = mw + kw - 1;
+    int oh = mh + kh - 1;
+    // factor the kernel through its center row and column: kernel(y, x) = kernel(y, cx) * kernel(cy, x) / kernel(cy, cx)
+    int cx = kw / 2;
+    int cy = kh / 2;
+    double center = kernel->buffer[cy * kw + cx];
+    double* row = (double*)calloc((size_t)kw, sizeof(double));
+    double* col = (double*)calloc((size_t)kh, sizeof(double));
+    for (int kx = 0; kx < kw; kx++)
+        row[kx] = kernel->buffer[cy * kw + kx] / center;
+    for (int ky = 0; ky < kh; ky++)
+        col[ky] = kernel->buffer[ky * kw + cx];
+    // horizontal pass: mh x ow
+    double* tmp = (double*)calloc((size_t)mh * (size_t)ow, sizeof(double));
+    for (int my = 0; my < mh; my++) {
+        for (int ox = 0; ox < ow; ox++) {
+            double sum = 0.0;
+            for (int kx = 0; kx < kw; kx++) {
+                int mx = ox + kx - kw + 1;
+                if (mx >= 0 && mx < mw)
+                    sum += row[kx] * matrix->buffer[my * mw + mx];
+            }
+            tmp[my * ow + ox] = sum;
+        }
+    }
+    // vertical pass: oh x ow
+    *out = Matrix_new(ow, oh);
+    for (int oy = 0; oy < oh; oy++) {
+        for (int ky = 0; ky < kh; ky++) {
+            int my = oy + ky - kh + 1;
+            if (my < 0 || my >= mh)
+                continue;
+            const double* src = &tmp[my * ow];
+            double* dst = &(*out)->buffer[oy * ow];
+            for (int ox = 0; ox < ow; ox++)
+                dst[ox] += col[ky] * src[ox];
+        }
+    }
+    free(tmp);
+    free(row);
+    free(col);
+}
+
 void get_cep(const DitherImage* img, int width, int height, int v, Matrix** cpp, Matrix** cep) {
     const int fs = 7;
     double c = 0.0;
@@ -90,98 +143,270 @@ void get_cep(const DitherImage* img, int width, int height, int v, Matrix** cpp,
     conv2d(gf, gf, cpp);
     // initial error and cross-correlation between error and Gaussian
     Matrix* err = Matrix_new(width, height);
+    const uint8_t* alpha = DitherImage_alpha(img, 0);  // NULL for opaque images
     for(int y = 0, i = 0; y < height; y++) {
         for(int x = 0; x < width; x++, i++) {
 
-            if (img->transparency[i] != 0)
-                err->buffer[i] = 0.0 - img->buffer[i];
+            if (alpha == NULL || alpha[i] != 0)
+                err->buffer[i] = 0.0 - DitherImage_value(img, (size_t)i);
             else
                 err->buffer[i] = 0.0;
         }
     }
-    conv2d(err, *cpp, cep);
+    if (v != 3)  // the filter is a single Gaussian, so its auto-correlation is separable
+        conv2d_separable(err, *cpp, cep);
+    else
+        conv2d(err, *cpp, cep);
     Matrix_free(gf);
     Matrix_free(err);
 }
 
+#define DBS_HALF_CPP 6   // the auto-correlation filter cpp is 13x13
+#define DBS_REACH 8      // a toggle or swap can change the best move of pixels up to this far away
+#define DBS_BLOCK 16     // edge length of the blocks used for dirty tracking and parallel tiles (> 2 * 7)
+
+struct DbsState {
+    const DitherImage* img;
+    const Matrix* cpp;
+    Matrix* cep;
+    int8_t* dst;
+    int blocks_x;
+    int blocks_y;
+    volatile int* dirty;       // blocks that have to be visited (again) in the current pass
+    volatile int* dirty_next;  // blocks that have to be visited in the next pass
+};
+typedef struct DbsState DbsState;
+
+static void mark_dirty(DbsState* st, int i, int j) {
+    /* a pixel changed at (j, i): every block within DBS_REACH has to be revisited */
+    int by0 = i - DBS_REACH < 0 ? 0 : (i - DBS_REACH) / DBS_BLOCK;
+    int by1 = i + DBS_REACH >= st->img->height ? st->blocks_y - 1 : (i + DBS_REACH) / DBS_BLOCK;
+    int bx0 = j - DBS_REACH < 0 ? 0 : (j - DBS_REACH) / DBS_BLOCK;
+    int bx1 = j + DBS_REACH >= st->img->width ? st->blocks_x - 1 : (j + DBS_REACH) / DBS_BLOCK;
+    for (int by = by0; by <= by1; by++) {
+        for (int bx = bx0; bx <= bx1; bx++) {
+            atomic_store_int(&st->dirty[by * st->blocks_x + bx], 1);
+            atomic_store_int(&st->dirty_next[by * st->blocks_x + bx], 1);
+        }
+    }
+}
+
+static bool dbs_pixel(DbsState* st, int i, int j) {
+    /* tries toggling pixel (j, i) or swapping it with one of its neighbors and applies the move that reduces the
+     * perceived error the most. Returns true if a move was applied */
+    const DitherImage* img = st->img;
+    const Matrix* cpp = st->cpp;
+    Matrix* cep = st->cep;
+    int8_t* dst = st->dst;
+    const int half_cpp_size = DBS_HALF_CPP;
+    int8_t a0c = 0, a1c = 0, cpx = 0, cpy = 0;
+    double eps_min = 0.0;
+    for(int8_t y = -1; y <= 1; y++) {
+        if(i + y < 0 || i + y >= img->height)
+            continue;
+        for(int8_t x = -1; x <= 1; x++) {
+            int8_t a1 = 0, a0 = 0;
+            double eps = 0.0;
+            if(j + x < 0 || j + x >= img->width)
+                continue;
+            size_t addr = (size_t)(i * img->width + j);
+            if(y == 0 && x == 0) {
+                a1 = 0;
+                a0 = dst[addr] == 1? -1 : 1;
+            } else {
+                if(dst[(i + y) * img->width + (j + x)] != dst[addr]) {
+                    a0 = dst[addr] == 1? -1 : 1;
+                    a1 = (int8_t)-a0;
+                } else {
+                    a0 = 0;
+                    a1 = 0;
+                }
+            }
+            eps = (a0 * a0 + a1 * a1) *
+                    cpp->buffer[half_cpp_size * cpp->width + half_cpp_size] + 2 * a0 * a1 *
+                    cpp->buffer[(half_cpp_size + y) * cpp->width + (half_cpp_size + x)] + 2 * a0 *
+                    cep->buffer[(half_cpp_size + i) * cep->width + (half_cpp_size + j)] + 2 * a1 *
+                    cep->buffer[(half_cpp_size + i + y) * cep->width + (half_cpp_size + j + x)];
+            if(eps_min > eps) {
+                eps_min = eps;
+                a0c = a0;
+                a1c = a1;
+                cpx = x;
+                cpy = y;
+            }
+        }
+    }
+    if(eps_min < 0) {
+        for(int y = -half_cpp_size; y <= half_cpp_size; y++)
+            for(int x = -half_cpp_size; x <= half_cpp_size; x++)
+                cep->buffer[(half_cpp_size + i + y) * cep->width + (half_cpp_size + j + x)] +=
+                        (cpp->buffer[(half_cpp_size + y) * cpp->width + (half_cpp_size + x)] * a0c);
+        for(int y = -half_cpp_size; y <= half_cpp_size; y++)
+            for(int x = -half_cpp_size; x <= half_cpp_size; x++)
+                cep->buffer[(half_cpp_size + i + y + cpy) * cep->width + (half_cpp_size + j + x + cpx)] +=
+                        (cpp->buffer[(half_cpp_size + y) * cpp->width + (half_cpp_size + x)] * a1c);
+        dst[i * img->width + j] = (int8_t)(dst[i * img->width + j] + a0c);
+        dst[(i + cpy) * img->width + (j + cpx)] = (int8_t)(dst[(i + cpy) * img->width + (j + cpx)] + a1c);
+        mark_dirty(st, i, j);
+        return true;
+    }
+    return false;
+}
+
+static double seconds_now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static bool out_of_time(double deadline) {
+    return deadline > 0.0 && seconds_now() >= deadline;
+}
+
+static int dbs_pass(DbsState* st, double deadline) {
+    /* one raster sweep over all pixels, skipping blocks where nothing changed nearby since their last visit. This
+     * visits pixels in the same order as a full sweep, and skipped pixels couldn't have changed, so the result is
+     * the same as sweeping the whole image. Returns the number of applied moves, or -1 if time ran out */
+    const DitherImage* img = st->img;
+    int count = 0;
+    for (int i = 0; i < img->height; i++) {
+        volatile int* dirty_row = &st->dirty[(i / DBS_BLOCK) * st->blocks_x];
+        for (int bx = 0; bx < st->blocks_x; bx++) {
+            if (atomic_load_int(&dirty_row[bx]) == 0)
+                continue;
+            int j_end = (bx + 1) * DBS_BLOCK < img->width ? (bx + 1) * DBS_BLOCK : img->width;
+            for (int j = bx * DBS_BLOCK; j < j_end; j++)
+                if (dbs_pixel(st, i, j))
+                    count++;
+        }
+        if (out_of_time(deadline))
+            return -1;
+    }
+    return count;
+}
+
+struct DbsWorker {
+    /* per-thread state for the block-parallel search */
+    DbsState* st;
+    const int* tiles;   // dirty tiles of the current phase
+    int tile_count;
+    int thread_index;
+    int thread_count;
+    int count;          // number of applied moves
+};
+typedef struct DbsWorker DbsWorker;
+
+static void dbs_worker(void* arg) {
+    /* optimizes every thread_count-th tile of the current phase. Tiles of the same phase are DBS_BLOCK pixels apart,
+     * more than the 2 * 7 pixels two moves need to influence each other, so they can be processed concurrently */
+    DbsWorker* w = (DbsWorker*)arg;
+    DbsState* st = w->st;
+    w->count = 0;
+    for (int t = w->thread_index; t < w->tile_count; t += w->thread_count) {
+        int bx = w->tiles[t] % st->blocks_x;
+        int by = w->tiles[t] / st->blocks_x;
+        int i_end = (by + 1) * DBS_BLOCK < st->img->height ? (by + 1) * DBS_BLOCK : st->img->height;
+        int j_end = (bx + 1) * DBS_BLOCK < st->img->width ? (bx + 1) * DBS_BLOCK : st->img->width;
+        for (int i = by * DBS_BLOCK; i < i_end; i++)
+            for (int j = bx * DBS_BLOCK; j < j_end; j++)
+                if (dbs_pixel(st, i, j))
+                    w->count++;
+    }
+}
+
+static int dbs_pass_parallel(DbsState* st, int thread_count, int* tiles, DbsWorker* workers, double deadline) {
+    /* one sweep in four phases; each phase optimizes every other tile in both directions (a 2x2 checkerboard).
+     * Returns the number of applied moves, or -1 if time ran out */
+    int count = 0;
+    for (int phase = 0; phase < 4; phase++) {
+        int tile_count = 0;
+        for (int by = phase / 2; by < st->blocks_y; by += 2)
+            for (int bx = phase % 2; bx < st->blocks_x; bx += 2)
+                if (atomic_load_int(&st->dirty[by * st->blocks_x + bx]) != 0)
+                    tiles[tile_count++] = by * st->blocks_x + bx;
+        for (int t = 0; t < thread_count; t++) {
+            workers[t].st = st;
+            workers[t].tiles = tiles;
+            workers[t].tile_count = tile_count;
+            workers[t].thread_index = t;
+            workers[t].thread_count = thread_count;
+        }
+        threads_run_independent(thread_count < tile_count ? thread_count : (tile_count > 0 ? tile_count : 1),
+                                dbs_worker, workers, sizeof(DbsWorker));
+        for (int t = 0; t < thread_count && t < (tile_count > 0 ? tile_count : 1); t++)
+            count += workers[t].count;
+        if (out_of_time(deadline))
+            return -1;
+    }
+    return count;
+}
+
 MODULE_API void dbs_dither(const DitherImage* img, int v, uint8_t* out) {
     /*
      * DBS dithering. Ported and adapted from Sankar Srinivasan's DBS ditherer (https://github.com/SankarSrin)
      * parameter v: 0 - 6. choose between 7 functions for matrix generation. The higher the number the coarser the output dither.
      */
+    dbs_dither_parallel(img, v, 1, 0, 0.0, out);
+}
+
+MODULE_API void dbs_dither_parallel(const DitherImage* img, int v, int threads, int max_passes, double max_seconds,
+                                    uint8_t* out) {
+    /* DBS dithering with an optional block-parallel search and a work budget.
+     * threads: 1 searches in the same order as dbs_dither; more threads optimize distant tiles concurrently (the
+     *          result then differs from dbs_dither, but is the same for any thread count > 1). 0 uses one thread per
+     *          CPU core
+     * max_passes: stop after this many sweeps; 0 = until no move improves the result
+     * max_seconds: stop after roughly this much time; 0 = no time limit */
     Matrix* cep = NULL;
     Matrix* cpp = NULL;
-    const int half_cpp_size = 6;
+    double deadline = max_seconds > 0.0 ? seconds_now() + max_seconds : 0.0;
     get_cep(img, img->width, img->height, v, &cpp, &cep);
-    int8_t* dst = (int8_t*)calloc((size_t)(img->width * img->height), sizeof(int8_t));
-    while(1) {
-        int count_b = 0;
-        for(int i = 0; i < img->height; i++) {
-            for(int j = 0; j < img->width; j++) {
-                int8_t a0c = 0, a1c = 0, cpx = 0, cpy = 0;
-                double eps_min = 0.0;
-                for(int8_t y = -1; y <= 1; y++) {
-                    if(i + y < 0 || i + y >= img->height)
-                        continue;
-                    for(int8_t x = -1; x <= 1; x++) {
-                        int8_t a1 = 0, a0 = 0;
-                        double eps = 0.0;
-                        if(j + x < 0 || j + x >= img->width)
-                            continue;
-                        size_t addr = (size_t)(i * img->width + j);
-                        if(y == 0 && x == 0) {
-                            a1 = 0;
-                            a0 = dst[addr] == 1? -1 : 1;
-                        } else {
-                            if(dst[(i + y) * img->width + (j + x)] != dst[addr]) {
-                                a0 = dst[addr] == 1? -1 : 1;
-                                a1 = (int8_t)-a0;
-                            } else {
-                                a0 = 0;
-                                a1 = 0;
-                            }
-                        }
-                        eps = (a0 * a0 + a1 * a1) *
-                                cpp->buffer[half_cpp_size * cpp->width + half_cpp_size] + 2 * a0 * a1 *
-                                cpp->buffer[(half_cpp_size + y) * cpp->width + (half_cpp_size + x)] + 2 * a0 *
-                                cep->buffer[(half_cpp_size + i) * cep->width + (half_cpp_size + j)] + 2 * a1 *
-                                cep->buffer[(half_cpp_size + i + y) * cep->width + (half_cpp_size + j + x)];
-                        if(eps_min > eps) {
-                            eps_min = eps;
-                            a0c = a0;
-                            a1c = a1;
-                            cpx = x;
-                            cpy = y;
-                        }
-                    }
-                }
-                if(eps_min < 0) {
-                    for(int y = -half_cpp_size; y <= half_cpp_size; y++)
-                        for(int x = -half_cpp_size; x <= half_cpp_size; x++)
-                            cep->buffer[(half_cpp_size + i + y) * cep->width + (half_cpp_size + j + x)] +=
-                                    (cpp->buffer[(half_cpp_size + y) * cpp->width + (half_cpp_size + x)] * a0c);
-                    for(int y = -half_cpp_size; y <= half_cpp_size; y++)
-                        for(int x = -half_cpp_size; x <= half_cpp_size; x++)
-                            cep->buffer[(half_cpp_size + i + y + cpy) * cep->width + (half_cpp_size + j + x + cpx)] +=
-                                    (cpp->buffer[(half_cpp_size + y) * cpp->width + (half_cpp_size + x)] * a1c);
-                    dst[i * img->width + j] = (int8_t)(dst[i * img->width + j] + a0c);
-                    dst[(i + cpy) * img->width + (j + cpx)] = (int8_t)(dst[(i + cpy) * img->width + (j + cpx)] + a1c);
-                    count_b++;
-                }
-            }
+    DbsState st;
+    st.img = img;
+    st.cpp = cpp;
+    st.cep = cep;
+    st.dst = (int8_t*)calloc((size_t)(img->width * img->height), sizeof(int8_t));
+    st.blocks_x = (img->width + DBS_BLOCK - 1) / DBS_BLOCK;
+    st.blocks_y = (img->height + DBS_BLOCK - 1) / DBS_BLOCK;
+    size_t block_count = (size_t)st.blocks_x * (size_t)st.blocks_y;
+    st.dirty = (volatile int*)calloc(block_count, sizeof(int));
+    st.dirty_next = (volatile int*)calloc(block_count, sizeof(int));
+    for (size_t b = 0; b < block_count; b++)
+        st.dirty_next[b] = 1;
+    int thread_count = thread_count_resolve(threads);
+    int* tiles = NULL;
+    DbsWorker* workers = NULL;
+    if (thread_count > 1) {
+        tiles = (int*)calloc(block_count, sizeof(int));
+        workers = (DbsWorker*)calloc((size_t)thread_count, sizeof(DbsWorker));
+    }
+    for (int pass = 0; max_passes <= 0 || pass < max_passes; pass++) {
+        for (size_t b = 0; b < block_count; b++) {
+            st.dirty[b] = st.dirty_next[b];
+            st.dirty_next[b] = 0;
         }
-        if(count_b == 0)
+        int count_b;
+        if (thread_count > 1)
+            count_b = dbs_pass_parallel(&st, thread_count, tiles, workers, deadline);
+        else
+            count_b = dbs_pass(&st, deadline);
+        if(count_b <= 0)
             break;
     }
+    const uint8_t* alpha = DitherImage_alpha(img, 0);  // NULL for opaque images
     for(size_t i = 0; i < (size_t)(img->width * img->height); i++) {
-        if (dst[i] == 1) {
+        if (st.dst[i] == 1) {
             out[i] = 255;
         } else {
-            out[i] = img->transparency[i] != 0 ? 0 : 128;
+            out[i] = alpha == NULL || alpha[i] != 0 ? 0 : 128;
         }
     }
 
-    free(dst);
+    free(tiles);
+    free(workers);
+    free((void*)st.dirty);
+    free((void*)st.dirty_next);
+    free(st.dst);
     Matrix_free(cpp);
     Matrix_free(cep);
 }
@@ -2,22 +2,37 @@
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 #include "libdither.h"
 #include "dither_dotdiff_data.h"
-#include "uthash/uthash.h"
+#include "threading.h"
 
-struct Point {
-    int x;
+#define DOT_NEIGHBORS 9  // the diffusion matrix covers a pixel's 3x3 neighborhood
+
+struct DotClass {
+    /* precomputed traversal data of one class number */
+    bool valid;                         // the class number occurs in the class matrix
+    int x;                              // position within the class matrix block
     int y;
+    int neighbors;                      // number of neighbors with a higher class number, which receive the error
+    int total_weight;                   // sum of their weights
+    int nx[DOT_NEIGHBORS];              // their positions within the block
+    int ny[DOT_NEIGHBORS];
+    double weight[DOT_NEIGHBORS];
 };
-typedef struct Point Point;
+typedef struct DotClass DotClass;
 
-struct DotDitherHashEntry {
-    int key;                   /* key */
-    Point point;
-    UT_hash_handle hh;         /* makes this structure hashable */
+struct DotWorker {
+    /* per-thread state: dithers the blocks first_block to last_block - 1 */
+    const DitherImage* img;
+    const DotClass* classes;
+    int blocksize;
+    int blocks_x;                       // blocks per row
+    size_t first_block;
+    size_t last_block;
+    uint8_t* out;
 };
-typedef struct DotDitherHashEntry DotDitherHashEntry;
+typedef struct DotWorker DotWorker;
 
 MODULE_API DotDiffusionMatrix* get_default_diffusion_matrix(void) { return DotDiffusionMatrix_new(3, 3, default_diffusion_matrix); }
 MODULE_API DotDiffusionMatrix* get_guoliu8_diffusion_matrix(void) { return DotDiffusionMatrix_new(3, 3, guoliu8_diffusion_matrix); }
@@ -68,97 +83,118 @@ MODULE_API void DotDiffusionMatrix_free(DotDiffusionMatrix* self) {
     }
 }
 
-MODULE_API void dot_diffusion_dither(const DitherImage* img, const DotDiffusionMatrix* dmatrix, const DotClassMatrix* cmatrix, uint8_t* out) {
-    /* Knuth's dot dither algorithm */
+static DotClass* dot_classes(const DotDiffusionMatrix* dmatrix, const DotClassMatrix* cmatrix) {
+    /* builds a table from class number to its position in the block and the neighbors its error is diffused to */
     int blocksize = cmatrix->width;
-
-    DotDitherHashEntry* lut = NULL;
-    DotDitherHashEntry* hash_item = NULL;
-    DotDitherHashEntry* tmp;
-
+    size_t count = (size_t)(blocksize * blocksize);
+    DotClass* classes = (DotClass*)calloc(count, sizeof(DotClass));
     for(int y = 0; y < blocksize; y++) {
         for (int x = 0; x < blocksize; x++) {
-            hash_item = malloc(sizeof *hash_item);
-            hash_item->key = cmatrix->buffer[y * blocksize + x];
-            hash_item->point.x = x;
-            hash_item->point.y = y;
-            HASH_ADD(hh, lut, key, sizeof(int), hash_item);
+            int point_no = cmatrix->buffer[y * blocksize + x];
+            if (point_no >= 0 && (size_t)point_no < count) {
+                classes[point_no].valid = true;
+                classes[point_no].x = x;
+                classes[point_no].y = y;
+            }
         }
     }
+    for (int current_point_no = 0; current_point_no < (int)count; current_point_no++) {
+        DotClass* c = &classes[current_point_no];
+        for (int dmy = 0; dmy < 3; dmy++) {
+            for (int dmx = 0; dmx < 3; dmx++) {
+                int cmy = dmy + c->y - 1;
+                int cmx = dmx + c->x - 1;
+                if (-1 < cmx && cmx < blocksize && -1 < cmy && cmy < blocksize) {
+                    int point_no = cmatrix->buffer[cmy * blocksize + cmx];
+                    if (point_no > current_point_no) {
+                        int sub_weight = (int) (dmatrix->buffer[dmy * dmatrix->width + dmx]);
+                        c->total_weight += sub_weight;
+                        c->nx[c->neighbors] = cmx;
+                        c->ny[c->neighbors] = cmy;
+                        c->weight[c->neighbors] = (double) sub_weight;
+                        c->neighbors++;
+                    }
+                }
+            }
+        }
+    }
+    return classes;
+}
 
-    double* orig_img = (double*)calloc((size_t)(img->width * img->height), sizeof(double));
-    memcpy(orig_img, img->buffer, (size_t)img->width * (size_t)img->height * sizeof(double));
-
-    int pixel_no[9];
-    double pixel_weight[9];
-    int yyend = (int)ceil((double)img->height / (double)blocksize);
-    for(int yy = 0; yy < yyend; yy++) {
-        int ofs_y = yy * blocksize;
-        int xxend = (int)ceil((double)img->width / (double)blocksize);
-        for(int xx = 0; xx < xxend; xx++) {
-            int ofs_x = xx * blocksize;
-            for(int current_point_no = 0; current_point_no < blocksize * blocksize; current_point_no++) {
-                HASH_FIND(hh, lut, &current_point_no, sizeof(int), hash_item);
-                Point* cm = &hash_item->point;
-                int imgx = cm->x + ofs_x;
-                int imgy = cm->y + ofs_y;
-                if (imgx < 0 || imgx >= img->width || imgy < 0 || imgy >= img->height) {
-                    continue;
+static void dot_diffusion_worker(void* arg) {
+    /* errors are only diffused within a block, so each block is dithered on its own in a small working buffer */
+    DotWorker* w = (DotWorker*)arg;
+    const DitherImage* img = w->img;
+    int blocksize = w->blocksize;
+    int count = blocksize * blocksize;
+    double* block = (double*)calloc((size_t)count, sizeof(double));
+    const uint8_t* alpha = DitherImage_alpha(img, 0);  // NULL for opaque images
+    for (size_t b = w->first_block; b < w->last_block; b++) {
+        int ofs_x = (int)(b % (size_t)w->blocks_x) * blocksize;
+        int ofs_y = (int)(b / (size_t)w->blocks_x) * blocksize;
+        for (int y = 0; y < blocksize; y++) {
+            for (int x = 0; x < blocksize; x++) {
+                if (x + ofs_x < img->width && y + ofs_y < img->height)
+                    block[y * blocksize + x] = DitherImage_value(img, (size_t)((y + ofs_y) * img->width + x + ofs_x));
+            }
+        }
+        for (int current_point_no = 0; current_point_no < count; current_point_no++) {
+            const DotClass* c = &w->classes[current_point_no];
+            int imgx = c->x + ofs_x;
+            int imgy = c->y + ofs_y;
+            if (!c->valid || imgx >= img->width || imgy >= img->height)
+                continue;
+            size_t addr = (size_t)(imgy * img->width + imgx);
+            if (alpha != NULL && alpha[addr] == 0) {
+                w->out[addr] = 0x80;
+            } else {
+                double err = block[c->y * blocksize + c->x];
+                if (err >= 0.5) {
+                    w->out[addr] = 0xff;
+                    err -= 1.0;
                 }
-                size_t addr = (size_t)(imgy * img->width + imgx);
-                if (img->transparency[addr] == 0) {
-                    out[addr] = 0x80;
-                } else {
-                    if (cm->y + ofs_y >= img->height || cm->x + ofs_x >= img->width)
-                        continue;
-                    double err = orig_img[addr];
-                    if (err >= 0.5) {
-                        out[addr] = 0xff;
-                        err -= 1.0;
-                    }
-                    size_t j = 0;
-                    int x = cm->x - 1;
-                    int y = cm->y - 1;
-                    int total_err_weight = 0;
-                    for (int dmy = 0; dmy < 3; dmy++) {
-                        for (int dmx = 0; dmx < 3; dmx++) {
-                            int cmy = dmy + y;
-                            int cmx = dmx + x;
-                            if (-1 < cmx && cmx < blocksize && -1 < cmy && cmy < blocksize) {
-                                int point_no = cmatrix->buffer[cmy * blocksize + cmx];
-                                if (point_no > current_point_no) {
-                                    int sub_weight = (int) (dmatrix->buffer[dmy * dmatrix->width + dmx]);
-                                    total_err_weight += sub_weight;
-                                    pixel_no[j] = point_no;
-                                    pixel_weight[j] = (double) sub_weight;
-                                    j++;
-                                }
-                            }
-                        }
-                    }
-                    if (total_err_weight > 0) {
-                        err /= (double) total_err_weight;
-                        for (size_t i = 0; i < j; i++) {
-                            int point_no = pixel_no[i];
-                            double sub_weight = pixel_weight[i];
-                            HASH_FIND(hh, lut, &point_no, sizeof(int), hash_item);
-                            if (hash_item != NULL) {
-                                Point *c = &hash_item->point;
-                                int cx = c->x + ofs_x;
-                                int cy = c->y + ofs_y;
-                                if (cx < img->width && cy < img->height) {
-                                    orig_img[cy * img->width + cx] += (err * sub_weight);
-                                }
-                            }
-                        }
+                if (c->total_weight > 0) {
+                    err /= (double) c->total_weight;
+                    for (int i = 0; i < c->neighbors; i++) {
+                        if (c->nx[i] + ofs_x < img->width && c->ny[i] + ofs_y < img->height)
+                            block[c->ny[i] * blocksize + c->nx[i]] += (err * c->weight[i]);
                     }
                 }
             }
         }
     }
-    // free hash
-    HASH_ITER(hh, lut, hash_item, tmp) {
-        HASH_DELETE(hh, lut, hash_item);  /* delete; advances to next */
-        free(hash_item);
+    free(block);
+}
+
+MODULE_API void dot_diffusion_dither_parallel(const DitherImage* img, const DotDiffusionMatrix* dmatrix, const DotClassMatrix* cmatrix, int threads, uint8_t* out) {
+    /* Knuth's dot dither algorithm.
+     * The image is split into blocks the size of the class matrix; within a block the pixels are processed in the
+     * order of their class numbers. The blocks are independent of each other and are dithered in parallel.
+     * threads: number of worker threads; 0 uses one thread per CPU core */
+    int blocksize = cmatrix->width;
+    DotClass* classes = dot_classes(dmatrix, cmatrix);
+    int blocks_x = (img->width + blocksize - 1) / blocksize;
+    int blocks_y = (img->height + blocksize - 1) / blocksize;
+    size_t blocks = (size_t)blocks_x * (size_t)blocks_y;
+    threads = thread_count_resolve(threads);
+    if ((size_t)threads > blocks)
+        threads = blocks > 0 ? (int)blocks : 1;
+    DotWorker* workers = (DotWorker*)calloc((size_t)threads, sizeof(DotWorker));
+    for (int t = 0; t < threads; t++) {
+        workers[t].img = img;
+        workers[t].classes = classes;
+        workers[t].blocksize = blocksize;
+        workers[t].blocks_x = blocks_x;
+        workers[t].first_block = blocks * (size_t)t / (size_t)threads;
+        workers[t].last_block = blocks * (size_t)(t + 1) / (size_t)threads;
+        workers[t].out = out;
     }
+    threads_run_independent(threads, dot_diffusion_worker, workers, sizeof(DotWorker));
+    free(workers);
+    free(classes);
+}
+
+MODULE_API void dot_diffusion_dither(const DitherImage* img, const DotDiffusionMatrix* dmatrix, const DotClassMatrix* cmatrix, uint8_t* out) {
+    /* Knuth's dot dither algorithm */
+    dot_diffusion_dither_parallel(img, dmatrix, cmatrix, 1, out);
 }
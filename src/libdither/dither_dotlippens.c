@@ -1,7 +1,9 @@
 #define MODULE_API_EXPORTS
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 #include "libdither.h"
+#include "threading.h"
 #include "dither_dotlippens_data.h"
 
 MODULE_API int* create_dot_lippens_cm(void) {
@@ -46,58 +48,214 @@ MODULE_API DotLippensCoefficients* get_dotlippens_coefficients1(void) { return D
 MODULE_API DotLippensCoefficients* get_dotlippens_coefficients2(void) { return DotLippensCoefficients_new(5, 5, dotlippens2_coe); }
 MODULE_API DotLippensCoefficients* get_dotlippens_coefficients3(void) { return DotLippensCoefficients_new(5, 5, dotlippens3_coe); }
 
-MODULE_API void dotlippens_dither(const DitherImage* img, const DotClassMatrix* class_matrix, const DotLippensCoefficients* coefficients, uint8_t* out) {
+#define LIPPENS_CLASSES 256  // class values 0 - 255 are processed, in increasing order
+
+struct LippensState {
+    /* everything shared by the threads of one dotlippens_dither_parallel call */
+    const DitherImage* img;
+    const uint8_t* alpha;       // transparency of each pixel, NULL for opaque images
+    const DotLippensCoefficients* coefficients;
+    double coefficients_sum;
+    int half_size;
+    int* image_cm;              // class of each pixel
+    double* image;              // working copy of the image
+    uint8_t* out;
+    size_t* order;              // pixel addresses grouped by class (counting sort), in raster order within a class
+    size_t class_start[LIPPENS_CLASSES + 1];  // class n occupies order[class_start[n]] to order[class_start[n + 1] - 1]
+    // parallel mode only
+    size_t* scratch;            // buffer for reordering the classes by round
+    int* level;                 // per pixel: processing round within its class
+    size_t* round_start;        // per class: max_rounds + 1 offsets into order where each round begins
+    int* rounds;                // per class: number of rounds
+    int max_rounds;
+    int threads;
+    ThreadBarrier barrier;
+};
+typedef struct LippensState LippensState;
+
+struct LippensWorker {
+    LippensState* state;
+    int index;
+};
+typedef struct LippensWorker LippensWorker;
+
+static void lippens_pixel(const LippensState* st, size_t addr) {
+    /* dithers one pixel and diffuses its error to its neighborhood */
+    const DitherImage* img = st->img;
+    const DotLippensCoefficients* coefficients = st->coefficients;
+    int half_size = st->half_size;
+    int x = (int)(addr % (size_t)img->width);
+    int y = (int)(addr / (size_t)img->width);
+    if (st->alpha == NULL || st->alpha[addr] != 0) {
+        double err = st->image[addr];
+        if (err > 0.5) {
+            err -= 1.0;
+            st->out[addr] = 0xff;
+        }
+        for (int cmy = -half_size; cmy <= half_size; cmy++) {
+            for (int cmx = -half_size; cmx <= half_size; cmx++) {
+                int imy = y + cmy;
+                int imx = x + cmx;
+                size_t naddr = (size_t)(imy * img->width + imx);
+                if (imy >= 0 && imy < img->height && imx >= 0 && imx < img->width)
+                    if (st->image_cm[naddr] > cmx)
+                        st->image[naddr] += err * (double) coefficients->buffer[
+                                (cmy + half_size) * coefficients->width + (cmx + half_size)] /
+                                           st->coefficients_sum;
+            }
+        }
+    } else
+        st->out[addr] = 128;
+}
+
+static void lippens_rounds(LippensState* st, int n) {
+    /* splits class n into rounds: a pixel goes one round after the latest earlier pixel (in raster order) of the same
+     * class whose neighborhood overlaps its own. Pixels of one round don't interact, and interacting pixels are
+     * processed in raster order, so the result is the same as processing the class sequentially */
+    const DitherImage* img = st->img;
+    int reach = st->half_size * 2;
+    size_t start = st->class_start[n];
+    size_t end = st->class_start[n + 1];
+    size_t* offsets = &st->round_start[(size_t)n * (size_t)(st->max_rounds + 1)];
+    int rounds = 0;
+    for (size_t i = start; i < end; i++) {
+        size_t addr = st->order[i];
+        int x = (int)(addr % (size_t)img->width);
+        int y = (int)(addr / (size_t)img->width);
+        int level = 0;
+        for (int yy = y - reach; yy <= y; yy++) {
+            if (yy < 0)
+                continue;
+            int x_end = yy < y ? x + reach : x - 1;  // earlier pixels only
+            for (int xx = x - reach; xx <= x_end; xx++) {
+                if (xx < 0 || xx >= img->width)
+                    continue;
+                size_t naddr = (size_t)(yy * img->width + xx);
+                if (st->image_cm[naddr] == n && st->level[naddr] >= level)
+                    level = st->level[naddr] + 1;
+            }
+        }
+        st->level[addr] = level;
+        offsets[level + 1]++;
+        if (level + 1 > rounds)
+            rounds = level + 1;
+    }
+    // stable counting sort of the class by round
+    offsets[0] = start;
+    for (int l = 1; l <= rounds; l++)
+        offsets[l] += offsets[l - 1];
+    for (size_t i = start; i < end; i++)
+        st->scratch[offsets[st->level[st->order[i]]]++] = st->order[i];
+    memcpy(&st->order[start], &st->scratch[start], (end - start) * sizeof(size_t));
+    for (int l = rounds; l > 0; l--)
+        offsets[l] = offsets[l - 1];
+    offsets[0] = start;
+    st->rounds[n] = rounds;
+}
+
+static void lippens_worker(void* arg) {
+    /* the threads first split the classes into rounds, then dither all classes in order, a round at a time */
+    LippensWorker* w = (LippensWorker*)arg;
+    LippensState* st = w->state;
+    for (int n = w->index; n < LIPPENS_CLASSES; n += st->threads)
+        lippens_rounds(st, n);
+    thread_barrier_wait(&st->barrier);
+    for (int n = 0; n < LIPPENS_CLASSES; n++) {
+        const size_t* offsets = &st->round_start[(size_t)n * (size_t)(st->max_rounds + 1)];
+        for (int l = 0; l < st->rounds[n]; l++) {
+            size_t count = offsets[l + 1] - offsets[l];
+            size_t start = offsets[l] + count * (size_t)w->index / (size_t)st->threads;
+            size_t end = offsets[l] + count * (size_t)(w->index + 1) / (size_t)st->threads;
+            for (size_t i = start; i < end; i++)
+                lippens_pixel(st, st->order[i]);
+            thread_barrier_wait(&st->barrier);
+        }
+    }
+}
+
+MODULE_API void dotlippens_dither_parallel(const DitherImage* img, const DotClassMatrix* class_matrix,
+                                           const DotLippensCoefficients* coefficients, int threads, uint8_t* out) {
     /* Lippens and Philips Dot Dithering
      * class_matix: same class matrix as used by regular (Knuth's) dot ditherer
-     * coefficients: Lippens and Philips coefficients */
+     * coefficients: Lippens and Philips coefficients
+     * threads: number of worker threads; 0 uses one thread per CPU core.
+     * The pixels are sorted by class once (counting sort) and each class is processed in raster order. With more
+     * than one thread, each class is split into rounds of pixels with non-overlapping neighborhoods, which are
+     * processed in parallel; the output is identical for any number of threads */
+    LippensState st;
+    memset(&st, 0, sizeof(LippensState));
+    st.img = img;
+    st.alpha = DitherImage_alpha(img, 0);
+    st.coefficients = coefficients;
+    st.out = out;
     double coefficients_sum = 0.0;
     for(int i = 0; i < coefficients->width * coefficients->height; i++)
         coefficients_sum += (double)coefficients->buffer[i];
-    coefficients_sum /= 2.0;
+    st.coefficients_sum = coefficients_sum / 2.0;
+    st.half_size = (int)(((float)coefficients->width - 1.0) / 2.0);
 
     size_t image_size = (size_t)(img->width * img->height);
-    int* image_cm = (int*)calloc(image_size, sizeof(int));
-    double* image = (double*)calloc(image_size, sizeof(double));
-
+    st.image_cm = (int*)calloc(image_size, sizeof(int));
+    st.image = (double*)calloc(image_size, sizeof(double));
+    st.order = (size_t*)calloc(image_size > 0 ? image_size : 1, sizeof(size_t));
+    size_t counts[LIPPENS_CLASSES] = {0};
     for(int y = 0; y < img->height; y++) {
         for(int x = 0; x < img->width; x++) {
             size_t addr = (size_t)(y * img->width + x);
-            image_cm[addr] = class_matrix->buffer[(y % class_matrix->height) * class_matrix->width + (x % class_matrix->width)];
-            image[addr] = img->buffer[addr];  // make a copy of the image as we can't modify the original
+            int n = class_matrix->buffer[(y % class_matrix->height) * class_matrix->width + (x % class_matrix->width)];
+            st.image_cm[addr] = n;
+            st.image[addr] = DitherImage_value(img, addr);  // make a copy of the image as we can't modify the original
+            if (n >= 0 && n < LIPPENS_CLASSES)  // other class values are never processed
+                counts[n]++;
         }
     }
-    int half_size = (int)(((float)coefficients->width - 1.0) / 2.0);
-    int n = 0;
-    while(n != 256) {
-        for(int y = 0; y < img->height; y++) {
-            for (int x = 0; x < img->width; x++) {
-                size_t addr = (size_t)(y * img->width + x);
-                if(image_cm[addr] == n) {
-                    if (img->transparency[addr] != 0) {
-                        double err = image[addr];
-                        if (err > 0.5) {
-                            err -= 1.0;
-                            out[addr] = 0xff;
-                        }
-                        for (int cmy = -half_size; cmy <= half_size; cmy++) {
-                            for (int cmx = -half_size; cmx <= half_size; cmx++) {
-                                int imy = y + cmy;
-                                int imx = x + cmx;
-                                addr = (size_t)(imy * img->width + imx);
-                                if (imy >= 0 && imy < img->height && imx >= 0 && imx < img->width)
-                                    if (image_cm[addr] > cmx)
-                                        image[addr] += err * (double) coefficients->buffer[
-                                                (cmy + half_size) * coefficients->width + (cmx + half_size)] /
-                                                       coefficients_sum;
-                            }
-                        }
-                    } else
-                        out[addr] = 128;
-                }
-            }
+    // counting sort of the pixels by class
+    st.class_start[0] = 0;
+    for (int n = 0; n < LIPPENS_CLASSES; n++)
+        st.class_start[n + 1] = st.class_start[n] + counts[n];
+    memcpy(counts, st.class_start, sizeof(counts));
+    for (size_t addr = 0; addr < image_size; addr++) {
+        int n = st.image_cm[addr];
+        if (n >= 0 && n < LIPPENS_CLASSES)
+            st.order[counts[n]++] = addr;
+    }
+
+    threads = thread_count_resolve(threads);
+    bool done = false;
+    if (threads > 1) {
+        int reach = st.half_size * 2;
+        st.max_rounds = reach * (2 * reach + 1) + reach + 1;  // one more than the number of earlier neighbors
+        st.threads = threads;
+        st.scratch = (size_t*)calloc(image_size > 0 ? image_size : 1, sizeof(size_t));
+        st.level = (int*)calloc(image_size > 0 ? image_size : 1, sizeof(int));
+        st.round_start = (size_t*)calloc((size_t)LIPPENS_CLASSES * (size_t)(st.max_rounds + 1), sizeof(size_t));
+        st.rounds = (int*)calloc(LIPPENS_CLASSES, sizeof(int));
+        thread_barrier_init(&st.barrier, threads);
+        LippensWorker* workers = (LippensWorker*)calloc((size_t)threads, sizeof(LippensWorker));
+        for (int t = 0; t < threads; t++) {
+            workers[t].state = &st;
+            workers[t].index = t;
         }
-        n++;
+        // the barrier needs all threads running at the same time; threads_run reports if they couldn't be started
+        done = threads_run(threads, lippens_worker, workers, sizeof(LippensWorker));
+        free(workers);
+        free(st.scratch);
+        free(st.level);
+        free(st.round_start);
+        free(st.rounds);
     }
-    free(image_cm);
-    free(image);
+    if (!done) {  // single thread: the classes in order, each in raster order
+        for (size_t i = 0; i < st.class_start[LIPPENS_CLASSES]; i++)
+            lippens_pixel(&st, st.order[i]);
+    }
+    free(st.order);
+    free(st.image_cm);
+    free(st.image);
+}
+
+MODULE_API void dotlippens_dither(const DitherImage* img, const DotClassMatrix* class_matrix, const DotLippensCoefficients* coefficients, uint8_t* out) {
+    /* Lippens and Philips Dot Dithering
+     * class_matix: same class matrix as used by regular (Knuth's) dot ditherer
+     * coefficients: Lippens and Philips coefficients */
+    dotlippens_dither_parallel(img, class_matrix, coefficients, 1, out);
 }
@@ -9,6 +9,7 @@
 #include "color_floatpalette.h"
 #include "color_models.h"
 #include "random.h"
+#include "threading.h"
 #include "dither_errordiff_data.h"
 
 /* ***** BUILT-IN DIFFUSION MATRICES ***** */
@@ -56,24 +57,16 @@ MODULE_API void ErrorDiffusionMatrix_free(ErrorDiffusionMatrix* self) {
 
 /* ***** ERROR DIFFUSION DITHER FUNCTION ***** */
 
-MODULE_API void error_diffusion_dither(const DitherImage* img,
-                                       const ErrorDiffusionMatrix* m,
-                                       bool serpentine,
-                                       double sigma,
-                                       uint8_t* out) {
-    /* Error Diffusion dithering
-     * img: source image to be dithered
-     * serpentine:
-     * sigma: jitter
-     * setPixel: callback function to set a pixel
-     */
-    // prepare the matrix...
+static int prepare_matrix(const ErrorDiffusionMatrix* m, double** weights, int** offset_x, int** offset_y) {
+    /* flattens the diffusion matrix into lists of weights and x/y offsets relative to the current pixel.
+     * The second half of weights and offset_x holds the mirrored matrix for right-to-left (serpentine) rows.
+     * Returns the number of entries in the (non-mirrored) matrix. */
     int i = 0;
     int j = 0;
+    int matrix_length = 0;
     double *m_weights = NULL;
     int *m_offset_x = NULL;
     int *m_offset_y = NULL;
-    int matrix_length = 0;
     for(int y = 0; y < m->height; y++) {
         for(int x = 0; x < m->width; x++) {
             int value = m->buffer[y * m->width + x];
@@ -94,31 +87,64 @@ MODULE_API void error_diffusion_dither(const DitherImage* img,
             }
         }
     }
+    *weights = m_weights;
+    *offset_x = m_offset_x;
+    *offset_y = m_offset_y;
+    return matrix_length;
+}
+
+static void row_thresholds(double* thresholds, int width, double sigma, uint64_t noise_key, int y) {
+    /* jittered thresholds for row y (sigma > 0). Every row has its own generator, so the serial, multithreaded and
+     * streaming ditherers produce the same output for the same seed */
+    DitherRandom row_rng;
+    random_init_row(&row_rng, noise_key, y);
+    random_fill_normal(&row_rng, thresholds, (size_t)width, sigma, 0.5);
+}
+
+MODULE_API void error_diffusion_dither(const DitherImage* img,
+                                       const ErrorDiffusionMatrix* m,
+                                       bool serpentine,
+                                       double sigma,
+                                       uint8_t* out) {
+    error_diffusion_dither_rng(img, m, serpentine, sigma, NULL, out);
+}
+
+static void error_diffusion_double(double* buffer, const uint8_t* transparency, int width, int height,
+                                   const ErrorDiffusionMatrix* m, bool serpentine, double sigma, uint64_t noise_key,
+                                   uint8_t* out) {
+    /* double precision error diffusion of a working buffer of linear values (0.0 - 1.0), which receives the errors.
+     * transparency: alpha values, or NULL for an opaque image */
+    double* thresholds = sigma > 0.0 ? (double*)calloc((size_t)width, sizeof(double)) : NULL;
+    // prepare the matrix...
+    double *m_weights = NULL;
+    int *m_offset_x = NULL;
+    int *m_offset_y = NULL;
+    int matrix_length = prepare_matrix(m, &m_weights, &m_offset_x, &m_offset_y);
     // do the error diffusion...
-    double* buffer = calloc((size_t)(img->width * img->height), sizeof(double));
-    memcpy(buffer,img->buffer, (size_t)(img->width * img->height) * sizeof(double));
     int direction = 0; // FORWARD
     int direction_toggle = 1;
     if(serpentine) direction_toggle = 2;
 
     double threshold = 0.5;
-    for(int y = 0; y < img->height; y++) {
+    for(int y = 0; y < height; y++) {
+        if (sigma > 0.0)
+            row_thresholds(thresholds, width, sigma, noise_key, y);
         int start, end, step;
         if(direction == 0) {
             start = 0;
-            end = img->width;
+            end = width;
             step = 1;
         } else {
-            start = img->width - 1;
+            start = width - 1;
             end = -1;
             step = -1;
         }
         for (int x = start; x != end; x += step) {
-            size_t addr = (size_t)(y * img->width + x);
-            if (img->transparency[addr] != 0) { // dither all not fully transparent pixels
+            size_t addr = (size_t)(y * width + x);
+            if (transparency == NULL || transparency[addr] != 0) { // dither all not fully transparent pixels
                 double err = buffer[addr];
                 if (sigma > 0.0)
-                    threshold = box_muller(sigma, 0.5);
+                    threshold = thresholds[x];
                 if (err > threshold) {
                     out[addr] = 0xff;
                     err -= 1.0;
@@ -126,10 +152,10 @@ MODULE_API void error_diffusion_dither(const DitherImage* img,
                 err /= m->divisor;
                 for (int g = 0; g < matrix_length; g++) {
                     int xx = x + m_offset_x[g + matrix_length * direction];
-                    if (-1 < xx && xx < img->width) {
+                    if (-1 < xx && xx < width) {
                         int yy = y + m_offset_y[g];
-                        if (yy < img->height) {
-                            buffer[yy * img->width + xx] += err * m_weights[g + matrix_length * direction];
+                        if (yy < height) {
+                            buffer[yy * width + xx] += err * m_weights[g + matrix_length * direction];
                         }
                     }
                 }
@@ -139,66 +165,234 @@ MODULE_API void error_diffusion_dither(const DitherImage* img,
         }
         direction = (y + 1) % direction_toggle;
     }
-    free(buffer);
+    free(thresholds);
     free(m_weights);
     free(m_offset_x);
     free(m_offset_y);
 }
 
-MODULE_API void error_diffusion_dither_color(const ColorImage* img, const ErrorDiffusionMatrix* m,
-                                             CachedPalette* lookup_pal, bool serpentine, int* out) {
+MODULE_API void error_diffusion_dither_rng(const DitherImage* img,
+                                           const ErrorDiffusionMatrix* m,
+                                           bool serpentine,
+                                           double sigma,
+                                           DitherRandom* rng,
+                                           uint8_t* out) {
+    /* Error Diffusion dithering
+     * img: source image to be dithered
+     * serpentine:
+     * sigma: jitter
+     * rng: random number generator for the jitter; NULL seeds one from the current time
+     */
+    DitherRandom time_rng;
+    uint64_t noise_key = random_next(random_or_time_seeded(rng, &time_rng));
+    double* buffer = calloc((size_t)(img->width * img->height), sizeof(double));
+    DitherImage_copy_buffer(img, buffer);
+    error_diffusion_double(buffer, DitherImage_alpha(img, 0), img->width, img->height, m, serpentine, sigma, noise_key, out);
+    free(buffer);
+}
+
+/* ***** MULTITHREADED (WAVEFRONT) ERROR DIFFUSION ***** */
+
+struct ErrorDiffusionWorker {
+    /* per-thread state for error_diffusion_dither_parallel */
+    const DitherImage* img;
+    const ErrorDiffusionMatrix* m;
+    const double* m_weights;
+    const int* m_offset_x;
+    const int* m_offset_y;
+    int matrix_length;
+    int reach;               // how many columns a row must be ahead of the row below it
+    int rows_above;          // how many rows above can still diffuse error into the current row
+    double* buffer;          // shared error buffer
+    volatile int* progress;  // number of pixels each row has finished
+    bool serpentine;
+    double sigma;
+    uint64_t noise_key;
+    int thread_index;
+    int thread_count;
+    uint8_t* out;
+};
+typedef struct ErrorDiffusionWorker ErrorDiffusionWorker;
+
+static void wait_for_rows_above(const ErrorDiffusionWorker* w, int y, int x, int* known) {
+    /* blocks until every row that can touch the same pixels as pixel (x, y) is done with them. Each row above must
+     * have passed all columns within 'reach' of x, which also guarantees that errors get added to each pixel in
+     * exactly the same order as in the single-threaded ditherer */
+    int width = w->img->width;
+    for (int k = 1; k <= w->rows_above && k <= y; k++) {
+        int row = y - k;
+        int needed;
+        if (!w->serpentine || row % 2 == 0)
+            needed = x + w->reach + 1;          // row above goes left-to-right
+        else
+            needed = width - x + w->reach;      // row above goes right-to-left
+        if (needed > width)
+            needed = width;
+        while (known[k - 1] < needed) {
+            known[k - 1] = atomic_load_int(&w->progress[row]);
+            if (known[k - 1] < needed)
+                thread_yield();
+        }
+    }
+}
+
+static void error_diffusion_worker(void* arg) {
+    /* dithers every thread_count-th row, starting at row thread_index */
+    ErrorDiffusionWorker* w = (ErrorDiffusionWorker*)arg;
+    const DitherImage* img = w->img;
+    int matrix_length = w->matrix_length;
+    int* known = (int*)calloc((size_t)w->rows_above + 1, sizeof(int));
+    double* thresholds = w->sigma > 0.0 ? (double*)calloc((size_t)img->width, sizeof(double)) : NULL;
+    double threshold = 0.5;
+    const uint8_t* alpha = DitherImage_alpha(img, 0);  // NULL for opaque images
+    for (int y = w->thread_index; y < img->height; y += w->thread_count) {
+        if (w->sigma > 0.0)
+            row_thresholds(thresholds, img->width, w->sigma, w->noise_key, y);
+        int direction = w->serpentine ? y % 2 : 0;
+        int start, end, step;
+        if (direction == 0) {
+            start = 0;
+            end = img->width;
+            step = 1;
+        } else {
+            start = img->width - 1;
+            end = -1;
+            step = -1;
+        }
+        for (int k = 0; k < w->rows_above; k++)
+            known[k] = 0;
+        int done = 0;
+        for (int x = start; x != end; x += step) {
+            wait_for_rows_above(w, y, x, known);
+            size_t addr = (size_t)(y * img->width + x);
+            if (alpha == NULL || alpha[addr] != 0) { // dither all not fully transparent pixels
+                double err = w->buffer[addr];
+                if (w->sigma > 0.0)
+                    threshold = thresholds[x];
+                if (err > threshold) {
+                    w->out[addr] = 0xff;
+                    err -= 1.0;
+                }
+                err /= w->m->divisor;
+                for (int g = 0; g < matrix_length; g++) {
+                    int xx = x + w->m_offset_x[g + matrix_length * direction];
+                    if (-1 < xx && xx < img->width) {
+                        int yy = y + w->m_offset_y[g];
+                        if (yy < img->height) {
+                            w->buffer[yy * img->width + xx] += err * w->m_weights[g + matrix_length * direction];
+                        }
+                    }
+                }
+            } else
+                w->out[addr] = 128;
+            atomic_store_int(&w->progress[y], ++done);
+        }
+    }
+    free(thresholds);
+    free(known);
+}
+
+MODULE_API void error_diffusion_dither_parallel(const DitherImage* img,
+                                                const ErrorDiffusionMatrix* m,
+                                                bool serpentine,
+                                                double sigma,
+                                                DitherRandom* rng,
+                                                int threads,
+                                                uint8_t* out) {
+    /* Multithreaded error diffusion dithering. Rows are handed out round-robin to the threads and processed as a
+     * wavefront: each row trails the row above it by the horizontal reach of the matrix. Output is bit-identical to
+     * error_diffusion_dither_rng with the same rng seed.
+     * threads: number of worker threads; 0 uses one thread per CPU core */
+    int thread_count = thread_count_resolve(threads);
+    if (thread_count > img->height)
+        thread_count = img->height;
+    if (thread_count <= 1) {
+        error_diffusion_dither_rng(img, m, serpentine, sigma, rng, out);
+        return;
+    }
+    DitherRandom time_rng;
+    uint64_t noise_key = random_next(random_or_time_seeded(rng, &time_rng));
     // prepare the matrix...
-    int i = 0;
-    int j = 0;
     double *m_weights = NULL;
     int *m_offset_x = NULL;
     int *m_offset_y = NULL;
-    int matrix_length = 0;
-    size_t image_size = (size_t)(img->width * img->height);
-    for(int y = 0; y < m->height; y++) {
-        for(int x = 0; x < m->width; x++) {
-            int value = m->buffer[y * m->width + x];
-            if(value == -1) {
-                matrix_length = (m->width * m->height - i - 1);
-                m_weights = calloc((size_t)matrix_length * 2, sizeof(double ));
-                m_offset_x = calloc((size_t)matrix_length * 2, sizeof(int));
-                m_offset_y = calloc((size_t)matrix_length, sizeof(int));
-            } else if(value > 0) {
-                m_weights[j] = (double)value;
-                m_weights[j + matrix_length] = (double)value;
-                m_offset_x[j] = (x - i);
-                m_offset_x[j + matrix_length] = -(x - i);
-                m_offset_y[j] = y;
-                j++;
-            } if(matrix_length == 0) {
-                i++;
-            }
-        }
+    int matrix_length = prepare_matrix(m, &m_weights, &m_offset_x, &m_offset_y);
+    int reach = 0;
+    int rows_above = 0;
+    for (int g = 0; g < matrix_length; g++) {
+        int dx = abs(m_offset_x[g]);
+        if (dx > reach)
+            reach = dx;
+        if (m_offset_y[g] > rows_above)
+            rows_above = m_offset_y[g];
     }
     // do the error diffusion...
-    FloatColor* buffer = (FloatColor*)calloc(image_size, sizeof(FloatColor));
-    memcpy(buffer, img->b_linear, image_size * sizeof(FloatColor));
+    size_t image_size = (size_t)(img->width * img->height);
+    double* buffer = calloc(image_size, sizeof(double));
+    DitherImage_copy_buffer(img, buffer);
+    int* progress = (int*)calloc((size_t)img->height, sizeof(int));
+    ErrorDiffusionWorker* workers = (ErrorDiffusionWorker*)calloc((size_t)thread_count, sizeof(ErrorDiffusionWorker));
+    for (int t = 0; t < thread_count; t++) {
+        ErrorDiffusionWorker* w = &workers[t];
+        w->img = img;
+        w->m = m;
+        w->m_weights = m_weights;
+        w->m_offset_x = m_offset_x;
+        w->m_offset_y = m_offset_y;
+        w->matrix_length = matrix_length;
+        w->reach = reach * 2;  // pixels touched now (+-reach) and the pixels that diffuse into them (+-reach)
+        w->rows_above = rows_above;
+        w->buffer = buffer;
+        w->progress = progress;
+        w->serpentine = serpentine;
+        w->sigma = sigma;
+        w->noise_key = noise_key;
+        w->thread_index = t;
+        w->thread_count = thread_count;
+        w->out = out;
+    }
+    if (!threads_run(thread_count, error_diffusion_worker, workers, sizeof(ErrorDiffusionWorker))) {
+        // the threads couldn't be started: dither every row on the calling thread
+        workers[0].thread_count = 1;
+        error_diffusion_worker(&workers[0]);
+    }
+    free(workers);
+    free(progress);
+    free(buffer);
+    free(m_weights);
+    free(m_offset_x);
+    free(m_offset_y);
+}
 
-    ByteColor bc;
+static void error_diffusion_double_color(FloatColor* buffer, const ByteColor* alpha, int width, int height,
+                                         const ErrorDiffusionMatrix* m, CachedPalette* lookup_pal, bool serpentine,
+                                         int* out) {
+    /* double precision error diffusion of a working buffer of linear colors, which receives the errors.
+     * alpha: the pixels' alpha values are taken from the colors' 'a' channel; NULL for an opaque image */
+    // prepare the matrix...
+    double *m_weights = NULL;
+    int *m_offset_x = NULL;
+    int *m_offset_y = NULL;
+    int matrix_length = prepare_matrix(m, &m_weights, &m_offset_x, &m_offset_y);
+    // do the error diffusion...
     int direction = 0; // FORWARD
     int direction_toggle = 1;
     if(serpentine) direction_toggle = 2;
-    for(int y = 0; y < img->height; y++) {
+    for(int y = 0; y < height; y++) {
         int start, end, step;
         if (direction == 0) {
             start = 0;
-            end = img->width;
+            end = width;
             step = 1;
         } else {
-            start = img->width - 1;
+            start = width - 1;
             end = -1;
             step = -1;
         }
         for (int x = start; x != end; x += step) {
             FloatColor  error_new;
-            size_t addr = (size_t)(y * img->width + x);
-            ColorImage_get_srgb(img, addr, &bc);
-            if (bc.a != 0) {  // dither all not fully transparent pixels
+            size_t addr = (size_t)(y * width + x);
+            if (alpha == NULL || alpha[addr].a != 0) {  // dither all not fully transparent pixels
                 FloatColor *color = &buffer[addr];         // get error (linear)
                 FloatColor_clamp(color);
 
@@ -210,11 +404,11 @@ MODULE_API void error_diffusion_dither_color(const ColorImage* img, const ErrorD
                 FloatColor_sub(color, &error_new); // calculate new error
                 for (int g = 0; g < matrix_length; g++) {
                     int xx = x + m_offset_x[g + matrix_length * direction];
-                    if (-1 < xx && xx < img->width) {
+                    if (-1 < xx && xx < width) {
                         int yy = y + m_offset_y[g];
-                        if (yy < img->height) {
+                        if (yy < height) {
                             double dd = (double) m_weights[g + matrix_length * direction] / m->divisor;
-                            addr = (size_t)(yy * img->width + xx);
+                            addr = (size_t)(yy * width + xx);
                             buffer[addr].r += (color->r * dd);
                             buffer[addr].g += (color->g * dd);
                             buffer[addr].b += (color->b * dd);
@@ -227,8 +421,466 @@ MODULE_API void error_diffusion_dither_color(const ColorImage* img, const ErrorD
         }
         direction = (y + 1) % direction_toggle;
     }
-    free(buffer);
     free(m_weights);
     free(m_offset_x);
     free(m_offset_y);
 }
+
+MODULE_API void error_diffusion_dither_color(const ColorImage* img, const ErrorDiffusionMatrix* m,
+                                             CachedPalette* lookup_pal, bool serpentine, int* out) {
+    FloatColor* buffer = (FloatColor*)calloc((size_t)(img->width * img->height), sizeof(FloatColor));
+    ColorImage_copy_linear(img, buffer);
+    error_diffusion_double_color(buffer, ColorImage_is_opaque(img) ? NULL : img->b_srgb, img->width, img->height, m, lookup_pal, serpentine, out);
+    free(buffer);
+}
+
+/* ***** STREAMING (CONSTANT MEMORY) ERROR DIFFUSION ***** */
+
+struct ErrorDiffusionStream {
+    /* rows are pushed into a ring buffer holding as many rows as the matrix is high. A row is dithered (popped) once
+     * every row it diffuses error into has been pushed, so errors are added in the same order as in
+     * error_diffusion_dither and error_diffusion_dither_color, and the output is identical */
+    const ErrorDiffusionMatrix* m;
+    double* m_weights;
+    int* m_offset_x;
+    int* m_offset_y;
+    int matrix_length;
+    int width;
+    int rows;                // ring buffer size in rows (the matrix height)
+    int channels;            // 1: greyscale, FLOAT_COLOR_RGB_CHANNELS: color
+    double* buffer;          // ring buffer: rows * width * channels values
+    uint8_t* alpha;          // ring buffer: transparency of each pixel
+    CachedPalette* lookup_pal;
+    bool serpentine;
+    double sigma;
+    uint64_t noise_key;
+    double* thresholds;      // jittered thresholds of the row being dithered (sigma > 0)
+    int pushed;              // number of rows pushed so far
+    int popped;              // number of rows popped so far
+    bool finished;
+};
+
+static ErrorDiffusionStream* stream_new(int width, const ErrorDiffusionMatrix* m, int channels, bool serpentine) {
+    ErrorDiffusionStream* self = calloc(1, sizeof(ErrorDiffusionStream));
+    self->m = m;
+    self->matrix_length = prepare_matrix(m, &self->m_weights, &self->m_offset_x, &self->m_offset_y);
+    self->width = width;
+    self->rows = m->height > 0 ? m->height : 1;
+    self->channels = channels;
+    self->buffer = calloc((size_t)width * (size_t)self->rows * (size_t)channels, sizeof(double));
+    self->alpha = calloc((size_t)width * (size_t)self->rows, sizeof(uint8_t));
+    self->serpentine = serpentine;
+    return self;
+}
+
+MODULE_API ErrorDiffusionStream* ErrorDiffusionStream_new(int width, const ErrorDiffusionMatrix* m, bool serpentine,
+                                                          double sigma, DitherRandom* rng) {
+    /* creates a greyscale stream. The matrix must stay valid for the lifetime of the stream.
+     * rng: random number generator for the jitter (sigma > 0); NULL seeds one from the current time */
+    ErrorDiffusionStream* self = stream_new(width, m, 1, serpentine);
+    DitherRandom time_rng;
+    self->sigma = sigma;
+    self->noise_key = random_next(random_or_time_seeded(rng, &time_rng));
+    if (sigma > 0.0)
+        self->thresholds = calloc((size_t)width, sizeof(double));
+    return self;
+}
+
+MODULE_API ErrorDiffusionStream* ErrorDiffusionStream_new_color(int width, const ErrorDiffusionMatrix* m,
+                                                                CachedPalette* lookup_pal, bool serpentine) {
+    /* creates a color stream. The matrix and palette must stay valid for the lifetime of the stream */
+    ErrorDiffusionStream* self = stream_new(width, m, FLOAT_COLOR_RGB_CHANNELS, serpentine);
+    self->lookup_pal = lookup_pal;
+    return self;
+}
+
+MODULE_API void ErrorDiffusionStream_free(ErrorDiffusionStream* self) {
+    if(self) {
+        free(self->buffer);
+        free(self->alpha);
+        free(self->thresholds);
+        free(self->m_weights);
+        free(self->m_offset_x);
+        free(self->m_offset_y);
+        free(self);
+        self = NULL;
+    }
+}
+
+static double* stream_push_slot(ErrorDiffusionStream* self, uint8_t** alpha) {
+    /* returns the ring buffer row for the next pushed row, or NULL if the ring buffer is full */
+    if (self->finished || self->pushed - self->popped >= self->rows)
+        return NULL;
+    size_t slot = (size_t)(self->pushed % self->rows);
+    *alpha = &self->alpha[slot * (size_t)self->width];
+    return &self->buffer[slot * (size_t)self->width * (size_t)self->channels];
+}
+
+MODULE_API bool ErrorDiffusionStream_push_row(ErrorDiffusionStream* self, const double* row, const uint8_t* transparency) {
+    /* row: 'width' greyscale values in linear color space (0.0 - 1.0)
+     * transparency: 'width' alpha values, or NULL if the row is fully opaque */
+    uint8_t* alpha;
+    double* slot = stream_push_slot(self, &alpha);
+    if (slot == NULL)
+        return false;
+    memcpy(slot, row, (size_t)self->width * sizeof(double));
+    if (transparency != NULL)
+        memcpy(alpha, transparency, (size_t)self->width * sizeof(uint8_t));
+    else
+        memset(alpha, 255, (size_t)self->width * sizeof(uint8_t));
+    self->pushed++;
+    return true;
+}
+
+MODULE_API bool ErrorDiffusionStream_push_row_color(ErrorDiffusionStream* self, const ByteColor* row) {
+    /* row: 'width' sRGB colors including alpha */
+    uint8_t* alpha;
+    double* slot = stream_push_slot(self, &alpha);
+    if (slot == NULL)
+        return false;
+    for (int x = 0; x < self->width; x++) {
+        FloatColor fc;
+        FloatColor_from_ByteColor(&fc, &row[x]);
+        slot[x * FLOAT_COLOR_RGB_CHANNELS] = fc.r;
+        slot[x * FLOAT_COLOR_RGB_CHANNELS + 1] = fc.g;
+        slot[x * FLOAT_COLOR_RGB_CHANNELS + 2] = fc.b;
+        alpha[x] = row[x].a;
+    }
+    self->pushed++;
+    return true;
+}
+
+MODULE_API void ErrorDiffusionStream_finish(ErrorDiffusionStream* self) {
+    /* marks the end of the image. Rows still held in the ring buffer can be popped afterwards */
+    self->finished = true;
+}
+
+static int stream_pop_row(ErrorDiffusionStream* self) {
+    /* returns the image row that can be dithered next, or -1 if it still needs rows below it */
+    if (self->popped >= self->pushed)
+        return -1;
+    if (!self->finished && self->pushed - self->popped < self->rows)
+        return -1;
+    return self->popped;
+}
+
+static double* stream_row(const ErrorDiffusionStream* self, int y) {
+    return &self->buffer[(size_t)(y % self->rows) * (size_t)self->width * (size_t)self->channels];
+}
+
+MODULE_API bool ErrorDiffusionStream_pop_row(ErrorDiffusionStream* self, uint8_t* out) {
+    /* dithers the oldest pushed row into out ('width' bytes: 0x00 black, 0xff white, 128 transparent).
+     * Returns false if no row is ready yet: push more rows, or call ErrorDiffusionStream_finish at the end */
+    int y = stream_pop_row(self);
+    if (y < 0)
+        return false;
+    const ErrorDiffusionMatrix* m = self->m;
+    int width = self->width;
+    int direction = self->serpentine ? y % 2 : 0;
+    int start = direction == 0 ? 0 : width - 1;
+    int end = direction == 0 ? width : -1;
+    int step = direction == 0 ? 1 : -1;
+    double* buffer = stream_row(self, y);
+    const uint8_t* alpha = &self->alpha[(size_t)(y % self->rows) * (size_t)width];
+    double threshold = 0.5;
+    if (self->sigma > 0.0)
+        row_thresholds(self->thresholds, width, self->sigma, self->noise_key, y);
+    for (int x = start; x != end; x += step) {
+        if (alpha[x] != 0) { // dither all not fully transparent pixels
+            double err = buffer[x];
+            if (self->sigma > 0.0)
+                threshold = self->thresholds[x];
+            out[x] = 0x00;
+            if (err > threshold) {
+                out[x] = 0xff;
+                err -= 1.0;
+            }
+            err /= m->divisor;
+            for (int g = 0; g < self->matrix_length; g++) {
+                int xx = x + self->m_offset_x[g + self->matrix_length * direction];
+                if (-1 < xx && xx < width) {
+                    int yy = y + self->m_offset_y[g];
+                    if (yy < self->pushed)
+                        stream_row(self, yy)[xx] += err * self->m_weights[g + self->matrix_length * direction];
+                }
+            }
+        } else
+            out[x] = 128;
+    }
+    self->popped++;
+    return true;
+}
+
+MODULE_API bool ErrorDiffusionStream_pop_row_color(ErrorDiffusionStream* self, int* out) {
+    /* dithers the oldest pushed row into out ('width' palette indices, -1 for transparent pixels).
+     * Returns false if no row is ready yet: push more rows, or call ErrorDiffusionStream_finish at the end */
+    int y = stream_pop_row(self);
+    if (y < 0)
+        return false;
+    const ErrorDiffusionMatrix* m = self->m;
+    int width = self->width;
+    int direction = self->serpentine ? y % 2 : 0;
+    int start = direction == 0 ? 0 : width - 1;
+    int end = direction == 0 ? width : -1;
+    int step = direction == 0 ? 1 : -1;
+    double* buffer = stream_row(self, y);
+    const uint8_t* alpha = &self->alpha[(size_t)(y % self->rows) * (size_t)width];
+    for (int x = start; x != end; x += step) {
+        if (alpha[x] != 0) {  // dither all not fully transparent pixels
+            double* px = &buffer[x * FLOAT_COLOR_RGB_CHANNELS];
+            FloatColor color;
+            FloatColor error_new;
+            FloatColor_set(&color, px[0], px[1], px[2]);  // get error (linear)
+            FloatColor_clamp(&color);
+
+            size_t index = CachedPalette_find_closest_color(self->lookup_pal, &color); // get closest
+            out[x] = (int) index; // set out image
+            ByteColor *srgb_b = BytePalette_get(self->lookup_pal->target_palette, index); // get sRGB color
+
+            FloatColor_from_ByteColor(&error_new, srgb_b);
+            FloatColor_sub(&color, &error_new); // calculate new error
+            for (int g = 0; g < self->matrix_length; g++) {
+                int xx = x + self->m_offset_x[g + self->matrix_length * direction];
+                if (-1 < xx && xx < width) {
+                    int yy = y + self->m_offset_y[g];
+                    if (yy < self->pushed) {
+                        double dd = (double) self->m_weights[g + self->matrix_length * direction] / m->divisor;
+                        double* target = &stream_row(self, yy)[xx * FLOAT_COLOR_RGB_CHANNELS];
+                        target[0] += (color.r * dd);
+                        target[1] += (color.g * dd);
+                        target[2] += (color.b * dd);
+                    }
+                }
+            }
+        } else {
+            out[x] = -1;  // transparent
+        }
+    }
+    self->popped++;
+    return true;
+}
+
+MODULE_API void error_diffusion_dither_packed(const DitherImage* img, const ErrorDiffusionMatrix* m, bool serpentine,
+                                              double sigma, DitherRandom* rng, const PackedOutput* out) {
+    /* error_diffusion_dither_rng with 1 bit per pixel output. The image is fed through an ErrorDiffusionStream and
+     * each row is packed as soon as it is dithered, so only the matrix height rows are kept in memory */
+    ErrorDiffusionStream* stream = ErrorDiffusionStream_new(img->width, m, serpentine, sigma, rng);
+    double* row = img->buffer == NULL ? (double*)calloc((size_t)img->width, sizeof(double)) : NULL;
+    uint8_t* dithered = (uint8_t*)calloc((size_t)img->width, sizeof(uint8_t));
+    int y_out = 0;
+    for (int y = 0; y < img->height; y++) {
+        size_t addr = (size_t)y * (size_t)img->width;
+        if (row != NULL) {
+            for (int x = 0; x < img->width; x++)
+                row[x] = (double)img->buffer_f32[addr + (size_t)x];
+        }
+        while (!ErrorDiffusionStream_push_row(stream, row != NULL ? row : &img->buffer[addr], DitherImage_alpha(img, addr))) {
+            ErrorDiffusionStream_pop_row(stream, dithered);
+            PackedOutput_store_row(out, y_out++, dithered, img->width);
+        }
+    }
+    ErrorDiffusionStream_finish(stream);
+    while (ErrorDiffusionStream_pop_row(stream, dithered))
+        PackedOutput_store_row(out, y_out++, dithered, img->width);
+    free(dithered);
+    free(row);
+    ErrorDiffusionStream_free(stream);
+}
+
+/* ***** 8 BIT INPUT (FIXED POINT) ERROR DIFFUSION ***** */
+
+#define ED_FIXED_BITS 12                          // fractional bits per 8 bit step of the fixed point values
+#define ED_FIXED_ONE (255 << ED_FIXED_BITS)       // 1.0, i.e. an 8 bit value of 255
+#define ED_FIXED_HALF (ED_FIXED_ONE / 2)          // dither threshold 0.5
+#define ED_RECIPROCAL_BITS 24                     // precision of the divisor's reciprocal
+
+struct FixedMatrix {
+    /* the diffusion matrix for integer errors: the error is divided by the divisor once per pixel with a
+     * multiply-shift, and the quotient is multiplied by the integer weights */
+    int32_t* weights;
+    int* offset_x;          // as returned by prepare_matrix: the second half is for right-to-left rows
+    int* offset_y;
+    int length;
+    int rows;               // rows of error accumulators needed: the current row and the rows below it
+    int reach;              // largest horizontal offset; accumulator rows are padded by it on both sides
+    int64_t reciprocal;     // 2^ED_RECIPROCAL_BITS / divisor
+    int32_t** taps;         // per matrix entry: where its error goes, relative to the current pixel's accumulator
+};
+typedef struct FixedMatrix FixedMatrix;
+
+static void FixedMatrix_init(FixedMatrix* self, const ErrorDiffusionMatrix* m) {
+    double* weights = NULL;
+    self->length = prepare_matrix(m, &weights, &self->offset_x, &self->offset_y);
+    self->weights = (int32_t*)calloc((size_t)self->length + 1, sizeof(int32_t));
+    self->taps = (int32_t**)calloc((size_t)self->length + 1, sizeof(int32_t*));
+    self->rows = 1;
+    self->reach = 0;
+    for (int g = 0; g < self->length; g++) {
+        self->weights[g] = (int32_t)weights[g];
+        if (self->offset_y[g] + 1 > self->rows)
+            self->rows = self->offset_y[g] + 1;
+        if (abs(self->offset_x[g]) > self->reach)
+            self->reach = abs(self->offset_x[g]);
+    }
+    self->reciprocal = (int64_t)llround((double)((int64_t)1 << ED_RECIPROCAL_BITS) / m->divisor);
+    free(weights);
+}
+
+static void FixedMatrix_free(FixedMatrix* self) {
+    free(self->weights);
+    free(self->taps);
+    free(self->offset_x);
+    free(self->offset_y);
+}
+
+static int32_t* FixedMatrix_row(FixedMatrix* self, int32_t* acc, int width, int channels, int y, int direction) {
+    /* returns the accumulators of row y (at x = 0) in the ring of padded rows and points the taps at the
+     * accumulators the matrix entries diffuse to. Rows below the image and the padding collect errors that are
+     * never read, which saves all bounds checks */
+    size_t stride = (size_t)(width + self->reach * 2) * (size_t)channels;
+    for (int g = 0; g < self->length; g++) {
+        int32_t* target_row = &acc[(size_t)((y + self->offset_y[g]) % self->rows) * stride];
+        self->taps[g] = target_row + (self->reach + self->offset_x[g + self->length * direction]) * channels;
+    }
+    return &acc[(size_t)(y % self->rows) * stride + (size_t)(self->reach * channels)];
+}
+
+static inline int32_t fixed_divide(const FixedMatrix* self, int32_t err) {
+    /* err / divisor, rounded. Relies on arithmetic right shifts of negative values, as do all supported compilers */
+    return (int32_t)(((int64_t)err * self->reciprocal + ((int64_t)1 << (ED_RECIPROCAL_BITS - 1))) >> ED_RECIPROCAL_BITS);
+}
+
+static void error_diffusion_fixed(const uint8_t* luma, const uint8_t* alpha, int width, int height,
+                                  const ErrorDiffusionMatrix* m, bool serpentine, uint8_t* out) {
+    /* fixed point error diffusion. Errors are accumulated as 32 bit integers in a ring of matrix height rows */
+    FixedMatrix fm;
+    FixedMatrix_init(&fm, m);
+    size_t stride = (size_t)(width + fm.reach * 2);
+    int32_t* acc = (int32_t*)calloc((size_t)fm.rows * stride, sizeof(int32_t));
+    for (int y = 0; y < height; y++) {
+        int direction = serpentine ? y % 2 : 0;
+        int32_t* row = FixedMatrix_row(&fm, acc, width, 1, y, direction);
+        int start, end, step;
+        if (direction == 0) {
+            start = 0;
+            end = width;
+            step = 1;
+        } else {
+            start = width - 1;
+            end = -1;
+            step = -1;
+        }
+        for (int x = start; x != end; x += step) {
+            size_t addr = (size_t)(y * width + x);
+            if (alpha == NULL || alpha[addr] != 0) { // dither all not fully transparent pixels
+                int32_t err = ((int32_t)luma[addr] << ED_FIXED_BITS) + row[x];
+                if (err > ED_FIXED_HALF) {
+                    out[addr] = 0xff;
+                    err -= ED_FIXED_ONE;
+                }
+                err = fixed_divide(&fm, err);
+                for (int g = 0; g < fm.length; g++)
+                    fm.taps[g][x] += err * fm.weights[g];
+            } else
+                out[addr] = 128;
+        }
+        memset(row - fm.reach, 0, stride * sizeof(int32_t));  // becomes row y + rows
+    }
+    free(acc);
+    FixedMatrix_free(&fm);
+}
+
+static inline int32_t fixed_clamp(int32_t v) {
+    return v < 0 ? 0 : (v > ED_FIXED_ONE ? ED_FIXED_ONE : v);
+}
+
+static void error_diffusion_fixed_color(const ByteColor* pixels, int width, int height, const ErrorDiffusionMatrix* m,
+                                        CachedPalette* lookup_pal, bool serpentine, int* out) {
+    /* fixed point color error diffusion; the accumulated colors are only converted to floating point for the
+     * palette lookup */
+    FixedMatrix fm;
+    FixedMatrix_init(&fm, m);
+    size_t stride = (size_t)(width + fm.reach * 2) * 3;
+    int32_t* acc = (int32_t*)calloc((size_t)fm.rows * stride, sizeof(int32_t));
+    const double scale = 1.0 / (double)ED_FIXED_ONE;
+    for (int y = 0; y < height; y++) {
+        int direction = serpentine ? y % 2 : 0;
+        int32_t* row = FixedMatrix_row(&fm, acc, width, 3, y, direction);
+        int start, end, step;
+        if (direction == 0) {
+            start = 0;
+            end = width;
+            step = 1;
+        } else {
+            start = width - 1;
+            end = -1;
+            step = -1;
+        }
+        for (int x = start; x != end; x += step) {
+            size_t addr = (size_t)(y * width + x);
+            const ByteColor* p = &pixels[addr];
+            if (p->a != 0) {  // dither all not fully transparent pixels
+                const int32_t* a = &row[x * 3];
+                int32_t r = fixed_clamp(((int32_t)p->r << ED_FIXED_BITS) + a[0]);
+                int32_t g = fixed_clamp(((int32_t)p->g << ED_FIXED_BITS) + a[1]);
+                int32_t b = fixed_clamp(((int32_t)p->b << ED_FIXED_BITS) + a[2]);
+                FloatColor color;
+                FloatColor_set(&color, (double)r * scale, (double)g * scale, (double)b * scale);
+                size_t index = CachedPalette_find_closest_color(lookup_pal, &color); // get closest
+                out[addr] = (int) index; // set out image
+                const ByteColor* srgb_b = BytePalette_get(lookup_pal->target_palette, index); // get sRGB color
+                // calculate new error; palette bytes convert to fixed point exactly
+                r = fixed_divide(&fm, r - ((int32_t)srgb_b->r << ED_FIXED_BITS));
+                g = fixed_divide(&fm, g - ((int32_t)srgb_b->g << ED_FIXED_BITS));
+                b = fixed_divide(&fm, b - ((int32_t)srgb_b->b << ED_FIXED_BITS));
+                for (int k = 0; k < fm.length; k++) {
+                    int32_t* t = &fm.taps[k][x * 3];
+                    t[0] += r * fm.weights[k];
+                    t[1] += g * fm.weights[k];
+                    t[2] += b * fm.weights[k];
+                }
+            } else {
+                out[addr] = -1;  // transparent
+            }
+        }
+        memset(row - fm.reach * 3, 0, stride * sizeof(int32_t));  // becomes row y + rows
+    }
+    free(acc);
+    FixedMatrix_free(&fm);
+}
+
+MODULE_API void error_diffusion_dither_8bit(const uint8_t* luma, const uint8_t* alpha, int width, int height,
+                                            const ErrorDiffusionMatrix* m, bool serpentine,
+                                            enum ErrorDiffusionArithmetic arithmetic, uint8_t* out) {
+    /* error diffusion of 8 bit linear (gamma decoded) luminance values
+     * alpha: alpha values, or NULL for an opaque image
+     * arithmetic: ED_DOUBLE gives the same output as error_diffusion_dither with sigma 0. ED_FIXED_POINT carries the
+     *             errors as 32 bit fixed point values with 12 fractional bits per 8 bit step */
+    if (arithmetic == ED_FIXED_POINT) {
+        error_diffusion_fixed(luma, alpha, width, height, m, serpentine, out);
+        return;
+    }
+    size_t image_size = (size_t)(width * height);
+    double* buffer = (double*)calloc(image_size, sizeof(double));
+    for (size_t i = 0; i < image_size; i++)
+        buffer[i] = (double)luma[i] / 255.0;
+    error_diffusion_double(buffer, alpha, width, height, m, serpentine, 0.0, 0, out);
+    free(buffer);
+}
+
+MODULE_API void error_diffusion_dither_color_8bit(const ByteColor* pixels, int width, int height,
+                                                  const ErrorDiffusionMatrix* m, CachedPalette* lookup_pal,
+                                                  bool serpentine, enum ErrorDiffusionArithmetic arithmetic, int* out) {
+    /* color error diffusion of 8 bit linear (gamma decoded) RGB values; 'a' holds the alpha value
+     * arithmetic: see error_diffusion_dither_8bit */
+    if (arithmetic == ED_FIXED_POINT) {
+        error_diffusion_fixed_color(pixels, width, height, m, lookup_pal, serpentine, out);
+        return;
+    }
+    size_t image_size = (size_t)(width * height);
+    FloatColor* buffer = (FloatColor*)calloc(image_size, sizeof(FloatColor));
+    for (size_t i = 0; i < image_size; i++)
+        FloatColor_from_ByteColor(&buffer[i], &pixels[i]);
+    error_diffusion_double_color(buffer, pixels, width, height, m, lookup_pal, serpentine, out);
+    free(buffer);
+}
@@ -1,14 +1,21 @@
 #define MODULE_API_EXPORTS
 #include <stdlib.h>
 #include <math.h>
-#include <time.h>
 #include <stdbool.h>
 #include "libdither.h"
+#include "random.h"
 
-inline int32_t MIN(int32_t a, int32_t b) { return((a) < (b) ? a : b); }
+static inline int32_t MIN(int32_t a, int32_t b) { return((a) < (b) ? a : b); }
 
 MODULE_API void grid_dither(const DitherImage* img, int w, int h, int min_pixels, bool alt_algorithm, uint8_t* out) {
-    srand((uint32_t)time(NULL));
+    grid_dither_rng(img, w, h, min_pixels, alt_algorithm, NULL, out);
+}
+
+MODULE_API void grid_dither_rng(const DitherImage* img, int w, int h, int min_pixels, bool alt_algorithm,
+                                DitherRandom* rng, uint8_t* out) {
+    /* rng: random number generator for pixel placement; NULL seeds one from the current time */
+    DitherRandom time_rng;
+    rng = random_or_time_seeded(rng, &time_rng);
     size_t dimensions = (size_t)(img->width * img->height);
     for(size_t i = 0; i < dimensions; i++)
         out[i] = 0xff;
@@ -24,7 +31,7 @@ MODULE_API void grid_dither(const DitherImage* img, int w, int h, int min_pixels
             for (int yy = 0; yy < grid_height; yy++)
                 for (int xx = 0; xx < grid_width; xx++, samplecount++)
                     if (y + yy < img->height && x + xx < img->width)
-                        sum_intensity += img->buffer[(y + yy) * img->width + x + xx];
+                        sum_intensity += DitherImage_value(img, (size_t)((y + yy) * img->width + x + xx));
 
             double avg_intensity = sum_intensity / (double)samplecount;
             double npow = (1.0 - avg_intensity) * max_pixels;
@@ -37,8 +44,8 @@ MODULE_API void grid_dither(const DitherImage* img, int w, int h, int min_pixels
                 int c = 0;
                 for(int i = 0; i < grid_area; i++) {
                     while(true) {
-                        int xr = rand() % (grid_width);
-                        int yr = rand() % (grid_height);
+                        int xr = random_int(rng, grid_width);
+                        int yr = random_int(rng, grid_height);
                         if(o[yr * grid_width + xr] == 0) {
                             if(x + xr < img->width && y + yr < img->height) {
                                 out[(y + yr) * img->width + x + xr] = 0;
@@ -54,8 +61,8 @@ MODULE_API void grid_dither(const DitherImage* img, int w, int h, int min_pixels
                 free(o);
             } else {
                 for (int i = 0; i < (int) n; i++) {
-                    int xx = x + (rand() % (MIN(x + grid_width, img->width) - x));
-                    int yy = y + (rand() % (MIN(y + grid_height, img->height) - y));
+                    int xx = x + random_int(rng, MIN(x + grid_width, img->width) - x);
+                    int yy = y + random_int(rng, MIN(y + grid_height, img->height) - y);
                     if (xx < img->width && yy < img->height)
                         out[yy * img->width + xx] = 0;
                 }
@@ -63,7 +70,9 @@ MODULE_API void grid_dither(const DitherImage* img, int w, int h, int min_pixels
         }
     }
     // apply transparency
-    for (size_t i = 0; i < (size_t)(img->width * img->height); i++) {
-        out[i] = img->transparency[i] != 0 ? out[i] : 128;
+    if (!DitherImage_is_opaque(img)) {
+        for (size_t i = 0; i < (size_t)(img->width * img->height); i++) {
+            out[i] = img->transparency[i] != 0 ? out[i] : 128;
+        }
     }
 }
@@ -1,54 +1,164 @@
 #define MODULE_API_EXPORTS
 #include <stdlib.h>
-#include <math.h>
-#include <time.h>
 #include "libdither.h"
+#include "random.h"
+#include "threading.h"
 #include "dither_kallebach_data.h"
 
 
-MODULE_API void kallebach_dither(const DitherImage* img, bool random, uint8_t* out) {
-    /* Kacker and Allebach dithering.
-     * The algorithm alternates between different dither arrays. The arrays can be
-     * chosen at random (parameter: random = true) or in order (parameter: random = false)
-     * */
-    srand((uint32_t)time(NULL));
-    const int dither_array_size = 32;
-    const int dither_array_count = 4;
-    int height_map_m = (int)ceil((double)img->height / (double)dither_array_size);
-    int width_map_m = (int)ceil((double)img->width / (double)dither_array_size);
-    short* map = (short*)calloc((size_t)((width_map_m + 1) * (height_map_m + 1)), sizeof(short));
+#define KALLEBACH_SIZE 32   // width and height of the dither arrays
+#define KALLEBACH_ARRAYS 4
+
+/*
+ * Kacker and Allebach dithering runs in two phases: first a dither array is chosen for every 32x32 tile, which
+ * only depends on the tile's left and upper neighbours and is cheap. After that every tile is independent, so the
+ * bands of tiles are thresholded in parallel.
+ * */
+
+struct KallebachWorker {
+    /* per-thread state for kallebach_dither_parallel */
+    const DitherImage* img;
+    const signed char* tiles;
+    const double* thresholds;
+    int thread_index;
+    int thread_count;
+    uint8_t* out;
+};
+typedef struct KallebachWorker KallebachWorker;
+
+static signed char* kallebach_tiles(const DitherImage* img, bool random, DitherRandom* rng) {
+    /* phase 1: chooses the dither array of every tile in raster order. A tile never uses the same array as its left
+     * or upper neighbour. The arrays are chosen at random or in order */
+    int tiles_w = (img->width + KALLEBACH_SIZE - 1) / KALLEBACH_SIZE;
+    int tiles_h = (img->height + KALLEBACH_SIZE - 1) / KALLEBACH_SIZE;
+    signed char* tiles = (signed char*)calloc((size_t)tiles_w * (size_t)tiles_h, sizeof(signed char));
     int current_index = 0;
-    for(int i = 0; i < img->height; i += dither_array_size) {
-        for(int j = 0; j < img->width; j += dither_array_size) {
-            int left_index = map[(int)((double)i / (double)dither_array_size + 1) * (width_map_m + 1) + (int)((double)j / (double)dither_array_size)];
-            int upper_index = map[(int)((double)i / (double)dither_array_size) * (width_map_m + 1) + (int)((double)j / (double)dither_array_size + 1)];
-            while(1) {
-                if(random) {
-                    current_index = rand() % (dither_array_count); // choose a dither array by random
+    for (int ty = 0; ty < tiles_h; ty++) {
+        for (int tx = 0; tx < tiles_w; tx++) {
+            int left_index = tx > 0 ? tiles[ty * tiles_w + tx - 1] : -1;
+            int upper_index = ty > 0 ? tiles[(ty - 1) * tiles_w + tx] : -1;
+            do {
+                if (random) {
+                    current_index = random_int(rng, KALLEBACH_ARRAYS);  // choose a dither array by random
                 } else {
                     current_index++;  // go through dither arrays in order
-                    if (current_index == dither_array_count)
+                    if (current_index == KALLEBACH_ARRAYS)
                         current_index = 0;
                 }
-                if(current_index != left_index && current_index != upper_index) {
-                    for(int m = 0; m < dither_array_size; m++) {
-                        for(int n = 0; n < dither_array_size; n++) {
-                            int im = i + m;
-                            int jn = j + n;
-                            if(im >=0 && im < img->height && jn >=0 && jn < img->width) {
-                                size_t addr = (size_t)(im * img->width + jn);
-                                if (img->transparency[addr] != 0) {
-                                    if (img->buffer[addr] * 256.0 > dither_arrays[current_index][m][n])
-                                        out[addr] = 0xff;
-                                } else
-                                    out[addr] = 128;
-                            }
-                        }
-                    }
-                    break;
-                }
+            } while (current_index == left_index || current_index == upper_index);
+            tiles[ty * tiles_w + tx] = (signed char)current_index;
+        }
+    }
+    return tiles;
+}
+
+static double* kallebach_thresholds(void) {
+    /* the dither arrays scaled to the 0.0 - 1.0 range of the pixel values. Dividing by 256 is exact, so
+     * (value > threshold) gives the same result as (value * 256 > dither array entry) */
+    double* thresholds = (double*)calloc(KALLEBACH_ARRAYS * KALLEBACH_SIZE * KALLEBACH_SIZE, sizeof(double));
+    for (int a = 0; a < KALLEBACH_ARRAYS; a++)
+        for (int m = 0; m < KALLEBACH_SIZE; m++)
+            for (int n = 0; n < KALLEBACH_SIZE; n++)
+                thresholds[(a * KALLEBACH_SIZE + m) * KALLEBACH_SIZE + n] = dither_arrays[a][m][n] / 256.0;
+    return thresholds;
+}
+
+static void kallebach_band(const DitherImage* img, const signed char* tiles, const double* thresholds, int i,
+                           uint8_t* out) {
+    /* phase 2: dithers the band of KALLEBACH_SIZE rows starting at row i into out, which holds the band's rows only */
+    int tiles_w = (img->width + KALLEBACH_SIZE - 1) / KALLEBACH_SIZE;
+    const signed char* band_tiles = &tiles[(i / KALLEBACH_SIZE) * tiles_w];
+    for (int m = 0; m < KALLEBACH_SIZE && i + m < img->height; m++) {
+        size_t addr = (size_t)(i + m) * (size_t)img->width;
+        uint8_t* row_out = &out[(size_t)m * (size_t)img->width];
+        for (int j = 0; j < img->width; j += KALLEBACH_SIZE) {
+            const double* t = &thresholds[(band_tiles[j / KALLEBACH_SIZE] * KALLEBACH_SIZE + m) * KALLEBACH_SIZE];
+            int count = img->width - j < KALLEBACH_SIZE ? img->width - j : KALLEBACH_SIZE;
+            if (img->buffer != NULL) {
+                const double* px = &img->buffer[addr + (size_t)j];
+                for (int n = 0; n < count; n++)
+                    row_out[j + n] = px[n] > t[n] ? 0xff : 0x00;
+            } else {
+                const float* px = &img->buffer_f32[addr + (size_t)j];
+                for (int n = 0; n < count; n++)
+                    row_out[j + n] = (double)px[n] > t[n] ? 0xff : 0x00;
             }
         }
+        const uint8_t* alpha = DitherImage_alpha(img, addr);
+        if (alpha != NULL) {
+            for (int x = 0; x < img->width; x++)
+                if (alpha[x] == 0)
+                    row_out[x] = 128;
+        }
+    }
+}
+
+static void kallebach_worker(void* arg) {
+    /* dithers every thread_count-th band, starting at band thread_index */
+    KallebachWorker* w = (KallebachWorker*)arg;
+    const DitherImage* img = w->img;
+    for (int i = w->thread_index * KALLEBACH_SIZE; i < img->height; i += w->thread_count * KALLEBACH_SIZE)
+        kallebach_band(img, w->tiles, w->thresholds, i, &w->out[(size_t)i * (size_t)img->width]);
+}
+
+MODULE_API void kallebach_dither(const DitherImage* img, bool random, uint8_t* out) {
+    kallebach_dither_rng(img, random, NULL, out);
+}
+
+MODULE_API void kallebach_dither_rng(const DitherImage* img, bool random, DitherRandom* rng, uint8_t* out) {
+    /* Kacker and Allebach dithering.
+     * The algorithm alternates between different dither arrays. The arrays can be
+     * chosen at random (parameter: random = true) or in order (parameter: random = false)
+     * rng: random number generator used to choose the arrays; NULL seeds one from the current time
+     * */
+    kallebach_dither_parallel(img, random, rng, 1, out);
+}
+
+MODULE_API void kallebach_dither_parallel(const DitherImage* img, bool random, DitherRandom* rng, int threads,
+                                          uint8_t* out) {
+    /* Multithreaded Kacker and Allebach dithering. The dither arrays are chosen up front, then the bands of tiles
+     * are dithered in parallel. Output is the same for any number of threads.
+     * threads: number of worker threads; 0 uses one thread per CPU core */
+    DitherRandom time_rng;
+    rng = random_or_time_seeded(rng, &time_rng);
+    int bands = (img->height + KALLEBACH_SIZE - 1) / KALLEBACH_SIZE;
+    int thread_count = thread_count_resolve(threads);
+    if (thread_count > bands)
+        thread_count = bands;
+    if (thread_count < 1)
+        thread_count = 1;
+    signed char* tiles = kallebach_tiles(img, random, rng);
+    double* thresholds = kallebach_thresholds();
+    KallebachWorker* workers = (KallebachWorker*)calloc((size_t)thread_count, sizeof(KallebachWorker));
+    for (int t = 0; t < thread_count; t++) {
+        KallebachWorker* w = &workers[t];
+        w->img = img;
+        w->tiles = tiles;
+        w->thresholds = thresholds;
+        w->thread_index = t;
+        w->thread_count = thread_count;
+        w->out = out;
+    }
+    threads_run_independent(thread_count, kallebach_worker, workers, sizeof(KallebachWorker));
+    free(workers);
+    free(thresholds);
+    free(tiles);
+}
+
+MODULE_API void kallebach_dither_packed(const DitherImage* img, bool random, DitherRandom* rng, const PackedOutput* out) {
+    /* kallebach_dither_rng with 1 bit per pixel output. Each band of dither array rows is dithered into a small
+     * buffer and packed */
+    DitherRandom time_rng;
+    rng = random_or_time_seeded(rng, &time_rng);
+    signed char* tiles = kallebach_tiles(img, random, rng);
+    double* thresholds = kallebach_thresholds();
+    uint8_t* band = (uint8_t*)calloc((size_t)KALLEBACH_SIZE * (size_t)img->width, sizeof(uint8_t));
+    for(int i = 0; i < img->height; i += KALLEBACH_SIZE) {
+        kallebach_band(img, tiles, thresholds, i, band);
+        for(int m = 0; m < KALLEBACH_SIZE && i + m < img->height; m++)
+            PackedOutput_store_row(out, i + m, &band[(size_t)m * (size_t)img->width], img->width);
     }
-    free(map);
+    free(band);
+    free(thresholds);
+    free(tiles);
 }
@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include "libdither.h"
 #include "random.h"
+#include "threading.h"
 #include "dither_ordered_data.h"
 
 MODULE_API OrderedDitherMatrix* get_bayer2x2_matrix(void) { return OrderedDitherMatrix_new(2, 2, 4.0, bayer2x2_matrix); }
@@ -73,7 +74,7 @@ MODULE_API OrderedDitherMatrix* get_matrix_from_image(const DitherImage* img) {
     for(int y = 0; y < img->height; y++) {
         for (int x = 0; x < img->width; x++) {
             size_t addr = (size_t)(y * img->width + x);
-            matrix[addr] = (int)round(img->buffer[addr] * INT_MAX);
+            matrix[addr] = (int)round(DitherImage_value(img, addr) * INT_MAX);
         }
     }
     OrderedDitherMatrix* m = OrderedDitherMatrix_new(img->width, img->height, INT_MAX, matrix);
@@ -138,31 +139,176 @@ MODULE_API OrderedDitherMatrix* get_blue_noise_128x128(void) {
     return m;
 }
 
-MODULE_API void ordered_dither(const DitherImage* img, const OrderedDitherMatrix* matrix, double sigma, uint8_t* out) {
-    /* Ordered dithering (mono)
-     * sigma: introduces noise into the final dither to make it look less regular.
-     * */
+static double* prepare_dmatrix(const OrderedDitherMatrix* matrix) {
+    /* converts the matrix into threshold offsets for ordered_dither */
     int matrix_size = matrix->width * matrix->height;
     double* dmatrix = calloc((size_t)matrix_size, sizeof(double));
     double divisor = 1.0 / matrix->divisor;
     for(int i = 0; i < matrix_size; i++) {
         dmatrix[i] = (double)matrix->buffer[i] * divisor - 0.5;
     }
-    size_t addr = 0;
-    for(int y = 0; y < img->height; y++) {
+    return dmatrix;
+}
+
+static double* prepare_dmatrix_color(const OrderedDitherMatrix* matrix) {
+    /* converts the matrix into (linearized) color offsets for ordered_dither_color */
+    int matrix_size = matrix->width * matrix->height;
+    double* dmatrix = (double*)calloc((size_t)matrix_size, sizeof(double));
+    for(int i = 0; i < matrix_size; i++) {
+        double error = ((double)matrix->buffer[i] / matrix->divisor - 0.5) + (0.5 / matrix->divisor);
+        dmatrix[i] = error <= 0.04045 ? (error / 12.02) : pow(((error + 0.055) / 1.055), 2.4);
+    }
+    return dmatrix;
+}
+
+static void ordered_dither_rows(const DitherImage* img, const OrderedDitherMatrix* matrix, const double* dmatrix,
+                                double sigma, uint64_t noise_key, int y_start, int y_end, uint8_t* out) {
+    /* dithers the rows y_start to y_end - 1. The matrix column advances with x instead of being computed per pixel.
+     * Each row's noise comes from its own generator derived from noise_key */
+    double* noise = sigma > 0.0 ? (double*)calloc((size_t)img->width, sizeof(double)) : NULL;
+    for(int y = y_start; y < y_end; y++) {
+        const double* mrow = &dmatrix[(y % matrix->height) * matrix->width];
+        size_t addr = (size_t)y * (size_t)img->width;
+        int mx = 0;
+        if (sigma > 0.0) {
+            DitherRandom row_rng;
+            random_init_row(&row_rng, noise_key, y);
+            random_fill_normal(&row_rng, noise, (size_t)img->width, sigma, 0.5);
+        }
+        const uint8_t* alpha = DitherImage_alpha(img, addr);
+        if (alpha == NULL) {  // opaque image: no alpha checks
+            for(int x = 0; x < img->width; x++) {
+                double px = DitherImage_value(img, addr) + mrow[mx];
+                if (sigma > 0.0)
+                    px += noise[x] - 0.5;
+                if (px > 0.5)
+                    out[addr] = 0xff;
+                addr++;
+                if (++mx == matrix->width)
+                    mx = 0;
+            }
+            continue;
+        }
         for(int x = 0; x < img->width; x++) {
-            if (img->transparency[addr] != 0) { // dither all not fully transparent pixels
-                double px = img->buffer[addr];
-                px += dmatrix[(y % matrix->height) * matrix->width + (x % matrix->width)];
+            if (alpha[x] != 0) { // dither all not fully transparent pixels
+                double px = DitherImage_value(img, addr);
+                px += mrow[mx];
                 if (sigma > 0.0)
-                    px += box_muller(sigma, 0.5) - 0.5;
+                    px += noise[x] - 0.5;
                 if (px > 0.5)
                     out[addr] = 0xff;
             } else
                 out[addr] = 128;
             addr++;
+            if (++mx == matrix->width)
+                mx = 0;
         }
     }
+    free(noise);
+}
+
+static void ordered_dither_color_rows(const ColorImage* image, CachedPalette* lookup_pal,
+                                      PaletteHashEntry** local_cache, const OrderedDitherMatrix* matrix,
+                                      const double* dmatrix, int y_start, int y_end, int* out) {
+    /* dithers the rows y_start to y_end - 1. With local_cache set, the palette is only read (see
+     * CachedPalette_find_closest_color_local), which allows several threads to share it. Otherwise each row is
+     * resolved with a single batch lookup */
+    FloatColor* row = (FloatColor*)calloc((size_t)image->width, sizeof(FloatColor));
+    int* indices = (int*)calloc((size_t)image->width, sizeof(int));
+    bool all_opaque = ColorImage_is_opaque(image);
+    for(int y = y_start; y < y_end; y++) {
+        const double* mrow = &dmatrix[(y % matrix->height) * matrix->width];
+        size_t addr = (size_t)y * (size_t)image->width;
+        size_t opaque = 0;
+        int mx = 0;
+        for (int x = 0; x < image->width; x++) {
+            ByteColor bc;
+            ColorImage_get_srgb(image, addr + (size_t)x, &bc);
+            if (bc.a != 0) {  // dither all not fully transparent pixels
+                FloatColor* fc = &row[opaque++];
+                FloatColor_from_ByteColor(fc, &bc);
+                FloatColor_sub_float(fc, 0.022);  // slightly darken the picture
+                FloatColor_add_float(fc, mrow[mx]);
+                FloatColor_clamp(fc);
+            }
+            if (++mx == matrix->width)
+                mx = 0;
+        }
+        if (local_cache != NULL) {
+            for (size_t i = 0; i < opaque; i++)
+                indices[i] = (int)CachedPalette_find_closest_color_local(lookup_pal, local_cache, &row[i]);
+        } else {
+            CachedPalette_find_closest_colors(lookup_pal, row, opaque, indices);
+        }
+        if (all_opaque) {  // one index per pixel, in order
+            memcpy(&out[addr], indices, (size_t)image->width * sizeof(int));
+            continue;
+        }
+        opaque = 0;
+        for (int x = 0; x < image->width; x++, addr++) {
+            if (image->b_srgb[addr].a != 0)
+                out[addr] = indices[opaque++];
+            else
+                out[addr] = -1;  // transparent
+        }
+    }
+    free(indices);
+    free(row);
+}
+
+MODULE_API void ordered_dither(const DitherImage* img, const OrderedDitherMatrix* matrix, double sigma, uint8_t* out) {
+    ordered_dither_rng(img, matrix, sigma, NULL, out);
+}
+
+MODULE_API void ordered_dither_rng(const DitherImage* img, const OrderedDitherMatrix* matrix, double sigma,
+                                   DitherRandom* rng, uint8_t* out) {
+    /* Ordered dithering (mono)
+     * sigma: introduces noise into the final dither to make it look less regular.
+     * rng: random number generator for the noise; NULL seeds one from the current time
+     * */
+    DitherRandom time_rng;
+    rng = random_or_time_seeded(rng, &time_rng);
+    double* dmatrix = prepare_dmatrix(matrix);
+    ordered_dither_rows(img, matrix, dmatrix, sigma, random_next(rng), 0, img->height, out);
+    free(dmatrix);
+}
+
+MODULE_API void ordered_dither_packed(const DitherImage* img, const OrderedDitherMatrix* matrix, double sigma,
+                                      DitherRandom* rng, const PackedOutput* out) {
+    /* ordered_dither_rng with 1 bit per pixel output. Each row's pixel values are offset by the tiled matrix row
+     * first, then compared and packed several pixels per instruction */
+    DitherRandom time_rng;
+    rng = random_or_time_seeded(rng, &time_rng);
+    uint64_t noise_key = random_next(rng);
+    double* dmatrix = prepare_dmatrix(matrix);
+    double* noise = sigma > 0.0 ? (double*)calloc((size_t)img->width, sizeof(double)) : NULL;
+    double* row = (double*)calloc((size_t)img->width, sizeof(double));
+    for(int y = 0; y < img->height; y++) {
+        const double* mrow = &dmatrix[(y % matrix->height) * matrix->width];
+        size_t addr = (size_t)y * (size_t)img->width;
+        // tile the matrix row across the image row, then add the pixel values
+        for(int x = 0; x < img->width; x += matrix->width) {
+            int count = img->width - x < matrix->width ? img->width - x : matrix->width;
+            memcpy(&row[x], mrow, (size_t)count * sizeof(double));
+        }
+        if (img->buffer != NULL) {
+            for(int x = 0; x < img->width; x++)
+                row[x] = img->buffer[addr + (size_t)x] + row[x];
+        } else {
+            for(int x = 0; x < img->width; x++)
+                row[x] = (double)img->buffer_f32[addr + (size_t)x] + row[x];
+        }
+        if (sigma > 0.0) {
+            DitherRandom row_rng;
+            random_init_row(&row_rng, noise_key, y);
+            random_fill_normal(&row_rng, noise, (size_t)img->width, sigma, 0.5);
+            for(int x = 0; x < img->width; x++)
+                row[x] += noise[x] - 0.5;
+        }
+        PackedOutput_compare_row(out, y, row, 0.5, DitherImage_alpha(img, addr), img->width);
+    }
+    free(row);
+    free(noise);
     free(dmatrix);
 }
 
@@ -171,34 +317,100 @@ MODULE_API void ordered_dither_color(const ColorImage* image, CachedPalette* loo
     /* contrast and gamme can be used to compensate that ordered dither may sometimes be more or less bright, as
      * there is no error to distribute. Good values: gamma = 0.5, contrast = 1.8
      */
-    int matrix_size = matrix->width * matrix->height;
-    double* dmatrix = (double*)calloc((size_t)matrix_size, sizeof(double));
-    for(int i = 0; i < matrix_size; i++) {
-        dmatrix[i] = ((double)matrix->buffer[i] / matrix->divisor - 0.5) + (0.5 / matrix->divisor);
+    double* dmatrix = prepare_dmatrix_color(matrix);
+    ordered_dither_color_rows(image, lookup_pal, NULL, matrix, dmatrix, 0, image->height, out);
+    free(dmatrix);
+}
+
+/* ***** MULTITHREADED ORDERED DITHERING ***** */
+
+struct OrderedDitherWorker {
+    /* per-thread state: each worker dithers one band of rows */
+    const DitherImage* img;
+    const ColorImage* image;
+    CachedPalette* lookup_pal;
+    const OrderedDitherMatrix* matrix;
+    const double* dmatrix;
+    double sigma;
+    uint64_t noise_key;
+    int y_start;
+    int y_end;
+    uint8_t* out;
+    int* out_color;
+};
+typedef struct OrderedDitherWorker OrderedDitherWorker;
+
+static void ordered_dither_worker(void* arg) {
+    OrderedDitherWorker* w = (OrderedDitherWorker*)arg;
+    ordered_dither_rows(w->img, w->matrix, w->dmatrix, w->sigma, w->noise_key, w->y_start, w->y_end, w->out);
+}
+
+static void ordered_dither_color_worker(void* arg) {
+    OrderedDitherWorker* w = (OrderedDitherWorker*)arg;
+    PaletteHashEntry* local_cache = NULL;
+    bool shared = CachedPalette_is_thread_safe(w->lookup_pal);  // use (and warm up) the palette's own cache
+    ordered_dither_color_rows(w->image, w->lookup_pal, shared ? NULL : &local_cache, w->matrix, w->dmatrix,
+                              w->y_start, w->y_end, w->out_color);
+    CachedPalette_free_local_cache(&local_cache);
+}
+
+static OrderedDitherWorker* split_rows(int height, int* thread_count) {
+    /* creates one worker per band of rows */
+    int count = thread_count_resolve(*thread_count);
+    if (count > height)
+        count = height > 0 ? height : 1;
+    OrderedDitherWorker* workers = (OrderedDitherWorker*)calloc((size_t)count, sizeof(OrderedDitherWorker));
+    for (int i = 0; i < count; i++) {
+        workers[i].y_start = (int)((long long)height * i / count);
+        workers[i].y_end = (int)((long long)height * (i + 1) / count);
     }
-    FloatColor fc;
-    for(int y = 0; y < image->height; y++) {
-        for (int x = 0; x < image->width; x++) {
-            int mh = y % matrix->height;
-            int mw = x % matrix->width;
-            size_t addr = (size_t)(y * image->width + x);
-            ByteColor bc;
-            ColorImage_get_srgb(image, addr, &bc);
-            if (bc.a != 0) {  // dither all not fully transparent pixels
-                FloatColor_from_ByteColor(&fc, &bc);
-                FloatColor_sub_float(&fc, 0.022);  // slightly darken the picture
+    *thread_count = count;
+    return workers;
+}
 
-                double error = dmatrix[mh * matrix->width + mw];
-                error = error <= 0.04045 ? (error / 12.02) : pow(((error + 0.055) / 1.055), 2.4);
+MODULE_API void ordered_dither_parallel(const DitherImage* img, const OrderedDitherMatrix* matrix, double sigma,
+                                        DitherRandom* rng, int threads, uint8_t* out) {
+    /* multithreaded ordered_dither: the image is split into bands of rows, one per thread. Noise is generated per
+     * row, so the output for a given rng seed doesn't depend on the number of threads */
+    DitherRandom time_rng;
+    rng = random_or_time_seeded(rng, &time_rng);
+    uint64_t noise_key = random_next(rng);
+    double* dmatrix = prepare_dmatrix(matrix);
+    OrderedDitherWorker* workers = split_rows(img->height, &threads);
+    for (int i = 0; i < threads; i++) {
+        workers[i].img = img;
+        workers[i].matrix = matrix;
+        workers[i].dmatrix = dmatrix;
+        workers[i].sigma = sigma;
+        workers[i].noise_key = noise_key;
+        workers[i].out = out;
+    }
+    if (threads == 1)
+        ordered_dither_rows(img, matrix, dmatrix, sigma, noise_key, 0, img->height, out);
+    else
+        threads_run_independent(threads, ordered_dither_worker, workers, sizeof(OrderedDitherWorker));
+    free(workers);
+    free(dmatrix);
+}
 
-                FloatColor_add_float(&fc, error);
-                FloatColor_clamp(&fc);
-                size_t index = CachedPalette_find_closest_color(lookup_pal, &fc);
-                out[addr] = (int) index;
-            } else {
-                out[addr] = -1;  // transparent
-            }
-        }
+MODULE_API void ordered_dither_color_parallel(const ColorImage* image, CachedPalette* lookup_pal,
+                                              const OrderedDitherMatrix* matrix, int threads, int* out) {
+    /* multithreaded ordered_dither_color: the image is split into bands of rows, one per thread. If lookup_pal is
+     * concurrent or frozen, the threads use its cache directly, otherwise they share it read-only and each keeps its
+     * own lookup cache */
+    double* dmatrix = prepare_dmatrix_color(matrix);
+    OrderedDitherWorker* workers = split_rows(image->height, &threads);
+    for (int i = 0; i < threads; i++) {
+        workers[i].image = image;
+        workers[i].lookup_pal = lookup_pal;
+        workers[i].matrix = matrix;
+        workers[i].dmatrix = dmatrix;
+        workers[i].out_color = out;
     }
+    if (threads == 1)
+        ordered_dither_color_rows(image, lookup_pal, NULL, matrix, dmatrix, 0, image->height, out);
+    else
+        threads_run_independent(threads, ordered_dither_color_worker, workers, sizeof(OrderedDitherWorker));
+    free(workers);
     free(dmatrix);
 }
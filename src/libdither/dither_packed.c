@@ -0,0 +1,193 @@
+#define MODULE_API_EXPORTS
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "libdither.h"
+#include "dither_packed.h"
+#include "color_simd.h"
+#include "threading.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#  if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#    define HAVE_SSE2
+#    define HAVE_AVX
+#    include <immintrin.h>
+#    if defined(_MSC_VER) && !defined(__clang__)
+#      define TARGET_AVX
+#    else
+#      define TARGET_AVX __attribute__((target("avx")))
+#    endif
+#  endif
+#endif
+
+#define PACKED_CHUNK 512  // pixels packed per step; a multiple of 16 so chunks start at whole bytes
+
+static volatile int detected_level = -1;
+
+static enum SimdLevel packed_simd_level(void) {
+    /* the CPU's SIMD level, detected once */
+    int level = atomic_load_int(&detected_level);
+    if (level < 0) {
+        level = (int)simd_detect();
+        atomic_store_int(&detected_level, level);
+    }
+    return (enum SimdLevel)level;
+}
+
+static inline uint8_t reverse_bits(uint8_t b) {
+    b = (uint8_t)((b & 0xf0) >> 4 | (b & 0x0f) << 4);
+    b = (uint8_t)((b & 0xcc) >> 2 | (b & 0x33) << 2);
+    return (uint8_t)((b & 0xaa) >> 1 | (b & 0x55) << 1);
+}
+
+static void compare_bits_scalar(const double* values, double threshold, size_t start, size_t n, uint8_t* out) {
+    /* packs (values > threshold) LSB first, starting at pixel 'start' (a multiple of 8), and clears the unused bits of
+     * the last byte */
+    for (size_t i = start; i < n; i += 8) {
+        uint8_t b = 0;
+        for (size_t k = 0; k < 8 && i + k < n; k++)
+            if (values[i + k] > threshold)
+                b |= (uint8_t)(1 << k);
+        out[i / 8] = b;
+    }
+}
+
+#if defined(HAVE_SSE2)
+static size_t compare_bits_sse2(const double* values, double threshold, size_t n, uint8_t* out) {
+    /* 2 pixels per compare; returns the number of pixels done (whole bytes only) */
+    __m128d t = _mm_set1_pd(threshold);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        int b = _mm_movemask_pd(_mm_cmpgt_pd(_mm_loadu_pd(&values[i]), t));
+        b |= _mm_movemask_pd(_mm_cmpgt_pd(_mm_loadu_pd(&values[i + 2]), t)) << 2;
+        b |= _mm_movemask_pd(_mm_cmpgt_pd(_mm_loadu_pd(&values[i + 4]), t)) << 4;
+        b |= _mm_movemask_pd(_mm_cmpgt_pd(_mm_loadu_pd(&values[i + 6]), t)) << 6;
+        out[i / 8] = (uint8_t)b;
+    }
+    return i;
+}
+
+static size_t byte_bits_sse2(const uint8_t* bytes, uint8_t value, bool equal, size_t n, uint8_t* out) {
+    /* 16 pixels per compare; returns the number of pixels done */
+    __m128i v = _mm_set1_epi8((char)value);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        int b = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)&bytes[i]), v));
+        if (!equal)
+            b = ~b;
+        out[i / 8] = (uint8_t)(b & 0xff);
+        out[i / 8 + 1] = (uint8_t)((b >> 8) & 0xff);
+    }
+    return i;
+}
+#endif
+
+#if defined(HAVE_AVX)
+TARGET_AVX static size_t compare_bits_avx(const double* values, double threshold, size_t n, uint8_t* out) {
+    /* 4 pixels per compare; returns the number of pixels done (whole bytes only) */
+    __m256d t = _mm256_set1_pd(threshold);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        int b = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(&values[i]), t, _CMP_GT_OQ));
+        b |= _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(&values[i + 4]), t, _CMP_GT_OQ)) << 4;
+        out[i / 8] = (uint8_t)b;
+    }
+    return i;
+}
+#endif
+
+static void compare_bits(const double* values, double threshold, size_t n, uint8_t* out, enum SimdLevel level) {
+    /* packs (values > threshold) for n pixels, LSB first */
+    size_t done = 0;
+    switch (level) {
+#if defined(HAVE_AVX)
+        case SIMD_AVX:
+            done = compare_bits_avx(values, threshold, n, out);
+            break;
+#endif
+#if defined(HAVE_SSE2)
+        case SIMD_SSE2:
+            done = compare_bits_sse2(values, threshold, n, out);
+            break;
+#endif
+        default:
+            break;
+    }
+    compare_bits_scalar(values, threshold, done, n, out);
+}
+
+static void byte_bits(const uint8_t* bytes, uint8_t value, bool equal, size_t n, uint8_t* out) {
+    /* packs (bytes == value) or (bytes != value) for n pixels, LSB first */
+    size_t i = 0;
+#if defined(HAVE_SSE2)
+    i = byte_bits_sse2(bytes, value, equal, n, out);
+#endif
+    for (; i < n; i += 8) {
+        uint8_t b = 0;
+        for (size_t k = 0; k < 8 && i + k < n; k++)
+            if ((bytes[i + k] == value) == equal)
+                b |= (uint8_t)(1 << k);
+        out[i / 8] = b;
+    }
+}
+
+static void all_bits(size_t n, uint8_t* out) {
+    /* n set bits, LSB first */
+    memset(out, 0xff, n / 8);
+    if (n % 8)
+        out[n / 8] = (uint8_t)((1 << (n % 8)) - 1);
+}
+
+static void finish_chunk(const PackedOutput* self, uint8_t* bits, uint8_t* mask, const uint8_t* opaque, size_t n) {
+    /* clears the transparent pixels, stores the mask and converts both to the requested bit order */
+    size_t bytes = (n + 7) / 8;
+    for (size_t i = 0; i < bytes; i++)
+        bits[i] &= opaque[i];
+    if (mask != NULL)
+        memcpy(mask, opaque, bytes);
+    if (self->bit_order == MSB_FIRST) {
+        for (size_t i = 0; i < bytes; i++)
+            bits[i] = reverse_bits(bits[i]);
+        if (mask != NULL)
+            for (size_t i = 0; i < bytes; i++)
+                mask[i] = reverse_bits(mask[i]);
+    }
+}
+
+void PackedOutput_compare_row(const PackedOutput* self, int y, const double* values, double threshold,
+                              const uint8_t* transparency, int width) {
+    /* packs row y of a ditherer that sets pixels white where values > threshold.
+     * transparency: alpha values of the row, or NULL if the row is opaque */
+    enum SimdLevel level = packed_simd_level();
+    uint8_t* bits = &self->bits[(size_t)y * self->stride];
+    uint8_t* mask = self->mask != NULL ? &self->mask[(size_t)y * self->mask_stride] : NULL;
+    uint8_t opaque[PACKED_CHUNK / 8];
+    for (size_t x = 0; x < (size_t)width; x += PACKED_CHUNK) {
+        size_t n = (size_t)width - x < PACKED_CHUNK ? (size_t)width - x : PACKED_CHUNK;
+        compare_bits(&values[x], threshold, n, &bits[x / 8], level);
+        if (transparency != NULL)
+            byte_bits(&transparency[x], 0, false, n, opaque);
+        else
+            all_bits(n, opaque);
+        finish_chunk(self, &bits[x / 8], mask != NULL ? &mask[x / 8] : NULL, opaque, n);
+    }
+}
+
+void PackedOutput_store_row(const PackedOutput* self, int y, const uint8_t* row, int width) {
+    /* packs row y of a ditherer's byte output (0x00 black, 0xff white, 128 transparent) */
+    uint8_t* bits = &self->bits[(size_t)y * self->stride];
+    uint8_t* mask = self->mask != NULL ? &self->mask[(size_t)y * self->mask_stride] : NULL;
+    uint8_t opaque[PACKED_CHUNK / 8];
+    for (size_t x = 0; x < (size_t)width; x += PACKED_CHUNK) {
+        size_t n = (size_t)width - x < PACKED_CHUNK ? (size_t)width - x : PACKED_CHUNK;
+        byte_bits(&row[x], 0xff, true, n, &bits[x / 8]);
+        byte_bits(&row[x], 128, false, n, opaque);
+        finish_chunk(self, &bits[x / 8], mask != NULL ? &mask[x / 8] : NULL, opaque, n);
+    }
+}
+
+MODULE_API void PackedOutput_pack(const PackedOutput* self, const uint8_t* out, int width, int height) {
+    /* packs the byte output of any mono ditherer */
+    for (int y = 0; y < height; y++)
+        PackedOutput_store_row(self, y, &out[(size_t)y * (size_t)width], width);
+}
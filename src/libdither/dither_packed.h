@@ -0,0 +1,29 @@
+#pragma once
+#ifndef DITHER_PACKED_H
+#define DITHER_PACKED_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/* order of the pixels within each byte of a packed row */
+enum BitOrder {
+    MSB_FIRST = 0,  // the leftmost pixel is bit 7 (PBM, most printers)
+    LSB_FIRST = 1   // the leftmost pixel is bit 0
+};
+
+struct PackedOutput {
+    /* caller-owned 1 bit per pixel output buffers. Each row starts 'stride' bytes after the previous one and
+     * takes (width + 7) / 8 bytes; unused bits in the last byte are cleared, bytes past it are left untouched */
+    uint8_t* bits;           // 1 = white (0xff), 0 = black or transparent
+    size_t stride;
+    uint8_t* mask;           // optional transparency mask, 1 = opaque, 0 = transparent (128); NULL if not needed
+    size_t mask_stride;
+    enum BitOrder bit_order;
+};
+typedef struct PackedOutput PackedOutput;
+
+void PackedOutput_store_row(const PackedOutput* self, int y, const uint8_t* row, int width);
+void PackedOutput_compare_row(const PackedOutput* self, int y, const double* values, double threshold,
+                              const uint8_t* transparency, int width);
+
+#endif  // DITHER_PACKED_H
@@ -51,7 +51,7 @@ MODULE_API void pattern_dither(const DitherImage* img, const TilePattern *patter
             // get block
             for(int ty = 0; ty < th; ty++)
                 for(int tx = 0; tx < tw; tx++)
-                    cur[ty * tw + tx] = img->buffer[(y * th + ty) * img->width + (x * tw + tx)];
+                    cur[ty * tw + tx] = DitherImage_value(img, (size_t)((y * th + ty) * img->width + (x * tw + tx)));
             // find closest tile, i.e. smallest distance
             double distance = 1000.0;
             int best_tile = 0;
@@ -79,8 +79,10 @@ MODULE_API void pattern_dither(const DitherImage* img, const TilePattern *patter
         }
     }
     // apply transparency
-    for (size_t i = 0; i < (size_t)(img->width * img->height); i++) {
-        out[i] = img->transparency[i] != 0 ? out[i] : 128;
+    if (!DitherImage_is_opaque(img)) {
+        for (size_t i = 0; i < (size_t)(img->width * img->height); i++) {
+            out[i] = img->transparency[i] != 0 ? out[i] : 128;
+        }
     }
     free(cur);
     free(diffusion);
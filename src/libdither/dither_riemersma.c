@@ -82,17 +82,19 @@ int get_rule_size(char *rule, char rule_key[], int rule_count) {
     return rule_size;
 }
 
-MODULE_API char* create_curve(RiemersmaCurve* curve, int width, int height, int* curve_dim) {
-    /* creates a space filling curve */
-    // determine iterations required
-    int iterations = -1;
+static int curve_iterations(const RiemersmaCurve* curve, int width, int height, int* curve_dim) {
+    /* determines the number of rewrites required for the curve to cover the image; -1 if MAX_ITER isn't enough */
     for(int j = 0; j < MAX_ITER; j++) {
         *curve_dim = (int)pow(curve->base, j + curve->exp_adjust) + curve->add_adjust;
-        if(*curve_dim > width && *curve_dim > height) {
-            iterations = j;
-            break;
-        }
+        if(*curve_dim > width && *curve_dim > height)
+            return j;
     }
+    return -1;
+}
+
+MODULE_API char* create_curve(RiemersmaCurve* curve, int width, int height, int* curve_dim) {
+    /* creates a space filling curve */
+    int iterations = curve_iterations(curve, width, height, curve_dim);
     if(iterations == -1)
         return NULL;
     // determine memory heuristics
@@ -141,11 +143,93 @@ MODULE_API char* create_curve(RiemersmaCurve* curve, int width, int height, int*
     return axiom;
 }
 
+MODULE_API CurveWalker* CurveWalker_new(const RiemersmaCurve* curve, int width, int height) {
+    /* The walker expands the L-system depth first: a stack holds the position within the axiom and within the rule
+     * being expanded at each rewrite level, so the curve is traced one drawing command at a time. */
+    int curve_dim;
+    int iterations = curve_iterations(curve, width, height, &curve_dim);
+    if(iterations == -1)
+        return NULL;
+    CurveWalker* self = (CurveWalker*)calloc(1, sizeof(CurveWalker));
+    self->curve = curve;
+    self->iterations = iterations;
+    self->stack = (struct CurveFrame*)calloc((size_t)iterations + 1, sizeof(struct CurveFrame));
+    self->stack[0].symbols = curve->axiom;
+    self->depth = 0;
+    for(int i = 0; i < 256; i++)
+        self->rule_of[i] = -1;
+    for(int i = curve->rule_count - 1; i >= 0; i--)  // the first matching rule wins, as in create_curve
+        self->rule_of[(unsigned char)curve->keys[i]] = i;
+    self->width = width;
+    self->height = height;
+    // position - some curves must be centered in relation to the image
+    float xc = (curve->adjust == 1 || curve->adjust == 2)? 0.5f : 0;
+    float yc = (curve->adjust == 1 || curve->adjust == 3)? 0.5f : 0;
+    self->x = (int)((float)curve_dim * xc);
+    self->y = (int)((float)curve_dim * yc);
+    // orientation
+    self->dx = curve->orientation[0];
+    self->dy = curve->orientation[1];
+    return self;
+}
+
+MODULE_API void CurveWalker_free(CurveWalker* self) {
+    if(self) {
+        free(self->stack);
+        free(self);
+    }
+}
+
+static char CurveWalker_symbol(CurveWalker* self) {
+    /* returns the next drawing command of the fully rewritten curve, or 0 at its end */
+    while(self->depth >= 0) {
+        struct CurveFrame* frame = &self->stack[self->depth];
+        char c = frame->symbols[frame->pos];
+        if(c == 0) {
+            self->depth--;
+            continue;
+        }
+        frame->pos++;
+        int rule = self->rule_of[(unsigned char)c];
+        if(rule != -1 && self->depth < self->iterations) {
+            self->depth++;
+            self->stack[self->depth].symbols = self->curve->rules[rule];
+            self->stack[self->depth].pos = 0;
+            continue;
+        }
+        return c;
+    }
+    return 0;
+}
+
+MODULE_API bool CurveWalker_next(CurveWalker* self, int* x, int* y) {
+    char c;
+    while((c = CurveWalker_symbol(self)) != 0) {
+        if (c == 'F') {
+            self->x += self->dx;
+            self->y += self->dy;
+            if (self->x >= 0 && self->y >= 0 && self->x < self->width && self->y < self->height) {
+                *x = self->x;
+                *y = self->y;
+                return true;
+            }
+        } else if (c == '+') {
+            int dx = self->dy; self->dy = -self->dx; self->dx = dx;
+        } else if (c == '-') {
+            int dx = -self->dy; self->dy = self->dx; self->dx = dx;
+        }
+    }
+    return false;
+}
+
 void riemersma_dither(const DitherImage* img, RiemersmaCurve* rcurve, bool use_riemersma, uint8_t* out) {
     /* Riemersma dither. Uses a space filling curve to distribute the dithering error.
      * parameter use_riemersma: when true, uses a slightly modified version of the Riemersma calculations which may
      *                          improve dithering results
      */
+    CurveWalker* walker = CurveWalker_new(rcurve, img->width, img->height);
+    if(!walker)
+        return;
     int max = 16;
     int err_len = use_riemersma? 16 : 8;
     Queue* q_err = Queue_new((size_t)err_len);
@@ -168,59 +252,37 @@ void riemersma_dither(const DitherImage* img, RiemersmaCurve* rcurve, bool use_r
         for(int i = 0; i < err_len; i++)
             weights[i] /= weights_sum;
     }
-    // generate curve
-    int curve_dim;
-    char* curve = create_curve(rcurve, img->width, img->height, &curve_dim);
-    char* c = curve;
-    // position - some curves must be centered in relation to the image
-    float xc = (rcurve->adjust == 1 || rcurve->adjust == 2)? 0.5f : 0;
-    float yc = (rcurve->adjust == 1 || rcurve->adjust == 3)? 0.5f : 0;
-    int x = (int)((float)curve_dim * xc);
-    int y = (int)((float)curve_dim * yc);
-    // orientation
-    int rx = rcurve->orientation[0];
-    int ry = rcurve->orientation[1];
-    // draw curve and dither
-    size_t lc = strlen(curve);
-    for(size_t j = 0; j < lc; j++) {
-        if (*c == 'F') {
-            x += rx;
-            y += ry;
-            if (x >= 0 && y >= 0 && x < img->width && y < img->height) {
-                size_t addr = (size_t)(y * img->width + x);
+    // trace curve and dither
+    const uint8_t* alpha = DitherImage_alpha(img, 0);  // NULL for opaque images
+    int x, y;
+    while (CurveWalker_next(walker, &x, &y)) {
+        size_t addr = (size_t)(y * img->width + x);
 
-                double err = 0.0;
-                for(int i = 0; i < err_len; i++) {
-                    err += q_err->queue[i] * (double)weights[i];
-                }
-                Queue_rotate(q_err);
+        double err = 0.0;
+        for(int i = 0; i < err_len; i++) {
+            err += q_err->queue[i] * (double)weights[i];
+        }
+        Queue_rotate(q_err);
 
-                if (img->transparency[addr] != 0) {
-                    double p = img->buffer[addr];
-                    if (use_riemersma) {  // original riemersma algorithm
-                        if (p + err / max > 0.5) {
-                            out[addr] = 0xff;
-                            q_err->queue[err_len - 1] = p - 1.0;
-                        } else
-                            q_err->queue[err_len - 1] = p;
-                    } else {  // modified riemersma algorithm
-                        if (err + p > 0.5) {
-                            out[addr] = 0xff;
-                            q_err->queue[err_len - 1] = err + p - 1.0;
-                        } else
-                            q_err->queue[err_len - 1] = err + p;
-                    }
+        if (alpha == NULL || alpha[addr] != 0) {
+            double p = DitherImage_value(img, addr);
+            if (use_riemersma) {  // original riemersma algorithm
+                if (p + err / max > 0.5) {
+                    out[addr] = 0xff;
+                    q_err->queue[err_len - 1] = p - 1.0;
                 } else
-                    out[addr] = 128;
+                    q_err->queue[err_len - 1] = p;
+            } else {  // modified riemersma algorithm
+                if (err + p > 0.5) {
+                    out[addr] = 0xff;
+                    q_err->queue[err_len - 1] = err + p - 1.0;
+                } else
+                    q_err->queue[err_len - 1] = err + p;
             }
-        } else if (*c == '+') {
-            int dx = ry; ry = -rx; rx = dx;
-        } else if (*c == '-') {
-            int dx = -ry; ry = rx; rx = dx;
-        }
-        c++;
+        } else
+            out[addr] = 128;
     }
     free(weights);
-    free(curve);
+    CurveWalker_free(walker);
     Queue_delete(q_err);
 }
@@ -11,7 +11,7 @@ MODULE_API double auto_threshold(const DitherImage* img) {
     double max = 0.0;
     size_t imgsize = (size_t)(img -> width * img -> height);
     for(size_t i = 0; i < imgsize; i++) {
-        double c = gamma_encode(img -> buffer[i]);
+        double c = gamma_encode(DitherImage_value(img, (size_t)i));
         avg += c;
         if(c < min) min = c;
         if(c > max) max = c;
@@ -24,18 +24,41 @@ MODULE_API double auto_threshold(const DitherImage* img) {
 }
 
 MODULE_API void threshold_dither(const DitherImage* img, double threshold, double noise, uint8_t* out) {
+    threshold_dither_rng(img, threshold, noise, NULL, out);
+}
+
+MODULE_API void threshold_dither_rng(const DitherImage* img, double threshold, double noise, DitherRandom* rng,
+                                     uint8_t* out) {
     /* Threshold dithering
      * threshold: threshold to dither a pixel black. From 0.0 to 1.0. Suggested value: 0.5.
      * noise: amount of noise / randomness in pixel placement
+     * rng: random number generator for the noise; NULL seeds one from the current time
      * */
+    DitherRandom time_rng;
+    rng = random_or_time_seeded(rng, &time_rng);
+    double* row_noise = noise > 0 ? (double*)calloc((size_t)img->width, sizeof(double)) : NULL;
     size_t addr = 0;
     threshold = (0.5 * noise + threshold * (1.0 - noise));
     for(int y = 0; y < img -> height; y++) {
+        if (noise > 0)
+            random_fill_uniform(rng, row_noise, (size_t)img->width);
+        const uint8_t* alpha = DitherImage_alpha(img, addr);
+        if (alpha == NULL) {  // opaque image: no alpha checks
+            for(int x = 0; x < img -> width; x++) {
+                double px = DitherImage_value(img, addr);
+                if (noise > 0)
+                    px += (row_noise[x] - 0.5) * noise;
+                if (px > threshold)
+                    out[addr] = 0xff;
+                addr++;
+            }
+            continue;
+        }
         for(int x = 0; x < img -> width; x++) {
-            if (img->transparency[addr] != 0) {
-                double px = img->buffer[addr];
+            if (alpha[x] != 0) {
+                double px = DitherImage_value(img, addr);
                 if (noise > 0)
-                    px += (rand_float() - 0.5) * noise;
+                    px += (row_noise[x] - 0.5) * noise;
                 if (px > threshold)
                     out[addr] = 0xff;
             } else
@@ -43,4 +66,32 @@ MODULE_API void threshold_dither(const DitherImage* img, double threshold, doubl
             addr++;
         }
     }
+    free(row_noise);
+}
+
+MODULE_API void threshold_dither_packed(const DitherImage* img, double threshold, double noise, DitherRandom* rng,
+                                        const PackedOutput* out) {
+    /* threshold_dither_rng with 1 bit per pixel output. Compares and packs several pixels per instruction */
+    DitherRandom time_rng;
+    rng = random_or_time_seeded(rng, &time_rng);
+    double* row_noise = noise > 0 ? (double*)calloc((size_t)img->width, sizeof(double)) : NULL;
+    double* row = (double*)calloc((size_t)img->width, sizeof(double));
+    threshold = (0.5 * noise + threshold * (1.0 - noise));
+    for(int y = 0; y < img->height; y++) {
+        size_t addr = (size_t)y * (size_t)img->width;
+        const double* values = row;
+        if (noise > 0) {
+            random_fill_uniform(rng, row_noise, (size_t)img->width);
+            for(int x = 0; x < img->width; x++)
+                row[x] = DitherImage_value(img, addr + (size_t)x) + (row_noise[x] - 0.5) * noise;
+        } else if (img->buffer != NULL) {
+            values = &img->buffer[addr];
+        } else {
+            for(int x = 0; x < img->width; x++)
+                row[x] = (double)img->buffer_f32[addr + (size_t)x];
+        }
+        PackedOutput_compare_row(out, y, values, threshold, DitherImage_alpha(img, addr), img->width);
+    }
+    free(row);
+    free(row_noise);
 }
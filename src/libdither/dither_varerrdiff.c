@@ -1,39 +1,87 @@
 #define MODULE_API_EXPORTS
 #include <stdlib.h>
 #include <stdint.h>
-#include <time.h>
 #include <string.h>
 #include "libdither.h"
+#include "random.h"
+#include "threading.h"
 #include "dither_varerrdiff_data.h"
 
 
-MODULE_API void variable_error_diffusion_dither(const DitherImage* img, enum VarDitherType type, bool serpentine, uint8_t* out) {
-    /* Variable Error Diffusion, implementing Ostromoukhov's and Zhou Fang's approach */
-    srand((uint32_t)time(NULL));
+struct VarErrLevel {
+    /* the diffusion weights of one gray level */
+    double divisor;
+    double coefs[3];
+    double weights[3];      // coefs / divisor
+    double modulation;      // Zhou Fang's threshold modulation: threshold = 0.5 + random(0 - 127) * modulation
+};
+typedef struct VarErrLevel VarErrLevel;
+
+struct VarErrWorker {
+    /* per-thread state for variable_error_diffusion_dither_parallel */
+    const DitherImage* img;
+    enum VarDitherType type;
+    const VarErrLevel* levels;
+    double* buffer;          // shared error buffer
+    volatile int* progress;  // number of pixels each row has finished; NULL when running on a single thread
+    bool serpentine;
+    uint64_t noise_key;
+    int thread_index;
+    int thread_count;
+    uint8_t* out;
+};
+typedef struct VarErrWorker VarErrWorker;
+
+static void prepare_levels(enum VarDitherType type, VarErrLevel* levels) {
+    /* converts the coefficient tables of all 256 gray levels to doubles once, instead of converting them for
+     * every pixel. Zhou Fang's tables only cover the levels 0 - 127 (the gray value is folded at 0.5); level 128,
+     * which a gray value of exactly 0.5 maps to, reuses level 127 */
+    const long* divs = type == Ostromoukhov ? ostro_divs : zhoufang_divs;
+    const long* coefs = type == Ostromoukhov ? ostro_coefs : zhoufang_coef;
+    int count = type == Ostromoukhov ? 256 : 128;
+    for (int i = 0; i < 256; i++) {
+        int k = i < count ? i : count - 1;
+        levels[i].divisor = (double)divs[k];
+        for (int c = 0; c < 3; c++) {
+            levels[i].coefs[c] = (double)coefs[k * 3 + c];
+            levels[i].weights[c] = levels[i].coefs[c] / levels[i].divisor;
+        }
+        levels[i].modulation = i < 128 ? rand_scale[i] / 100.0 / 256.0 : 0.0;
+    }
+}
+
+static void wait_for_row_above(const VarErrWorker* w, int y, int x, int* known) {
+    /* blocks until the row above has passed every column within 2 of x: the pixels (x - 1) to (x + 1) that pixel
+     * (x, y) writes to are final, and no pixel of the row above writes to them anymore. This also keeps the order
+     * in which errors are added to each pixel the same as in a single thread */
+    int width = w->img->width;
+    int needed;
+    if (!w->serpentine || (y - 1) % 2 == 0)
+        needed = x + 3;          // row above goes left-to-right
+    else
+        needed = width - x + 2;  // row above goes right-to-left
+    if (needed > width)
+        needed = width;
+    while (*known < needed) {
+        *known = atomic_load_int(&w->progress[y - 1]);
+        if (*known < needed)
+            thread_yield();
+    }
+}
+
+static void variable_error_diffusion_worker(void* arg) {
+    /* dithers every thread_count-th row, starting at row thread_index */
+    VarErrWorker* w = (VarErrWorker*)arg;
+    const DitherImage* img = w->img;
+    const VarErrLevel* levels = w->levels;
+    double* buffer = w->buffer;
     // dither matrix
     const int m_offset_x[2][3] = {{1, -1, 0}, {-1, 1, 0}};
     const int m_offset_y[2][3] = {{0, 1, 1}, {0, 1, 1}};
-
-    size_t image_size = (size_t)(img->width * img->height);
-    double* buffer = calloc(image_size, sizeof(double));
-    const long* divs;
-    const long* coefs;
-    if(type == Ostromoukhov) {
-        coefs = ostro_coefs;
-        divs = ostro_divs;
-    } else {  // zhoufang
-        coefs = zhoufang_coef;
-        divs = zhoufang_divs;
-        memcpy(buffer, img->buffer, image_size * sizeof(double));
-    }
-    // serpentine direction setup
-    int direction = 0; // FORWARD
-    int direction_toggle = 1;
-    if(serpentine) direction_toggle = 2;
-    // start dithering
-    for(int y = 0; y < img->height; y++) {
+    const uint8_t* alpha = DitherImage_alpha(img, 0);  // NULL for opaque images
+    for (int y = w->thread_index; y < img->height; y += w->thread_count) {
+        int direction = w->serpentine ? y % 2 : 0;
         int start, end, step;
-        // get direction
         if (direction == 0) {
             start = 0;
             end = img->width;
@@ -43,45 +91,114 @@ MODULE_API void variable_error_diffusion_dither(const DitherImage* img, enum Var
             end = -1;
             step = -1;
         }
+        int known = 0;
+        int done = 0;
         for (int x = start; x != end; x += step) {
-            double err;
-            int coef_offs;
+            if (w->progress != NULL && y > 0)
+                wait_for_row_above(w, y, x, &known);
             size_t addr = (size_t)(y * img->width + x);
-            if (img->transparency[addr] != 0) {
-                double px = img->buffer[addr];
+            if (alpha == NULL || alpha[addr] != 0) {
+                double px = DitherImage_value(img, addr);
+                double err;
+                const VarErrLevel* level;
+                double diffused[3];
                 // dither function
-                if (type == Ostromoukhov) {   // ostro
+                if (w->type == Ostromoukhov) {   // ostro
                     err = buffer[addr] + px;
                     if (err > 0.5) {
-                        out[addr] = 0xff;
+                        w->out[addr] = 0xff;
                         err -= 1.0;
                     }
+                    level = &levels[(int) (px * 255.0 + 0.5)];
+                    err /= level->divisor;
+                    for (int i = 0; i < 3; i++)
+                        diffused[i] = err * level->coefs[i];
                 } else {  // zhoufang
                     err = buffer[addr];
                     if (px >= 0.5)
                         px = 1.0 - px;
-                    double threshold = (128.0 + (rand() % 128) * (rand_scale[(int) (px * 128.0)] / 100.0)) / 256.0;
+                    level = &levels[(int) (px * 255.0 + 0.5)];
+                    // counter-based random number per pixel: independent of the order the rows are dithered in
+                    int r = (int)(random_at(w->noise_key, addr) >> 57);
+                    double threshold = 0.5 + r * levels[(int) (px * 128.0)].modulation;
                     if (err >= threshold) {
-                        out[addr] = 0xff;
-                        err = buffer[addr] - 1.0;
+                        w->out[addr] = 0xff;
+                        err -= 1.0;
                     }
+                    for (int i = 0; i < 3; i++)
+                        diffused[i] = err * level->weights[i];
                 }
-                coef_offs = (int) (px * 255.0 + 0.5);
                 // distribute the error
-                err /= (double) divs[coef_offs];
                 for (int i = 0; i < 3; i++) {
                     int xx = x + m_offset_x[direction][i];
                     if (-1 < xx && xx < img->width) {
                         int yy = y + m_offset_y[direction][i];
                         if (yy < img->height) {
-                            buffer[yy * img->width + xx] += err * (double) coefs[coef_offs * 3 + i];
+                            buffer[yy * img->width + xx] += diffused[i];
                         }
                     }
                 }
             } else
-                out[addr] = 128;
+                w->out[addr] = 128;
+            if (w->progress != NULL)
+                atomic_store_int(&w->progress[y], ++done);
         }
-        direction = (y + 1) % direction_toggle;
     }
+}
+
+MODULE_API void variable_error_diffusion_dither(const DitherImage* img, enum VarDitherType type, bool serpentine, uint8_t* out) {
+    variable_error_diffusion_dither_rng(img, type, serpentine, NULL, out);
+}
+
+MODULE_API void variable_error_diffusion_dither_rng(const DitherImage* img, enum VarDitherType type, bool serpentine,
+                                                    DitherRandom* rng, uint8_t* out) {
+    /* Variable Error Diffusion, implementing Ostromoukhov's and Zhou Fang's approach
+     * rng: random number generator for Zhou Fang's threshold modulation; NULL seeds one from the current time */
+    variable_error_diffusion_dither_parallel(img, type, serpentine, rng, 1, out);
+}
+
+MODULE_API void variable_error_diffusion_dither_parallel(const DitherImage* img, enum VarDitherType type,
+                                                         bool serpentine, DitherRandom* rng, int threads,
+                                                         uint8_t* out) {
+    /* Multithreaded variable error diffusion. The kernel only reaches one pixel to each side and one row down, so
+     * rows are handed out round-robin and processed as a wavefront, each row trailing the one above it by 2
+     * pixels. Output is the same for any number of threads.
+     * threads: number of worker threads; 0 uses one thread per CPU core */
+    int thread_count = thread_count_resolve(threads);
+    if (thread_count > img->height)
+        thread_count = img->height;
+    if (thread_count < 1)
+        thread_count = 1;
+    DitherRandom time_rng;
+    uint64_t noise_key = type == Zhoufang ? random_next(random_or_time_seeded(rng, &time_rng)) : 0;
+    VarErrLevel levels[256];
+    prepare_levels(type, levels);
+    size_t image_size = (size_t)(img->width * img->height);
+    double* buffer = calloc(image_size, sizeof(double));
+    if (type == Zhoufang)
+        DitherImage_copy_buffer(img, buffer);
+    int* progress = thread_count > 1 ? (int*)calloc((size_t)img->height, sizeof(int)) : NULL;
+    VarErrWorker* workers = (VarErrWorker*)calloc((size_t)thread_count, sizeof(VarErrWorker));
+    for (int t = 0; t < thread_count; t++) {
+        VarErrWorker* w = &workers[t];
+        w->img = img;
+        w->type = type;
+        w->levels = levels;
+        w->buffer = buffer;
+        w->progress = progress;
+        w->serpentine = serpentine;
+        w->noise_key = noise_key;
+        w->thread_index = t;
+        w->thread_count = thread_count;
+        w->out = out;
+    }
+    if (!threads_run(thread_count, variable_error_diffusion_worker, workers, sizeof(VarErrWorker))) {
+        // the threads couldn't be started: dither every row on the calling thread
+        workers[0].thread_count = 1;
+        workers[0].progress = NULL;
+        variable_error_diffusion_worker(&workers[0]);
+    }
+    free(workers);
+    free(progress);
     free(buffer);
 }
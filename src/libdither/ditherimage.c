@@ -1,12 +1,15 @@
 #define MODULE_API_EXPORTS
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "ditherimage.h"
 #include "libdither.h"
 
 /*
  * DitherImage is a greyscale buffer in linear color space.
  * DitherImages serve as source input for various dithering algorithms.
+ * The image counts its pixels that aren't fully opaque. While there are none, the ditherers skip all alpha checks;
+ * DitherImage_compact additionally frees the transparency plane of an opaque image to save its memory.
  * */
 
 MODULE_API DitherImage* DitherImage_new(int width, int height) {
@@ -14,19 +17,52 @@ MODULE_API DitherImage* DitherImage_new(int width, int height) {
     self->width = width;
     self->height = height;
     self->buffer = calloc((size_t)(width * height), sizeof(double));
-    self->transparency = calloc((size_t)(width * height), sizeof(uint8_t));
+    // new pixels are transparent until they are set
+    self->not_opaque = (size_t)(width * height);
+    self->transparency = self->not_opaque > 0 ? calloc(self->not_opaque, sizeof(uint8_t)) : NULL;
+    return self;
+}
+
+MODULE_API DitherImage* DitherImage_new_f32(int width, int height) {
+    /* creates a DitherImage that stores its pixels as single precision floats, halving the buffer's size */
+    DitherImage* self = calloc(1, sizeof(DitherImage));
+    self->width = width;
+    self->height = height;
+    self->buffer_f32 = calloc((size_t)(width * height), sizeof(float));
+    // new pixels are transparent until they are set
+    self->not_opaque = (size_t)(width * height);
+    self->transparency = self->not_opaque > 0 ? calloc(self->not_opaque, sizeof(uint8_t)) : NULL;
     return self;
 }
 
 MODULE_API void DitherImage_free(DitherImage* self) {
     if(self) {
         free(self->buffer);
+        free(self->buffer_f32);
         free(self->transparency);
         free(self);
         self = NULL;
     }
 }
 
+static void DitherImage_set_alpha(DitherImage* self, size_t addr, uint8_t a) {
+    /* keeps the count of pixels that aren't opaque. The transparency plane stays allocated when the count reaches
+     * zero, so toggling a pixel's alpha stays cheap; it is only restored (all opaque) after DitherImage_compact */
+    if (self->transparency == NULL) {
+        if (a == 255)
+            return;
+        size_t size = (size_t)(self->width * self->height);
+        self->transparency = (uint8_t*)malloc(size * sizeof(uint8_t));
+        memset(self->transparency, 255, size * sizeof(uint8_t));
+    }
+    uint8_t old = self->transparency[addr];
+    if (old == 255 && a != 255)
+        self->not_opaque++;
+    else if (old != 255 && a == 255)
+        self->not_opaque--;
+    self->transparency[addr] = a;
+}
+
 MODULE_API void DitherImage_set_pixel_rgba(DitherImage* self, int x, int y, int r, int g, int b, int a, bool correct_gamma) {
     /* takes sRGB inputs (r, g, b, a) in the range 0 - 255. supports transparency */
     if(x < self -> width && y < self -> height) {
@@ -43,8 +79,12 @@ MODULE_API void DitherImage_set_pixel_rgba(DitherImage* self, int x, int y, int
         }
         // weigh RGB values based on human perception to create final greyscale value, and set transparency
         size_t addr = (size_t)(y * self->width + x);
-        self->buffer[addr] = dr * 0.299 + dg * 0.586 + db * 0.114;
-        self->transparency[addr] = (uint8_t)a;
+        double value = dr * 0.299 + dg * 0.586 + db * 0.114;
+        if (self->buffer_f32 != NULL)
+            self->buffer_f32[addr] = (float)value;
+        else
+            self->buffer[addr] = value;
+        DitherImage_set_alpha(self, addr, (uint8_t)a);
     }
 }
 
@@ -58,11 +98,35 @@ MODULE_API void DitherImage_set_pixel(DitherImage* self, int x, int y, int r, in
 
 MODULE_API double DitherImage_get_pixel(DitherImage* self, int x, int y) {
     /* returns greyscale pixel value in linear color space in the range 0.0 - 1.0 */
-    return self->buffer[y * self->width + x];
+    return DitherImage_value(self, (size_t)(y * self->width + x));
 }
 
 
 MODULE_API uint8_t DitherImage_get_transparency(DitherImage* self, int x, int y) {
-    /* returns greyscale pixel value in linear color space in the range 0.0 - 1.0 */
-    return self->transparency[y * self->width + x];
+    /* returns the pixel's alpha value (0 - 255) */
+    return self->transparency != NULL ? self->transparency[y * self->width + x] : 255;
+}
+
+MODULE_API bool DitherImage_is_opaque(const DitherImage* self) {
+    /* true if every pixel is fully opaque */
+    return self->not_opaque == 0;
+}
+
+MODULE_API void DitherImage_compact(DitherImage* self) {
+    /* frees the transparency plane if every pixel is fully opaque */
+    if (self->not_opaque == 0) {
+        free(self->transparency);
+        self->transparency = NULL;
+    }
+}
+
+void DitherImage_copy_buffer(const DitherImage* self, double* out) {
+    /* copies the image's pixel values into a double precision working buffer */
+    size_t size = (size_t)(self->width * self->height);
+    if (self->buffer_f32 != NULL) {
+        for (size_t i = 0; i < size; i++)
+            out[i] = (double)self->buffer_f32[i];
+    } else {
+        memcpy(out, self->buffer, size * sizeof(double));
+    }
 }
@@ -2,14 +2,30 @@
 #ifndef DITHERIMAGE_H
 #define DITHERIMAGE_H
 
+#include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 struct DitherImage {
-    double* buffer;        // buffer for float color values
-    uint8_t* transparency; // transparency
+    double* buffer;        // buffer for float color values (NULL if the image uses buffer_f32)
+    float* buffer_f32;     // buffer for single precision color values (images created with DitherImage_new_f32)
+    uint8_t* transparency; // alpha per pixel; NULL after DitherImage_compact of an opaque image
+    size_t not_opaque;     // number of pixels whose alpha isn't 255
     int width;
     int height;
 };
 typedef struct DitherImage DitherImage;
 
+static inline double DitherImage_value(const DitherImage* self, size_t addr) {
+    /* returns a pixel value regardless of the image's buffer precision */
+    return self->buffer_f32 != NULL ? (double)self->buffer_f32[addr] : self->buffer[addr];
+}
+static inline const uint8_t* DitherImage_alpha(const DitherImage* self, size_t addr) {
+    /* the alpha values from addr on, or NULL if the image is fully opaque. Ditherers read this once, outside their
+     * pixel loops, skip fully transparent pixels and mark them as 128 */
+    return self->not_opaque != 0 ? &self->transparency[addr] : NULL;
+}
+
+void DitherImage_copy_buffer(const DitherImage* self, double* out);
+
 #endif // DITHERIMAGE_H
@@ -29,6 +29,7 @@ extern "C"{
 #include "color_floatpalette.h"
 #include "color_bytepalette.h"
 #include "ditherimage.h"
+#include "dither_packed.h"
 
 // default LAB weights (Munsell color system)
 #define LAB_W_HUE 0.91      // hue = color
@@ -42,12 +43,27 @@ MODULE_API double gamma_decode(double c);
 /* linear color to sRGB space conversion */
 MODULE_API double gamma_encode(double c);
 
+/* ************************************************* */
+/* **** RANDOM NUMBER GENERATOR FOR NOISY DITHERERS **** */
+/* ************************************************* */
+
+/* random number generator state used by the '_rng' variants of the ditherers. The same seed gives the same output.
+ * A generator must not be used by several threads at the same time; passing NULL instead seeds a new generator
+ * from the current time, which is what the functions without '_rng' do */
+typedef struct DitherRandom DitherRandom;
+MODULE_API DitherRandom* DitherRandom_new(uint64_t seed);
+MODULE_API void DitherRandom_free(DitherRandom* self);
+
 /* ************************************************* */
 /* **** DITHERIMAGE - INPUT IMAGE FOR MONO DITHERERS **** */
 /* ************************************************* */
 
 /* create a new DitherImage */
 MODULE_API DitherImage* DitherImage_new(int width, int height);
+/* create a new DitherImage with single precision pixel storage (half the memory). Dithering results match the
+ * double precision image except where a pixel lies within float rounding (~6e-8 relative) of a decision threshold;
+ * error diffusing ditherers may propagate such a difference to a few neighbouring pixels */
+MODULE_API DitherImage* DitherImage_new_f32(int width, int height);
 /* frees the DitherImage's memory */
 MODULE_API void DitherImage_free(DitherImage* self);
 /* Sets a pixel; r, g and b are sRGB color values in the range 0 - 255 */
@@ -56,6 +72,21 @@ MODULE_API void DitherImage_set_pixel(DitherImage* self, int x, int y, int r, in
 /* Returns a pixel. Returned pixels are in linear color space in the value range 0.0 - 1.0 */
 MODULE_API double DitherImage_get_pixel(DitherImage* self, int x, int y);
 MODULE_API uint8_t DitherImage_get_transparency(DitherImage* self, int x, int y);
+/* true if every pixel is fully opaque. The ditherers skip all alpha checks for opaque images */
+MODULE_API bool DitherImage_is_opaque(const DitherImage* self);
+/* frees the transparency plane if every pixel is fully opaque, e.g. after loading an image. Setting a pixel's alpha
+ * below 255 afterwards recreates it */
+MODULE_API void DitherImage_compact(DitherImage* self);
+
+/* ************************************************* */
+/* **** PACKED OUTPUT - 1 BIT PER PIXEL FOR MONO DITHERERS **** */
+/* ************************************************* */
+
+/* The '_packed' ditherers write into a PackedOutput (see dither_packed.h): 1 bit per pixel rows, MSB or LSB first,
+ * with a caller-chosen row stride and an optional packed transparency mask. Their output matches the byte output
+ * of the '_rng' variants. Other mono ditherers can be packed with PackedOutput_pack */
+/* packs the byte output (0x00, 0xff, 128 for transparent) of any mono ditherer */
+MODULE_API void PackedOutput_pack(const PackedOutput* self, const uint8_t* out, int width, int height);
 
 /* ********************************************* */
 /* **** BOSCH HERMAN INSPIRED GRID DITHERER **** */
@@ -68,6 +99,7 @@ MODULE_API uint8_t DitherImage_get_transparency(DitherImage* self, int x, int y)
  *             for best results it is recommended to have this number at most at (width * height / 2)
  * algorithm: when true uses a modified algorithm that yields contrast that is more true to the input image */
 MODULE_API void grid_dither(const DitherImage* img, int w, int h, int min_pixels, bool alt_algorithm, uint8_t* out);
+MODULE_API void grid_dither_rng(const DitherImage* img, int w, int h, int min_pixels, bool alt_algorithm, DitherRandom* rng, uint8_t* out);
 
 /* ********************************** */
 /* **** ERROR DIFFUSION DITHERER **** */
@@ -84,6 +116,44 @@ MODULE_API void ErrorDiffusionMatrix_free(ErrorDiffusionMatrix* self);
  * serpentine: if the image should be traversed from top to bottom in a serpentine (left-to-right, right-to-left, etc.) manner
  * sigma: introduces jitter to the dither output to make it appear less regular. Recommended range: 0.0 - 1.0 */
 MODULE_API void error_diffusion_dither(const DitherImage* img, const ErrorDiffusionMatrix* m, bool serpentine, double sigma, uint8_t* out);
+MODULE_API void error_diffusion_dither_rng(const DitherImage* img, const ErrorDiffusionMatrix* m, bool serpentine, double sigma, DitherRandom* rng, uint8_t* out);
+/* Multithreaded version of 'error_diffusion_dither_rng' with bit-identical output. Rows are processed in parallel,
+ * each row trailing the row above it by the reach of the matrix.
+ * threads: number of worker threads; 0 uses one thread per CPU core */
+MODULE_API void error_diffusion_dither_parallel(const DitherImage* img, const ErrorDiffusionMatrix* m, bool serpentine, double sigma, DitherRandom* rng, int threads, uint8_t* out);
+/* 'error_diffusion_dither_rng' with 1 bit per pixel output; only the rows the matrix reaches are kept in memory */
+MODULE_API void error_diffusion_dither_packed(const DitherImage* img, const ErrorDiffusionMatrix* m, bool serpentine, double sigma, DitherRandom* rng, const PackedOutput* out);
+/* enum for selecting the arithmetic of the 8 bit error diffusion ditherers: ED_FIXED_POINT carries the errors as
+ * 32 bit integers and turns the division by the matrix divisor into a multiply-shift; it is about twice as fast as
+ * ED_DOUBLE (more with color, less with very large matrices) */
+enum ErrorDiffusionArithmetic {
+    ED_DOUBLE = 0,
+    ED_FIXED_POINT = 1
+};
+/* Error diffusion of 8 bit linear (gamma decoded) luminance values, e.g. straight from a scanner.
+ * alpha: alpha values, or NULL for an opaque image. With ED_DOUBLE the output is the same as 'error_diffusion_dither'
+ * with sigma 0; with ED_FIXED_POINT the errors stay within a fraction of an 8 bit step of ED_DOUBLE, so single dots
+ * only differ where a pixel is right at the threshold */
+MODULE_API void error_diffusion_dither_8bit(const uint8_t* luma, const uint8_t* alpha, int width, int height, const ErrorDiffusionMatrix* m, bool serpentine, enum ErrorDiffusionArithmetic arithmetic, uint8_t* out);
+/* Streaming error diffusion for very tall images: memory use only depends on the width and matrix height.
+ * Push rows top to bottom and pop the dithered rows; a row can be popped once all rows it diffuses error into have
+ * been pushed (or after ErrorDiffusionStream_finish). The output is identical to 'error_diffusion_dither' and
+ * 'error_diffusion_dither_color'. Push functions return false if a row has to be popped first,
+ * pop functions return false if no row is ready yet. */
+typedef struct ErrorDiffusionStream ErrorDiffusionStream;
+MODULE_API ErrorDiffusionStream* ErrorDiffusionStream_new(int width, const ErrorDiffusionMatrix* m, bool serpentine, double sigma, DitherRandom* rng);
+MODULE_API ErrorDiffusionStream* ErrorDiffusionStream_new_color(int width, const ErrorDiffusionMatrix* m, CachedPalette* lookup_pal, bool serpentine);
+MODULE_API void ErrorDiffusionStream_free(ErrorDiffusionStream* self);
+/* row: linear greyscale values (0.0 - 1.0); transparency: alpha values, or NULL for an opaque row */
+MODULE_API bool ErrorDiffusionStream_push_row(ErrorDiffusionStream* self, const double* row, const uint8_t* transparency);
+/* row: sRGB colors including alpha */
+MODULE_API bool ErrorDiffusionStream_push_row_color(ErrorDiffusionStream* self, const ByteColor* row);
+/* marks the end of the image */
+MODULE_API void ErrorDiffusionStream_finish(ErrorDiffusionStream* self);
+/* out: 'width' bytes (0x00, 0xff, 128 for transparent) */
+MODULE_API bool ErrorDiffusionStream_pop_row(ErrorDiffusionStream* self, uint8_t* out);
+/* out: 'width' palette indices (-1 for transparent) */
+MODULE_API bool ErrorDiffusionStream_pop_row_color(ErrorDiffusionStream* self, int* out);
 /* below functions return different error diffusion matrices which can be used as input for 'error_diffusion_dither' */
 MODULE_API ErrorDiffusionMatrix* get_xot_matrix(void);
 MODULE_API ErrorDiffusionMatrix* get_diagonal_matrix(void);
@@ -119,6 +189,12 @@ MODULE_API void OrderedDitherMatrix_free(OrderedDitherMatrix *self);
  * matrix: an OrderedDitherMatrix which determines how the image will be dithered
  * sigma: introduces jitter to the dither output to make it appear less regular. Recommended range 0.0 - 0.2 */
 MODULE_API void ordered_dither(const DitherImage* img, const OrderedDitherMatrix* matrix, double sigma, uint8_t* out);
+MODULE_API void ordered_dither_rng(const DitherImage* img, const OrderedDitherMatrix* matrix, double sigma, DitherRandom* rng, uint8_t* out);
+/* 'ordered_dither_rng' with 1 bit per pixel output */
+MODULE_API void ordered_dither_packed(const DitherImage* img, const OrderedDitherMatrix* matrix, double sigma, DitherRandom* rng, const PackedOutput* out);
+/* Multithreaded version of 'ordered_dither_rng' with identical output; the image is split into bands of rows.
+ * threads: number of worker threads; 0 uses one thread per CPU core */
+MODULE_API void ordered_dither_parallel(const DitherImage* img, const OrderedDitherMatrix* matrix, double sigma, DitherRandom* rng, int threads, uint8_t* out);
 /* below functions return different ordered dither matrices which can be used as input for 'ordered_dither' */
 MODULE_API OrderedDitherMatrix* get_blue_noise_128x128(void);
 MODULE_API OrderedDitherMatrix* get_bayer2x2_matrix(void);
@@ -190,6 +266,9 @@ MODULE_API DotDiffusionMatrix* DotDiffusionMatrix_new(int width, int height, con
 MODULE_API void DotDiffusionMatrix_free(DotDiffusionMatrix* self);
 /* Uses grid dither algorithm to dither an image - allows for different combination of class and diffusion matrices */
 MODULE_API void dot_diffusion_dither(const DitherImage* img, const DotDiffusionMatrix* dmatrix, const DotClassMatrix* cmatrix, uint8_t* out);
+/* Multithreaded version of 'dot_diffusion_dither' with identical output; the class matrix blocks are dithered in
+ * parallel. threads: number of worker threads; 0 uses one thread per CPU core */
+MODULE_API void dot_diffusion_dither_parallel(const DitherImage* img, const DotDiffusionMatrix* dmatrix, const DotClassMatrix* cmatrix, int threads, uint8_t* out);
 /* below functions return different ordered dither matrices which can be used as input for 'dot_diffusion_dither' */
 MODULE_API DotDiffusionMatrix* get_default_diffusion_matrix(void);
 MODULE_API DotDiffusionMatrix* get_guoliu8_diffusion_matrix(void);
@@ -214,6 +293,11 @@ enum VarDitherType{Ostromoukhov, Zhoufang};
  * type: Ostromoukhov or Zhoufang
  * serpentine: if the image should be traversed from top to bottom in a serpentine (left-to-right, right-to-left, etc.) manner */
 MODULE_API void variable_error_diffusion_dither(const DitherImage* img, enum VarDitherType type, bool serpentine, uint8_t* out);
+MODULE_API void variable_error_diffusion_dither_rng(const DitherImage* img, enum VarDitherType type, bool serpentine, DitherRandom* rng, uint8_t* out);
+/* Multithreaded version of 'variable_error_diffusion_dither_rng' with bit-identical output. Rows are processed in
+ * parallel, each row trailing the row above it by two pixels.
+ * threads: number of worker threads; 0 uses one thread per CPU core */
+MODULE_API void variable_error_diffusion_dither_parallel(const DitherImage* img, enum VarDitherType type, bool serpentine, DitherRandom* rng, int threads, uint8_t* out);
 
 /* **************************** */
 /* **** THRESHOLD DITHERER **** */
@@ -225,6 +309,9 @@ MODULE_API double auto_threshold(const DitherImage* img);
  * threshold: threshold for dithering a pixel as black. from 0.0 to 1.0.
  * noise: amount of noise. from 0.0 to 1.0. Recommended 0.55 */
 MODULE_API void threshold_dither(const DitherImage* img, double threshold, double noise, uint8_t* out);
+MODULE_API void threshold_dither_rng(const DitherImage* img, double threshold, double noise, DitherRandom* rng, uint8_t* out);
+/* 'threshold_dither_rng' with 1 bit per pixel output */
+MODULE_API void threshold_dither_packed(const DitherImage* img, double threshold, double noise, DitherRandom* rng, const PackedOutput* out);
 
 /* ********************** */
 /* **** DBS DITHERER **** */
@@ -233,6 +320,11 @@ MODULE_API void threshold_dither(const DitherImage* img, double threshold, doubl
 /* Uses the direct binary search (DBS) dither algorithm to dither an image. */
 // v: value from 0-7. The higher the value, the coarser the output dither will be.
 MODULE_API void dbs_dither(const DitherImage* img, int v, uint8_t* out);
+/* DBS with a work budget and an optional block-parallel search.
+ * threads: 1 keeps the search order of 'dbs_dither'; with more threads (0 = one per CPU core) distant tiles are
+ *          optimized concurrently, which gives a different (but equally valid and thread count independent) result
+ * max_passes: maximum number of sweeps, 0 = until converged. max_seconds: time budget, 0 = unlimited */
+MODULE_API void dbs_dither_parallel(const DitherImage* img, int v, int threads, int max_passes, double max_seconds, uint8_t* out);
 
 /* *************************************** */
 /* **** KACKER AND ALLEBACH DITHERING **** */
@@ -241,6 +333,13 @@ MODULE_API void dbs_dither(const DitherImage* img, int v, uint8_t* out);
 /* Uses the Kacker and Allebach dither algorithm to dither an image.
  * random: when false, dither output will always be the same for the same image; otherwise there will be randomness */
 MODULE_API void kallebach_dither(const DitherImage* img, bool random, uint8_t* out);
+MODULE_API void kallebach_dither_rng(const DitherImage* img, bool random, DitherRandom* rng, uint8_t* out);
+/* Multithreaded version of 'kallebach_dither_rng' with bit-identical output. The dither arrays of all tiles are chosen
+ * first, then the bands of tiles are dithered in parallel.
+ * threads: number of worker threads; 0 uses one thread per CPU core */
+MODULE_API void kallebach_dither_parallel(const DitherImage* img, bool random, DitherRandom* rng, int threads, uint8_t* out);
+/* 'kallebach_dither_rng' with 1 bit per pixel output */
+MODULE_API void kallebach_dither_packed(const DitherImage* img, bool random, DitherRandom* rng, const PackedOutput* out);
 
 /* **************************** */
 /* **** RIEMERSMA DITHERER **** */
@@ -254,8 +353,18 @@ typedef struct Private_RiemersmaCurve RiemersmaCurve;
 MODULE_API RiemersmaCurve* RiemersmaCurve_new(int base, int add_adjust, int exp_adjust, const char* axiom, int rule_count, const char* rules[], const char* keys, const int orientation[2], enum AdjustCurve adjust);
 /* frees the curve's memory */
 MODULE_API void RiemersmaCurve_free(RiemersmaCurve* self);
-/* calculates the entire space filling curve */
+/* calculates the entire space filling curve as a string of drawing commands; its size grows with the image area, use
+ * a CurveWalker to trace the curve without generating it */
 MODULE_API char* create_curve(RiemersmaCurve* curve, int width, int height, int* curve_dim);
+/* data-structure for tracing a space filling curve lazily, with memory proportional to the number of rewrites */
+typedef struct Private_CurveWalker CurveWalker;
+/* creates a walker for the curve covering an image of the given size; NULL if the image is too large for the curve.
+ * The curve must outlive the walker */
+MODULE_API CurveWalker* CurveWalker_new(const RiemersmaCurve* curve, int width, int height);
+/* frees the walker's memory */
+MODULE_API void CurveWalker_free(CurveWalker* self);
+/* stores the next pixel of the curve that lies within the image in x and y; false once the curve is finished */
+MODULE_API bool CurveWalker_next(CurveWalker* self, int* x, int* y);
 /* Uses the Riemersma dither algorithm to dither an image.
  * use_riemersma: when false, uses a slightly improved algorithm for better visual results. */
 MODULE_API void riemersma_dither(const DitherImage* img, RiemersmaCurve* curve, bool use_riemersma, uint8_t* out);
@@ -303,6 +412,9 @@ MODULE_API void DotLippensCoefficients_free(DotLippensCoefficients* self);
 MODULE_API int* create_dot_lippens_class_matrix(void);
 /* Uses Lippens and Philip's dot dither algorithm to dither an image. */
 MODULE_API void dotlippens_dither(const DitherImage* img, const DotClassMatrix* class_matrix, const DotLippensCoefficients* coefficients, uint8_t* out);
+/* Multithreaded version of 'dotlippens_dither' with identical output: pixels of the same class whose neighborhoods
+ * don't overlap are processed in parallel. threads: number of worker threads; 0 uses one thread per CPU core */
+MODULE_API void dotlippens_dither_parallel(const DitherImage* img, const DotClassMatrix* class_matrix, const DotLippensCoefficients* coefficients, int threads, uint8_t* out);
 /* below functions return matrices which can be used as input for 'dotlippens_dither' */
 MODULE_API DotClassMatrix* get_dotlippens_class_matrix(void);
 MODULE_API DotLippensCoefficients* get_dotlippens_coefficients1(void);
@@ -332,7 +444,11 @@ static const FloatColor F7_XYZ = { {0.95041}, {1.0}, {1.08747} }; // 6500 K, Bro
 static const FloatColor F11_XYZ = { {1.00962}, {1.0}, {0.08747} }; // 4000 K, TL84 (commercial standard)
 
 MODULE_API ColorImage* ColorImage_new(int width, int height);
+/* create a new ColorImage with single precision linear color storage; same tolerance as DitherImage_new_f32 */
+MODULE_API ColorImage* ColorImage_new_f32(int width, int height);
 MODULE_API void ColorImage_set_rgb(ColorImage* self, size_t addr, uint8_t r, uint8_t g, uint8_t b, uint8_t a);
+/* true if every pixel is fully opaque; the color ditherers then skip all alpha checks */
+MODULE_API bool ColorImage_is_opaque(const ColorImage* self);
 MODULE_API void ColorImage_free(ColorImage* self);
 
 MODULE_API CachedPalette* CachedPalette_new(void);
@@ -340,9 +456,41 @@ MODULE_API void CachedPalette_update_cache(CachedPalette* self, enum ColorCompar
 MODULE_API void CachedPalette_free(CachedPalette* self);
 MODULE_API void CachedPalette_from_image(CachedPalette* self, const ColorImage* image, size_t target_colors, enum QuantizationMethod quantization_method, bool unique, bool include_bw, bool include_rgb, bool include_cmy);
 MODULE_API void CachedPalette_from_BytePalette(CachedPalette* self, const BytePalette* pal);
+/* KDTREE (k-means) quantization options: threads for the color assignment (0 = one per CPU core, default 1) and
+ * k-means++ seeding with the given seed instead of evenly spread initial centers (default off) */
+MODULE_API void CachedPalette_set_kdtree_options(CachedPalette* self, int threads, bool plus_plus, uint64_t seed);
+/* WU quantization options: histogram precision of 5 - 7 bits per channel (default 5) and threads for building the
+ * moment tables (0 = one per CPU core, default 1). Target palettes may have more than 256 colors */
+MODULE_API void CachedPalette_set_wu_options(CachedPalette* self, int bits, int threads);
 MODULE_API void CachedPalette_set_shift(CachedPalette* self, uint8_t r_shift, uint8_t g_shift, uint8_t b_shift);
+/* LAB94 / LAB2000 only: compare just the 'candidates' closest colors by LAB76 distance (0 - 64, 0 = all colors)
+ * instead of the whole palette. Faster for large palettes, but not always exact. Applies from the next
+ * CachedPalette_update_cache() call */
+MODULE_API void CachedPalette_set_lab_prefilter(CachedPalette* self, int candidates);
+/* Uses a dense 2^bits x 2^bits x 2^bits lookup table (bits: 4 - 8, 0 = off) instead of the hash cache for color
+ * lookups. eager: fill the table in advance instead of on first use of each entry */
+MODULE_API void CachedPalette_set_lut(CachedPalette* self, uint8_t bits, bool eager);
 MODULE_API void CachedPalette_free_cache(CachedPalette* self);
+/* makes lookups thread-safe by replacing the hash cache with a lock-free table of 2^capacity_bits slots shared by
+ * all threads (clamped to 10 - 25 bits, 8 bytes per slot); 0 switches back to the hash cache */
+MODULE_API void CachedPalette_set_concurrent(CachedPalette* self, uint8_t capacity_bits);
+/* freezes the cache into a read-only snapshot: misses are no longer cached, and any number of threads can share the
+ * palette. Neither function may be called while other threads are using the palette */
+MODULE_API void CachedPalette_freeze(CachedPalette* self, bool frozen);
+/* number of color lookups since the cache was last cleared and how many of them missed the cache (lookup table or
+ * hash). Only counted while the palette is neither concurrent nor frozen */
+MODULE_API void CachedPalette_get_stats(const CachedPalette* self, size_t* lookups, size_t* misses);
+/* saves the resolved lookups (lookup table or cache) with the palette and all lookup settings to a versioned file, and
+ * loads them back into a palette with identical settings (false if the settings don't match or on I/O errors) */
+MODULE_API bool CachedPalette_save(const CachedPalette* self, const char* filename);
+MODULE_API bool CachedPalette_load(CachedPalette* self, const char* filename);
 MODULE_API void CachedPalette_set_lab_weights(CachedPalette* self, FloatColor* weights);
+/* maps count sRGB colors (0.0 - 1.0 per channel) to the indices of their closest palette colors in one call; the
+ * results are identical to looking the colors up one by one, but the color space conversion and palette search
+ * are done in bulk for all colors missing from the cache */
+MODULE_API void CachedPalette_find_closest_colors(CachedPalette* self, const FloatColor* colors, size_t count, int* out);
+/* remaps an image to the palette without dithering. out: palette index per pixel, -1 for transparent pixels */
+MODULE_API void CachedPalette_map_image(CachedPalette* self, const ColorImage* image, int* out);
 
 MODULE_API void FloatColor_from_FloatColor(FloatColor* out, const FloatColor* fc2);
 
@@ -353,7 +501,14 @@ MODULE_API void BytePalette_set(BytePalette* self, size_t index, const ByteColor
 MODULE_API BytePalette* BytePalette_copy(const BytePalette* in);
 
 MODULE_API void error_diffusion_dither_color(const ColorImage* img, const ErrorDiffusionMatrix* m, CachedPalette* lookup_pal, bool serpentine, int* out);
+/* color version of 'error_diffusion_dither_8bit'. pixels: 8 bit linear (gamma decoded) RGB values and alpha */
+MODULE_API void error_diffusion_dither_color_8bit(const ByteColor* pixels, int width, int height, const ErrorDiffusionMatrix* m, CachedPalette* lookup_pal, bool serpentine, enum ErrorDiffusionArithmetic arithmetic, int* out);
 MODULE_API void ordered_dither_color(const ColorImage* image, CachedPalette* lookup_pal, const OrderedDitherMatrix* matrix, int* out);
+/* Multithreaded version of 'ordered_dither_color'. All threads share lookup_pal without modifying it, each one
+ * caching its lookups separately (unless the palette is concurrent or frozen, see CachedPalette_set_concurrent).
+ * The output is identical to 'ordered_dither_color' when the palette uses a lookup table (CachedPalette_set_lut);
+ * with a hash cache, colors that share a cache key may resolve differently */
+MODULE_API void ordered_dither_color_parallel(const ColorImage* image, CachedPalette* lookup_pal, const OrderedDitherMatrix* matrix, int threads, int* out);
 
 MODULE_API void rgb_to_linear(const FloatColor* c, FloatColor* out);
 
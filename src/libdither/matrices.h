@@ -2,6 +2,8 @@
 #ifndef MATRICES_H
 #define MATRICES_H
 
+#include <stddef.h>
+
 struct Private_GenericDitherMatrix {
     double divisor;
     int* buffer;  // buffer for flat matrix array
@@ -40,6 +42,25 @@ struct Private_RiemersmaCurve {
     int adjust;
 };
 
+struct CurveFrame {
+    const char* symbols;  // axiom or rule being expanded at this depth
+    size_t pos;           // next symbol to read
+};
+
+struct Private_CurveWalker {
+    const struct Private_RiemersmaCurve* curve;
+    struct CurveFrame* stack;  // one frame per rewrite level: iterations + 1
+    int depth;                 // index of the top frame, -1 once the curve is exhausted
+    int iterations;
+    int rule_of[256];          // rule index for each key symbol, -1 for all other symbols
+    int width;
+    int height;
+    int x;
+    int y;
+    int dx;
+    int dy;
+};
+
 struct Private_DotLippensData {
     int* cm;
     int cm_width;
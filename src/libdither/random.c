@@ -1,30 +1,169 @@
+#define MODULE_API_EXPORTS
 #include <time.h>
 #include <math.h>
+#include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include "libdither.h"
+#include "random.h"
+#include "threading.h"
 
-#ifndef M_PI
-#define M_PI (3.14159265358979323846)
-#endif
+/*
+ * Random numbers for the ditherers that use noise. Each call gets its own generator state, so results are
+ * reproducible for a given seed and threads never share (or lock) a generator.
+ * */
 
-double rand_float(void) {
-    /* returns a random floating point number between 0.0 and 1.0 */
-    static bool initialized = false;
-    if(!initialized) {
-        srand((uint32_t)time(NULL));
-        initialized = true;
-    }
-    return (double)rand() / RAND_MAX;
+static uint64_t splitmix64(uint64_t* x) {
+    /* used to expand a seed into the generator's state */
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static inline uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline double to_unit(uint64_t x) {
+    /* converts the upper 52 bits to a double in [0.0, 1.0) by setting the mantissa of a number in [1.0, 2.0).
+     * Unlike a uint64 to double conversion this is available as a vector instruction on every SIMD level */
+    union { uint64_t u; double d; } v;
+    v.u = (x >> 12) | 0x3FF0000000000000ULL;
+    return v.d - 1.0;
+}
+
+void random_init(DitherRandom* self, uint64_t seed) {
+    for (int i = 0; i < 4; i++)
+        for (int lane = 0; lane < RANDOM_LANES; lane++)
+            self->s[i][lane] = splitmix64(&seed);
+}
+
+DitherRandom* random_or_time_seeded(DitherRandom* rng, DitherRandom* fallback) {
+    /* returns rng, or - if rng is NULL - fallback seeded from the current time (the behavior of the ditherers
+     * before seeds were supported) */
+    static volatile int calls = 0;
+    if (rng != NULL)
+        return rng;
+    uint64_t seed = (uint64_t)time(NULL) ^ ((uint64_t)clock() << 32) ^ (uint64_t)atomic_add_int(&calls, 1);
+    random_init(fallback, seed);
+    return fallback;
 }
 
-double box_muller(double sigma, double mean) {
-    /* Box-Muller algorithm:
-     * generates a normal distributed random number between 0 and 2*mean.
-     * useful default values: sigma=2.5, mean=50.0
-    */
-    double r1 = rand_float();
-    double r2 = rand_float();
-    double x = sigma * sqrt(-2 * log(r1)) * cos(2 * M_PI * r2) + mean;
+void random_init_row(DitherRandom* self, uint64_t key, int row) {
+    /* initializes an independent generator for one image row. Ditherers draw a key from the caller's generator
+     * once and derive every row's noise from it, so the noise doesn't depend on the order (or thread) in which
+     * rows are processed */
+    random_init(self, key ^ ((uint64_t)(uint32_t)row * 0xD1342543DE82EF95ULL));
+}
+
+uint64_t random_next(DitherRandom* self) {
+    /* xoshiro256+ step of lane 0 */
+    uint64_t* s0 = &self->s[0][0];
+    uint64_t* s1 = &self->s[1][0];
+    uint64_t* s2 = &self->s[2][0];
+    uint64_t* s3 = &self->s[3][0];
+    uint64_t result = *s0 + *s3;
+    uint64_t t = *s1 << 17;
+    *s2 ^= *s0;
+    *s3 ^= *s1;
+    *s1 ^= *s2;
+    *s0 ^= *s3;
+    *s2 ^= t;
+    *s3 = rotl(*s3, 45);
+    return result;
+}
+
+uint64_t random_at(uint64_t key, uint64_t counter) {
+    /* counter-based random number: the same key and counter always give the same bits, so a ditherer can draw
+     * the number for each pixel without a generator state, in any order and on any thread */
+    uint64_t x = key ^ (counter * 0xD1342543DE82EF95ULL);
+    return splitmix64(&x);
+}
+
+double random_float(DitherRandom* self) {
+    /* returns a random floating point number in [0.0, 1.0) */
+    return to_unit(random_next(self));
+}
+
+int random_int(DitherRandom* self, int n) {
+    /* returns a random integer in [0, n) */
+    return (int)(((random_next(self) >> 32) * (uint64_t)n) >> 32);
+}
+
+static inline double normal_from_bits(uint64_t x) {
+    /* approximately standard normal number from 64 random bits: the sum of four 16 bit uniform numbers
+     * (Irwin-Hall distribution), centered and scaled to unit variance. Needs no log, sqrt or cos; values are bound
+     * to +-3.46 standard deviations, which doesn't matter for dither noise */
+    int sum = (int)(x & 0xffff) + (int)((x >> 16) & 0xffff) + (int)((x >> 32) & 0xffff) + (int)(x >> 48);
+    return ((double)sum - 131070.0) * (1.0 / 37837.22);  // sqrt(4 * (65536^2 - 1) / 12) = 37837.22
+}
+
+double random_normal(DitherRandom* self, double sigma, double mean) {
+    /* returns a normal distributed random number clamped to 0 - 2*mean (like the former box_muller) */
+    double x = sigma * normal_from_bits(random_next(self)) + mean;
     return fmin(fmax(x, 0), mean * 2);
 }
+
+static void fill_bits(DitherRandom* self, uint64_t* out, size_t n) {
+    /* bulk generation: advances all lanes together. n must be a multiple of RANDOM_LANES */
+    uint64_t s0[RANDOM_LANES], s1[RANDOM_LANES], s2[RANDOM_LANES], s3[RANDOM_LANES];
+    memcpy(s0, self->s[0], sizeof(s0));
+    memcpy(s1, self->s[1], sizeof(s1));
+    memcpy(s2, self->s[2], sizeof(s2));
+    memcpy(s3, self->s[3], sizeof(s3));
+    for (size_t i = 0; i < n; i += RANDOM_LANES) {
+        for (int lane = 0; lane < RANDOM_LANES; lane++) {
+            out[i + (size_t)lane] = s0[lane] + s3[lane];
+            uint64_t t = s1[lane] << 17;
+            s2[lane] ^= s0[lane];
+            s3[lane] ^= s1[lane];
+            s1[lane] ^= s2[lane];
+            s0[lane] ^= s3[lane];
+            s2[lane] ^= t;
+            s3[lane] = rotl(s3[lane], 45);
+        }
+    }
+    memcpy(self->s[0], s0, sizeof(s0));
+    memcpy(self->s[1], s1, sizeof(s1));
+    memcpy(self->s[2], s2, sizeof(s2));
+    memcpy(self->s[3], s3, sizeof(s3));
+}
+
+#define FILL_CHUNK 256  // values generated per bulk step; a multiple of RANDOM_LANES
+
+void random_fill_uniform(DitherRandom* self, double* out, size_t n) {
+    /* fills out with n random numbers in [0.0, 1.0) */
+    uint64_t bits[FILL_CHUNK];
+    for (size_t i = 0; i < n; i += FILL_CHUNK) {
+        size_t count = n - i < FILL_CHUNK ? n - i : FILL_CHUNK;
+        fill_bits(self, bits, (count + RANDOM_LANES - 1) / RANDOM_LANES * RANDOM_LANES);
+        for (size_t j = 0; j < count; j++)
+            out[i + j] = to_unit(bits[j]);
+    }
+}
+
+void random_fill_normal(DitherRandom* self, double* out, size_t n, double sigma, double mean) {
+    /* fills out with n normal distributed random numbers clamped to 0 - 2*mean (see random_normal) */
+    uint64_t bits[FILL_CHUNK];
+    for (size_t i = 0; i < n; i += FILL_CHUNK) {
+        size_t count = n - i < FILL_CHUNK ? n - i : FILL_CHUNK;
+        fill_bits(self, bits, (count + RANDOM_LANES - 1) / RANDOM_LANES * RANDOM_LANES);
+        for (size_t j = 0; j < count; j++) {
+            double x = sigma * normal_from_bits(bits[j]) + mean;
+            out[i + j] = fmin(fmax(x, 0), mean * 2);
+        }
+    }
+}
+
+MODULE_API DitherRandom* DitherRandom_new(uint64_t seed) {
+    /* creates a random number generator for the ditherers that use noise. The same seed gives the same output */
+    DitherRandom* self = (DitherRandom*)calloc(1, sizeof(DitherRandom));
+    random_init(self, seed);
+    return self;
+}
+
+MODULE_API void DitherRandom_free(DitherRandom* self) {
+    free(self);
+}
@@ -2,7 +2,27 @@
 #ifndef RANDOM_H
 #define RANDOM_H
 
-double rand_float(void);
-double box_muller(double sigma, double mean);
+#include <stdlib.h>
+#include <stdint.h>
+
+#define RANDOM_LANES 4  // number of interleaved generators used for bulk noise
+
+struct DitherRandom {
+    /* xoshiro256+ random number generator. Single draws use lane 0, bulk draws advance all lanes side by side,
+     * which lets the compiler vectorize the generator */
+    uint64_t s[4][RANDOM_LANES];
+};
+typedef struct DitherRandom DitherRandom;
+
+void random_init(DitherRandom* self, uint64_t seed);
+DitherRandom* random_or_time_seeded(DitherRandom* rng, DitherRandom* fallback);
+void random_init_row(DitherRandom* self, uint64_t key, int row);
+uint64_t random_next(DitherRandom* self);
+uint64_t random_at(uint64_t key, uint64_t counter);
+double random_float(DitherRandom* self);
+int random_int(DitherRandom* self, int n);
+double random_normal(DitherRandom* self, double sigma, double mean);
+void random_fill_uniform(DitherRandom* self, double* out, size_t n);
+void random_fill_normal(DitherRandom* self, double* out, size_t n, double sigma, double mean);
 
 #endif  // RANDOM_H
@@ -0,0 +1,187 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include "threading.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+struct ThreadStart {
+    ThreadFunc func;
+    void* arg;
+    volatile int* gate;  // 0 while the threads are being created, 1 to run func, -1 to return without running it
+};
+typedef struct ThreadStart ThreadStart;
+
+#if defined(_WIN32)
+static DWORD WINAPI thread_entry(LPVOID param) {
+    ThreadStart* ts = (ThreadStart*)param;
+    int gate;
+    while ((gate = atomic_load_int(ts->gate)) == 0)
+        thread_yield();
+    if (gate > 0)
+        ts->func(ts->arg);
+    return 0;
+}
+#else
+static void* thread_entry(void* param) {
+    ThreadStart* ts = (ThreadStart*)param;
+    int gate;
+    while ((gate = atomic_load_int(ts->gate)) == 0)
+        thread_yield();
+    if (gate > 0)
+        ts->func(ts->arg);
+    return NULL;
+}
+#endif
+
+int thread_count_resolve(int threads) {
+    /* returns the number of worker threads to use. threads <= 0 means: one thread per online CPU core */
+    if (threads > 0)
+        return threads;
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    threads = (int)info.dwNumberOfProcessors;
+#else
+    threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return threads > 0 ? threads : 1;
+}
+
+bool threads_run(int thread_count, ThreadFunc func, void* args, size_t arg_size) {
+    /* runs func(args[i]) on thread_count threads and waits until all of them have finished.
+     * args is an array of thread_count elements, each arg_size bytes large. The calling thread runs args[0] itself.
+     * All threads are created before any of them runs func, so workers may wait for each other. If a thread cannot
+     * be started, func isn't run at all and false is returned; the caller then has to do the work another way
+     * (usually with a single thread). Running the missing workers afterwards on the calling thread would hang
+     * workers that wait for each other */
+    uint8_t* base = (uint8_t*)args;
+    if (thread_count <= 1) {
+        func(base);
+        return true;
+    }
+    size_t extra = (size_t)(thread_count - 1);
+    ThreadStart* starts = (ThreadStart*)calloc(extra, sizeof(ThreadStart));
+#if defined(_WIN32)
+    HANDLE* handles = (HANDLE*)calloc(extra, sizeof(HANDLE));
+#else
+    pthread_t* handles = (pthread_t*)calloc(extra, sizeof(pthread_t));
+#endif
+    volatile int gate = 0;
+    size_t started = 0;
+    for (; started < extra; started++) {
+        starts[started].func = func;
+        starts[started].arg = base + (started + 1) * arg_size;
+        starts[started].gate = &gate;
+#if defined(_WIN32)
+        handles[started] = CreateThread(NULL, 0, thread_entry, &starts[started], 0, NULL);
+        if (handles[started] == NULL)
+            break;
+#else
+        if (pthread_create(&handles[started], NULL, thread_entry, &starts[started]) != 0)
+            break;
+#endif
+    }
+    bool all_started = started == extra;
+    atomic_store_int(&gate, all_started ? 1 : -1);  // open the gate, or let the started threads return
+    if (all_started)
+        func(base);
+    for (size_t i = 0; i < started; i++) {
+#if defined(_WIN32)
+        WaitForSingleObject(handles[i], INFINITE);
+        CloseHandle(handles[i]);
+#else
+        pthread_join(handles[i], NULL);
+#endif
+    }
+    free(handles);
+    free(starts);
+    return all_started;
+}
+
+void threads_run_independent(int thread_count, ThreadFunc func, void* args, size_t arg_size) {
+    /* threads_run for workers that never wait for each other: if the threads can't be started, the calling thread
+     * runs the workers one after another */
+    if (!threads_run(thread_count, func, args, arg_size)) {
+        for (int i = 0; i < thread_count; i++)
+            func((uint8_t*)args + (size_t)i * arg_size);
+    }
+}
+
+int atomic_load_int(const volatile int* p) {
+    /* load with acquire semantics: memory written before the matching atomic_store_int() becomes visible */
+#if defined(_MSC_VER)
+    return (int)InterlockedCompareExchange((volatile LONG*)p, 0, 0);
+#else
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#endif
+}
+
+void atomic_store_int(volatile int* p, int value) {
+    /* store with release semantics */
+#if defined(_MSC_VER)
+    InterlockedExchange((volatile LONG*)p, (LONG)value);
+#else
+    __atomic_store_n(p, value, __ATOMIC_RELEASE);
+#endif
+}
+
+int atomic_add_int(volatile int* p, int value) {
+    /* atomically adds value to *p and returns the previous value */
+#if defined(_MSC_VER)
+    return (int)InterlockedExchangeAdd((volatile LONG*)p, (LONG)value);
+#else
+    return __atomic_fetch_add(p, value, __ATOMIC_ACQ_REL);
+#endif
+}
+
+int64_t atomic_load_int64(const volatile int64_t* p) {
+    /* 64 bit load with acquire semantics */
+#if defined(_MSC_VER)
+    return (int64_t)InterlockedCompareExchange64((volatile LONG64*)p, 0, 0);
+#else
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#endif
+}
+
+bool atomic_cas_int64(volatile int64_t* p, int64_t expected, int64_t desired) {
+    /* stores desired in *p if *p equals expected. Returns true on success */
+#if defined(_MSC_VER)
+    return InterlockedCompareExchange64((volatile LONG64*)p, (LONG64)desired, (LONG64)expected) == (LONG64)expected;
+#else
+    return __atomic_compare_exchange_n(p, &expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#endif
+}
+
+void thread_yield(void) {
+    /* gives up the remainder of the time slice while a worker waits for another one */
+#if defined(_WIN32)
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+void thread_barrier_init(ThreadBarrier* self, int thread_count) {
+    self->count = 0;
+    self->generation = 0;
+    self->thread_count = thread_count;
+}
+
+void thread_barrier_wait(ThreadBarrier* self) {
+    /* blocks until all thread_count threads have reached the barrier; the barrier can be reused right away */
+    int generation = atomic_load_int(&self->generation);
+    if (atomic_add_int(&self->count, 1) == self->thread_count - 1) {  // last thread to arrive releases the others
+        atomic_store_int(&self->count, 0);
+        atomic_add_int(&self->generation, 1);
+        return;
+    }
+    while (atomic_load_int(&self->generation) == generation)
+        thread_yield();
+}
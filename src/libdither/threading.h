@@ -0,0 +1,34 @@
+#pragma once
+#ifndef THREADING_H
+#define THREADING_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* minimal, portable worker threads (pthreads / Win32) used by the multithreaded ditherers */
+
+typedef void (*ThreadFunc)(void* arg);
+
+struct ThreadBarrier {
+    /* reusable spinning barrier for the threads of one threads_run call */
+    volatile int count;         // threads waiting in the current generation
+    volatile int generation;    // incremented each time all threads have arrived
+    int thread_count;
+};
+typedef struct ThreadBarrier ThreadBarrier;
+
+int thread_count_resolve(int threads);
+bool threads_run(int thread_count, ThreadFunc func, void* args, size_t arg_size);
+void threads_run_independent(int thread_count, ThreadFunc func, void* args, size_t arg_size);
+
+int atomic_load_int(const volatile int* p);
+void atomic_store_int(volatile int* p, int value);
+int atomic_add_int(volatile int* p, int value);
+int64_t atomic_load_int64(const volatile int64_t* p);
+bool atomic_cas_int64(volatile int64_t* p, int64_t expected, int64_t desired);
+void thread_yield(void);
+void thread_barrier_init(ThreadBarrier* self, int thread_count);
+void thread_barrier_wait(ThreadBarrier* self);
+
+#endif  // THREADING_H